@@ -0,0 +1,324 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+// Measure broker_t with many virtual clients in one process.
+// The clients are connected by loopback_endpoint instead of TCP sockets,
+// and everything runs on one io_context, so the result is deterministic
+// and doesn't include the kernel networking.
+//
+// Client i subscribes to lb/<i / fanout>, so each topic has fanout subscribers.
+// Then each client publishes the messages to the topic of the next group.
+
+#include <mqtt/config.hpp>
+#include <mqtt/setup_log.hpp>
+#include <mqtt/loopback_endpoint.hpp>
+#include <mqtt/broker/broker.hpp>
+#include <mqtt/broker/latency_histogram.hpp>
+
+#include "micro_bench.hpp"
+
+namespace as = boost::asio;
+namespace mb = micro_bench;
+
+namespace {
+
+using endpoint_t = MQTT_NS::broker::endpoint_t;
+
+struct client {
+    std::shared_ptr<endpoint_t> ep;
+    std::string pub_topic;
+    std::size_t sent = 0;
+    std::size_t inflight = 0;
+};
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        boost::program_options::options_description desc("Options");
+        desc.add_options()
+            ("help", "produce help message")
+            (
+                "clients",
+                boost::program_options::value<std::size_t>()->default_value(1000),
+                "number of the virtual clients"
+            )
+            (
+                "messages",
+                boost::program_options::value<std::size_t>()->default_value(100),
+                "number of the messages that each client publishes"
+            )
+            (
+                "qos",
+                boost::program_options::value<unsigned int>()->default_value(0),
+                "QoS of the subscriptions and the messages"
+            )
+            (
+                "payload",
+                boost::program_options::value<std::size_t>()->default_value(32),
+                "payload bytes. at least 8 bytes for the timestamp"
+            )
+            (
+                "fanout",
+                boost::program_options::value<std::size_t>()->default_value(1),
+                "number of the subscribers of each topic"
+            )
+            (
+                "inflight",
+                boost::program_options::value<std::size_t>()->default_value(16),
+                "maximum number of the messages that each client publishes without the completion"
+            )
+            (
+                "ring_bytes",
+                boost::program_options::value<std::size_t>()->default_value(64 * 1024),
+                "ring buffer bytes of each direction of the loopback connection"
+            )
+            (
+                "format",
+                boost::program_options::value<std::string>()->default_value("text"),
+                "output format. text, csv, or json (one object per line). "
+                "latency rows have ops 1 and ns_per_op is the latency"
+            )
+            (
+                "verbose",
+                boost::program_options::value<unsigned int>()->default_value(1),
+                "set verbose level, possible values:\n 0 - Fatal\n 1 - Error\n 2 - Warning\n 3 - Info\n 4 - Debug\n 5 - Trace"
+            )
+            ;
+
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+
+        auto clients_num = vm["clients"].as<std::size_t>();
+        auto messages = vm["messages"].as<std::size_t>();
+        auto qos_value = static_cast<MQTT_NS::qos>(vm["qos"].as<unsigned int>());
+        auto payload_size = std::max(vm["payload"].as<std::size_t>(), std::size_t(8));
+        auto fanout = std::max(vm["fanout"].as<std::size_t>(), std::size_t(1));
+        auto max_inflight = std::max(vm["inflight"].as<std::size_t>(), std::size_t(1));
+        auto ring_bytes = vm["ring_bytes"].as<std::size_t>();
+
+        mb::options opts;
+        opts.format = vm["format"].as<std::string>();
+        if (opts.format != "text" && opts.format != "csv" && opts.format != "json") {
+            std::cerr << "invalid format:" << opts.format << std::endl;
+            return 1;
+        }
+        if (qos_value > MQTT_NS::qos::exactly_once || clients_num == 0) {
+            std::cerr << "invalid qos or clients" << std::endl;
+            return 1;
+        }
+
+        switch (vm["verbose"].as<unsigned int>()) {
+        case 5:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::trace);
+            break;
+        case 4:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::debug);
+            break;
+        case 3:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::info);
+            break;
+        case 2:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::warning);
+            break;
+        default:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::error);
+            break;
+        case 0:
+            MQTT_NS::setup_log(MQTT_NS::severity_level::fatal);
+            break;
+        }
+
+        auto groups = (clients_num + fanout - 1) / fanout;
+        auto group_topic = [](std::size_t g) { return "lb/" + std::to_string(g); };
+        auto group_size =
+            [&](std::size_t g) {
+                return std::min(fanout, clients_num - g * fanout);
+            };
+
+        std::size_t expected = 0;
+        std::vector<client> clients(clients_num);
+        for (std::size_t i = 0; i != clients_num; ++i) {
+            auto g = (i / fanout + 1) % groups;
+            clients[i].pub_topic = group_topic(g);
+            expected += group_size(g) * messages;
+        }
+
+        as::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        MQTT_NS::broker::latency_histogram latency;
+
+        std::size_t connected = 0;
+        std::size_t subscribed = 0;
+        std::size_t delivered = 0;
+        std::size_t closed = 0;
+        std::array<std::chrono::steady_clock::time_point, 5> tps;
+
+        std::string filler(payload_size - 8, 'x');
+
+        std::function<void(client&)> publish_next =
+            [&](client& c) {
+                while (c.inflight < max_inflight && c.sent < messages) {
+                    ++c.sent;
+                    ++c.inflight;
+                    auto now = std::chrono::steady_clock::now().time_since_epoch();
+                    auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+                    std::string payload(8, '\0');
+                    for (std::size_t i = 0; i != 8; ++i) payload[i] = static_cast<char>((ns >> (i * 8)) & 0xff);
+                    payload += filler;
+                    auto pid = qos_value == MQTT_NS::qos::at_most_once ? 0 : c.ep->acquire_unique_packet_id();
+                    c.ep->async_publish(
+                        pid,
+                        c.pub_topic,
+                        MQTT_NS::force_move(payload),
+                        qos_value,
+                        [&, qos_value](MQTT_NS::error_code ec) {
+                            if (ec) {
+                                std::cerr << "publish error:" << ec.message() << std::endl;
+                                return;
+                            }
+                            // QoS1 and QoS2 are completed by the response.
+                            if (qos_value != MQTT_NS::qos::at_most_once) return;
+                            --c.inflight;
+                            publish_next(c);
+                        }
+                    );
+                }
+            };
+
+        auto start_publish =
+            [&] {
+                tps[2] = std::chrono::steady_clock::now();
+                for (auto& c : clients) publish_next(c);
+            };
+
+        auto finish =
+            [&] {
+                tps[3] = std::chrono::steady_clock::now();
+                for (auto& c : clients) c.ep->async_disconnect();
+            };
+
+        auto on_closed =
+            [&] {
+                if (++closed == clients_num) {
+                    tps[4] = std::chrono::steady_clock::now();
+                    ioc.stop();
+                }
+            };
+
+        tps[0] = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i != clients_num; ++i) {
+            auto& c = clients[i];
+            auto p = MQTT_NS::make_loopback_pair(ioc, ring_bytes);
+            b.handle_accept(std::make_shared<endpoint_t>(ioc, p.first, MQTT_NS::protocol_version::undetermined));
+            c.ep = std::make_shared<endpoint_t>(ioc, p.second, MQTT_NS::protocol_version::v3_1_1, true);
+
+            c.ep->set_connack_handler(
+                [&, i](bool, MQTT_NS::connect_return_code rc) {
+                    if (rc != MQTT_NS::connect_return_code::accepted) {
+                        std::cerr << "connect error:" << rc << std::endl;
+                        return true;
+                    }
+                    if (++connected == clients_num) {
+                        tps[1] = std::chrono::steady_clock::now();
+                        for (std::size_t j = 0; j != clients_num; ++j) {
+                            auto& ep = *clients[j].ep;
+                            ep.async_subscribe(ep.acquire_unique_packet_id(), group_topic(j / fanout), qos_value);
+                        }
+                    }
+                    return true;
+                }
+            );
+            c.ep->set_suback_handler(
+                [&](endpoint_t::packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                    if (++subscribed == clients_num) start_publish();
+                    return true;
+                }
+            );
+            c.ep->set_puback_handler(
+                [&, i](endpoint_t::packet_id_t) {
+                    --clients[i].inflight;
+                    publish_next(clients[i]);
+                    return true;
+                }
+            );
+            c.ep->set_pubcomp_handler(
+                [&, i](endpoint_t::packet_id_t) {
+                    --clients[i].inflight;
+                    publish_next(clients[i]);
+                    return true;
+                }
+            );
+            c.ep->set_publish_handler(
+                [&](MQTT_NS::optional<endpoint_t::packet_id_t>,
+                    MQTT_NS::publish_options,
+                    MQTT_NS::buffer,
+                    MQTT_NS::buffer contents) {
+                    std::uint64_t ns = 0;
+                    for (std::size_t i = 0; i != 8; ++i) {
+                        ns |= std::uint64_t(static_cast<unsigned char>(contents[i])) << (i * 8);
+                    }
+                    auto now = std::chrono::steady_clock::now().time_since_epoch();
+                    latency.record(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(now) -
+                        std::chrono::nanoseconds(ns)
+                    );
+                    if (++delivered == expected) finish();
+                    return true;
+                }
+            );
+            c.ep->set_close_handler(on_closed);
+            c.ep->set_error_handler(
+                [&](MQTT_NS::error_code ec) {
+                    std::cerr << "client error:" << ec.message() << std::endl;
+                    on_closed();
+                }
+            );
+
+            c.ep->start_session();
+            c.ep->async_connect(
+                MQTT_NS::allocate_buffer("lb" + std::to_string(i)),
+                MQTT_NS::nullopt,
+                MQTT_NS::nullopt,
+                MQTT_NS::nullopt,
+                0
+            );
+        }
+
+        ioc.run();
+
+        if (delivered != expected) {
+            std::cerr << "delivered:" << delivered << " expected:" << expected << std::endl;
+            return 1;
+        }
+
+        mb::reporter r(opts);
+        auto name = "broker_loopback_qos" + std::to_string(static_cast<int>(qos_value));
+        auto dist = "fanout" + std::to_string(fanout);
+        auto elapsed =
+            [&](std::size_t from) {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(tps[from + 1] - tps[from]);
+            };
+        r.result(name, dist, clients_num, "connect", clients_num, elapsed(0));
+        r.result(name, dist, clients_num, "subscribe", clients_num, elapsed(1));
+        r.result(name, dist, clients_num, "publish", clients_num * messages, elapsed(2));
+        r.result(name, dist, clients_num, "deliver", expected, elapsed(2));
+        r.result(name, dist, clients_num, "disconnect", clients_num, elapsed(3));
+        r.result(name, dist, clients_num, "latency_p50", 1, latency.value_at_percentile(50.0));
+        r.result(name, dist, clients_num, "latency_p99", 1, latency.value_at_percentile(99.0));
+        r.result(name, dist, clients_num, "latency_max", 1, latency.max());
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,122 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/packet_decoder.hpp>
+#include <mqtt/message.hpp>
+#include <mqtt/v5_message.hpp>
+#include <mqtt/packet_id_type.hpp>
+#include <mqtt/visitor_util.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+using namespace MQTT_NS::literals;
+
+// Number of the packets in the stream that is fed repeatedly.
+constexpr std::size_t packets_in_stream = 1000;
+
+/**
+ * @brief The stream of QoS1 PUBLISH packets that have the specified payload size.
+ */
+std::string make_stream(MQTT_NS::protocol_version version, std::size_t payload_size) {
+    std::string const topic = "sensor/room1/temperature";
+    std::string const payload(payload_size, 'x');
+    std::string ret;
+    for (std::size_t i = 0; i != packets_in_stream; ++i) {
+        auto pid = static_cast<MQTT_NS::packet_id_type<2>::type>(i % 0xffff + 1);
+        if (version == MQTT_NS::protocol_version::v5) {
+            ret += MQTT_NS::v5::publish_message(
+                pid,
+                MQTT_NS::as::buffer(topic),
+                MQTT_NS::as::buffer(payload),
+                MQTT_NS::qos::at_least_once,
+                { MQTT_NS::v5::property::content_type("application/json"_mb) }
+            ).continuous_buffer();
+        }
+        else {
+            ret += MQTT_NS::publish_message(
+                pid,
+                MQTT_NS::as::buffer(topic),
+                MQTT_NS::as::buffer(payload),
+                MQTT_NS::qos::at_least_once
+            ).continuous_buffer();
+        }
+    }
+    return ret;
+}
+
+void bench(mb::reporter& r, MQTT_NS::protocol_version version, std::size_t payload_size, std::size_t ops) {
+    std::string const name = "packet_decoder";
+    std::string const dist = version == MQTT_NS::protocol_version::v5 ? "v5" : "v3_1_1";
+    auto stream = make_stream(version, payload_size);
+    auto rounds = std::max(ops / packets_in_stream, std::size_t(1));
+
+    std::size_t decoded = 0;
+    auto vis =
+        MQTT_NS::make_lambda_visitor(
+            [&](MQTT_NS::publish_view const& v) {
+                decoded += v.payload.size();
+            },
+            [&](auto const&) {}
+        );
+
+    // The whole packets are in the fed bytes, so they are decoded in place.
+    r.result(
+        name, dist, payload_size, "feed_whole", rounds * packets_in_stream,
+        mb::measure(
+            [&] {
+                MQTT_NS::packet_decoder d(version);
+                for (std::size_t i = 0; i != rounds; ++i) {
+                    d.feed(stream, vis);
+                }
+            }
+        )
+    );
+
+    // Like the socket reads. The packets on the boundaries are reassembled.
+    for (std::size_t chunk : { 64, 1460 }) {
+        r.result(
+            name, dist, payload_size, "feed_" + std::to_string(chunk), rounds * packets_in_stream,
+            mb::measure(
+                [&] {
+                    MQTT_NS::packet_decoder d(version);
+                    MQTT_NS::string_view sv(stream);
+                    for (std::size_t i = 0; i != rounds; ++i) {
+                        for (std::size_t pos = 0; pos < sv.size(); pos += chunk) {
+                            d.feed(sv.substr(pos, chunk), vis);
+                        }
+                    }
+                }
+            )
+        );
+    }
+    mb::do_not_optimize(decoded);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        if (!mb::parse_options(argc, argv, 10000000, opts)) return 1;
+        mb::reporter r(opts);
+        if (!r.enabled("packet_decoder")) return 0;
+        // The entries of the packet_decoder benchmark is the payload size of a packet.
+        for (auto version : { MQTT_NS::protocol_version::v3_1_1, MQTT_NS::protocol_version::v5 }) {
+            for (std::size_t n : { 16, 256, 4096 }) {
+                bench(r, version, n, opts.queries);
+            }
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,104 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/property.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/property_parse.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+using namespace MQTT_NS::literals;
+
+/**
+ * @brief Typical properties of PUBLISH with the specified number of user properties.
+ */
+MQTT_NS::v5::properties make_props(std::size_t user_properties) {
+    MQTT_NS::v5::properties props {
+        MQTT_NS::v5::property::payload_format_indicator(MQTT_NS::v5::property::payload_format_indicator::string),
+        MQTT_NS::v5::property::message_expiry_interval(3600),
+        MQTT_NS::v5::property::content_type("application/json"_mb),
+        MQTT_NS::v5::property::response_topic("response/topic/of/the/requester"_mb),
+        MQTT_NS::v5::property::correlation_data("0123456789abcdef"_mb),
+        MQTT_NS::v5::property::topic_alias(10)
+    };
+    for (std::size_t i = 0; i != user_properties; ++i) {
+        props.emplace_back(
+            MQTT_NS::v5::property::user_property(
+                MQTT_NS::allocate_buffer("key" + std::to_string(i)),
+                MQTT_NS::allocate_buffer("value" + std::to_string(i))
+            )
+        );
+    }
+    return props;
+}
+
+std::string serialize(MQTT_NS::v5::properties const& props) {
+    std::vector<MQTT_NS::as::const_buffer> cbs;
+    for (auto const& p : props) MQTT_NS::v5::add_const_buffer_sequence(cbs, p);
+    std::string ret;
+    for (auto const& cb : cbs) ret.append(static_cast<char const*>(cb.data()), cb.size());
+    return ret;
+}
+
+void bench(mb::reporter& r, std::size_t user_properties, std::size_t ops) {
+    std::string const name = "property";
+    auto props = make_props(user_properties);
+    auto bytes = serialize(props);
+    auto buf = MQTT_NS::allocate_buffer(bytes);
+
+    std::size_t parsed = 0;
+    r.result(
+        name, "publish", user_properties, "parse", ops,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != ops; ++i) {
+                    parsed += MQTT_NS::v5::property::parse(buf).size();
+                }
+            }
+        )
+    );
+
+    std::size_t serialized = 0;
+    r.result(
+        name, "publish", user_properties, "serialize", ops,
+        mb::measure(
+            [&] {
+                std::vector<MQTT_NS::as::const_buffer> cbs;
+                for (std::size_t i = 0; i != ops; ++i) {
+                    cbs.clear();
+                    for (auto const& p : props) MQTT_NS::v5::add_const_buffer_sequence(cbs, p);
+                    serialized += cbs.size();
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(parsed + serialized);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        if (!mb::parse_options(argc, argv, 10000000, opts)) return 1;
+        mb::reporter r(opts);
+        if (!r.enabled("property")) return 0;
+        // The entries of the property benchmark is the number of the user properties in a packet.
+        // The sizes option is not used because a packet has a few properties.
+        for (std::size_t n : { 0, 1, 4, 16, 64 }) {
+            bench(r, n, opts.queries);
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
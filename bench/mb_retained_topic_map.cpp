@@ -0,0 +1,133 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/broker/retained_topic_map.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+void bench(mb::reporter& r, mb::distribution d, std::size_t n, std::size_t queries) {
+    std::string const name = "retained_topic_map";
+    auto dist = mb::distribution_to_str(d);
+
+    // Retained messages are stored by the topic, and matched by the subscribed filter.
+    std::vector<std::string> topics;
+    topics.reserve(n);
+    for (std::size_t i = 0; i != n; ++i) topics.push_back(mb::make_topic(d, i, n));
+    std::vector<std::string> filters;
+    for (auto i : mb::shuffled_indexes(n, queries)) {
+        filters.push_back(mb::make_query_filter(d, i, n));
+    }
+    auto erase_order = mb::permutation(n);
+
+    MQTT_NS::broker::retained_topic_map<std::size_t> m;
+
+    r.result(
+        name, dist, n, "insert", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    m.insert_or_assign(topics[i], i);
+                }
+            }
+        )
+    );
+
+    r.result(
+        name, dist, n, "update", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    m.insert_or_assign(topics[i], n - i);
+                }
+            }
+        )
+    );
+
+    std::size_t matched = 0;
+    r.result(
+        name, dist, n, "match", filters.size(),
+        mb::measure(
+            [&] {
+                for (auto const& f : filters) {
+                    m.find(f, [&](std::size_t) { ++matched; });
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(matched);
+
+    // Filters that match all stored topics, like a dashboard subscribing to site/#.
+    // They iterate all children of the widest levels. ops is the number of matched topics.
+    auto levels = mb::split_levels(topics.front());
+    for (std::size_t l = 1; l != levels.size(); ++l) levels[l] = "+";
+    std::vector<std::pair<std::string, std::string>> scans {
+        { "match_all_plus", mb::join_levels(levels, levels.size()) },
+        { "match_all_hash", levels.front() + "/#" },
+        { "match_root_hash", "#" },
+    };
+    auto reps = std::max(queries / n, std::size_t(1));
+    for (auto const& s : scans) {
+        std::size_t scanned = 0;
+        auto ns = mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != reps; ++i) {
+                    m.find(s.second, [&](std::size_t) { ++scanned; });
+                }
+            }
+        );
+        r.result(name, dist, n, s.first, scanned, ns);
+    }
+
+    // The broker delivers the retained messages of a new subscription in chunks by the cursor.
+    std::size_t streamed = 0;
+    auto ns = mb::measure(
+        [&] {
+            for (std::size_t i = 0; i != reps; ++i) {
+                auto c = m.make_cursor(levels.front() + "/#");
+                while (!c.done()) {
+                    m.find_next(c, 256, [&](std::size_t) { ++streamed; });
+                }
+            }
+        }
+    );
+    r.result(name, dist, n, "cursor_all_hash", streamed, ns);
+
+    r.result(
+        name, dist, n, "erase", n,
+        mb::measure(
+            [&] {
+                for (auto i : erase_order) {
+                    m.erase(topics[i]);
+                }
+            }
+        )
+    );
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        if (!mb::parse_options(argc, argv, 10000000, opts)) return 1;
+        mb::reporter r(opts);
+        if (!r.enabled("retained_topic_map")) return 0;
+        for (auto n : opts.sizes) {
+            for (auto d : mb::all_distributions()) {
+                bench(r, d, n, opts.queries);
+            }
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,111 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/broker/security.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+using security = MQTT_NS::broker::security;
+
+void bench(mb::reporter& r, mb::distribution d, std::size_t n, std::size_t queries) {
+    std::string const name = "security";
+    auto dist = mb::distribution_to_str(d);
+
+    std::vector<std::string> filters;
+    filters.reserve(n);
+    for (std::size_t i = 0; i != n; ++i) filters.push_back(mb::make_filter(d, i, n));
+    std::vector<std::string> topics;
+    for (auto i : mb::shuffled_indexes(n, queries)) {
+        topics.push_back(mb::make_topic(d, i, n));
+    }
+    std::set<std::string> const users { "anonymous" };
+
+    security s;
+    s.default_config();
+
+    std::vector<std::size_t> rules;
+    rules.reserve(n);
+    r.result(
+        name, dist, n, "add_auth", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    rules.push_back(
+                        s.add_auth(
+                            filters[i],
+                            users,
+                            i % 2 == 0 ? security::authorization::type::allow : security::authorization::type::deny,
+                            users,
+                            i % 2 == 0 ? security::authorization::type::allow : security::authorization::type::deny
+                        )
+                    );
+                }
+            }
+        )
+    );
+
+    std::size_t allowed = 0;
+    r.result(
+        name, dist, n, "auth_pub", topics.size(),
+        mb::measure(
+            [&] {
+                for (auto const& t : topics) {
+                    if (s.auth_pub(t, "anonymous") == security::authorization::type::allow) ++allowed;
+                }
+            }
+        )
+    );
+
+    r.result(
+        name, dist, n, "auth_sub", topics.size(),
+        mb::measure(
+            [&] {
+                for (auto const& t : topics) {
+                    if (s.auth_sub_user(s.auth_sub(t), "anonymous") == security::authorization::type::allow) ++allowed;
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(allowed);
+
+    auto erase_order = mb::permutation(n);
+    r.result(
+        name, dist, n, "remove_auth", n,
+        mb::measure(
+            [&] {
+                for (auto i : erase_order) {
+                    s.remove_auth(rules[i]);
+                }
+            }
+        )
+    );
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        // add_auth() and remove_auth() scan all rules, so the larger sizes take too long.
+        if (!mb::parse_options(argc, argv, 100000, opts)) return 1;
+        mb::reporter r(opts);
+        if (!r.enabled("security")) return 0;
+        for (auto n : opts.sizes) {
+            for (auto d : mb::all_distributions()) {
+                bench(r, d, n, opts.queries);
+            }
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
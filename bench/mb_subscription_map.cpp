@@ -0,0 +1,141 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/broker/subscription_map.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+// The key is the client id like sub_con_map.
+using multiple_map = MQTT_NS::broker::multiple_subscription_map<std::string, std::size_t>;
+using single_map = MQTT_NS::broker::single_subscription_map<std::size_t>;
+
+struct data_set {
+    data_set(mb::distribution d, std::size_t n, std::size_t queries)
+        :erase_order(mb::permutation(n)) {
+        filters.reserve(n);
+        keys.reserve(n);
+        for (std::size_t i = 0; i != n; ++i) {
+            filters.push_back(mb::make_filter(d, i, n));
+            keys.push_back("cid" + std::to_string(i));
+        }
+        for (auto i : mb::shuffled_indexes(n, queries)) {
+            topics.push_back(mb::make_topic(d, i, n));
+        }
+    }
+
+    std::vector<std::string> filters;
+    std::vector<std::string> keys;
+    std::vector<std::string> topics;
+    std::vector<std::size_t> erase_order;
+};
+
+void bench_multiple(mb::reporter& r, mb::distribution d, std::size_t n, data_set const& ds) {
+    std::string const name = "multiple_subscription_map";
+    auto dist = mb::distribution_to_str(d);
+    multiple_map m;
+
+    r.result(
+        name, dist, n, "insert", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    m.insert_or_assign(ds.filters[i], ds.keys[i], i);
+                }
+            }
+        )
+    );
+
+    std::size_t matched = 0;
+    r.result(
+        name, dist, n, "match", ds.topics.size(),
+        mb::measure(
+            [&] {
+                for (auto const& t : ds.topics) {
+                    m.find(t, [&](std::string const&, std::size_t) { ++matched; });
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(matched);
+
+    r.result(
+        name, dist, n, "erase", n,
+        mb::measure(
+            [&] {
+                for (auto i : ds.erase_order) {
+                    m.erase(ds.filters[i], ds.keys[i]);
+                }
+            }
+        )
+    );
+}
+
+void bench_single(mb::reporter& r, mb::distribution d, std::size_t n, data_set const& ds) {
+    std::string const name = "single_subscription_map";
+    auto dist = mb::distribution_to_str(d);
+    single_map m;
+
+    r.result(
+        name, dist, n, "insert", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    m.insert(ds.filters[i], i);
+                }
+            }
+        )
+    );
+
+    std::size_t matched = 0;
+    r.result(
+        name, dist, n, "match", ds.topics.size(),
+        mb::measure(
+            [&] {
+                for (auto const& t : ds.topics) {
+                    m.find(t, [&](std::size_t) { ++matched; });
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(matched);
+
+    r.result(
+        name, dist, n, "erase", n,
+        mb::measure(
+            [&] {
+                for (auto i : ds.erase_order) {
+                    m.erase(ds.filters[i]);
+                }
+            }
+        )
+    );
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        if (!mb::parse_options(argc, argv, 10000000, opts)) return 1;
+        mb::reporter r(opts);
+        for (auto n : opts.sizes) {
+            for (auto d : mb::all_distributions()) {
+                data_set ds(d, n, opts.queries);
+                if (r.enabled("multiple_subscription_map")) bench_multiple(r, d, n, ds);
+                if (r.enabled("single_subscription_map")) bench_single(r, d, n, ds);
+            }
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,140 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/topic_alias_send.hpp>
+#include <mqtt/topic_alias_recv.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+struct data_set {
+    data_set(mb::distribution d, std::size_t n, std::size_t queries)
+        :query_indexes(mb::shuffled_indexes(n, queries)) {
+        topics.reserve(n);
+        for (std::size_t i = 0; i != n; ++i) topics.push_back(mb::make_topic(d, i, n));
+        // Topics that replace the least recently used aliases.
+        for (std::size_t i = 0; i != queries; ++i) new_topics.push_back(mb::make_topic(d, n + i, n) + "/n");
+    }
+
+    static MQTT_NS::topic_alias_t alias(std::size_t i) {
+        return static_cast<MQTT_NS::topic_alias_t>(i + 1);
+    }
+
+    std::vector<std::string> topics;
+    std::vector<std::string> new_topics;
+    std::vector<std::size_t> query_indexes;
+};
+
+void bench_send(mb::reporter& r, mb::distribution d, std::size_t n, data_set const& ds) {
+    std::string const name = "topic_alias_send";
+    auto dist = mb::distribution_to_str(d);
+    MQTT_NS::topic_alias_send ta(static_cast<MQTT_NS::topic_alias_t>(n));
+
+    r.result(
+        name, dist, n, "insert", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    ta.insert_or_update(ds.topics[i], data_set::alias(i));
+                }
+            }
+        )
+    );
+
+    std::size_t found = 0;
+    r.result(
+        name, dist, n, "find_topic", ds.query_indexes.size(),
+        mb::measure(
+            [&] {
+                for (auto i : ds.query_indexes) {
+                    if (ta.find(ds.topics[i])) ++found;
+                }
+            }
+        )
+    );
+
+    r.result(
+        name, dist, n, "find_alias", ds.query_indexes.size(),
+        mb::measure(
+            [&] {
+                for (auto i : ds.query_indexes) {
+                    found += ta.find(data_set::alias(i)).size();
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(found);
+
+    // The sender replaces the least recently used alias when all aliases are used.
+    r.result(
+        name, dist, n, "replace_lru", ds.new_topics.size(),
+        mb::measure(
+            [&] {
+                for (auto const& t : ds.new_topics) {
+                    ta.insert_or_update(t, ta.get_lru_alias());
+                }
+            }
+        )
+    );
+}
+
+void bench_recv(mb::reporter& r, mb::distribution d, std::size_t n, data_set const& ds) {
+    std::string const name = "topic_alias_recv";
+    auto dist = mb::distribution_to_str(d);
+    MQTT_NS::topic_alias_recv ta(static_cast<MQTT_NS::topic_alias_t>(n));
+
+    r.result(
+        name, dist, n, "insert", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    ta.insert_or_update(ds.topics[i], data_set::alias(i));
+                }
+            }
+        )
+    );
+
+    std::size_t found = 0;
+    r.result(
+        name, dist, n, "find_alias", ds.query_indexes.size(),
+        mb::measure(
+            [&] {
+                for (auto i : ds.query_indexes) {
+                    found += ta.find(data_set::alias(i)).size();
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(found);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        // Topic alias is 16 bits.
+        if (!mb::parse_options(argc, argv, std::numeric_limits<MQTT_NS::topic_alias_t>::max(), opts)) return 1;
+        mb::reporter r(opts);
+        for (auto n : opts.sizes) {
+            for (auto d : mb::all_distributions()) {
+                // Topic alias has no filter, so the wildcard distribution is the same as deep.
+                if (d == mb::distribution::wildcard) continue;
+                data_set ds(d, n, opts.queries);
+                if (r.enabled("topic_alias_send")) bench_send(r, d, n, ds);
+                if (r.enabled("topic_alias_recv")) bench_recv(r, d, n, ds);
+            }
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,92 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include <mqtt/config.hpp>
+#include <mqtt/value_allocator.hpp>
+
+#include "micro_bench.hpp"
+
+namespace mb = micro_bench;
+
+namespace {
+
+using allocator = MQTT_NS::value_allocator<std::uint32_t>;
+
+void bench(mb::reporter& r, std::size_t n) {
+    std::string const name = "value_allocator";
+    auto order = mb::permutation(n);
+    auto highest = static_cast<std::uint32_t>(n - 1);
+
+    allocator a(0, highest);
+    std::uint64_t sum = 0;
+
+    r.result(
+        name, "sequential", n, "allocate", n,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != n; ++i) {
+                    sum += a.allocate().value();
+                }
+            }
+        )
+    );
+
+    // The vacant intervals are fragmented and merged again.
+    r.result(
+        name, "random", n, "deallocate", n,
+        mb::measure(
+            [&] {
+                for (auto i : order) {
+                    a.deallocate(static_cast<std::uint32_t>(i));
+                }
+            }
+        )
+    );
+
+    r.result(
+        name, "random", n, "use", n,
+        mb::measure(
+            [&] {
+                for (auto i : order) {
+                    if (a.use(static_cast<std::uint32_t>(i))) ++sum;
+                }
+            }
+        )
+    );
+
+    // Free every other value, then allocate them from the fragmented pool.
+    for (std::size_t i = 0; i < n; i += 2) a.deallocate(static_cast<std::uint32_t>(i));
+    auto half = (n + 1) / 2;
+    r.result(
+        name, "fragmented", n, "allocate", half,
+        mb::measure(
+            [&] {
+                for (std::size_t i = 0; i != half; ++i) {
+                    sum += a.allocate().value();
+                }
+            }
+        )
+    );
+    mb::do_not_optimize(sum);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    try {
+        mb::options opts;
+        if (!mb::parse_options(argc, argv, 10000000, opts)) return 1;
+        mb::reporter r(opts);
+        if (!r.enabled("value_allocator")) return 0;
+        for (auto n : opts.sizes) {
+            bench(r, n);
+        }
+    }
+    catch(std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,345 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BENCH_MICRO_BENCH_HPP)
+#define MQTT_BENCH_MICRO_BENCH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace micro_bench {
+
+/**
+ * @brief Topic distribution of the entries.
+ *        wide     : one level under a single parent. "w/<n>"
+ *        deep     : one hex digit per level, so each level has up to 16 children. "d/1/f/3"
+ *        wildcard : topics are the same as deep, and 3/4 of the filters contain '+' or '#'
+ */
+enum class distribution {
+    wide,
+    deep,
+    wildcard
+};
+
+constexpr char const* distribution_to_str(distribution v) {
+    switch(v) {
+    case distribution::wide:     return "wide";
+    case distribution::deep:     return "deep";
+    case distribution::wildcard: return "wildcard";
+    default:                     return "unknown_distribution";
+    }
+}
+
+inline std::vector<distribution> all_distributions() {
+    return { distribution::wide, distribution::deep, distribution::wildcard };
+}
+
+/**
+ * @brief Number of the hex digit levels that can hold n entries.
+ */
+inline std::size_t depth_for(std::size_t n) {
+    std::size_t depth = 1;
+    for (std::size_t cap = 16; cap < n; cap *= 16) ++depth;
+    return depth;
+}
+
+inline std::vector<std::string> split_levels(std::string const& topic) {
+    std::vector<std::string> levels;
+    std::string::size_type b = 0;
+    while (true) {
+        auto e = topic.find('/', b);
+        levels.push_back(topic.substr(b, e - b));
+        if (e == std::string::npos) break;
+        b = e + 1;
+    }
+    return levels;
+}
+
+inline std::string join_levels(std::vector<std::string> const& levels, std::size_t count) {
+    std::string ret;
+    for (std::size_t i = 0; i != count; ++i) {
+        if (i != 0) ret += '/';
+        ret += levels[i];
+    }
+    return ret;
+}
+
+/**
+ * @brief Create the i-th topic of the distribution that has n entries.
+ */
+inline std::string make_topic(distribution d, std::size_t i, std::size_t n) {
+    static char const digits[] = "0123456789abcdef";
+    if (d == distribution::wide) return "w/" + std::to_string(i);
+
+    auto depth = depth_for(n);
+    std::string ret = "d";
+    for (std::size_t l = depth; l != 0; --l) {
+        ret += '/';
+        ret += digits[(i >> ((l - 1) * 4)) & 0xf];
+    }
+    return ret;
+}
+
+/**
+ * @brief Create the i-th topic filter of the distribution that has n entries.
+ *        It is the same as the topic except for the wildcard distribution.
+ */
+inline std::string make_filter(distribution d, std::size_t i, std::size_t n) {
+    auto topic = make_topic(d, i, n);
+    if (d != distribution::wildcard) return topic;
+
+    auto levels = split_levels(topic);
+    // The first level is the fixed prefix.
+    auto k = 1 + (i / 4) % (levels.size() - 1);
+    switch (i % 4) {
+    case 1:
+        levels[k] = "+";
+        return join_levels(levels, levels.size());
+    case 2:
+        return join_levels(levels, k) + "/#";
+    case 3:
+        levels[k] = "+";
+        levels.back() = "+";
+        return join_levels(levels, levels.size());
+    default:
+        return topic;
+    }
+}
+
+/**
+ * @brief Create the filter to match the stored topics.
+ *        Each filter of the wildcard distribution matches up to 16 topics.
+ */
+inline std::string make_query_filter(distribution d, std::size_t i, std::size_t n) {
+    auto topic = make_topic(d, i, n);
+    if (d != distribution::wildcard) return topic;
+
+    auto levels = split_levels(topic);
+    if (i % 2 == 0) {
+        levels[1 + (i / 2) % (levels.size() - 1)] = "+";
+        return join_levels(levels, levels.size());
+    }
+    return join_levels(levels, levels.size() - 1) + "/#";
+}
+
+/**
+ * @brief Indexes in [0, n) in the deterministic random order.
+ */
+inline std::vector<std::size_t> shuffled_indexes(std::size_t n, std::size_t count) {
+    std::mt19937_64 rng(n);
+    std::uniform_int_distribution<std::size_t> dist(0, n - 1);
+    std::vector<std::size_t> ret;
+    ret.reserve(count);
+    for (std::size_t i = 0; i != count; ++i) ret.push_back(dist(rng));
+    return ret;
+}
+
+inline std::vector<std::size_t> permutation(std::size_t n) {
+    std::vector<std::size_t> ret(n);
+    for (std::size_t i = 0; i != n; ++i) ret[i] = i;
+    std::shuffle(ret.begin(), ret.end(), std::mt19937_64(n));
+    return ret;
+}
+
+/**
+ * @brief Measure the elapsed time of f.
+ */
+template <typename Func>
+std::chrono::nanoseconds measure(Func&& f) {
+    auto start = std::chrono::steady_clock::now();
+    std::forward<Func>(f)();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+}
+
+/**
+ * @brief Keep the value alive, so the compiler doesn't remove the measured code.
+ */
+template <typename T>
+void do_not_optimize(T const& v) {
+    static volatile std::uint64_t sink;
+    sink = sink + static_cast<std::uint64_t>(v);
+}
+
+struct options {
+    std::vector<std::size_t> sizes;
+    std::size_t queries;
+    std::string format;
+    std::string filter;
+};
+
+/**
+ * @brief Parse the common command line options.
+ * @param limit maximum entries of the benchmark. The larger sizes are skipped.
+ * @return false if the help is requested or the options are invalid.
+ */
+inline bool parse_options(int argc, char** argv, std::size_t limit, options& opts) {
+    boost::program_options::options_description desc("Options");
+    desc.add_options()
+        ("help", "produce help message")
+        (
+            "sizes",
+            boost::program_options::value<std::vector<std::size_t>>()->multitoken(),
+            "numbers of entries. default is 10^3 to max_entries in powers of ten"
+        )
+        (
+            "max_entries",
+            boost::program_options::value<std::size_t>()->default_value(1000000),
+            "maximum number of entries of the default sizes. up to 10000000"
+        )
+        (
+            "queries",
+            boost::program_options::value<std::size_t>()->default_value(100000),
+            "number of the match operations per size"
+        )
+        (
+            "format",
+            boost::program_options::value<std::string>()->default_value("text"),
+            "output format. text, csv, or json (one object per line)"
+        )
+        (
+            "filter",
+            boost::program_options::value<std::string>()->default_value(""),
+            "run only the benchmarks whose name contains the string"
+        )
+        ;
+
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+    boost::program_options::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return false;
+    }
+
+    if (vm.count("sizes")) {
+        opts.sizes = vm["sizes"].as<std::vector<std::size_t>>();
+    }
+    else {
+        auto max_entries = vm["max_entries"].as<std::size_t>();
+        for (std::size_t n = 1000; n <= max_entries; n *= 10) opts.sizes.push_back(n);
+    }
+    opts.sizes.erase(
+        std::remove_if(
+            opts.sizes.begin(),
+            opts.sizes.end(),
+            [&](std::size_t n) { return n == 0 || n > limit; }
+        ),
+        opts.sizes.end()
+    );
+    opts.queries = vm["queries"].as<std::size_t>();
+    opts.format = vm["format"].as<std::string>();
+    opts.filter = vm["filter"].as<std::string>();
+    if (opts.format != "text" && opts.format != "csv" && opts.format != "json") {
+        std::cerr << "invalid format:" << opts.format << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Output the results in the specified format.
+ *        One row per (benchmark, distribution, entries, operation).
+ */
+class reporter {
+public:
+    explicit reporter(options const& opts)
+        :opts_(opts) {
+        if (opts_.format == "csv") {
+            std::cout << "benchmark,distribution,entries,operation,ops,total_ns,ns_per_op" << std::endl;
+        }
+        else if (opts_.format == "text") {
+            std::cout
+                << std::left
+                << std::setw(28) << "benchmark"
+                << "  "
+                << std::setw(10) << "dist"
+                << "  "
+                << std::right
+                << std::setw(10) << "entries"
+                << "  "
+                << std::left
+                << std::setw(16) << "operation"
+                << "  "
+                << std::right
+                << std::setw(10) << "ops"
+                << "  "
+                << std::setw(12) << "ns/op"
+                << std::endl;
+        }
+    }
+
+    bool enabled(std::string const& benchmark) const {
+        return benchmark.find(opts_.filter) != std::string::npos;
+    }
+
+    void result(
+        std::string const& benchmark,
+        std::string const& dist,
+        std::size_t entries,
+        std::string const& operation,
+        std::size_t ops,
+        std::chrono::nanoseconds total) {
+        auto ns_per_op = ops == 0 ? 0.0 : static_cast<double>(total.count()) / static_cast<double>(ops);
+        if (opts_.format == "csv") {
+            std::cout
+                << benchmark << ','
+                << dist << ','
+                << entries << ','
+                << operation << ','
+                << ops << ','
+                << total.count() << ','
+                << std::fixed << std::setprecision(1) << ns_per_op
+                << std::endl;
+        }
+        else if (opts_.format == "json") {
+            std::cout
+                << "{\"benchmark\":\"" << benchmark
+                << "\",\"distribution\":\"" << dist
+                << "\",\"entries\":" << entries
+                << ",\"operation\":\"" << operation
+                << "\",\"ops\":" << ops
+                << ",\"total_ns\":" << total.count()
+                << ",\"ns_per_op\":" << std::fixed << std::setprecision(1) << ns_per_op
+                << "}" << std::endl;
+        }
+        else {
+            std::cout
+                << std::left
+                << std::setw(28) << benchmark
+                << "  "
+                << std::setw(10) << dist
+                << "  "
+                << std::right
+                << std::setw(10) << entries
+                << "  "
+                << std::left
+                << std::setw(16) << operation
+                << "  "
+                << std::right
+                << std::setw(10) << ops
+                << "  "
+                << std::setw(12) << std::fixed << std::setprecision(1) << ns_per_op
+                << std::endl;
+        }
+    }
+
+private:
+    options const& opts_;
+};
+
+} // namespace micro_bench
+
+#endif // MQTT_BENCH_MICRO_BENCH_HPP
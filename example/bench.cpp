@@ -11,6 +11,11 @@
 #include <thread>
 #include <fstream>
 #include <iostream>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+
+#include <mqtt/broker/latency_histogram.hpp>
 
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
@@ -34,7 +39,8 @@ int main(int argc, char **argv) {
     try {
         boost::program_options::options_description desc;
 
-        constexpr std::size_t min_payload = 15;
+        // payload: [client index:8][sequence:8][send timestamp:16][filler]
+        constexpr std::size_t min_payload = 31;
         std::string payload_size_desc =
             "payload bytes. must be greater than " + std::to_string(min_payload);
 
@@ -181,6 +187,11 @@ int main(int argc, char **argv) {
                 boost::program_options::value<bool>()->default_value(false),
                 "report for each client's max mid avg min"
             )
+            (
+                "csv",
+                boost::program_options::value<std::string>()->default_value(""),
+                "output file of the latency percentiles for each QoS and each client in CSV format. empty means no output."
+            )
             (
                 "pub_idle_count",
                 boost::program_options::value<std::size_t>()->default_value(1),
@@ -304,6 +315,7 @@ int main(int argc, char **argv) {
         std::chrono::steady_clock::time_point tp_publish;
 
         auto detail_report = vm["detail_report"].as<bool>();
+        auto csv = vm["csv"].as<std::string>();
         auto host = vm["host"].as<std::string>();
         auto port = vm["port"].as<std::uint16_t>();
         auto protocol = vm["protocol"].as<std::string>();
@@ -466,6 +478,9 @@ int main(int argc, char **argv) {
                 std::atomic<std::size_t> rest_idle{pub_idle_count * clients};
                 std::atomic<std::uint64_t> rest_times{times * clients};
 
+                // end-to-end latency of the received messages for each QoS
+                std::array<MQTT_NS::broker::latency_histogram, 3> qos_latency;
+
                 // ==== begin local lambda expressions
                 auto sub_proc =
                     [&] {
@@ -517,7 +532,6 @@ int main(int argc, char **argv) {
                                 }
                                 else {
                                     MQTT_NS::publish_options opts = qos | retain;
-                                    ci.sent.at(ci.send_times - 1) = std::chrono::steady_clock::now();
 
                                     ci.c->async_publish(
                                         MQTT_NS::allocate_buffer(topic_prefix + ci.index_str),
@@ -637,17 +651,18 @@ int main(int argc, char **argv) {
                         std::string maxavg_cid;
                         std::size_t maxmin = 0;
                         std::string maxmin_cid;
+                        auto to_us =
+                            [](std::chrono::nanoseconds d) {
+                                return static_cast<std::size_t>(
+                                    std::chrono::duration_cast<std::chrono::microseconds>(d).count()
+                                );
+                            };
                         for (auto& ci : cis) {
-                            std::sort(ci.rtt_us.begin(), ci.rtt_us.end());
                             std::string cid = ci.c->get_client_id();
-                            std::size_t max = ci.rtt_us.back();
-                            std::size_t mid = ci.rtt_us.at(ci.rtt_us.size() / 2);
-                            std::size_t avg = std::accumulate(
-                                ci.rtt_us.begin(),
-                                ci.rtt_us.end(),
-                                std::size_t(0)
-                            ) / ci.rtt_us.size();
-                            std::size_t min = ci.rtt_us.front();
+                            std::size_t max = to_us(ci.latency->max());
+                            std::size_t mid = to_us(ci.latency->value_at_percentile(50.0));
+                            std::size_t avg = to_us(ci.latency->mean());
+                            std::size_t min = to_us(ci.latency->min());
                             if (maxmax < max) {
                                 maxmax = max;
                                 maxmax_cid = cid;
@@ -691,6 +706,60 @@ int main(int argc, char **argv) {
                             << "(" << boost::format("%+8d") % (maxmin / 1000) << " ms ) "
                             << "client_id:" << maxmin_cid << std::endl;
 
+                        auto percentiles =
+                            [&](MQTT_NS::broker::latency_histogram const& h) {
+                                return std::array<std::size_t, 5> {
+                                    {
+                                        to_us(h.value_at_percentile(50.0)),
+                                        to_us(h.value_at_percentile(90.0)),
+                                        to_us(h.value_at_percentile(99.0)),
+                                        to_us(h.value_at_percentile(99.9)),
+                                        to_us(h.max())
+                                    }
+                                };
+                            };
+                        locked_cout()
+                            << boost::format("%-6s %12s %12s %12s %12s %12s %12s")
+                            % "qos" % "count" % "p50(us)" % "p90(us)" % "p99(us)" % "p999(us)" % "max(us)"
+                            << std::endl;
+                        for (std::size_t i = 0; i != qos_latency.size(); ++i) {
+                            auto const& h = qos_latency[i];
+                            if (h.count() == 0) continue;
+                            auto p = percentiles(h);
+                            locked_cout()
+                                << boost::format("%-6d %12d %12d %12d %12d %12d %12d")
+                                % i % h.count() % p[0] % p[1] % p[2] % p[3] % p[4]
+                                << std::endl;
+                        }
+
+                        if (!csv.empty()) {
+                            std::ofstream ofs(csv);
+                            if (!ofs) {
+                                locked_cout() << "cannot open csv file:" << csv << std::endl;
+                            }
+                            else {
+                                ofs << "client_id,qos,count,min_us,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n";
+                                auto output =
+                                    [&](std::string const& cid, std::string const& qos_str, MQTT_NS::broker::latency_histogram const& h) {
+                                        auto p = percentiles(h);
+                                        ofs << cid << ',' << qos_str << ',' << h.count()
+                                            << ',' << to_us(h.min()) << ',' << to_us(h.mean())
+                                            << ',' << p[0] << ',' << p[1] << ',' << p[2] << ',' << p[3] << ',' << p[4]
+                                            << '\n';
+                                    };
+                                // all clients for each QoS
+                                for (std::size_t i = 0; i != qos_latency.size(); ++i) {
+                                    if (qos_latency[i].count() == 0) continue;
+                                    output("*", std::to_string(i), qos_latency[i]);
+                                }
+                                // each client for all QoS
+                                for (auto& ci : cis) {
+                                    output(ci.c->get_client_id(), "*", *ci.latency);
+                                }
+                                locked_cout() << "csv written to " << csv << std::endl;
+                            }
+                        }
+
                         for (auto& ci : cis) {
                             ci.c->async_force_disconnect();
                         }
@@ -719,16 +788,16 @@ int main(int argc, char **argv) {
                         }
                         else {
                             auto recv = std::chrono::steady_clock::now();
-                            auto dur_us = std::chrono::duration_cast<std::chrono::microseconds>(
-                                recv - ci.sent.at(ci.recv_times - 1)
-                            ).count();
+                            auto dur = recv - ci.sent_time(contents);
+                            auto dur_us = std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
                             if (limit_ms != 0 && static_cast<unsigned long>(dur_us) > limit_ms * 1000) {
                                 std::cout << "RTT:" << (dur_us / 1000) << "ms over " << limit_ms << "ms" << std::endl;
                             }
                             if (compare) {
-                                if (contents != ci.recv_payload()) {
+                                auto expected = ci.recv_payload(contents);
+                                if (contents != expected) {
                                     locked_cout() << "received payload doesn't match to sent one" << std::endl;
-                                    locked_cout() << "  expected: " << ci.recv_payload() << std::endl;
+                                    locked_cout() << "  expected: " << expected << std::endl;
                                     locked_cout() << "  received: " << contents << std::endl;;
                                 }
                             }
@@ -737,7 +806,9 @@ int main(int argc, char **argv) {
                                 locked_cout() << "  expected: " << topic_prefix + ci.index_str << std::endl;
                                 locked_cout() << "  received: " << topic_name << std::endl;
                             }
-                            ci.rtt_us.emplace_back(dur_us);
+                            auto dur_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(dur);
+                            ci.latency->record(dur_ns);
+                            qos_latency.at(static_cast<std::size_t>(pubopts.get_qos())).record(dur_ns);
                             BOOST_ASSERT(ci.recv_times != 0);
                             --ci.recv_times;
                             if (rest_times == 0) finish_proc();
@@ -1002,10 +1073,10 @@ int main(int argc, char **argv) {
                  send_times{times},
                  recv_times{times},
                  send_idle_count{idle_count},
-                 recv_idle_count{idle_count}
+                 recv_idle_count{idle_count},
+                 latency{std::make_unique<MQTT_NS::broker::latency_histogram>()}
             {
                 payload_str.resize(payload_size);
-                sent.resize(times);
                 auto it = payload_str.begin() + min_payload + 1;
                 auto end = payload_str.end();
                 char c = 'A';
@@ -1019,16 +1090,35 @@ int main(int argc, char **argv) {
                 std::string ret = payload_str;
                 auto variable = (boost::format("%s%08d") %index_str % send_times).str();
                 std::copy(variable.begin(), variable.end(), ret.begin());
+                auto sent = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()
+                ).count();
+                char timestamp[17];
+                std::snprintf(timestamp, sizeof(timestamp), "%016llx", static_cast<unsigned long long>(sent));
+                std::copy(timestamp, timestamp + 16, ret.begin() + 16);
                 return MQTT_NS::allocate_buffer(ret);
             }
 
-            MQTT_NS::buffer recv_payload() const {
+            // The send timestamp is not compared.
+            MQTT_NS::buffer recv_payload(MQTT_NS::string_view received) const {
                 std::string ret = payload_str;
                 auto variable = (boost::format("%s%08d") %index_str % recv_times).str();
                 std::copy(variable.begin(), variable.end(), ret.begin());
+                if (received.size() == ret.size()) {
+                    std::copy(received.begin() + 16, received.begin() + 32, ret.begin() + 16);
+                }
                 return MQTT_NS::allocate_buffer(ret);
             }
 
+            static std::chrono::steady_clock::time_point sent_time(MQTT_NS::string_view received) {
+                std::string timestamp(received.substr(16, 16));
+                return std::chrono::steady_clock::time_point(
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::nanoseconds(std::strtoull(timestamp.c_str(), nullptr, 16))
+                    )
+                );
+            }
+
 #if BOOST_VERSION < 107400 || defined(BOOST_ASIO_USE_TS_EXECUTOR_AS_DEFAULT)
             using executor_t =  as::executor;
 #else  // BOOST_VERSION < 107400 || defined(BOOST_ASIO_USE_TS_EXECUTOR_AS_DEFAULT)
@@ -1045,8 +1135,7 @@ int main(int argc, char **argv) {
             std::size_t recv_times;
             std::size_t send_idle_count;
             std::size_t recv_idle_count;
-            std::vector<std::chrono::steady_clock::time_point> sent;
-            std::vector<std::size_t> rtt_us;
+            std::unique_ptr<MQTT_NS::broker::latency_histogram> latency;
             std::shared_ptr<as::steady_timer> tim;
         };
 
@@ -167,6 +167,14 @@ public:
         server_.close();
     }
 
+    /**
+     * @brief Set io_context getter for TLS handshake.
+     * @param ioc_handshake_getter io_context getter for TLS handshake
+     */
+    void set_handshake_ioc_getter(std::function<as::io_context&()> ioc_handshake_getter) {
+        server_.set_handshake_ioc_getter(MQTT_NS::force_move(ioc_handshake_getter));
+    }
+
     /**
      * @brief Get boost asio ssl context.
      * @return ssl context
@@ -233,6 +241,22 @@ public:
         server_.close();
     }
 
+    /**
+     * @brief Set permessage-deflate extension option.
+     * @param pmd permessage-deflate option
+     */
+    void set_permessage_deflate(boost::beast::websocket::permessage_deflate const& pmd) {
+        server_.set_permessage_deflate(pmd);
+    }
+
+    /**
+     * @brief Set the maximum total memory for permessage-deflate of all connections.
+     * @param size maximum memory in bytes. 0 means no limit.
+     */
+    void set_max_deflate_memory(std::size_t size) {
+        server_.set_max_deflate_memory(size);
+    }
+
 private:
     MQTT_NS::server_ws<> server_;
     MQTT_NS::broker::broker_t& b_;
@@ -297,6 +321,30 @@ public:
         server_.close();
     }
 
+    /**
+     * @brief Set io_context getter for TLS handshake.
+     * @param ioc_handshake_getter io_context getter for TLS handshake
+     */
+    void set_handshake_ioc_getter(std::function<as::io_context&()> ioc_handshake_getter) {
+        server_.set_handshake_ioc_getter(MQTT_NS::force_move(ioc_handshake_getter));
+    }
+
+    /**
+     * @brief Set permessage-deflate extension option.
+     * @param pmd permessage-deflate option
+     */
+    void set_permessage_deflate(boost::beast::websocket::permessage_deflate const& pmd) {
+        server_.set_permessage_deflate(pmd);
+    }
+
+    /**
+     * @brief Set the maximum total memory for permessage-deflate of all connections.
+     * @param size maximum memory in bytes. 0 means no limit.
+     */
+    void set_max_deflate_memory(std::size_t size) {
+        server_.set_max_deflate_memory(size);
+    }
+
     /**
      * @brief Get boost asio ssl context.
      * @return ssl context
@@ -432,6 +480,33 @@ void load_ctx(
 }
 #endif // defined(MQTT_USE_TLS)
 
+#if defined(MQTT_USE_WS)
+template<typename Server>
+void load_deflate(
+    Server& server,
+    boost::program_options::variables_map const& vm,
+    char const* name
+) {
+    if (!vm["ws_deflate.enable"].as<bool>()) return;
+
+    boost::beast::websocket::permessage_deflate pmd;
+    pmd.server_enable = true;
+    pmd.server_max_window_bits = vm["ws_deflate.window_bits"].as<int>();
+    pmd.client_max_window_bits = vm["ws_deflate.window_bits"].as<int>();
+    pmd.memLevel = vm["ws_deflate.mem_level"].as<int>();
+    pmd.compLevel = vm["ws_deflate.comp_level"].as<int>();
+    auto max_memory = vm["ws_deflate.max_memory"].as<std::size_t>();
+    MQTT_LOG("mqtt_broker", info)
+        << name << " permessage-deflate"
+        << " window_bits:" << pmd.server_max_window_bits
+        << " mem_level:" << pmd.memLevel
+        << " comp_level:" << pmd.compLevel
+        << " max_memory:" << max_memory;
+    server.set_permessage_deflate(pmd);
+    server.set_max_deflate_memory(max_memory);
+}
+#endif // defined(MQTT_USE_WS)
+
 void run_broker(boost::program_options::variables_map const& vm) {
     try {
         as::io_context timer_ioc;
@@ -469,6 +544,18 @@ void run_broker(boost::program_options::variables_map const& vm) {
             << " threads_per_ioc:" << threads_per_ioc
             << " total threads:" << num_of_iocs * threads_per_ioc;
 
+        if (vm["delivery_mailbox"].as<bool>()) {
+            if (num_of_iocs > 1) {
+                MQTT_LOG("mqtt_broker", info)
+                    << "delivery_mailbox enabled";
+                b.set_delivery_mailbox(true);
+            }
+            else {
+                MQTT_LOG("mqtt_broker", info)
+                    << "delivery_mailbox is ignored because iocs is 1";
+            }
+        }
+
         if (vm.count("auth_file")) {
             std::string auth_file = vm["auth_file"].as<std::string>();
             if (!auth_file.empty()) {
@@ -491,6 +578,161 @@ void run_broker(boost::program_options::variables_map const& vm) {
             }
         }
 
+        if (auto high = vm["backpressure.high_watermark"].as<std::size_t>()) {
+            MQTT_NS::broker::backpressure_policy policy;
+            policy.drop_qos0 = vm["backpressure.drop_qos0"].as<bool>();
+            policy.queue_offline = vm["backpressure.queue_offline"].as<bool>();
+            policy.pause_publishers = vm["backpressure.pause_publishers"].as<bool>();
+            auto low = vm["backpressure.low_watermark"].as<std::size_t>();
+            if (low >= high) {
+                throw std::runtime_error("backpressure.low_watermark must be less than backpressure.high_watermark");
+            }
+            MQTT_LOG("mqtt_broker", info)
+                << "backpressure"
+                << " high_watermark:" << high
+                << " low_watermark:" << low
+                << " drop_qos0:" << std::boolalpha << policy.drop_qos0
+                << " queue_offline:" << policy.queue_offline
+                << " pause_publishers:" << policy.pause_publishers;
+            b.set_send_queue_watermark(high, low, policy);
+        }
+
+        {
+            MQTT_NS::broker::slow_consumer_policy policy;
+            policy.check_interval = std::chrono::milliseconds(vm["slow_consumer.check_interval_ms"].as<std::size_t>());
+            policy.max_send_queue_bytes = vm["slow_consumer.max_send_queue_bytes"].as<std::size_t>();
+            policy.max_send_queue_age = std::chrono::milliseconds(vm["slow_consumer.max_send_queue_age_ms"].as<std::size_t>());
+            policy.max_offline_messages = vm["slow_consumer.max_offline_messages"].as<std::size_t>();
+            policy.max_inflight_saturated = std::chrono::milliseconds(vm["slow_consumer.max_inflight_saturated_ms"].as<std::size_t>());
+            auto action = vm["slow_consumer.action"].as<std::string>();
+            if (action == "warn") {
+                policy.action = MQTT_NS::broker::slow_consumer_action::warn;
+            }
+            else if (action == "drop_qos0") {
+                policy.action = MQTT_NS::broker::slow_consumer_action::drop_qos0;
+            }
+            else if (action == "disconnect") {
+                policy.action = MQTT_NS::broker::slow_consumer_action::disconnect;
+            }
+            else {
+                throw std::runtime_error("slow_consumer.action must be warn, drop_qos0, or disconnect");
+            }
+            if (policy.max_send_queue_bytes != 0 ||
+                policy.max_send_queue_age != std::chrono::steady_clock::duration::zero() ||
+                policy.max_offline_messages != 0 ||
+                policy.max_inflight_saturated != std::chrono::steady_clock::duration::zero()) {
+                MQTT_LOG("mqtt_broker", info)
+                    << "slow_consumer"
+                    << " max_send_queue_bytes:" << policy.max_send_queue_bytes
+                    << " max_send_queue_age_ms:" << vm["slow_consumer.max_send_queue_age_ms"].as<std::size_t>()
+                    << " max_offline_messages:" << policy.max_offline_messages
+                    << " max_inflight_saturated_ms:" << vm["slow_consumer.max_inflight_saturated_ms"].as<std::size_t>()
+                    << " action:" << policy.action;
+                b.set_slow_consumer_policy(policy);
+            }
+        }
+
+        {
+            MQTT_NS::broker::shared_target_policy policy;
+            auto strategy = vm["shared_subscription.strategy"].as<std::string>();
+            if (strategy == "round_robin") {
+                policy.strategy = MQTT_NS::broker::shared_target_strategy::round_robin;
+            }
+            else if (strategy == "least_inflight") {
+                policy.strategy = MQTT_NS::broker::shared_target_strategy::least_inflight;
+            }
+            else if (strategy == "sticky_topic") {
+                policy.strategy = MQTT_NS::broker::shared_target_strategy::sticky_topic;
+            }
+            else {
+                throw std::runtime_error("shared_subscription.strategy must be round_robin, least_inflight, or sticky_topic");
+            }
+            policy.send_queue_threshold = vm["shared_subscription.send_queue_threshold"].as<std::size_t>();
+            MQTT_LOG("mqtt_broker", info)
+                << "shared_subscription"
+                << " strategy:" << strategy
+                << " send_queue_threshold:" << policy.send_queue_threshold;
+            b.set_shared_subscription_policy(policy);
+        }
+
+        if (vm.count("session_wal.path")) {
+            MQTT_NS::broker::session_wal_config config;
+            config.path = vm["session_wal.path"].as<std::string>();
+            config.segment_size = vm["session_wal.segment_size"].as<std::size_t>();
+            config.flush_interval = std::chrono::milliseconds(vm["session_wal.flush_interval_ms"].as<std::size_t>());
+            config.compaction_interval = std::chrono::seconds(vm["session_wal.compaction_interval_s"].as<std::size_t>());
+            config.sync = vm["session_wal.sync"].as<bool>();
+            MQTT_LOG("mqtt_broker", info)
+                << "session_wal"
+                << " path:" << config.path
+                << " segment_size:" << config.segment_size
+                << " flush_interval_ms:" << vm["session_wal.flush_interval_ms"].as<std::size_t>()
+                << " compaction_interval_s:" << vm["session_wal.compaction_interval_s"].as<std::size_t>()
+                << " sync:" << std::boolalpha << config.sync;
+            b.set_session_wal(MQTT_NS::force_move(config));
+        }
+
+        if (vm.count("offline_spill.directory")) {
+            MQTT_NS::broker::offline_spill_config config;
+            config.directory = vm["offline_spill.directory"].as<std::string>();
+            config.session_memory_budget = vm["offline_spill.session_memory_budget"].as<std::size_t>();
+            config.global_memory_budget = vm["offline_spill.global_memory_budget"].as<std::size_t>();
+            config.segment_size = vm["offline_spill.segment_size"].as<std::size_t>();
+            MQTT_LOG("mqtt_broker", info)
+                << "offline_spill"
+                << " directory:" << config.directory
+                << " session_memory_budget:" << config.session_memory_budget
+                << " global_memory_budget:" << config.global_memory_budget
+                << " segment_size:" << config.segment_size;
+            b.set_offline_spill(MQTT_NS::force_move(config));
+        }
+
+        // Set before loading the retained messages so that the loaded payloads are deduplicated.
+        if (vm["retained_store.dedupe_payloads"].as<bool>()) {
+            MQTT_LOG("mqtt_broker", info)
+                << "retained_store dedupe_payloads:true";
+            b.set_retained_payload_dedupe(true);
+        }
+
+        if (vm.count("retained_store.path")) {
+            MQTT_NS::broker::retained_store_config config;
+            config.path = vm["retained_store.path"].as<std::string>();
+            config.segment_size = vm["retained_store.segment_size"].as<std::size_t>();
+            config.compaction_interval = std::chrono::seconds(vm["retained_store.compaction_interval_s"].as<std::size_t>());
+            config.verify_checksum = vm["retained_store.verify_checksum"].as<bool>();
+            config.sync = vm["retained_store.sync"].as<bool>();
+            MQTT_LOG("mqtt_broker", info)
+                << "retained_store"
+                << " path:" << config.path
+                << " segment_size:" << config.segment_size
+                << " compaction_interval_s:" << vm["retained_store.compaction_interval_s"].as<std::size_t>()
+                << " verify_checksum:" << std::boolalpha << config.verify_checksum
+                << " sync:" << std::boolalpha << config.sync;
+            b.set_retained_store(MQTT_NS::force_move(config));
+        }
+
+        if (vm["sys_metrics.interval_s"].as<std::size_t>() != 0) {
+            MQTT_NS::broker::sys_metrics_config config;
+            config.interval = std::chrono::seconds(vm["sys_metrics.interval_s"].as<std::size_t>());
+            config.prefix = vm["sys_metrics.prefix"].as<std::string>();
+            MQTT_LOG("mqtt_broker", info)
+                << "sys_metrics"
+                << " interval_s:" << vm["sys_metrics.interval_s"].as<std::size_t>()
+                << " prefix:" << config.prefix;
+            b.set_sys_metrics(MQTT_NS::force_move(config));
+        }
+
+        if (vm["latency.enable"].as<bool>()) {
+            MQTT_NS::broker::latency_tracking_config config;
+            if (auto interval = vm["latency.log_interval_s"].as<std::size_t>()) {
+                config.log_interval.emplace(std::chrono::seconds(interval));
+            }
+            MQTT_LOG("mqtt_broker", info)
+                << "latency"
+                << " log_interval_s:" << vm["latency.log_interval_s"].as<std::size_t>();
+            b.set_latency_tracking(MQTT_NS::force_move(config));
+        }
+
         as::io_context accept_ioc;
 
         std::mutex mtx_con_iocs;
@@ -517,6 +759,46 @@ void run_broker(boost::program_options::variables_map const& vm) {
                 return ret;
             };
 
+#if defined(MQTT_USE_TLS)
+        auto num_of_handshake_iocs =
+            [&] () -> std::size_t {
+                if (vm.count("handshake_iocs")) {
+                    return vm["handshake_iocs"].as<std::size_t>();
+                }
+                return 0;
+            } ();
+        MQTT_LOG("mqtt_broker", info)
+            << "handshake_iocs:" << num_of_handshake_iocs;
+
+        std::mutex mtx_handshake_iocs;
+        std::vector<as::io_context> handshake_iocs(num_of_handshake_iocs);
+
+        std::vector<
+            as::executor_work_guard<
+                as::io_context::executor_type
+            >
+        > guard_handshake_iocs;
+        guard_handshake_iocs.reserve(handshake_iocs.size());
+        for (auto& handshake_ioc : handshake_iocs) {
+            guard_handshake_iocs.emplace_back(handshake_ioc.get_executor());
+        }
+
+        auto handshake_iocs_it = handshake_iocs.begin();
+
+        // If handshake_iocs is 0, TLS handshake is processed on con_iocs.
+        auto handshake_ioc_getter =
+            [&] () -> std::function<as::io_context&()> {
+                if (handshake_iocs.empty()) return nullptr;
+                return
+                    [&mtx_handshake_iocs, &handshake_iocs, &handshake_iocs_it]() -> as::io_context& {
+                        std::lock_guard<std::mutex> g{mtx_handshake_iocs};
+                        auto& ret = *handshake_iocs_it++;
+                        if (handshake_iocs_it == handshake_iocs.end()) handshake_iocs_it = handshake_iocs.begin();
+                        return ret;
+                    };
+            } ();
+#endif // defined(MQTT_USE_TLS)
+
         MQTT_NS::optional<server_no_tls> s;
         if (vm.count("tcp.port")) {
             s.emplace(
@@ -537,6 +819,7 @@ void run_broker(boost::program_options::variables_map const& vm) {
                 b,
                 vm["ws.port"].as<std::uint16_t>()
             );
+            load_deflate(s_ws.value(), vm, "WS");
             s_ws->listen();
         }
 #endif // defined(MQTT_USE_WS)
@@ -567,6 +850,7 @@ void run_broker(boost::program_options::variables_map const& vm) {
             );
             s_lts_timer.emplace(accept_ioc);
             load_ctx(s_tls.value(), s_lts_timer.value(), vm, "TLS");
+            s_tls->set_handshake_ioc_getter(handshake_ioc_getter);
             s_tls->listen();
         }
 #endif // defined(MQTT_USE_TLS)
@@ -586,6 +870,8 @@ void run_broker(boost::program_options::variables_map const& vm) {
             );
             s_tls_ws_timer.emplace(accept_ioc);
             load_ctx(s_tls_ws.value(), s_tls_ws_timer.value(), vm, "WSS");
+            s_tls_ws->set_handshake_ioc_getter(handshake_ioc_getter);
+            load_deflate(s_tls_ws.value(), vm, "WSS");
             s_tls_ws->listen();
         }
 #endif // defined(MQTT_USE_TLS) && defined(MQTT_USE_WS)
@@ -620,6 +906,19 @@ void run_broker(boost::program_options::variables_map const& vm) {
             }
         }
 
+#if defined(MQTT_USE_TLS)
+        std::vector<std::thread> ts_handshake;
+        ts_handshake.reserve(handshake_iocs.size());
+        for (auto& handshake_ioc : handshake_iocs) {
+            ts_handshake.emplace_back(
+                [&handshake_ioc] {
+                    handshake_ioc.run();
+                    MQTT_LOG("mqtt_broker", trace) << "handshake_ioc.run() finished";
+                }
+            );
+        }
+#endif // defined(MQTT_USE_TLS)
+
         as::io_context ioc_signal;
         as::signal_set signals{ioc_signal, SIGINT, SIGTERM};
         signals.async_wait(
@@ -643,6 +942,12 @@ void run_broker(boost::program_options::variables_map const& vm) {
         th_accept.join();
         MQTT_LOG("mqtt_broker", trace) << "th_accept joined";
 
+#if defined(MQTT_USE_TLS)
+        for (auto& g : guard_handshake_iocs) g.reset();
+        for (auto& t : ts_handshake) t.join();
+        MQTT_LOG("mqtt_broker", trace) << "ts_handshake joined";
+#endif // defined(MQTT_USE_TLS)
+
         for (auto& g : guard_con_iocs) g.reset();
         for (auto& t : ts) t.join();
         MQTT_LOG("mqtt_broker", trace) << "ts joined";
@@ -682,6 +987,11 @@ int main(int argc, char **argv) {
                 boost::program_options::value<std::size_t>()->default_value(1),
                 "Number of worker threads for each io_context."
             )
+            (
+                "delivery_mailbox",
+                boost::program_options::value<bool>()->default_value(false),
+                "Deliver published messages to the subscribers via per io_context mailboxes. Effective only if iocs is greater than 1."
+            )
 #if defined(MQTT_USE_LOG)
             (
                 "verbose",
@@ -716,6 +1026,11 @@ int main(int argc, char **argv) {
                 boost::program_options::value<unsigned int>()->default_value(0),
                 "Reload interval for the certificate and private key files (hours)\n 0 - Disabled"
             )
+            (
+                "handshake_iocs",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Number of io_context dedicated to TLS handshake. Each io_context runs on its own thread.\n 0 - Handshake is processed on the connection io_context"
+            )
 #endif
             (
                 "auth_file",
@@ -724,11 +1039,203 @@ int main(int argc, char **argv) {
             )
             ;
 
+        boost::program_options::options_description backpressure_desc("Backpressure options");
+        backpressure_desc.add_options()
+            (
+                "backpressure.high_watermark",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Bytes in the send queue of a connection that start backpressure\n 0 - Disabled"
+            )
+            (
+                "backpressure.low_watermark",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Bytes in the send queue of a connection that stop backpressure"
+            )
+            (
+                "backpressure.drop_qos0",
+                boost::program_options::value<bool>()->default_value(false),
+                "Drop QoS0 messages to the congested subscriber"
+            )
+            (
+                "backpressure.queue_offline",
+                boost::program_options::value<bool>()->default_value(false),
+                "Store QoS1 and QoS2 messages to the offline queue of the congested subscriber"
+            )
+            (
+                "backpressure.pause_publishers",
+                boost::program_options::value<bool>()->default_value(false),
+                "Pause reading from the publishers that feed the congested subscriber"
+            )
+        ;
+
+        boost::program_options::options_description slow_consumer_desc("Slow consumer options");
+        slow_consumer_desc.add_options()
+            (
+                "slow_consumer.check_interval_ms",
+                boost::program_options::value<std::size_t>()->default_value(1000),
+                "Interval of checking all online sessions (milliseconds)"
+            )
+            (
+                "slow_consumer.max_send_queue_bytes",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Bytes in the send queue of a connection\n 0 - Not checked"
+            )
+            (
+                "slow_consumer.max_send_queue_age_ms",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Waiting time of the oldest message in the send queue (milliseconds)\n 0 - Not checked"
+            )
+            (
+                "slow_consumer.max_offline_messages",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Number of the messages in the offline queue of an online session\n 0 - Not checked"
+            )
+            (
+                "slow_consumer.max_inflight_saturated_ms",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Duration that the inflight window is saturated (milliseconds)\n 0 - Not checked"
+            )
+            (
+                "slow_consumer.action",
+                boost::program_options::value<std::string>()->default_value("warn"),
+                "Action for the slow consumer\n warn - Output warning log\n drop_qos0 - Drop QoS0 messages\n disconnect - Disconnect with Quota exceeded"
+            )
+        ;
+
+        boost::program_options::options_description shared_subscription_desc("Shared subscription options");
+        shared_subscription_desc.add_options()
+            (
+                "shared_subscription.strategy",
+                boost::program_options::value<std::string>()->default_value("round_robin"),
+                "Member selection of the shared subscriptions\n round_robin - In turn\n least_inflight - Fewest messages waiting for the responses relative to Receive Maximum\n sticky_topic - By the hash of the topic name"
+            )
+            (
+                "shared_subscription.send_queue_threshold",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Skip the members whose send queue exceeds this bytes\n 0 - Not checked"
+            )
+        ;
+
+        boost::program_options::options_description session_wal_desc("Session persistence options");
+        session_wal_desc.add_options()
+            (
+                "session_wal.path",
+                boost::program_options::value<std::string>(),
+                "Base path of the write-ahead log files of the durable sessions. If not set, sessions are not persisted."
+            )
+            (
+                "session_wal.segment_size",
+                boost::program_options::value<std::size_t>()->default_value(64 * 1024 * 1024),
+                "A new segment file is started when the current one exceeds this size (bytes)"
+            )
+            (
+                "session_wal.flush_interval_ms",
+                boost::program_options::value<std::size_t>()->default_value(100),
+                "Maximum interval of writing the appended records (milliseconds)"
+            )
+            (
+                "session_wal.compaction_interval_s",
+                boost::program_options::value<std::size_t>()->default_value(600),
+                "Interval of writing the snapshot and removing the older segment files (seconds)"
+            )
+            (
+                "session_wal.sync",
+                boost::program_options::value<bool>()->default_value(false),
+                "Synchronize the file to the storage device on each write"
+            )
+        ;
+
+        boost::program_options::options_description offline_spill_desc("Offline message memory budget options");
+        offline_spill_desc.add_options()
+            (
+                "offline_spill.directory",
+                boost::program_options::value<std::string>(),
+                "Directory of the spill files. If not set, all offline messages are kept in memory."
+            )
+            (
+                "offline_spill.session_memory_budget",
+                boost::program_options::value<std::size_t>()->default_value(1024 * 1024),
+                "Bytes of the offline messages that each session keeps in memory"
+            )
+            (
+                "offline_spill.global_memory_budget",
+                boost::program_options::value<std::size_t>()->default_value(256 * 1024 * 1024),
+                "Bytes of the offline messages that all sessions keep in memory"
+            )
+            (
+                "offline_spill.segment_size",
+                boost::program_options::value<std::size_t>()->default_value(16 * 1024 * 1024),
+                "A new spill file of the session is started when the current one exceeds this size (bytes)"
+            )
+        ;
+
+        boost::program_options::options_description retained_store_desc("Retained message persistence options");
+        retained_store_desc.add_options()
+            (
+                "retained_store.path",
+                boost::program_options::value<std::string>(),
+                "Base path of the retained message files. If not set, retained messages are not persisted."
+            )
+            (
+                "retained_store.segment_size",
+                boost::program_options::value<std::size_t>()->default_value(64 * 1024 * 1024),
+                "A new segment file is started when the current one exceeds this size (bytes)"
+            )
+            (
+                "retained_store.compaction_interval_s",
+                boost::program_options::value<std::size_t>()->default_value(600),
+                "Interval of checking the garbage ratio and writing the snapshot (seconds)"
+            )
+            (
+                "retained_store.verify_checksum",
+                boost::program_options::value<bool>()->default_value(false),
+                "Verify the checksum of all records on startup. If false, only the last segment is verified."
+            )
+            (
+                "retained_store.sync",
+                boost::program_options::value<bool>()->default_value(false),
+                "Synchronize the file to the storage device on each write"
+            )
+            (
+                "retained_store.dedupe_payloads",
+                boost::program_options::value<bool>()->default_value(false),
+                "Store the identical payloads of the retained messages once in memory"
+            )
+        ;
+
+        boost::program_options::options_description sys_metrics_desc("$SYS metrics options");
+        sys_metrics_desc.add_options()
+            (
+                "sys_metrics.interval_s",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Interval of publishing the broker metrics as retained messages (seconds)\n 0 - Not published"
+            )
+            (
+                "sys_metrics.prefix",
+                boost::program_options::value<std::string>()->default_value("$SYS/broker"),
+                "Topic prefix of the broker metrics"
+            )
+        ;
+
+        boost::program_options::options_description latency_desc("Latency tracking options");
+        latency_desc.add_options()
+            (
+                "latency.enable",
+                boost::program_options::value<bool>()->default_value(false),
+                "Record the latency histograms of the delivery path (auth, match, enqueue, and write)"
+            )
+            (
+                "latency.log_interval_s",
+                boost::program_options::value<std::size_t>()->default_value(60),
+                "Interval of writing the latency summary to the log (seconds)\n 0 - Not written"
+            )
+        ;
+
         boost::program_options::options_description notls_desc("TCP Server options");
         notls_desc.add_options()
             ("tcp.port", boost::program_options::value<std::uint16_t>(), "default port (TCP)")
         ;
-        desc.add(general_desc).add(notls_desc);
+        desc.add(general_desc).add(backpressure_desc).add(slow_consumer_desc).add(shared_subscription_desc).add(session_wal_desc).add(offline_spill_desc).add(retained_store_desc).add(sys_metrics_desc).add(latency_desc).add(notls_desc);
 
 #if defined(MQTT_USE_WS)
         boost::program_options::options_description ws_desc("TCP websocket Server options");
@@ -736,7 +1243,36 @@ int main(int argc, char **argv) {
             ("ws.port", boost::program_options::value<std::uint16_t>(), "default port (TCP)")
         ;
 
-        desc.add(ws_desc);
+        boost::program_options::options_description ws_deflate_desc("Websocket permessage-deflate options (WS and WSS)");
+        ws_deflate_desc.add_options()
+            (
+                "ws_deflate.enable",
+                boost::program_options::value<bool>()->default_value(false),
+                "Offer permessage-deflate extension"
+            )
+            (
+                "ws_deflate.window_bits",
+                boost::program_options::value<int>()->default_value(15),
+                "Maximum window bits (9-15)"
+            )
+            (
+                "ws_deflate.mem_level",
+                boost::program_options::value<int>()->default_value(4),
+                "Deflate memory level (1-9)"
+            )
+            (
+                "ws_deflate.comp_level",
+                boost::program_options::value<int>()->default_value(8),
+                "Deflate compression level (0-9)"
+            )
+            (
+                "ws_deflate.max_memory",
+                boost::program_options::value<std::size_t>()->default_value(0),
+                "Maximum total deflate memory of all connections (bytes). If exceeded, permessage-deflate is not offered to new connections.\n 0 - No limit"
+            )
+        ;
+
+        desc.add(ws_desc).add(ws_deflate_desc);
 #endif // defined(MQTT_USE_WS)
 
 #if defined(MQTT_USE_TLS)
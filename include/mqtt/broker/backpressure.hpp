@@ -0,0 +1,113 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_BACKPRESSURE_HPP)
+#define MQTT_BROKER_BACKPRESSURE_HPP
+
+#include <mqtt/config.hpp>
+
+#include <memory>
+
+#include <mqtt/any.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/shared_scope_guard.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/common_type.hpp>
+#include <mqtt/broker/mutex.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+/**
+ * @brief The broker behavior while the send queue of the subscriber's connection
+ *        exceeds the high watermark. See broker_t::set_send_queue_watermark().
+ */
+struct backpressure_policy {
+    /// Drop QoS0 messages to the congested subscriber.
+    bool drop_qos0 = false;
+
+    /// Store QoS1 and QoS2 messages to the offline queue of the congested subscriber.
+    /// They are sent when the send queue falls to the low watermark.
+    bool queue_offline = false;
+
+    /// Stop reading from the publishers that publish messages to the congested subscriber.
+    /// The reading is resumed when the send queues of all such subscribers fall to the low watermark.
+    bool pause_publishers = false;
+};
+
+/**
+ * @brief Pauses reading from the publisher's connection.
+ *        Reading is paused while at least one guard that is returned by pause() is alive.
+ */
+class read_pause_control : public std::enable_shared_from_this<read_pause_control> {
+public:
+    explicit read_pause_control(con_wp_t con)
+        :con_(force_move(con)) {}
+
+    /**
+     * @brief Pause reading
+     * @return guard. When all guards are released, reading is resumed.
+     */
+    std::shared_ptr<void> pause() {
+        {
+            std::lock_guard<mutex> g(mtx_);
+            ++count_;
+        }
+        return shared_scope_guard(
+            [self = shared_from_this()] {
+                self->resume();
+            }
+        );
+    }
+
+    /**
+     * @brief Call this function from the mqtt_message_processed handler of the connection.
+     * @param session_life_keeper the parameter of the mqtt_message_processed handler.
+     */
+    void message_processed(any session_life_keeper) {
+        {
+            std::lock_guard<mutex> g(mtx_);
+            if (count_ != 0) {
+                session_life_keeper_.emplace(force_move(session_life_keeper));
+                return;
+            }
+        }
+        if (auto sp = con_.lock()) {
+            sp->async_read_next_message(force_move(session_life_keeper));
+        }
+    }
+
+private:
+    void resume() {
+        optional<any> session_life_keeper;
+        {
+            std::lock_guard<mutex> g(mtx_);
+            BOOST_ASSERT(count_ != 0);
+            if (--count_ != 0 || !session_life_keeper_) return;
+            session_life_keeper = force_move(session_life_keeper_);
+            session_life_keeper_ = nullopt;
+        }
+        if (auto sp = con_.lock()) {
+            // resume() could be called on the subscriber's strand.
+            // So move to the publisher's strand.
+            sp->socket().post(
+                [sp, session_life_keeper = force_move(session_life_keeper.value())] () mutable {
+                    sp->async_read_next_message(force_move(session_life_keeper));
+                }
+            );
+        }
+    }
+
+private:
+    con_wp_t con_;
+    mutex mtx_;
+    std::size_t count_ = 0;
+    optional<any> session_life_keeper_;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_BACKPRESSURE_HPP
@@ -9,9 +9,13 @@
 
 #include <mqtt/config.hpp>
 
-#include <set>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <vector>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/container/small_vector.hpp>
 
 #include <mqtt/broker/broker_namespace.hpp>
 #include <mqtt/optional.hpp>
@@ -19,6 +23,14 @@
 #include <mqtt/visitor_util.hpp>
 
 #include <mqtt/broker/session_state.hpp>
+#include <mqtt/broker/backpressure.hpp>
+#include <mqtt/broker/slow_consumer.hpp>
+#include <mqtt/broker/delivery_mailbox.hpp>
+#include <mqtt/broker/session_wal.hpp>
+#include <mqtt/broker/retained_store.hpp>
+#include <mqtt/broker/retained_payload_store.hpp>
+#include <mqtt/broker/metrics.hpp>
+#include <mqtt/broker/latency_histogram.hpp>
 #include <mqtt/broker/sub_con_map.hpp>
 #include <mqtt/broker/retained_messages.hpp>
 
@@ -39,10 +51,24 @@ class broker_t {
 public:
     broker_t(as::io_context& timer_ioc)
         :timer_ioc_(timer_ioc),
-         tim_disconnect_(timer_ioc_) {
+         tim_disconnect_(timer_ioc_),
+         tim_slow_consumer_(timer_ioc_),
+         tim_wal_flush_(timer_ioc_),
+         tim_wal_compaction_(timer_ioc_),
+         tim_retained_compaction_(timer_ioc_),
+         tim_sys_metrics_(timer_ioc_),
+         tim_latency_log_(timer_ioc_) {
         security.default_config();
     }
 
+    ~broker_t() {
+        // The durable sessions remain in the session_wal.
+        // So the destruction of sessions_ must not be recorded.
+        if (wal_) detach_session_wal();
+        // The wills of the retired sessions are published with the other members.
+        retired_sessions_.clear();
+    }
+
     // [begin] for test setting
     /**
      * @brief set_disconnect_delay adds a delay to disconnect operations.
@@ -86,6 +112,426 @@ public:
 
     // [end] for test setting
 
+    /**
+     * @brief set the send queue watermarks of the connections
+     *
+     * When the bytes in the send queue of the subscriber's connection exceed the high
+     * watermark, the broker applies the policy until the bytes fall to the low watermark.
+     * The setting is applied to the connections that are accepted after this function call.
+     *
+     * @param high - high watermark in bytes. 0 means no watermark.
+     * @param low - low watermark in bytes.
+     * @param policy - the broker behavior while the send queue is congested.
+     */
+    void set_send_queue_watermark(std::size_t high, std::size_t low, backpressure_policy policy) {
+        send_queue_high_watermark_ = high;
+        send_queue_low_watermark_ = low;
+        backpressure_policy_ = policy;
+    }
+
+    /**
+     * @brief set the number of the retained messages that are delivered at once
+     *
+     * The retained messages that match a new subscription are delivered in chunks.
+     * The next chunk is delivered when the last message of the previous chunk is written,
+     * and the delivery is paused while the send queue is congested or the receive maximum
+     * of the client is reached.
+     *
+     * @param chunk - number of the messages. 0 is treated as 1.
+     */
+    void set_retained_delivery_chunk(std::size_t chunk) {
+        retained_delivery_chunk_ = std::max(chunk, std::size_t(1));
+    }
+
+    /**
+     * @brief set the slow consumer detection policy
+     *
+     * The broker checks the queue state of all online sessions every check_interval
+     * on the timer_ioc. If any threshold of the policy is exceeded, the session is
+     * treated as a slow consumer and the action is applied until the state falls
+     * under the thresholds.
+     *
+     * @param policy - thresholds and action. nullopt stops checking.
+     */
+    void set_slow_consumer_policy(optional<slow_consumer_policy> policy) {
+        // slow_consumer_policy_ and tim_slow_consumer_ are only accessed on the timer_ioc
+        as::post(
+            timer_ioc_,
+            [this, policy = force_move(policy)] {
+                slow_consumer_policy_ = policy;
+                tim_slow_consumer_.cancel();
+                if (slow_consumer_policy_) start_slow_consumer_check();
+            }
+        );
+    }
+
+    /**
+     * @brief set the distribution policy of the shared subscriptions
+     *
+     * The policy chooses the member of the shared subscription that receives each
+     * message. It can be changed while the broker is running.
+     *
+     * @param policy - strategy and send queue threshold. The default is round robin without threshold.
+     */
+    void set_shared_subscription_policy(shared_target_policy policy) {
+        shared_targets_.set_policy(policy);
+    }
+
+    /**
+     * @brief set the delivery mailbox mode
+     *
+     * If enabled, a published message is not delivered to the online subscribers on the
+     * publisher's thread. The deliveries are batched per io_context that the subscriber's
+     * connection runs on, and the io_context delivers them. It reduces cross-thread
+     * contention when the broker runs on multiple io_contexts.
+     * Call this function before the broker accepts connections.
+     *
+     * @param b - if true, enable the delivery mailbox mode.
+     */
+    void set_delivery_mailbox(bool b) {
+        delivery_mailbox_ = b;
+    }
+
+    /**
+     * @brief set the session persistence
+     *
+     * The durable sessions (subscriptions, offline messages, and inflight messages)
+     * are recovered from the session_wal synchronously, and then the mutations are
+     * recorded to it. The recovered sessions start as offline sessions.
+     * Will messages, QoS2 messages that are received from the client but not
+     * released yet, and messages in the send queue of the online connections
+     * are not recorded.
+     * Call this function before the broker accepts connections.
+     *
+     * @param config - session_wal configuration. nullopt flushes and stops recording.
+     */
+    void set_session_wal(optional<session_wal_config> config) {
+        if (!config) {
+            if (!wal_) return;
+            detach_session_wal();
+            wal_.reset();
+            // tim_wal_flush_ and tim_wal_compaction_ are only accessed on the timer_ioc
+            as::post(
+                timer_ioc_,
+                [this] {
+                    tim_wal_flush_.cancel();
+                    tim_wal_compaction_.cancel();
+                }
+            );
+            return;
+        }
+
+        auto wal = std::make_shared<session_wal>(force_move(config.value()));
+        auto recovered = wal->recover();
+        {
+            std::lock_guard<mutex> g(mtx_sessions_);
+            auto& idx = sessions_.get<tag_cid>();
+            for (auto const& e : recovered) {
+                auto const& ws = e.second;
+                if (ws.version != protocol_version::v3_1_1 && ws.version != protocol_version::v5) continue;
+                auto ret = idx.emplace(
+                    timer_ioc_,
+                    mtx_subs_map_,
+                    subs_map_,
+                    shared_targets_,
+                    ws.version,
+                    allocate_buffer(e.first.second),
+                    e.first.first,
+                    // will_sender
+                    [this](auto&&... params) {
+                        do_publish(std::forward<decltype(params)>(params)...);
+                    },
+                    ws.session_expiry_interval
+                );
+                // The session that has already been connected is preferred.
+                if (!ret.second) continue;
+                idx.modify(
+                    ret.first,
+                    [&](session_state& ss) {
+                        ss.set_offline_spill(offline_spill_);
+                        // restore updates index
+                        ss.restore(
+                            ws,
+                            [this]
+                            (std::shared_ptr<as::steady_timer> const& sp_tim) {
+                                sessions_.get<tag_tim>().erase(sp_tim);
+                            }
+                        );
+                    },
+                    [](auto&) { BOOST_ASSERT(false); }
+                );
+            }
+
+            // Start with the snapshot of the recovered sessions.
+            // The older segments are removed.
+            wal_ = force_move(wal);
+            compact_session_wal_no_lock(*wal_);
+            for (auto const& elem : sessions_.get<tag_con>()) {
+                // const_cast is appropriate here
+                // See https://github.com/boostorg/multi_index/issues/50
+                const_cast<session_state&>(elem).set_wal(wal_.get());
+            }
+        }
+        MQTT_LOG("mqtt_broker", info)
+            << MQTT_ADD_VALUE(address, this)
+            << "session_wal recovered sessions:" << recovered.size();
+
+        as::post(
+            timer_ioc_,
+            [this, wal = wal_] {
+                tim_wal_flush_.cancel();
+                tim_wal_compaction_.cancel();
+                start_session_wal_flush(wal);
+                start_session_wal_compaction(wal);
+            }
+        );
+    }
+
+    /**
+     * @brief set the memory budget of the offline messages
+     *
+     * While the offline messages in memory exceed the per session budget or the
+     * global budget, the older offline messages of the session that is queuing a
+     * message are moved to the spill files. They are read back in order when they
+     * are sent to the reconnected client. The spill files are not recovered after
+     * restart. Use set_session_wal() for the persistence.
+     *
+     * @param config - offline_spill configuration. nullopt disables the budget.
+     *                 The already spilled messages remain in the spill files until they are sent.
+     */
+    void set_offline_spill(optional<offline_spill_config> config) {
+        std::shared_ptr<offline_spill> spill;
+        if (config) spill = std::make_shared<offline_spill>(force_move(config.value()));
+        std::lock_guard<mutex> g(mtx_sessions_);
+        offline_spill_ = spill;
+        for (auto const& elem : sessions_.get<tag_con>()) {
+            // const_cast is appropriate here
+            // See https://github.com/boostorg/multi_index/issues/50
+            const_cast<session_state&>(elem).set_offline_spill(spill);
+        }
+    }
+
+    /**
+     * @brief set the retained message persistence
+     *
+     * The retained messages are loaded from the retained_store synchronously, and then
+     * set and erase of the retained messages are recorded to it. The load is eager:
+     * all records are replayed and the topic index is rebuilt in memory before this
+     * function returns, so the startup time is proportional to the number of the records.
+     * The loaded topics and payloads refer to the memory mapped segments without copy,
+     * so the payload is read from the storage when the message is delivered at first.
+     * Call this function before the broker accepts connections.
+     *
+     * @param config - retained_store configuration. nullopt flushes and stops recording.
+     */
+    void set_retained_store(optional<retained_store_config> config) {
+        if (!config) {
+            {
+                std::lock_guard<mutex> g(mtx_retains_);
+                if (!retained_store_) return;
+                retained_store_->flush();
+                retained_store_.reset();
+            }
+            // tim_retained_compaction_ is only accessed on the timer_ioc
+            as::post(
+                timer_ioc_,
+                [this] {
+                    tim_retained_compaction_.cancel();
+                }
+            );
+            return;
+        }
+
+        auto store = std::make_shared<retained_store>(force_move(config.value()));
+        std::size_t loaded;
+        {
+            std::lock_guard<mutex> g(mtx_retains_);
+            loaded = store->load(
+                [this](stored_retain&& r) {
+                    optional<std::chrono::steady_clock::duration> message_expiry_interval;
+                    if (r.message_expiry) {
+                        message_expiry_interval.emplace(
+                            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                r.message_expiry.value() - std::chrono::system_clock::now()
+                            )
+                        );
+                    }
+                    insert_retain_no_lock(
+                        force_move(r.topic),
+                        force_move(r.contents),
+                        force_move(r.props),
+                        r.qos_value,
+                        message_expiry_interval
+                    );
+                }
+            );
+            retained_store_ = store;
+        }
+        MQTT_LOG("mqtt_broker", info)
+            << MQTT_ADD_VALUE(address, this)
+            << "retained_store loaded messages:" << loaded;
+
+        as::post(
+            timer_ioc_,
+            [this, store = force_move(store)] {
+                tim_retained_compaction_.cancel();
+                start_retained_store_compaction(store);
+            }
+        );
+    }
+
+    /**
+     * @brief set the deduplication of the retained payloads
+     *
+     * If enabled, the retained messages that have the identical payload share one buffer
+     * in the content-addressed store. It is effective when many topics retain the same
+     * payload, e.g. the status "online" of the devices. The setting is applied to the
+     * retained messages that are stored after this function call.
+     *
+     * @param enable - true to deduplicate the payloads
+     */
+    void set_retained_payload_dedupe(bool enable) {
+        std::lock_guard<mutex> g(mtx_retains_);
+        if (!enable) {
+            retained_payloads_.reset();
+        }
+        else if (!retained_payloads_) {
+            retained_payloads_ = std::make_shared<retained_payload_store>();
+        }
+    }
+
+    /**
+     * @brief get the statistics of the retained payload deduplication
+     *
+     * It scans all distinct payloads.
+     *
+     * @return statistics. nullopt if the deduplication is disabled.
+     */
+    optional<retained_payload_stats> get_retained_payload_stats() const {
+        std::shared_lock<mutex> g(mtx_retains_);
+        if (!retained_payloads_) return nullopt;
+        return retained_payloads_->stats();
+    }
+
+    /**
+     * @brief get the approximate memory that the broker holds
+     *
+     * Each session, connection, and the retained message map keeps its own counters,
+     * and they are aggregated by this function. No shared counter is updated on the
+     * message path.
+     *
+     * @return memory usage
+     */
+    memory_usage get_memory_usage() const {
+        memory_usage mu;
+        {
+            std::shared_lock<mutex> g(mtx_sessions_);
+            for (auto const& elem : sessions_.get<tag_con>()) {
+                elem.add_memory_usage(mu);
+            }
+        }
+        {
+            std::shared_lock<mutex> g(mtx_retains_);
+            mu.retained_messages.add(retains_.size(), retains_.memory_size());
+            if (retained_payloads_) mu.retained_messages.add(0, retained_payloads_->memory_size());
+        }
+        return mu;
+    }
+
+    /**
+     * @brief get the cumulative counters of the broker
+     *
+     * The counters are kept per thread and merged by this function.
+     *
+     * @return merged counters
+     */
+    broker_metrics_values get_metrics() const {
+        return metrics_.values();
+    }
+
+    /**
+     * @brief set the $SYS metrics publisher
+     *
+     * The counters of get_metrics(), the number of the clients, and the queue depths
+     * and the memory of get_memory_usage() are published periodically as retained
+     * QoS0 messages. The topic is the prefix followed by the name of the value,
+     * e.g. $SYS/broker/messages/received/qos0, and the payload is the decimal string.
+     * The topic filter "#" doesn't match the topics that start with '$', so the subscribers
+     * require an authorization rule for the prefix, e.g. "$SYS/#".
+     *
+     * @param config - publishing configuration. nullopt stops publishing.
+     */
+    void set_sys_metrics(optional<sys_metrics_config> config) {
+        // sys_metrics_config_ and tim_sys_metrics_ are only accessed on the timer_ioc
+        as::post(
+            timer_ioc_,
+            [this, config = force_move(config)] {
+                sys_metrics_config_ = config;
+                tim_sys_metrics_.cancel();
+                if (sys_metrics_config_) start_sys_metrics();
+            }
+        );
+    }
+
+    /**
+     * @brief set the latency tracking of the delivery path
+     *
+     * If enabled, the received PUBLISH message is timestamped and the latencies of
+     * the stages (auth, match, enqueue, and write) are recorded to the histograms.
+     * The write stage is from receiving the message to completing the write to each
+     * subscriber's connection. Messages that are queued offline are not recorded to it.
+     * Call this function before the broker accepts connections.
+     *
+     * @param config - tracking configuration. nullopt disables the tracking.
+     */
+    void set_latency_tracking(optional<latency_tracking_config> config) {
+        if (config) {
+            latency_ = std::make_shared<broker_latency>();
+        }
+        else {
+            latency_.reset();
+        }
+        // tim_latency_log_ is only accessed on the timer_ioc
+        as::post(
+            timer_ioc_,
+            [this,
+             latency = latency_,
+             log_interval = config ? config.value().log_interval : nullopt] {
+                tim_latency_log_.cancel();
+                if (latency && log_interval) start_latency_log(latency, log_interval.value());
+            }
+        );
+    }
+
+    /**
+     * @brief get the latency histograms
+     *
+     * The histograms can be written to std::ostream as the text summary.
+     *
+     * @return histograms. nullptr if the latency tracking is disabled.
+     */
+    std::shared_ptr<broker_latency> get_latency() const {
+        return latency_;
+    }
+
+    /**
+     * @brief get the queue state of all online sessions
+     *
+     * @return queue states
+     */
+    std::vector<session_queue_stats> get_session_queue_stats() {
+        std::vector<session_queue_stats> ret;
+        auto now = std::chrono::steady_clock::now();
+        std::shared_lock<mutex> g(mtx_sessions_);
+        for (auto const& elem : sessions_.get<tag_con>()) {
+            if (!elem.online()) continue;
+            // const_cast is appropriate here
+            // See https://github.com/boostorg/multi_index/issues/50
+            ret.push_back(const_cast<session_state&>(elem).queue_stats(now));
+        }
+        return ret;
+    }
+
     /**
      * @brief handle_accept
      *
@@ -106,11 +552,37 @@ public:
         con_wp_t wp(spep);
         endpoint_t& ep = *spep;
 
-        ep.socket().lowest_layer().set_option(as::ip::tcp::no_delay(true));
+        {
+            // The socket that is not TCP, like loopback_endpoint, doesn't have the option.
+            error_code ec;
+            ep.socket().lowest_layer().set_option(as::ip::tcp::no_delay(true), ec);
+        }
         ep.set_auto_pub_response(false);
         ep.set_async_operation(true);
         ep.set_topic_alias_maximum(MQTT_NS::topic_alias_max);
 
+        std::shared_ptr<read_pause_control> rpc;
+        if (send_queue_high_watermark_ != 0) {
+            ep.set_send_queue_watermark(send_queue_high_watermark_, send_queue_low_watermark_);
+            ep.set_send_queue_drained_handler(
+                [this, wp]
+                () {
+                    con_sp_t sp = wp.lock();
+                    BOOST_ASSERT(sp);
+                    send_queue_drained_handler(force_move(sp));
+                }
+            );
+            if (backpressure_policy_.pause_publishers) {
+                rpc = std::make_shared<read_pause_control>(wp);
+                ep.set_mqtt_message_processed_handler(
+                    [rpc]
+                    (any session_life_keeper) {
+                        rpc->message_processed(force_move(session_life_keeper));
+                    }
+                );
+            }
+        }
+
         // set connection (lower than MQTT) level handlers
         ep.set_close_handler(
             [this, wp]
@@ -505,7 +977,7 @@ public:
             }
         );
         ep.set_publish_handler(
-            [this, wp]
+            [this, wp, rpc]
             (optional<packet_id_t> packet_id,
              publish_options pubopts,
              buffer topic_name,
@@ -520,7 +992,8 @@ public:
                         pubopts,
                         force_move(topic_name),
                         force_move(contents),
-                        v5::properties{}
+                        v5::properties{},
+                        rpc
                     );
                 }
                 catch (std::exception const& ex) {
@@ -532,7 +1005,7 @@ public:
             }
         );
         ep.set_v5_publish_handler(
-            [this, wp]
+            [this, wp, rpc]
             (optional<packet_id_t> packet_id,
              publish_options pubopts,
              buffer topic_name,
@@ -550,7 +1023,8 @@ public:
                         pubopts,
                         force_move(topic_name),
                         force_move(contents),
-                        force_move(props)
+                        force_move(props),
+                        rpc
                     );
                 }
                 catch (std::exception const& ex) {
@@ -769,6 +1243,10 @@ public:
     void clear_all_retained_topics() {
         std::lock_guard<mutex> g(mtx_retains_);
         retains_.clear();
+        if (retained_store_) {
+            retained_store_->clear();
+            retained_store_->flush();
+        }
     }
 
 private:
@@ -827,6 +1305,8 @@ private:
     ) {
         auto& ep = *spep;
 
+        metrics_.add(broker_metric::connects);
+
         optional<std::string> username;
         if (ep.get_preauthed_user_name()) {
             if (security.login_cert(ep.get_preauthed_user_name().value())) {
@@ -888,6 +1368,30 @@ private:
         // Find any sessions that have the same client_id
         std::lock_guard<mutex> g(mtx_sessions_);
         auto& idx = sessions_.get<tag_cid>();
+
+        auto emplace_session =
+            [&](auto hint) {
+                return idx.emplace_hint(
+                    hint,
+                    timer_ioc_,
+                    mtx_subs_map_,
+                    subs_map_,
+                    shared_targets_,
+                    spep,
+                    client_id,
+                    *username,
+                    force_move(will),
+                    // will_sender
+                    [this](auto&&... params) {
+                        do_publish(std::forward<decltype(params)>(params)...);
+                    },
+                    force_move(cp.will_expiry_interval),
+                    force_move(cp.session_expiry_interval),
+                    wal_.get(),
+                    offline_spill_
+                );
+            };
+
         auto it = idx.lower_bound(std::make_tuple(*username, client_id));
         if (it == idx.end() ||
             it->client_id() != client_id ||
@@ -898,23 +1402,7 @@ private:
                 << MQTT_ADD_VALUE(address, this)
                 << "cid:" << client_id
                 << " new connection inserted.";
-            it = idx.emplace_hint(
-                it,
-                timer_ioc_,
-                mtx_subs_map_,
-                subs_map_,
-                shared_targets_,
-                spep,
-                client_id,
-                *username,
-                force_move(will),
-                // will_sender
-                [this](auto&&... params) {
-                    do_publish(std::forward<decltype(params)>(params)...);
-                },
-                force_move(cp.will_expiry_interval),
-                force_move(cp.session_expiry_interval)
-            );
+            it = emplace_session(it);
             if (cp.response_topic_requested) {
                 // set_response_topic never modify key part
                 set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
@@ -928,110 +1416,20 @@ private:
         }
         else if (it->online()) {
             // online overwrite
-            if (close_proc_no_lock(it->con(), true, v5::disconnect_reason_code::session_taken_over)) {
-                // remain offline
-                if (clean_start) {
-                    // discard offline session
-                    MQTT_LOG("mqtt_broker", trace)
-                        << MQTT_ADD_VALUE(address, this)
-                        << "cid:" << client_id
-                        << "online connection exists, discard old one due to new one's clean_start and renew";
-                    if (cp.response_topic_requested) {
-                        // set_response_topic never modify key part
-                        set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
-                    }
-                    send_connack(
-                        ep,
-                        false, // session present
-                        true,  // authenticated
-                        force_move(connack_props)
-                    );
-                    idx.modify(
-                        it,
-                        [&](auto& e) {
-                            e.clean();
-                            e.update_will(timer_ioc_, force_move(will), cp.will_expiry_interval);
-                            e.set_username(*username);
-                            // renew_session_expiry updates index
-                            e.renew_session_expiry(force_move(cp.session_expiry_interval));
-                        },
-                        [](auto&) { BOOST_ASSERT(false); }
-                    );
-                }
-                else {
-                    // inherit online session if previous session's session exists
-                    MQTT_LOG("mqtt_broker", trace)
-                        << MQTT_ADD_VALUE(address, this)
-                        << "cid:" << client_id
-                        << "online connection exists, inherit old one and renew";
-                    if (cp.response_topic_requested) {
-                        // set_response_topic never modify key part
-                        set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
-                    }
-                    send_connack(
-                        ep,
-                        true, // session present
-                        true, // authenticated
-                        force_move(connack_props),
-                        [
-                            this,
-                            &idx,
-                            it,
-                            will = force_move(will),
-                            clean_start,
-                            spep,
-                            will_expiry_interval = cp.will_expiry_interval,
-                            session_expiry_interval = cp.session_expiry_interval,
-                            username
-                        ]
-                        (error_code ec) mutable {
-                            if (ec) {
-                                MQTT_LOG("mqtt_broker", trace)
-                                    << MQTT_ADD_VALUE(address, this)
-                                    << ec.message();
-                                return;
-                            }
-                            idx.modify(
-                                it,
-                                [&](auto& e) {
-                                    e.renew(spep, clean_start);
-                                    e.set_username(*username);
-                                    e.update_will(timer_ioc_, force_move(will), will_expiry_interval);
-                                    // renew_session_expiry updates index
-                                    e.renew_session_expiry(force_move(session_expiry_interval));
-                                    e.send_inflight_messages();
-                                    e.send_all_offline_messages();
-                                },
-                                [](auto&) { BOOST_ASSERT(false); }
-                            );
-                        }
-                    );
-                }
-            }
-            else {
-                // new connection
+            if (clean_start) {
+                // discard online session
                 MQTT_LOG("mqtt_broker", trace)
                     << MQTT_ADD_VALUE(address, this)
                     << "cid:" << client_id
-                    << "online connection exists, discard old one due to session_expiry and renew";
-                bool inserted;
-                std::tie(it, inserted) = idx.emplace(
-                    timer_ioc_,
-                    mtx_subs_map_,
-                    subs_map_,
-                    shared_targets_,
-                    spep,
-                    client_id,
-                    *username,
-                    force_move(will),
-                    // will_sender
-                    [this](auto&&... params) {
-                        do_publish(std::forward<decltype(params)>(params)...);
-                    },
-                    force_move(cp.will_expiry_interval),
-                    force_move(cp.session_expiry_interval)
-                );
-                BOOST_ASSERT(inserted);
+                    << "online connection exists, discard old one due to new one's clean_start and renew";
+                metrics_.add(broker_metric::disconnects);
+                // const_cast is appropriate here
+                // See https://github.com/boostorg/multi_index/issues/50
+                auto& old = const_cast<session_state&>(*it);
+                old.send_will();
+                disconnect_and_force_disconnect(old.con(), v5::disconnect_reason_code::session_taken_over);
+                auto hint = retire_session_no_lock(idx, it);
+                it = emplace_session(hint);
                 if (cp.response_topic_requested) {
                     // set_response_topic never modify key part
                     set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
@@ -1043,36 +1441,95 @@ private:
                     force_move(connack_props)
                 );
             }
-        }
-        else {
-            // offline -> online
-            if (clean_start) {
-                // discard offline session
+            else if (close_proc_no_lock(it->con(), true, v5::disconnect_reason_code::session_taken_over)) {
+                // remain offline
+                // inherit online session if previous session's session exists
                 MQTT_LOG("mqtt_broker", trace)
                     << MQTT_ADD_VALUE(address, this)
                     << "cid:" << client_id
-                    << "offline connection exists, discard old one due to new one's clean_start and renew";
+                    << "online connection exists, inherit old one and renew";
                 if (cp.response_topic_requested) {
                     // set_response_topic never modify key part
                     set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
                 }
                 send_connack(
                     ep,
-                    false, // session present
-                    true,  // authenticated
-                    force_move(connack_props)
-                );
-                idx.modify(
-                    it,
-                    [&](auto& e) {
-                        e.clean();
-                        e.renew(spep, clean_start);
-                        e.update_will(timer_ioc_, force_move(will), cp.will_expiry_interval);
-                        e.set_username(*username);
-                        // renew_session_expiry updates index
-                        e.renew_session_expiry(force_move(cp.session_expiry_interval));
-                    },
-                    [](auto&) { BOOST_ASSERT(false); }
+                    true, // session present
+                    true, // authenticated
+                    force_move(connack_props),
+                    [
+                        this,
+                        &idx,
+                        it,
+                        will = force_move(will),
+                        clean_start,
+                        spep,
+                        will_expiry_interval = cp.will_expiry_interval,
+                        session_expiry_interval = cp.session_expiry_interval,
+                        username
+                    ]
+                    (error_code ec) mutable {
+                        if (ec) {
+                            MQTT_LOG("mqtt_broker", trace)
+                                << MQTT_ADD_VALUE(address, this)
+                                << ec.message();
+                            return;
+                        }
+                        idx.modify(
+                            it,
+                            [&](auto& e) {
+                                e.renew(spep, clean_start);
+                                e.set_username(*username);
+                                e.update_will(timer_ioc_, force_move(will), will_expiry_interval);
+                                // renew_session_expiry updates index
+                                e.renew_session_expiry(force_move(session_expiry_interval));
+                                e.send_inflight_messages();
+                                e.send_all_offline_messages();
+                            },
+                            [](auto&) { BOOST_ASSERT(false); }
+                        );
+                    }
+                );
+            }
+            else {
+                // new connection
+                MQTT_LOG("mqtt_broker", trace)
+                    << MQTT_ADD_VALUE(address, this)
+                    << "cid:" << client_id
+                    << "online connection exists, discard old one due to session_expiry and renew";
+                it = emplace_session(idx.end());
+                BOOST_ASSERT(it->con() == spep);
+                if (cp.response_topic_requested) {
+                    // set_response_topic never modify key part
+                    set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
+                }
+                send_connack(
+                    ep,
+                    false, // session present
+                    true,  // authenticated
+                    force_move(connack_props)
+                );
+            }
+        }
+        else {
+            // offline -> online
+            if (clean_start) {
+                // discard offline session
+                MQTT_LOG("mqtt_broker", trace)
+                    << MQTT_ADD_VALUE(address, this)
+                    << "cid:" << client_id
+                    << "offline connection exists, discard old one due to new one's clean_start and renew";
+                auto hint = retire_session_no_lock(idx, it);
+                it = emplace_session(hint);
+                if (cp.response_topic_requested) {
+                    // set_response_topic never modify key part
+                    set_response_topic(const_cast<session_state&>(*it), connack_props, *username);
+                }
+                send_connack(
+                    ep,
+                    false, // session present
+                    true,  // authenticated
+                    force_move(connack_props)
                 );
             }
             else {
@@ -1250,7 +1707,10 @@ private:
         s.set_clean_handler(
             [this, response_topic, rule_nr]() {
                 std::lock_guard<mutex> g(mtx_retains_);
-                retains_.erase(response_topic);
+                if (retains_.erase(response_topic) != 0 && retained_store_) {
+                    retained_store_->erase(response_topic);
+                    retained_store_->flush();
+                }
                 remove_rule(rule_nr);
             }
         );
@@ -1346,6 +1806,54 @@ private:
         close_proc(force_move(spep), false);
     }
 
+    /**
+     * @brief Detach the session from sessions_. The subscriptions and the stored messages
+     *        of the session are discarded on timer_ioc_ without the lock of mtx_sessions_.
+     *        mtx_sessions_ must be locked exclusively by the caller.
+     * @param idx index of sessions_
+     * @param it session to retire
+     * @return the iterator that follows the retired session
+     */
+    template <typename Index>
+    typename Index::iterator retire_session_no_lock(Index& idx, typename Index::iterator it) {
+        auto next = std::next(it);
+        auto node = idx.extract(it);
+        node.value().retire();
+        bool post;
+        {
+            std::lock_guard<mutex> g(mtx_retired_sessions_);
+            post = retired_sessions_.empty();
+            retired_sessions_.push_back(force_move(node));
+        }
+        if (post) {
+            as::post(
+                timer_ioc_,
+                [this] {
+                    discard_retired_sessions();
+                }
+            );
+        }
+        return next;
+    }
+
+    void discard_retired_sessions() {
+        std::vector<session_states::node_type> nodes;
+        {
+            std::lock_guard<mutex> g(mtx_retired_sessions_);
+            nodes.swap(retired_sessions_);
+        }
+        MQTT_LOG("mqtt_broker", trace)
+            << MQTT_ADD_VALUE(address, this)
+            << "discard retired sessions:" << nodes.size();
+        for (auto& node : nodes) {
+            node.value().discard();
+        }
+        // do_publish() could refer the sessions that it found before discard().
+        // The exclusive lock waits for them, and the destructors send the wills.
+        std::lock_guard<mutex> g(mtx_sessions_);
+        nodes.clear();
+    }
+
     /**
      * @brief close_proc_no_lock - clean up a connection that has been closed.
      *
@@ -1369,6 +1877,8 @@ private:
         // In this case, do nothing is correct behavior.
         if (it == idx.end()) return false;
 
+        metrics_.add(broker_metric::disconnects);
+
         bool session_clear =
             [&] {
                 if (ep.get_protocol_version() == protocol_version::v3_1_1) {
@@ -1408,7 +1918,7 @@ private:
                     << "force_disconnect(async) cid:" << ss.client_id();
                 force_disconnect(spep);
             }
-            idx.erase(it);
+            retire_session_no_lock(idx, it);
             BOOST_ASSERT(sessions_.get<tag_con>().find(spep) == sessions_.get<tag_con>().end());
             return false;
         }
@@ -1468,10 +1978,13 @@ private:
         publish_options pubopts,
         buffer topic_name,
         buffer contents,
-        v5::properties props) {
+        v5::properties props,
+        std::shared_ptr<read_pause_control> const& rpc = nullptr) {
 
         auto& ep = *spep;
 
+        latency_probe probe = latency_ ? latency_probe(latency_) : latency_probe();
+
         std::shared_lock<mutex> g(mtx_sessions_);
         auto& idx = sessions_.get<tag_con>();
         auto it = idx.find(spep);
@@ -1483,6 +1996,9 @@ private:
         // erased from sessions_
         if (it == idx.end()) return true;
 
+        metrics_.add(messages_received_metric(pubopts.get_qos()));
+        metrics_.add(broker_metric::bytes_received, topic_name.size() + contents.size());
+
         auto send_pubres =
             [&] (bool authorized = true) {
                 switch (pubopts.get_qos()) {
@@ -1523,6 +2039,9 @@ private:
                 }
             };
 
+        std::chrono::steady_clock::time_point auth_begin;
+        if (probe) auth_begin = std::chrono::steady_clock::now();
+
         // See if this session is authorized to publish this topic
         if (security.auth_pub(topic_name, it->get_username()) != security::authorization::type::allow) {
 
@@ -1530,6 +2049,7 @@ private:
             send_pubres(false);
             return true;
         }
+        if (probe) probe.auth_elapsed = std::chrono::steady_clock::now() - auth_begin;
 
         v5::properties forward_props;
 
@@ -1560,13 +2080,471 @@ private:
             force_move(topic_name),
             force_move(contents),
             pubopts.get_qos() | pubopts.get_retain(), // remove dup flag
-            force_move(forward_props)
+            force_move(forward_props),
+            rpc,
+            probe
         );
 
         send_pubres();
         return true;
     }
 
+    void send_queue_drained_handler(con_sp_t spep) {
+        std::shared_lock<mutex> g(mtx_sessions_);
+        auto& idx = sessions_.get<tag_con>();
+        auto it = idx.find(spep);
+
+        // The send queue is also drained when the connection is closed.
+        // In this case, the session has already been erased or become offline.
+        if (it == idx.end()) return;
+
+        // const_cast is appropriate here
+        // See https://github.com/boostorg/multi_index/issues/50
+        auto& ss = const_cast<session_state&>(*it);
+        if (spep->connected()) {
+            ss.send_all_offline_messages();
+            deliver_retained(ss);
+        }
+        ss.resume_publishers();
+    }
+
+    void retained_written_handler(con_sp_t spep) {
+        std::shared_lock<mutex> g(mtx_sessions_);
+        auto& idx = sessions_.get<tag_con>();
+        auto it = idx.find(spep);
+        if (it == idx.end()) return;
+
+        // const_cast is appropriate here
+        // See https://github.com/boostorg/multi_index/issues/50
+        auto& ss = const_cast<session_state&>(*it);
+        deliver_retained(ss);
+    }
+
+    /**
+     * @brief Deliver the next chunk of the retained messages of the new subscriptions.
+     *        mtx_sessions_ must be locked by the caller.
+     */
+    void deliver_retained(session_state& ss) {
+        if (!ss.online()) return;
+        auto const& con = ss.con();
+        std::size_t delivered = 0;
+        while (auto rd = ss.take_retained_delivery()) {
+            // Resumed by send_queue_drained_handler(), puback_handler(), or pubcomp_handler()
+            if (con->send_queue_congested() || con->publish_send_saturated() || ss.has_offline_messages()) {
+                ss.return_retained_delivery(force_move(rd.value()));
+                return;
+            }
+
+            // Copy the messages to publish them without mtx_retains_.
+            std::vector<retain_t> chunk;
+            {
+                std::shared_lock<mutex> g(mtx_retains_);
+                retains_.find_next(
+                    rd.value().cursor,
+                    retained_delivery_chunk_ - delivered,
+                    [&](retain_t const& r) {
+                        chunk.push_back(r);
+                    }
+                );
+            }
+            auto qos_value = rd.value().qos_value;
+            auto sid = rd.value().sid;
+            ss.return_retained_delivery(force_move(rd.value()));
+
+            delivered += chunk.size();
+            bool full = delivered == retained_delivery_chunk_;
+            for (std::size_t i = 0; i != chunk.size(); ++i) {
+                auto& r = chunk[i];
+                auto props = force_move(r.props);
+                if (sid) {
+                    props.push_back(v5::property::subscription_identifier(*sid));
+                }
+                if (r.tim_message_expiry) {
+                    auto d =
+                        std::chrono::duration_cast<std::chrono::seconds>(
+                            r.tim_message_expiry->expiry() - std::chrono::steady_clock::now()
+                        ).count();
+                    set_property<v5::property::message_expiry_interval>(
+                        props,
+                        v5::property::message_expiry_interval(
+                            static_cast<uint32_t>(d)
+                        )
+                    );
+                }
+                std::function<void()> written;
+                if (full && i + 1 == chunk.size()) {
+                    written =
+                        [this, wp = con_wp_t(con)] {
+                            if (auto sp = wp.lock()) retained_written_handler(force_move(sp));
+                        };
+                }
+                ss.publish(
+                    timer_ioc_,
+                    force_move(r.topic),
+                    force_move(r.contents),
+                    std::min(r.qos_value, qos_value) | MQTT_NS::retain::yes,
+                    force_move(props),
+                    backpressure_policy_,
+                    latency_probe(),
+                    force_move(written)
+                );
+            }
+            if (full) return;
+        }
+    }
+
+    /**
+     * @brief Get the mailbox of the execution context that the connection runs on.
+     *        The mailbox drains on its own strand of the context, so the drain doesn't wait for
+     *        the I/O of the connection, and it continues after the connection is closed.
+     */
+    delivery_mailbox& get_delivery_mailbox(endpoint_t& ep) {
+        auto exe = ep.get_executor();
+        auto ctx = &as::query(exe, as::execution::context);
+        std::lock_guard<mutex> g(mtx_delivery_mailboxes_);
+        auto it = delivery_mailboxes_.find(ctx);
+        if (it == delivery_mailboxes_.end()) {
+            it = delivery_mailboxes_.emplace(
+                ctx,
+                std::make_unique<delivery_mailbox>(
+                    inner_executor(force_move(exe)),
+                    [this](std::vector<delivery>& deliveries) {
+                        deliver_from_mailbox(deliveries);
+                    }
+                )
+            ).first;
+        }
+        return *it->second;
+    }
+
+    /**
+     * @brief Get the executor that the strand of the connection wraps.
+     *        If the executor is not a known strand, it is returned as is.
+     */
+    static as::any_io_executor inner_executor(as::any_io_executor exe) {
+        if (auto s = exe.target<as::strand<as::io_context::executor_type>>()) return s->get_inner_executor();
+        if (auto s = exe.target<as::strand<as::any_io_executor>>()) return s->get_inner_executor();
+        return exe;
+    }
+
+    void deliver_from_mailbox(std::vector<delivery>& deliveries) {
+        // The sessions are locked once for all deliveries. It keeps the targets and
+        // the connections of the sessions while they are delivered.
+        std::shared_lock<mutex> g(mtx_sessions_);
+        for (auto& d : deliveries) {
+            // The connection could be closed after the message was published.
+            // In this case, the message is delivered to the same session that
+            // is offline or has been taken over by the new connection.
+            auto ss = d.target->ss;
+            // The session has been erased or cleaned.
+            if (!ss || ss->generation() != d.generation) continue;
+
+            auto const& m = *d.message;
+            auto props = m.props;
+            if (d.sid) props.push_back(v5::property::subscription_identifier(d.sid.value()));
+            std::chrono::steady_clock::time_point enqueue_begin;
+            if (m.probe) enqueue_begin = std::chrono::steady_clock::now();
+            count_delivery(
+                ss->deliver(
+                    timer_ioc_,
+                    m.topic,
+                    m.contents,
+                    d.pubopts,
+                    force_move(props),
+                    backpressure_policy_,
+                    m.probe
+                ),
+                d.pubopts.get_qos(),
+                m.topic.size() + m.contents.size()
+            );
+            if (m.probe) {
+                m.probe.record(latency_stage::enqueue, std::chrono::steady_clock::now() - enqueue_begin);
+            }
+        }
+    }
+
+    void detach_session_wal() {
+        {
+            std::lock_guard<mutex> g(mtx_sessions_);
+            for (auto const& elem : sessions_.get<tag_con>()) {
+                // const_cast is appropriate here
+                // See https://github.com/boostorg/multi_index/issues/50
+                const_cast<session_state&>(elem).set_wal(nullptr);
+            }
+        }
+        wal_->flush();
+    }
+
+    void compact_session_wal_no_lock(session_wal& wal) {
+        wal.compact(
+            [&](session_wal& w) {
+                write_session_snapshots_no_lock(w);
+            }
+        );
+    }
+
+    // mtx_sessions_ must be locked by the caller. The shared lock is enough.
+    void write_session_snapshots_no_lock(session_wal& wal) const {
+        for (auto const& elem : sessions_.get<tag_con>()) {
+            elem.write_snapshot(wal);
+        }
+    }
+
+    void start_session_wal_flush(std::shared_ptr<session_wal> const& wal) {
+        tim_wal_flush_.expires_after(wal->config().flush_interval);
+        tim_wal_flush_.async_wait(
+            [this, wal]
+            (error_code ec) {
+                if (ec) return;
+                wal->flush();
+                start_session_wal_flush(wal);
+            }
+        );
+    }
+
+    void start_session_wal_compaction(std::shared_ptr<session_wal> const& wal) {
+        tim_wal_compaction_.expires_after(wal->config().compaction_interval);
+        tim_wal_compaction_.async_wait(
+            [this, wal]
+            (error_code ec) {
+                if (ec) return;
+                {
+                    std::shared_lock<mutex> g(mtx_sessions_);
+                    if (wal_ != wal) return;
+                }
+                // The sessions keep appending records during the compaction.
+                // Each session is written under its own locks with the shared lock of the sessions,
+                // and the snapshot is written to the storage after the lock is released.
+                wal->compact(
+                    [&](session_wal& w) {
+                        std::shared_lock<mutex> g(mtx_sessions_);
+                        write_session_snapshots_no_lock(w);
+                    }
+                );
+                start_session_wal_compaction(wal);
+            }
+        );
+    }
+
+    void insert_retain_no_lock(
+        buffer topic,
+        buffer contents,
+        v5::properties props,
+        qos qos_value,
+        optional<std::chrono::steady_clock::duration> message_expiry_interval) {
+        std::shared_ptr<as::steady_timer> tim_message_expiry;
+        if (message_expiry_interval) {
+            tim_message_expiry = std::make_shared<as::steady_timer>(timer_ioc_, message_expiry_interval.value());
+            tim_message_expiry->async_wait(
+                [this, topic = topic, wp = std::weak_ptr<as::steady_timer>(tim_message_expiry)]
+                (boost::system::error_code const& ec) {
+                    if (auto sp = wp.lock()) {
+                        if (!ec) {
+                            retains_.erase(topic);
+                        }
+                    }
+                }
+            );
+        }
+
+        retained_payload_store::ref_t payload_ref;
+        if (retained_payloads_) {
+            auto interned = retained_payloads_->intern(force_move(contents));
+            contents = force_move(interned.first);
+            payload_ref = force_move(interned.second);
+        }
+
+        retains_.insert_or_assign(
+            topic,
+            retain_t {
+                force_move(topic),
+                force_move(contents),
+                force_move(props),
+                qos_value,
+                tim_message_expiry,
+                force_move(payload_ref)
+            }
+        );
+    }
+
+    void start_retained_store_compaction(std::shared_ptr<retained_store> const& store) {
+        tim_retained_compaction_.expires_after(store->config().compaction_interval);
+        tim_retained_compaction_.async_wait(
+            [this, store]
+            (error_code ec) {
+                if (ec) return;
+                {
+                    // Appending records requires the exclusive lock,
+                    // so it is blocked during the compaction.
+                    std::shared_lock<mutex> g(mtx_retains_);
+                    if (retained_store_ != store) return;
+                    if (store->needs_compaction(retains_.size())) {
+                        store->compact(
+                            [&](retained_store& rs) {
+                                retains_.for_each(
+                                    [&](retain_t const& r) {
+                                        rs.set(
+                                            r.topic,
+                                            r.contents,
+                                            r.props,
+                                            r.qos_value,
+                                            r.tim_message_expiry
+                                            ? optional<std::chrono::steady_clock::time_point>(
+                                                r.tim_message_expiry->expiry()
+                                            )
+                                            : nullopt
+                                        );
+                                    }
+                                );
+                            }
+                        );
+                    }
+                }
+                start_retained_store_compaction(store);
+            }
+        );
+    }
+
+    void start_sys_metrics() {
+        tim_sys_metrics_.expires_after(sys_metrics_config_.value().interval);
+        tim_sys_metrics_.async_wait(
+            [this]
+            (error_code ec) {
+                if (ec) return;
+                publish_sys_metrics();
+                start_sys_metrics();
+            }
+        );
+    }
+
+    void publish_sys_metrics() {
+        auto values = metrics_.values();
+        auto mu = get_memory_usage();
+
+        auto const& prefix = sys_metrics_config_.value().prefix;
+        std::shared_lock<mutex> g(mtx_sessions_);
+        auto publish =
+            [&](char const* name, std::uint64_t value) {
+                do_publish(
+                    buffer(),
+                    protocol_version::v3_1_1,
+                    allocate_buffer(prefix + '/' + name),
+                    allocate_buffer(std::to_string(value)),
+                    qos::at_most_once | MQTT_NS::retain::yes,
+                    v5::properties()
+                );
+            };
+
+        for (std::size_t i = 0; i != values.values.size(); ++i) {
+            publish(broker_metric_to_str(static_cast<broker_metric>(i)), values.values[i]);
+        }
+
+        std::size_t connected = 0;
+        for (auto const& elem : sessions_.get<tag_con>()) {
+            if (elem.online()) ++connected;
+        }
+        publish("clients/connected", connected);
+        publish("clients/total", mu.sessions.count);
+        publish("subscriptions/count", mu.subscriptions.count);
+        publish("retained/count", mu.retained_messages.count);
+        if (auto stats = get_retained_payload_stats()) {
+            publish("retained/unique_payloads", stats.value().unique_payloads);
+            publish("retained/unique_payload_bytes", stats.value().unique_bytes);
+            publish("retained/referenced_payload_bytes", stats.value().referenced_bytes);
+        }
+        publish("queue/offline_messages", mu.offline_messages.count);
+        publish("queue/spilled_offline_messages", mu.spilled_offline_messages.count);
+        publish("queue/inflight_messages", mu.inflight_messages.count);
+        publish("queue/send_queue_messages", mu.send_queue.count);
+        publish("queue/send_queue_bytes", mu.send_queue.bytes);
+        publish("memory/bytes", mu.total_bytes());
+    }
+
+    void start_latency_log(
+        std::shared_ptr<broker_latency> const& latency,
+        std::chrono::steady_clock::duration log_interval) {
+        tim_latency_log_.expires_after(log_interval);
+        tim_latency_log_.async_wait(
+            [this, latency, log_interval]
+            (error_code ec) {
+                if (ec) return;
+                MQTT_LOG("mqtt_broker", info)
+                    << MQTT_ADD_VALUE(address, this)
+                    << "latency\n" << *latency;
+                start_latency_log(latency, log_interval);
+            }
+        );
+    }
+
+    void count_delivery(bool delivered, qos qos_value, std::size_t bytes) {
+        if (delivered) {
+            metrics_.add(messages_sent_metric(qos_value));
+            metrics_.add(broker_metric::bytes_sent, bytes);
+        }
+        else {
+            metrics_.add(broker_metric::dropped_messages);
+        }
+    }
+
+    void start_slow_consumer_check() {
+        tim_slow_consumer_.expires_after(slow_consumer_policy_.value().check_interval);
+        tim_slow_consumer_.async_wait(
+            [this]
+            (error_code ec) {
+                if (ec) return;
+                check_slow_consumers();
+                start_slow_consumer_check();
+            }
+        );
+    }
+
+    void check_slow_consumers() {
+        auto const& policy = slow_consumer_policy_.value();
+        auto now = std::chrono::steady_clock::now();
+        std::vector<con_sp_t> evicted;
+        {
+            std::shared_lock<mutex> g(mtx_sessions_);
+            for (auto const& elem : sessions_.get<tag_con>()) {
+                if (!elem.online()) continue;
+                // const_cast is appropriate here
+                // See https://github.com/boostorg/multi_index/issues/50
+                auto& ss = const_cast<session_state&>(elem);
+                auto stats = ss.queue_stats(now);
+                bool slow = policy.exceeded(stats);
+                if (ss.set_slow_consumer(slow, policy.action == slow_consumer_action::drop_qos0)) {
+                    if (slow) {
+                        MQTT_LOG("mqtt_broker", warning)
+                            << MQTT_ADD_VALUE(address, ss.con().get())
+                            << "slow consumer detected cid:" << stats.client_id
+                            << " send_queue_bytes:" << stats.send_queue_bytes
+                            << " send_queue_age_ms:"
+                            << std::chrono::duration_cast<std::chrono::milliseconds>(stats.send_queue_age).count()
+                            << " offline_messages:" << stats.offline_messages
+                            << " inflight_saturated_ms:"
+                            << std::chrono::duration_cast<std::chrono::milliseconds>(stats.inflight_saturated).count()
+                            << " action:" << policy.action;
+                    }
+                    else {
+                        MQTT_LOG("mqtt_broker", info)
+                            << MQTT_ADD_VALUE(address, ss.con().get())
+                            << "slow consumer recovered cid:" << stats.client_id;
+                    }
+                }
+                if (slow && policy.action == slow_consumer_action::disconnect) {
+                    evicted.push_back(ss.con());
+                }
+            }
+        }
+        for (auto& con : evicted) {
+            // DISCONNECT can't be sent by broker on v3.1.1
+            optional<v5::disconnect_reason_code> rc;
+            if (con->get_protocol_version() == protocol_version::v5) {
+                rc.emplace(v5::disconnect_reason_code::quota_exceeded);
+            }
+            close_proc(force_move(con), true, rc);
+        }
+    }
+
     bool puback_handler(
         con_sp_t spep,
         packet_id_t packet_id,
@@ -1588,6 +2566,7 @@ private:
         auto& ss = const_cast<session_state&>(*it);
         ss.erase_inflight_message_by_packet_id(packet_id);
         ss.send_offline_messages_by_packet_id_release();
+        deliver_retained(ss);
 
         return true;
     }
@@ -1729,6 +2708,7 @@ private:
         auto& ss = const_cast<session_state&>(*it);
         ss.erase_inflight_message_by_packet_id(packet_id);
         ss.send_offline_messages_by_packet_id_release();
+        deliver_retained(ss);
 
         return true;
     }
@@ -1752,6 +2732,8 @@ private:
         // erased from sessions_
         if (it == idx.end()) return true;
 
+        metrics_.add(broker_metric::subscriptions, entries.size());
+
         // The element of sessions_ must have longer lifetime
         // than corresponding subscription.
         // Because the subscription store the reference of the element.
@@ -1765,38 +2747,38 @@ private:
         BOOST_ASSERT(ssr_opt);
         session_state_ref ssr {ssr_opt.value()};
 
-        auto publish_proc =
-            [this, &ssr](retain_t const& r, qos qos_value, optional<std::size_t> sid) {
-                auto props = r.props;
-                if (sid) {
-                    props.push_back(v5::property::subscription_identifier(*sid));
-                }
-                if (r.tim_message_expiry) {
-                    auto d =
-                        std::chrono::duration_cast<std::chrono::seconds>(
-                            r.tim_message_expiry->expiry() - std::chrono::steady_clock::now()
-                        ).count();
-                    set_property<v5::property::message_expiry_interval>(
-                        props,
-                        v5::property::message_expiry_interval(
-                            static_cast<uint32_t>(d)
-                        )
-                    );
-                }
-                ssr.get().publish(
-                    timer_ioc_,
-                    r.topic,
-                    r.contents,
-                    std::min(r.qos_value, qos_value) | MQTT_NS::retain::yes,
-                    props
-                );
-            };
-
-        std::vector<std::function<void()>> retain_deliver;
-        retain_deliver.reserve(entries.size());
-
         // subscription identifier
         optional<std::size_t> sid;
+        if (ep.get_protocol_version() == protocol_version::v5) {
+            auto v = get_property<v5::property::subscription_identifier>(props);
+            if (v && v.value().val() != 0) {
+                sid.emplace(v.value().val());
+            }
+        }
+
+        // The user's authorizations are looked up once for all entries.
+        std::vector<string_view> topic_filters;
+        topic_filters.reserve(entries.size());
+        for (auto const& e : entries) topic_filters.emplace_back(e.topic_filter);
+        auto authorized = security.is_subscribe_authorized(ss.get_username(), topic_filters);
+
+        std::vector<subscribe_entry> authorized_entries;
+        authorized_entries.reserve(entries.size());
+        for (std::size_t i = 0; i != entries.size(); ++i) {
+            if (authorized[i]) authorized_entries.push_back(entries[i]);
+        }
+        // All authorized entries are applied with one lock of the subscription map.
+        // The retained messages are not scanned here. Each delivery is a cursor
+        // that is advanced by deliver_retained().
+        ssr.get().subscribe(
+            force_move(authorized_entries),
+            [&](subscribe_entry const& e) {
+                ss.push_retained_delivery(
+                    { retains_.make_cursor(e.topic_filter), e.subopts.get_qos(), sid }
+                );
+            },
+            sid
+        );
 
         // An in-order list of qos settings, used to send the reply.
         // The MQTT protocol 3.1.1 - 3.8.4 Response - paragraph 6
@@ -1807,27 +2789,9 @@ private:
         case protocol_version::v3_1_1: {
             std::vector<suback_return_code> res;
             res.reserve(entries.size());
-            for (auto& e : entries) {
-                if (security.is_subscribe_authorized(ss.get_username(), e.topic_filter)) {
-                    res.emplace_back(qos_to_suback_return_code(e.subopts.get_qos())); // converts to granted_qos_x
-                    ssr.get().subscribe(
-                        force_move(e.share_name),
-                        e.topic_filter,
-                        e.subopts,
-                        [&] {
-                            std::shared_lock<mutex> g(mtx_retains_);
-                            retains_.find(
-                                e.topic_filter,
-                                [&](retain_t const& r) {
-                                    retain_deliver.emplace_back(
-                                        [&publish_proc, &r, qos_value = e.subopts.get_qos(), sid] {
-                                            publish_proc(r, qos_value, sid);
-                                        }
-                                    );
-                                }
-                            );
-                        }
-                    );
+            for (std::size_t i = 0; i != entries.size(); ++i) {
+                if (authorized[i]) {
+                    res.emplace_back(qos_to_suback_return_code(entries[i].subopts.get_qos())); // converts to granted_qos_x
                 }
                 else {
                     // User not authorized to subscribe to topic filter
@@ -1849,36 +2813,11 @@ private:
             );
         } break;
         case protocol_version::v5: {
-            // Get subscription identifier
-            auto v = get_property<v5::property::subscription_identifier>(props);
-            if (v && v.value().val() != 0) {
-                sid.emplace(v.value().val());
-            }
-
             std::vector<v5::suback_reason_code> res;
             res.reserve(entries.size());
-            for (auto& e : entries) {
-                if (security.is_subscribe_authorized(ss.get_username(), e.topic_filter)) {
-                    res.emplace_back(v5::qos_to_suback_reason_code(e.subopts.get_qos())); // converts to granted_qos_x
-                    ssr.get().subscribe(
-                        force_move(e.share_name),
-                        e.topic_filter,
-                        e.subopts,
-                        [&] {
-                            std::shared_lock<mutex> g(mtx_retains_);
-                            retains_.find(
-                                e.topic_filter,
-                                [&](retain_t const& r) {
-                                    retain_deliver.emplace_back(
-                                        [&publish_proc, &r, qos_value = e.subopts.get_qos(), sid] {
-                                            publish_proc(r, qos_value, sid);
-                                        }
-                                    );
-                                }
-                            );
-                        },
-                        sid
-                    );
+            for (std::size_t i = 0; i != entries.size(); ++i) {
+                if (authorized[i]) {
+                    res.emplace_back(v5::qos_to_suback_reason_code(entries[i].subopts.get_qos())); // converts to granted_qos_x
                 }
                 else {
                     // User not authorized to subscribe to topic filter
@@ -1906,9 +2845,8 @@ private:
             break;
         }
 
-        for (auto const& f : retain_deliver) {
-            f();
-        }
+        // The retained messages are delivered after the suback.
+        deliver_retained(ss);
         return true;
     }
 
@@ -1931,6 +2869,8 @@ private:
         // erased from sessions_
         if (it == idx.end()) return true;
 
+        metrics_.add(broker_metric::unsubscriptions, entries.size());
+
         // The element of sessions_ must have longer lifetime
         // than corresponding subscription.
         // Because the subscription store the reference of the element.
@@ -1947,9 +2887,7 @@ private:
         // For each subscription that this connection has
         // Compare against the list of topic filters, and remove
         // the subscription if the topic filter is in the list.
-        for (auto const& e : entries) {
-            ssr.get().unsubscribe(e.share_name, e.topic_filter);
-        }
+        ssr.get().unsubscribe(entries);
 
         switch (ep.get_protocol_version()) {
         case protocol_version::v3_1_1:
@@ -2000,17 +2938,79 @@ private:
      * @param contents - The contents of the message.
      * @param pubopts - publish options
      * @param props - properties
+     * @param rpc - read pause control of the source connection. nullptr if reading is never paused.
+     * @param probe - timestamp of the message. Empty if the latency is not recorded.
      */
     void do_publish(
         session_state const& source_ss,
         buffer topic,
         buffer contents,
         publish_options pubopts,
-        v5::properties props
+        v5::properties props,
+        std::shared_ptr<read_pause_control> const& rpc = nullptr,
+        latency_probe const& probe = latency_probe()
     ) {
+        do_publish(
+            source_ss.client_id(),
+            source_ss.get_protocol_version(),
+            force_move(topic),
+            force_move(contents),
+            pubopts,
+            force_move(props),
+            rpc,
+            probe
+        );
+    }
+
+    /**
+     * @brief do_publish Publish a message to any subscribed clients.
+     *
+     * @param source_client_id - client id of the source. It is compared for NL (no local) subscriptions.
+     * @param source_version - protocol version of the source.
+     * @param topic - The topic to publish the message on.
+     * @param contents - The contents of the message.
+     * @param pubopts - publish options
+     * @param props - properties
+     * @param rpc - read pause control of the source connection. nullptr if reading is never paused.
+     * @param probe - timestamp of the message. Empty if the latency is not recorded.
+     */
+    void do_publish(
+        buffer const& source_client_id,
+        protocol_version source_version,
+        buffer topic,
+        buffer contents,
+        publish_options pubopts,
+        v5::properties props,
+        std::shared_ptr<read_pause_control> const& rpc = nullptr,
+        latency_probe const& probe = latency_probe()
+    ) {
+        std::chrono::steady_clock::time_point stage_begin;
+        if (probe) stage_begin = std::chrono::steady_clock::now();
+
+        // If the prefilter tells that no subscription matches the topic,
+        // the auth rights and the subscriptions are not looked up.
+        bool may_match = subs_map_.may_match(topic);
+
         // Get auth rights for this topic
         // auth_users prepared once here, and then referred multiple times in subs_map_.modify() for efficiency
-        auto auth_users = security.auth_sub(topic);
+        auto auth_users = may_match ? security.auth_sub(topic) : decltype(security.auth_sub(topic))();
+
+        // Time spent in ss.deliver() is excluded from the match stage.
+        std::chrono::steady_clock::duration enqueue_elapsed = std::chrono::steady_clock::duration::zero();
+        if (probe) {
+            auto now = std::chrono::steady_clock::now();
+            probe.record(latency_stage::auth, probe.auth_elapsed + (now - stage_begin));
+            stage_begin = now;
+        }
+
+        // Reading from the source connection is paused until all guards are released.
+        std::shared_ptr<void> pause_guard;
+
+        // Deliveries to the online sessions grouped by the mailbox.
+        // They are pushed after the subscriptions are traversed.
+        std::vector<std::pair<delivery_mailbox*, std::vector<delivery>>> batches;
+        // The message that is shared by the deliveries in the mailboxes.
+        std::shared_ptr<delivery_message const> message;
 
         // publish the message to subscribers.
         // retain is delivered as the original only if rap_value is rap::retain.
@@ -2027,32 +3027,78 @@ private:
                     new_pubopts |= MQTT_NS::retain::yes;
                 }
 
-                if (sub.sid) {
-                    props.push_back(v5::property::subscription_identifier(sub.sid.value()));
-                    ss.deliver(
-                        timer_ioc_,
-                        topic,
-                        contents,
-                        new_pubopts,
-                        props
+                if (delivery_mailbox_ && ss.online()) {
+                    auto mb = ss.mailbox();
+                    if (!mb) {
+                        mb = &get_delivery_mailbox(*ss.con());
+                        ss.set_mailbox(mb);
+                    }
+                    auto it = std::find_if(
+                        batches.begin(),
+                        batches.end(),
+                        [&](auto const& e) { return e.first == mb; }
+                    );
+                    if (it == batches.end()) {
+                        batches.emplace_back(mb, std::vector<delivery>());
+                        it = std::prev(batches.end());
+                    }
+                    if (!message) {
+                        message = std::make_shared<delivery_message const>(
+                            delivery_message { topic, contents, props, probe }
+                        );
+                    }
+                    it->second.push_back(
+                        delivery {
+                            ss.mailbox_target(),
+                            ss.generation(),
+                            message,
+                            new_pubopts,
+                            sub.sid
+                        }
                     );
-                    props.pop_back();
                 }
                 else {
-                    ss.deliver(
-                        timer_ioc_,
-                        topic,
-                        contents,
-                        new_pubopts,
-                        props
+                    std::chrono::steady_clock::time_point enqueue_begin;
+                    if (probe) enqueue_begin = std::chrono::steady_clock::now();
+                    if (sub.sid) {
+                        props.push_back(v5::property::subscription_identifier(sub.sid.value()));
+                    }
+                    count_delivery(
+                        ss.deliver(
+                            timer_ioc_,
+                            topic,
+                            contents,
+                            new_pubopts,
+                            props,
+                            backpressure_policy_,
+                            probe
+                        ),
+                        new_pubopts.get_qos(),
+                        topic.size() + contents.size()
                     );
+                    if (sub.sid) props.pop_back();
+                    if (probe) {
+                        auto elapsed = std::chrono::steady_clock::now() - enqueue_begin;
+                        probe.record(latency_stage::enqueue, elapsed);
+                        enqueue_elapsed += elapsed;
+                    }
+                }
+
+                if (rpc && ss.online() && ss.con()->send_queue_congested()) {
+                    // pause_guard is shared by all congested subscribers of this message
+                    if (!pause_guard) pause_guard = rpc->pause();
+                    ss.add_paused_publisher(pause_guard);
                 }
             };
 
-        //                  share_name   topic_filter
-        std::set<std::tuple<string_view, string_view>> sent;
+        // A shared subscription is delivered once per share_name/topic_filter pair.
+        // The subscriptions of a topic_filter are the values of one node of subs_map_,
+        // so they are visited in a row. Only the share_names of the current topic_filter
+        // are recorded, and they are kept inline unless the topic_filter has many share_names.
+        string_view shared_topic_filter;
+        boost::container::small_vector<string_view, 4> shared_sent;
 
-        {
+        if (may_match) {
             std::shared_lock<mutex> g{mtx_subs_map_};
             subs_map_.modify(
                 topic,
@@ -2063,25 +3109,43 @@ private:
                         // If NL (no local) subscription option is set and
                         // publisher is the same as subscriber, then skip it.
                         if (sub.subopts.get_nl() == nl::yes &&
-                            sub.ss.get().client_id() ==  source_ss.client_id()) return;
+                            sub.ss.get().client_id() ==  source_client_id) return;
                         deliver(sub.ss.get(), sub, auth_users);
                     }
                     else {
                         // Shared subscriptions
-                        bool inserted;
-                        std::tie(std::ignore, inserted) = sent.emplace(sub.share_name, sub.topic_filter);
-                        if (inserted) {
-                            if (auto ssr_opt = shared_targets_.get_target(sub.share_name, sub.topic_filter)) {
-                                deliver(ssr_opt.value().get(), sub, auth_users);
-                            }
+                        if (sub.topic_filter != shared_topic_filter) {
+                            shared_topic_filter = sub.topic_filter;
+                            shared_sent.clear();
+                        }
+                        else if (std::find(shared_sent.begin(), shared_sent.end(), sub.share_name) != shared_sent.end()) {
+                            return;
+                        }
+                        shared_sent.push_back(sub.share_name);
+                        if (auto ssr_opt = shared_targets_.get_target(sub.share_name, sub.topic_filter, topic)) {
+                            deliver(ssr_opt.value().get(), sub, auth_users);
                         }
                     }
                 }
             );
         }
 
+        if (probe) {
+            probe.record(
+                latency_stage::match,
+                std::chrono::steady_clock::now() - stage_begin - enqueue_elapsed
+            );
+        }
+
+        for (auto& e : batches) {
+            e.first->push(force_move(e.second));
+        }
+
+        // The records of the offline messages are written at once.
+        if (wal_) wal_->flush();
+
         optional<std::chrono::steady_clock::duration> message_expiry_interval;
-        if (source_ss.get_protocol_version() == protocol_version::v5) {
+        if (source_version == protocol_version::v5) {
             auto v = get_property<v5::property::message_expiry_interval>(props);
             if (v) {
                 message_expiry_interval.emplace(std::chrono::seconds(v.value().val()));
@@ -2111,36 +3175,36 @@ private:
          *        the retained message is removed.
          */
         if (pubopts.get_retain() == MQTT_NS::retain::yes) {
+            std::lock_guard<mutex> g(mtx_retains_);
             if (contents.empty()) {
-                std::lock_guard<mutex> g(mtx_retains_);
-                retains_.erase(topic);
+                if (retains_.erase(topic) != 0 && retained_store_) {
+                    retained_store_->erase(topic);
+                    retained_store_->flush();
+                }
             }
             else {
-                std::shared_ptr<as::steady_timer> tim_message_expiry;
-                if (message_expiry_interval) {
-                    tim_message_expiry = std::make_shared<as::steady_timer>(timer_ioc_, message_expiry_interval.value());
-                    tim_message_expiry->async_wait(
-                        [this, topic = topic, wp = std::weak_ptr<as::steady_timer>(tim_message_expiry)]
-                        (boost::system::error_code const& ec) {
-                            if (auto sp = wp.lock()) {
-                                if (!ec) {
-                                    retains_.erase(topic);
-                                }
-                            }
-                        }
+                if (retained_store_) {
+                    retained_store_->set(
+                        topic,
+                        contents,
+                        props,
+                        pubopts.get_qos(),
+                        message_expiry_interval
+                        ? optional<std::chrono::steady_clock::time_point>(
+                            std::chrono::steady_clock::now() + message_expiry_interval.value()
+                        )
+                        : nullopt
                     );
+                    retained_store_->flush();
                 }
-
-                std::lock_guard<mutex> g(mtx_retains_);
-                retains_.insert_or_assign(
-                    topic,
-                    retain_t {
-                        force_move(topic),
-                        force_move(contents),
-                        force_move(props),
-                        pubopts.get_qos(),
-                        tim_message_expiry
-                    }
+                // The topic of a small packet shares the receive buffer with the other packets,
+                // so it is copied not to keep the buffer while the message is retained.
+                insert_retain_no_lock(
+                    allocate_buffer(topic),
+                    force_move(contents),
+                    force_move(props),
+                    pubopts.get_qos(),
+                    message_expiry_interval
                 );
             }
         }
@@ -2156,7 +3220,7 @@ private:
 
     mutable mutex mtx_subs_map_;
     sub_con_map subs_map_;   /// subscription information
-    shared_target shared_targets_; /// shared subscription targets
+    shared_target shared_targets_; /// shared subscription targets. guarded by mtx_subs_map_
 
     ///< Map of active client id and connections
     /// session_state has references of subs_map_ and shared_targets_.
@@ -2164,6 +3228,10 @@ private:
     mutable mutex mtx_sessions_;
     session_states sessions_;
 
+    /// The sessions that have been detached from sessions_ and wait for the discard on timer_ioc_.
+    mutex mtx_retired_sessions_;
+    std::vector<session_states::node_type> retired_sessions_;
+
     mutable mutex mtx_retains_;
     retained_messages retains_; ///< A list of messages retained so they can be sent to newly subscribed clients.
 
@@ -2187,6 +3255,35 @@ private:
     std::function<void(v5::properties const&)> h_auth_props_;
     bool pingresp_ = true;
     bool connack_ = true;
+
+    std::size_t send_queue_high_watermark_ = 0;
+    std::size_t send_queue_low_watermark_ = 0;
+    backpressure_policy backpressure_policy_;
+    std::size_t retained_delivery_chunk_ = 256;
+
+    optional<slow_consumer_policy> slow_consumer_policy_;
+    as::steady_timer tim_slow_consumer_; ///< Used to check slow consumers periodically
+
+    bool delivery_mailbox_ = false;
+    mutex mtx_delivery_mailboxes_;
+    std::map<as::execution_context*, std::unique_ptr<delivery_mailbox>> delivery_mailboxes_;
+
+    std::shared_ptr<session_wal> wal_;
+    as::steady_timer tim_wal_flush_; ///< Used to flush the session_wal periodically
+    as::steady_timer tim_wal_compaction_; ///< Used to compact the session_wal periodically
+
+    std::shared_ptr<offline_spill> offline_spill_;
+
+    std::shared_ptr<retained_store> retained_store_;
+    std::shared_ptr<retained_payload_store> retained_payloads_;
+    as::steady_timer tim_retained_compaction_; ///< Used to compact the retained_store periodically
+
+    broker_metrics metrics_;
+    optional<sys_metrics_config> sys_metrics_config_;
+    as::steady_timer tim_sys_metrics_; ///< Used to publish the $SYS metrics periodically
+
+    std::shared_ptr<broker_latency> latency_;
+    as::steady_timer tim_latency_log_; ///< Used to write the latency summary to the log periodically
 };
 
 MQTT_BROKER_NS_END
@@ -0,0 +1,133 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_DELIVERY_MAILBOX_HPP)
+#define MQTT_BROKER_DELIVERY_MAILBOX_HPP
+
+#include <mqtt/config.hpp>
+
+#include <vector>
+#include <iterator>
+#include <functional>
+#include <memory>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/publish.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/session_state_fwd.hpp>
+#include <mqtt/broker/mutex.hpp>
+#include <mqtt/broker/latency_histogram.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+namespace as = boost::asio;
+
+/**
+ * @brief Handle of the session that the queued deliveries refer to.
+ *        The session sets ss to nullptr when it is retired or destroyed.
+ *        It is written and read while the sessions are locked.
+ */
+struct delivery_target {
+    session_state* ss;
+};
+
+/**
+ * @brief The published message that is shared by all deliveries of it.
+ */
+struct delivery_message {
+    buffer topic;
+    buffer contents;
+    v5::properties props;
+    latency_probe probe;
+};
+
+/**
+ * @brief A message that is delivered to the session on the io_context of the session's connection.
+ *        The session keeps the target even if the connection has been closed before the delivery.
+ *        generation avoids the delivery to the session that has been cleaned after the message is
+ *        published.
+ */
+struct delivery {
+    std::shared_ptr<delivery_target> target;
+    std::uint64_t generation;
+    std::shared_ptr<delivery_message const> message;
+    publish_options pubopts;
+    optional<std::size_t> sid;
+};
+
+/**
+ * @brief Multi producer single consumer queue of deliveries for one io_context.
+ *        Producers push a batch of deliveries. Only the first push to an idle mailbox posts
+ *        the drain job to the strand that the mailbox owns. The drain job hands all queued
+ *        deliveries to the handler at once, so deliveries to the same session are processed
+ *        in the pushed order.
+ */
+class delivery_mailbox {
+public:
+    using handler_t = std::function<void(std::vector<delivery>& deliveries)>;
+
+    delivery_mailbox(as::any_io_executor exe, handler_t h)
+        :exe_(as::make_strand(force_move(exe))),
+         h_(force_move(h))
+    {}
+
+    void push(std::vector<delivery> batch) {
+        {
+            std::lock_guard<mutex> g(mtx_);
+            if (queue_.empty()) {
+                queue_ = force_move(batch);
+            }
+            else {
+                queue_.insert(
+                    queue_.end(),
+                    std::make_move_iterator(batch.begin()),
+                    std::make_move_iterator(batch.end())
+                );
+            }
+            if (draining_) return;
+            draining_ = true;
+        }
+        as::post(exe_, [this] { drain(); });
+    }
+
+private:
+    void drain() {
+        std::vector<delivery> deliveries;
+        {
+            std::lock_guard<mutex> g(mtx_);
+            deliveries.swap(queue_);
+        }
+        h_(deliveries);
+        {
+            std::lock_guard<mutex> g(mtx_);
+            if (queue_.empty()) {
+                draining_ = false;
+                return;
+            }
+        }
+        // Pushed during the handler call. Post again instead of looping
+        // so that other jobs on the io_context are not starved.
+        as::post(exe_, [this] { drain(); });
+    }
+
+private:
+    as::strand<as::any_io_executor> exe_;
+    handler_t h_;
+    mutex mtx_;
+    std::vector<delivery> queue_;
+    bool draining_ = false;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_DELIVERY_MAILBOX_HPP
@@ -90,6 +90,15 @@ public:
         );
     }
 
+    store_message_variant const& message() const {
+        return msg_;
+    }
+
+    optional<std::chrono::steady_clock::time_point> message_expiry() const {
+        if (!tim_message_expiry_) return nullopt;
+        return tim_message_expiry_->expiry();
+    }
+
 private:
     friend class inflight_messages;
 
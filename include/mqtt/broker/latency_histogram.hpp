@@ -0,0 +1,281 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_LATENCY_HISTOGRAM_HPP)
+#define MQTT_BROKER_LATENCY_HISTOGRAM_HPP
+
+#include <mqtt/config.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <mqtt/move.hpp>
+#include <mqtt/optional.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+/**
+ * @brief Log-linear histogram of durations in nanoseconds like HdrHistogram.
+ *
+ * Each power of two range is divided into sub_bucket_half buckets, so the
+ * recorded value is kept with the relative error less than 1/sub_bucket_half.
+ * Values less than sub_bucket_count are kept exactly. Values that exceed
+ * max_value are counted in the highest bucket.
+ * record() can be called from multiple threads concurrently.
+ */
+class latency_histogram {
+public:
+    static constexpr std::size_t sub_bucket_bits = 7;
+    static constexpr std::uint64_t sub_bucket_count = std::uint64_t(1) << sub_bucket_bits;
+    static constexpr std::uint64_t sub_bucket_half = sub_bucket_count / 2;
+    static constexpr std::size_t max_value_bits = 40; // about 18 minutes
+    static constexpr std::uint64_t max_value = (std::uint64_t(1) << max_value_bits) - 1;
+    static constexpr std::size_t bucket_count =
+        sub_bucket_count + (max_value_bits - sub_bucket_bits) * sub_bucket_half;
+
+    latency_histogram() = default;
+    latency_histogram(latency_histogram const&) = delete;
+    latency_histogram& operator=(latency_histogram const&) = delete;
+
+    void record(std::chrono::nanoseconds d) {
+        auto v = d.count() < 0 ? std::uint64_t(0) : static_cast<std::uint64_t>(d.count());
+        if (v > max_value) v = max_value;
+        buckets_[index(v)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        auto cur = max_.load(std::memory_order_relaxed);
+        while (v > cur && !max_.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+        cur = min_.load(std::memory_order_relaxed);
+        while (v < cur && !min_.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+    }
+
+    void reset() {
+        for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+        min_.store(std::numeric_limits<std::uint64_t>::max(), std::memory_order_relaxed);
+    }
+
+    std::uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds min() const {
+        if (count() == 0) return std::chrono::nanoseconds::zero();
+        return std::chrono::nanoseconds(min_.load(std::memory_order_relaxed));
+    }
+
+    std::chrono::nanoseconds max() const {
+        return std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    }
+
+    std::chrono::nanoseconds mean() const {
+        auto c = count();
+        if (c == 0) return std::chrono::nanoseconds::zero();
+        return std::chrono::nanoseconds(sum_.load(std::memory_order_relaxed) / c);
+    }
+
+    /**
+     * @brief Get the value that percentile of the recorded values are less than or equal to.
+     *        The value is the highest value that is equivalent to the bucket, but not more than max().
+     * @param percentile 0.0 to 100.0
+     */
+    std::chrono::nanoseconds value_at_percentile(double percentile) const {
+        std::vector<std::uint64_t> counts;
+        counts.reserve(bucket_count);
+        std::uint64_t total = 0;
+        for (auto const& b : buckets_) {
+            counts.push_back(b.load(std::memory_order_relaxed));
+            total += counts.back();
+        }
+        if (total == 0) return std::chrono::nanoseconds::zero();
+
+        if (percentile > 100.0) percentile = 100.0;
+        auto target = static_cast<std::uint64_t>(percentile / 100.0 * static_cast<double>(total) + 0.5);
+        if (target == 0) target = 1;
+        std::uint64_t acc = 0;
+        for (std::size_t i = 0; i != counts.size(); ++i) {
+            acc += counts[i];
+            if (acc >= target) {
+                return std::chrono::nanoseconds(std::min(highest_equivalent(i), max_.load(std::memory_order_relaxed)));
+            }
+        }
+        return max();
+    }
+
+    static std::size_t index(std::uint64_t v) {
+        if (v < sub_bucket_count) return static_cast<std::size_t>(v);
+        auto shift = msb(v) - sub_bucket_bits + 1;
+        return static_cast<std::size_t>(
+            sub_bucket_count + (shift - 1) * sub_bucket_half + ((v >> shift) - sub_bucket_half)
+        );
+    }
+
+    static std::uint64_t highest_equivalent(std::size_t i) {
+        if (i < sub_bucket_count) return i;
+        auto k = i - sub_bucket_count;
+        auto shift = k / sub_bucket_half + 1;
+        auto m = k % sub_bucket_half + sub_bucket_half;
+        return ((m + 1) << shift) - 1;
+    }
+
+private:
+    static std::size_t msb(std::uint64_t v) {
+#if defined(__GNUC__)
+        return static_cast<std::size_t>(63 - __builtin_clzll(v));
+#else  // defined(__GNUC__)
+        std::size_t n = 0;
+        while (v >>= 1) ++n;
+        return n;
+#endif // defined(__GNUC__)
+    }
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> buckets_ {};
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> sum_{0};
+    std::atomic<std::uint64_t> max_{0};
+    std::atomic<std::uint64_t> min_{std::numeric_limits<std::uint64_t>::max()};
+};
+
+enum class latency_stage : std::size_t {
+    auth,    ///< authorization of the received message
+    match,   ///< traversing the subscriptions that match the topic
+    enqueue, ///< passing the message to the session of each subscriber
+    write,   ///< from receiving the message to completing the write to each subscriber
+    num      ///< the number of the stages
+};
+
+constexpr char const* latency_stage_to_str(latency_stage v) {
+    switch(v) {
+    case latency_stage::auth:    return "auth";
+    case latency_stage::match:   return "match";
+    case latency_stage::enqueue: return "enqueue";
+    case latency_stage::write:   return "write";
+    default:                     return "unknown_latency_stage";
+    }
+}
+
+inline
+std::ostream& operator<<(std::ostream& os, latency_stage val)
+{
+    os << latency_stage_to_str(val);
+    return os;
+}
+
+/**
+ * @brief Latency histograms of the stages of the broker delivery path.
+ */
+class broker_latency {
+public:
+    void record(latency_stage s, std::chrono::nanoseconds d) {
+        histograms_[static_cast<std::size_t>(s)].record(d);
+    }
+
+    latency_histogram const& histogram(latency_stage s) const {
+        return histograms_[static_cast<std::size_t>(s)];
+    }
+
+    void reset() {
+        for (auto& h : histograms_) h.reset();
+    }
+
+private:
+    std::array<latency_histogram, static_cast<std::size_t>(latency_stage::num)> histograms_;
+};
+
+/**
+ * @brief Output the summary of all stages in microseconds. One line per stage.
+ */
+inline
+std::ostream& operator<<(std::ostream& os, broker_latency const& val)
+{
+    auto us =
+        [](std::chrono::nanoseconds d) {
+            return static_cast<double>(d.count()) / 1000.0;
+        };
+    auto flags = os.flags();
+    auto precision = os.precision();
+    os << std::left << std::setw(8) << "stage" << std::right
+       << std::setw(12) << "count"
+       << std::setw(12) << "mean(us)"
+       << std::setw(12) << "p50(us)"
+       << std::setw(12) << "p90(us)"
+       << std::setw(12) << "p99(us)"
+       << std::setw(12) << "p999(us)"
+       << std::setw(12) << "max(us)"
+       << '\n';
+    os << std::fixed << std::setprecision(1);
+    for (std::size_t i = 0; i != static_cast<std::size_t>(latency_stage::num); ++i) {
+        auto s = static_cast<latency_stage>(i);
+        auto const& h = val.histogram(s);
+        os << std::left << std::setw(8) << latency_stage_to_str(s) << std::right
+           << std::setw(12) << h.count()
+           << std::setw(12) << us(h.mean())
+           << std::setw(12) << us(h.value_at_percentile(50.0))
+           << std::setw(12) << us(h.value_at_percentile(90.0))
+           << std::setw(12) << us(h.value_at_percentile(99.0))
+           << std::setw(12) << us(h.value_at_percentile(99.9))
+           << std::setw(12) << us(h.max())
+           << '\n';
+    }
+    os.flags(flags);
+    os.precision(precision);
+    return os;
+}
+
+/**
+ * @brief Timestamp of the message that is carried along the delivery path.
+ *        It is empty if the latency tracking is disabled.
+ */
+struct latency_probe {
+    latency_probe() = default;
+
+    explicit latency_probe(std::shared_ptr<broker_latency> latency)
+        :latency(force_move(latency)),
+         received(std::chrono::steady_clock::now()) {
+    }
+
+    explicit operator bool() const {
+        return static_cast<bool>(latency);
+    }
+
+    void record(latency_stage s, std::chrono::steady_clock::duration d) const {
+        latency->record(s, std::chrono::duration_cast<std::chrono::nanoseconds>(d));
+    }
+
+    void record_since_received(latency_stage s) const {
+        record(s, std::chrono::steady_clock::now() - received);
+    }
+
+    std::shared_ptr<broker_latency> latency;
+    std::chrono::steady_clock::time_point received;
+
+    /// time spent on the authorization before the message is published to the subscribers
+    std::chrono::steady_clock::duration auth_elapsed = std::chrono::steady_clock::duration::zero();
+};
+
+/**
+ * @brief Configuration of the latency tracking.
+ */
+struct latency_tracking_config {
+    /// interval of writing the summary to the log. nullopt means no log.
+    optional<std::chrono::steady_clock::duration> log_interval;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_LATENCY_HISTOGRAM_HPP
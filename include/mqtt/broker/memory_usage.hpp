@@ -0,0 +1,69 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_MEMORY_USAGE_HPP)
+#define MQTT_BROKER_MEMORY_USAGE_HPP
+
+#include <mqtt/config.hpp>
+
+#include <cstddef>
+
+#include <mqtt/broker/broker_namespace.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+struct memory_usage_entry {
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+
+    void add(std::size_t c, std::size_t b) {
+        count += c;
+        bytes += b;
+    }
+};
+
+/**
+ * @brief Approximate memory that the broker holds.
+ *        Each structure keeps its own counters, and they are aggregated on demand.
+ *        The bytes include the payload and the fixed size of the element,
+ *        but not the allocator overhead.
+ */
+struct memory_usage {
+    /// sessions including offline sessions
+    memory_usage_entry sessions;
+
+    /// subscriptions of all sessions
+    memory_usage_entry subscriptions;
+
+    /// retained messages. count is the number of topics that have the retained message.
+    memory_usage_entry retained_messages;
+
+    /// offline messages in memory
+    memory_usage_entry offline_messages;
+
+    /// offline messages that are spilled to the files. Not included in total_bytes().
+    memory_usage_entry spilled_offline_messages;
+
+    /// messages that are sent but not acknowledged yet
+    memory_usage_entry inflight_messages;
+
+    /// messages in the async send queues of the connections
+    memory_usage_entry send_queue;
+
+    std::size_t total_bytes() const {
+        return
+            sessions.bytes +
+            subscriptions.bytes +
+            retained_messages.bytes +
+            offline_messages.bytes +
+            inflight_messages.bytes +
+            send_queue.bytes;
+    }
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_MEMORY_USAGE_HPP
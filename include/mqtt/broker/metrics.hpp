@@ -0,0 +1,177 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_METRICS_HPP)
+#define MQTT_BROKER_METRICS_HPP
+
+#include <mqtt/config.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include <mqtt/subscribe_options.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+enum class broker_metric : std::size_t {
+    messages_received_qos0, ///< PUBLISH packets received from the clients
+    messages_received_qos1,
+    messages_received_qos2,
+    messages_sent_qos0,     ///< messages delivered to the sessions including the offline queue
+    messages_sent_qos1,
+    messages_sent_qos2,
+    bytes_received,         ///< topic and payload bytes of the received messages
+    bytes_sent,             ///< topic and payload bytes of the delivered messages
+    connects,               ///< CONNECT packets received
+    disconnects,            ///< connections of the sessions closed
+    subscriptions,          ///< topic filters subscribed
+    unsubscriptions,        ///< topic filters unsubscribed
+    dropped_messages,       ///< QoS0 messages dropped by the slow consumer or the backpressure policy
+    num                     ///< the number of the metrics
+};
+
+/**
+ * @brief Get the topic level of the metric that follows the $SYS prefix.
+ */
+constexpr char const* broker_metric_to_str(broker_metric v) {
+    switch(v) {
+    case broker_metric::messages_received_qos0: return "messages/received/qos0";
+    case broker_metric::messages_received_qos1: return "messages/received/qos1";
+    case broker_metric::messages_received_qos2: return "messages/received/qos2";
+    case broker_metric::messages_sent_qos0:     return "messages/sent/qos0";
+    case broker_metric::messages_sent_qos1:     return "messages/sent/qos1";
+    case broker_metric::messages_sent_qos2:     return "messages/sent/qos2";
+    case broker_metric::bytes_received:         return "bytes/received";
+    case broker_metric::bytes_sent:             return "bytes/sent";
+    case broker_metric::connects:               return "clients/connects";
+    case broker_metric::disconnects:            return "clients/disconnects";
+    case broker_metric::subscriptions:          return "subscriptions/added";
+    case broker_metric::unsubscriptions:        return "subscriptions/removed";
+    case broker_metric::dropped_messages:       return "messages/dropped";
+    default:                                    return "unknown_broker_metric";
+    }
+}
+
+inline
+std::ostream& operator<<(std::ostream& os, broker_metric val)
+{
+    os << broker_metric_to_str(val);
+    return os;
+}
+
+constexpr broker_metric messages_received_metric(qos v) {
+    return static_cast<broker_metric>(
+        static_cast<std::size_t>(broker_metric::messages_received_qos0) + static_cast<std::size_t>(v)
+    );
+}
+
+constexpr broker_metric messages_sent_metric(qos v) {
+    return static_cast<broker_metric>(
+        static_cast<std::size_t>(broker_metric::messages_sent_qos0) + static_cast<std::size_t>(v)
+    );
+}
+
+/**
+ * @brief Merged values of the counters of all threads.
+ */
+struct broker_metrics_values {
+    std::uint64_t operator[](broker_metric m) const {
+        return values[static_cast<std::size_t>(m)];
+    }
+
+    std::array<std::uint64_t, static_cast<std::size_t>(broker_metric::num)> values {};
+};
+
+/**
+ * @brief Cumulative counters of the broker.
+ *
+ * Each thread that updates the counters has its own shard, so the message path
+ * neither locks nor contends on a shared cache line. In the broker that runs an
+ * io_context per thread, the shard is per io_context.
+ * The shards are merged when values() is called.
+ */
+class broker_metrics {
+public:
+    broker_metrics()
+        :id_(next_id()) {
+    }
+
+    broker_metrics(broker_metrics const&) = delete;
+    broker_metrics& operator=(broker_metrics const&) = delete;
+
+    void add(broker_metric m, std::uint64_t v = 1) {
+        auto& c = local_shard().counters[static_cast<std::size_t>(m)];
+        // Only the owner thread writes to the shard.
+        c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+
+    broker_metrics_values values() const {
+        broker_metrics_values ret;
+        std::lock_guard<std::mutex> g(mtx_shards_);
+        for (auto const& e : shards_) {
+            for (std::size_t i = 0; i != ret.values.size(); ++i) {
+                ret.values[i] += e.second->counters[i].load(std::memory_order_relaxed);
+            }
+        }
+        return ret;
+    }
+
+private:
+    struct shard {
+        std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(broker_metric::num)> counters {};
+        // Avoid sharing the cache line with the next allocation.
+        char padding[64];
+    };
+
+    static std::uint64_t next_id() {
+        static std::atomic<std::uint64_t> id{0};
+        return ++id;
+    }
+
+    shard& local_shard() {
+        // The id distinguishes the instance that is allocated at the same address as the destroyed one.
+        thread_local std::uint64_t cached_id = 0;
+        thread_local shard* cached_shard = nullptr;
+        if (cached_id == id_) return *cached_shard;
+
+        std::lock_guard<std::mutex> g(mtx_shards_);
+        auto& s = shards_[std::this_thread::get_id()];
+        if (!s) s = std::make_unique<shard>();
+        cached_id = id_;
+        cached_shard = s.get();
+        return *s;
+    }
+
+private:
+    std::uint64_t const id_;
+    mutable std::mutex mtx_shards_;
+    std::map<std::thread::id, std::unique_ptr<shard>> shards_;
+};
+
+/**
+ * @brief Configuration of publishing the metrics as the retained $SYS topics.
+ */
+struct sys_metrics_config {
+    /// interval of publishing the metrics
+    std::chrono::steady_clock::duration interval = std::chrono::seconds(10);
+
+    /// topic prefix of the metrics
+    std::string prefix = "$SYS/broker";
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_METRICS_HPP
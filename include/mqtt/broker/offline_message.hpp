@@ -17,12 +17,14 @@
 
 #include <mqtt/buffer.hpp>
 #include <mqtt/property_variant.hpp>
+#include <mqtt/property_parse.hpp>
 #include <mqtt/publish.hpp>
 
 #include <mqtt/broker/broker_namespace.hpp>
 #include <mqtt/broker/common_type.hpp>
 #include <mqtt/broker/tags.hpp>
 #include <mqtt/broker/property_util.hpp>
+#include <mqtt/broker/offline_spill.hpp>
 
 MQTT_BROKER_NS_BEGIN
 
@@ -37,24 +39,45 @@ class offline_messages;
 class offline_message {
 public:
     offline_message(
+        std::uint64_t seq,
         buffer topic,
         buffer contents,
         publish_options pubopts,
         v5::properties props,
         std::shared_ptr<as::steady_timer> tim_message_expiry)
-        : topic_(force_move(topic)),
+        : seq_(seq),
+          topic_(force_move(topic)),
           contents_(force_move(contents)),
           pubopts_(pubopts),
           props_(force_move(props)),
           tim_message_expiry_(force_move(tim_message_expiry))
     { }
 
+    /**
+     * @brief Construct the message that is read from the spill file.
+     *        It has no expiry timer. The expiry is checked when it is read.
+     */
+    offline_message(
+        std::uint64_t seq,
+        buffer topic,
+        buffer contents,
+        publish_options pubopts,
+        v5::properties props,
+        optional<std::chrono::steady_clock::time_point> message_expiry)
+        : seq_(seq),
+          topic_(force_move(topic)),
+          contents_(force_move(contents)),
+          pubopts_(pubopts),
+          props_(force_move(props)),
+          message_expiry_(message_expiry)
+    { }
+
     bool send(endpoint_t& ep) {
         auto props = props_;
-        if (tim_message_expiry_) {
+        if (auto expiry = message_expiry()) {
             auto d =
                 std::chrono::duration_cast<std::chrono::seconds>(
-                    tim_message_expiry_->expiry() - std::chrono::steady_clock::now()
+                    expiry.value() - std::chrono::steady_clock::now()
                 ).count();
             if (d < 0) d = 0;
             set_property<v5::property::message_expiry_interval>(
@@ -99,44 +122,201 @@ public:
         return false;
     }
 
+    std::uint64_t seq() const {
+        return seq_;
+    }
+
+    buffer const& topic() const {
+        return topic_;
+    }
+
+    buffer const& contents() const {
+        return contents_;
+    }
+
+    publish_options pubopts() const {
+        return pubopts_;
+    }
+
+    v5::properties const& props() const {
+        return props_;
+    }
+
+    optional<std::chrono::steady_clock::time_point> message_expiry() const {
+        if (!tim_message_expiry_) return message_expiry_;
+        return tim_message_expiry_->expiry();
+    }
+
+    /**
+     * @brief Get the approximate bytes that the message occupies in memory.
+     */
+    std::size_t memory_size() const {
+        std::size_t size = sizeof(offline_message) + topic_.size() + contents_.size();
+        for (auto const& p : props_) size += v5::size(p);
+        return size;
+    }
+
 private:
     friend class offline_messages;
 
+    std::uint64_t seq_;
     buffer topic_;
     buffer contents_;
     publish_options pubopts_;
     v5::properties props_;
     std::shared_ptr<as::steady_timer> tim_message_expiry_;
+    optional<std::chrono::steady_clock::time_point> message_expiry_;
 };
 
+/**
+ * @brief Queue of the offline messages of one session.
+ *        If the offline_spill is set, the older messages are moved to the spill files
+ *        while the memory budget is exceeded. The spilled messages are always older than
+ *        the messages in memory, so they are sent first.
+ */
 class offline_messages {
 public:
-    void send_until_fail(endpoint_t& ep) {
+    offline_messages() = default;
+
+    ~offline_messages() {
+        clear();
+    }
+
+    offline_messages(offline_messages const&) = delete;
+    offline_messages& operator=(offline_messages const&) = delete;
+
+    /**
+     * @brief Send messages from the front until sending fails.
+     * @return seq of the last sent message. nullopt if no message is sent.
+     */
+    optional<std::uint64_t> send_until_fail(endpoint_t& ep) {
+        optional<std::uint64_t> last_sent;
         auto& idx = messages_.get<tag_seq>();
-        while (!idx.empty()) {
+        while (true) {
+            // The rest of messages are sent when the send queue is drained.
+            if (ep.send_queue_congested()) break;
+            if (spilled_ && !spilled_->empty()) {
+                auto m = decode(spilled_->front());
+                if (!m) {
+                    // expired or invalid
+                    spilled_->pop();
+                    continue;
+                }
+                auto seq = m.value().seq();
+                if (!m.value().send(ep)) break;
+                spilled_->pop();
+                last_sent.emplace(seq);
+                continue;
+            }
+            if (idx.empty()) break;
             auto it = idx.begin();
 
             // const_cast is appropriate here
             // See https://github.com/boostorg/multi_index/issues/50
             auto& m = const_cast<offline_message&>(*it);
+            auto seq = m.seq();
+            auto size = m.memory_size();
             if (m.send(ep)) {
                 idx.pop_front();
+                sub_memory(size);
+                last_sent.emplace(seq);
             }
             else {
                 break;
             }
         }
+        return last_sent;
     }
 
     void clear() {
         messages_.clear();
+        sub_memory(memory_bytes_);
+        if (spilled_) spilled_->clear();
     }
 
     bool empty() const {
-        return messages_.empty();
+        return messages_.empty() && (!spilled_ || spilled_->empty());
+    }
+
+    std::size_t size() const {
+        return messages_.size() + (spilled_ ? spilled_->size() : 0);
+    }
+
+    /**
+     * @brief Get the number of the spilled messages.
+     */
+    std::size_t spilled_size() const {
+        return spilled_ ? spilled_->size() : 0;
+    }
+
+    /**
+     * @brief Get the bytes of the spilled messages in the files.
+     */
+    std::size_t spilled_bytes() const {
+        return spilled_ ? spilled_->bytes() : 0;
+    }
+
+    /**
+     * @brief Get the approximate bytes of the messages in memory.
+     */
+    std::size_t memory_bytes() const {
+        return memory_bytes_;
+    }
+
+    /**
+     * @brief Call f(offline_message const&) from the front.
+     *        The spilled messages are read from the spill files.
+     */
+    template <typename Func>
+    void for_each(Func&& f) const {
+        if (spilled_) {
+            spilled_->for_each(
+                [&](buffer const& payload) {
+                    if (auto m = decode(payload)) f(m.value());
+                }
+            );
+        }
+        for (auto const& m : messages_.get<tag_seq>()) {
+            f(m);
+        }
+    }
+
+    /**
+     * @brief Set the memory budget of the offline messages.
+     *        The already spilled messages remain in the spill files.
+     * @param spill offline_spill. nullptr disables the budget.
+     */
+    void set_spill(std::shared_ptr<offline_spill> spill) {
+        if (spill_) spill_->sub_memory(memory_bytes_);
+        spill_ = force_move(spill);
+        if (spill_) spill_->add_memory(memory_bytes_);
+    }
+
+    /**
+     * @brief Move the messages from the front to the spill files while the memory budget is exceeded.
+     *        If the spill file cannot be written, the messages are kept in memory.
+     */
+    void enforce_memory_budget() {
+        if (!spill_) return;
+        auto& idx = messages_.get<tag_seq>();
+        while (!idx.empty() && spill_->over_budget(memory_bytes_)) {
+            if (!spilled_) spilled_.emplace(spill_);
+            auto const& m = idx.front();
+            std::string payload;
+            encode(payload, m);
+            if (!spilled_->push(payload)) break;
+            auto size = m.memory_size();
+            idx.pop_front();
+            sub_memory(size);
+        }
     }
 
-    void push_back(
+    /**
+     * @brief Push the message to the back of the queue.
+     *        Call enforce_memory_budget() after the pushed message is used.
+     * @return the pushed message
+     */
+    offline_message const& push_back(
         as::io_context& timer_ioc,
         buffer pub_topic,
         buffer contents,
@@ -156,7 +336,12 @@ public:
                 [this, wp = std::weak_ptr<as::steady_timer>(tim_message_expiry)](error_code ec) mutable {
                     if (auto sp = wp.lock()) {
                         if (!ec) {
-                            messages_.get<tag_tim>().erase(sp);
+                            auto& idx = messages_.get<tag_tim>();
+                            auto it = idx.find(sp);
+                            if (it == idx.end()) return;
+                            auto size = it->memory_size();
+                            idx.erase(it);
+                            sub_memory(size);
                         }
                     }
                 }
@@ -164,12 +349,86 @@ public:
         }
 
         auto& seq_idx = messages_.get<tag_seq>();
-        seq_idx.emplace_back(
+        auto const& m = *seq_idx.emplace_back(
+            next_seq_++,
             force_move(pub_topic),
             force_move(contents),
             pubopts,
             force_move(props),
             force_move(tim_message_expiry)
+        ).first;
+        add_memory(m.memory_size());
+        return m;
+    }
+
+private:
+    void add_memory(std::size_t bytes) {
+        memory_bytes_ += bytes;
+        if (spill_) spill_->add_memory(bytes);
+    }
+
+    void sub_memory(std::size_t bytes) {
+        memory_bytes_ -= bytes;
+        if (spill_) spill_->sub_memory(bytes);
+    }
+
+    static void encode(std::string& payload, offline_message const& m) {
+        log_writer w { payload };
+        w.put_u64(m.seq());
+        w.put_expiry(m.message_expiry());
+        w.put_str(m.topic());
+        w.put_str(m.contents());
+        w.put_u8(static_cast<std::uint8_t>(m.pubopts()));
+        w.put_props(m.props());
+    }
+
+    /**
+     * @brief Decode the spilled message.
+     * @return the message. nullopt if it has expired or the record is invalid.
+     */
+    static optional<offline_message> decode(buffer const& payload) {
+        log_reader r { payload.data(), payload.data() + payload.size() };
+        auto field =
+            [&](string_view sv) {
+                return payload.substr(static_cast<std::size_t>(sv.data() - payload.data()), sv.size());
+            };
+        auto seq = r.get_u64();
+        auto deadline = r.get_expiry();
+        auto topic = r.get_str();
+        auto contents = r.get_str();
+        publish_options pubopts(r.get_u8());
+        auto props = r.get_str();
+        if (!r.ok) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill invalid record dropped. size:" << payload.size();
+            return nullopt;
+        }
+        v5::properties parsed_props;
+        try {
+            parsed_props = v5::property::parse(field(props));
+        }
+        catch (std::exception const& e) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill invalid record dropped. " << e.what();
+            return nullopt;
+        }
+
+        optional<std::chrono::steady_clock::time_point> message_expiry;
+        if (deadline) {
+            auto now = std::chrono::system_clock::now();
+            if (deadline.value() <= now) return nullopt;
+            message_expiry.emplace(
+                std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(deadline.value() - now)
+            );
+        }
+        return offline_message(
+            seq,
+            field(topic),
+            field(contents),
+            pubopts,
+            force_move(parsed_props),
+            message_expiry
         );
     }
 
@@ -188,6 +447,10 @@ private:
     >;
 
     mi_offline_message messages_;
+    std::uint64_t next_seq_ = 0;
+    std::size_t memory_bytes_ = 0;
+    std::shared_ptr<offline_spill> spill_;
+    optional<spill_queue> spilled_;
 };
 
 MQTT_BROKER_NS_END
@@ -0,0 +1,355 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_OFFLINE_SPILL_HPP)
+#define MQTT_BROKER_OFFLINE_SPILL_HPP
+
+#include <mqtt/config.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <sstream>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/log.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/mutex.hpp>
+#include <mqtt/broker/segment_log.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+struct offline_spill_config {
+    /// Directory that the spill files are created in.
+    std::string directory;
+
+    /// Bytes of the offline messages that each session keeps in memory.
+    std::size_t session_memory_budget = 1024 * 1024;
+
+    /// Bytes of the offline messages that all sessions keep in memory.
+    std::size_t global_memory_budget = 256 * 1024 * 1024;
+
+    /// A new spill file is started when the current one exceeds this size.
+    /// The spill files are shared by all sessions.
+    std::size_t segment_size = 16 * 1024 * 1024;
+};
+
+/**
+ * @brief Spill file that the records of all sessions are appended to.
+ *        The file is closed and removed when no record refers to it.
+ *        On POSIX, it is unlinked just after it is opened, so it never remains after a crash.
+ */
+class spill_segment {
+public:
+    spill_segment(std::string name, std::FILE* fp, std::atomic<std::size_t>& opened)
+        :name_(force_move(name)),
+         fp_(fp),
+         opened_(opened)
+    {
+        ++opened_;
+    }
+
+    ~spill_segment() {
+        std::fclose(fp_);
+#if defined(_WIN32)
+        std::remove(name_.c_str());
+#endif // defined(_WIN32)
+        --opened_;
+    }
+
+    spill_segment(spill_segment const&) = delete;
+    spill_segment& operator=(spill_segment const&) = delete;
+
+private:
+    friend class offline_spill;
+
+    std::string name_;
+    std::FILE* fp_;
+    std::atomic<std::size_t>& opened_;
+    std::size_t write_offset_ = 0;
+};
+
+/**
+ * @brief Location of a spilled record. The record keeps the spill file.
+ */
+struct spill_record {
+    /**
+     * @brief Get the bytes of the record in the spill file.
+     */
+    std::size_t bytes() const;
+
+    std::shared_ptr<spill_segment> segment;
+    std::size_t offset;
+    std::size_t size;
+};
+
+/**
+ * @brief Memory budget of the offline messages that is shared by all sessions.
+ *        When the budget is exceeded, the older offline messages of the session
+ *        are moved to the spill files. The spill files are shared by all sessions,
+ *        so the number of the open files depends on the spilled bytes, not on the
+ *        number of the sessions.
+ *        Record format: [length:4][payload:length]
+ */
+class offline_spill {
+public:
+    static constexpr std::size_t header_size = 4;
+
+    explicit offline_spill(offline_spill_config config)
+        :config_(force_move(config))
+    {
+        if (config_.directory.empty()) {
+            throw std::runtime_error("offline_spill directory is empty");
+        }
+    }
+
+    offline_spill_config const& config() const {
+        return config_;
+    }
+
+    /**
+     * @brief Check whether the offline messages of the session should be spilled.
+     * @param session_bytes bytes of the offline messages of the session in memory
+     */
+    bool over_budget(std::size_t session_bytes) const {
+        return
+            session_bytes > config_.session_memory_budget ||
+            memory_bytes_ > config_.global_memory_budget;
+    }
+
+    void add_memory(std::size_t bytes) {
+        memory_bytes_ += bytes;
+    }
+
+    void sub_memory(std::size_t bytes) {
+        memory_bytes_ -= bytes;
+    }
+
+    void add_spilled(std::size_t bytes) {
+        spilled_bytes_ += bytes;
+    }
+
+    void sub_spilled(std::size_t bytes) {
+        spilled_bytes_ -= bytes;
+    }
+
+    /**
+     * @brief Get the bytes of the offline messages of all sessions in memory.
+     */
+    std::size_t memory_bytes() const {
+        return memory_bytes_;
+    }
+
+    /**
+     * @brief Get the bytes of the spilled offline messages of all sessions.
+     */
+    std::size_t spilled_bytes() const {
+        return spilled_bytes_;
+    }
+
+    /**
+     * @brief Get the number of the open spill files.
+     */
+    std::size_t segments() const {
+        return segments_;
+    }
+
+    /**
+     * @brief Append the payload to the current spill file.
+     * @return the record. nullopt if the spill file cannot be opened or written.
+     */
+    optional<spill_record> append(string_view payload) {
+        std::lock_guard<mutex> g(mtx_);
+        if (!current_ || current_->write_offset_ >= config_.segment_size) {
+            current_ = open_segment();
+            if (!current_) return nullopt;
+        }
+        auto& s = *current_;
+        std::string header;
+        log_writer w { header };
+        w.put_u32(static_cast<std::uint32_t>(payload.size()));
+        // A partially written record is overwritten by the next one.
+        if (std::fseek(s.fp_, static_cast<long>(s.write_offset_), SEEK_SET) != 0 ||
+            std::fwrite(header.data(), 1, header.size(), s.fp_) != header.size() ||
+            std::fwrite(payload.data(), 1, payload.size(), s.fp_) != payload.size()) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill write failed " << s.name_
+                << " " << std::strerror(errno);
+            return nullopt;
+        }
+        spill_record r { current_, s.write_offset_, payload.size() };
+        s.write_offset_ += r.bytes();
+        return r;
+    }
+
+    /**
+     * @brief Read the payload of the record.
+     * @return the payload. nullopt if the spill file cannot be read.
+     */
+    optional<buffer> read(spill_record const& r) const {
+        std::lock_guard<mutex> g(mtx_);
+        auto const& s = *r.segment;
+        char header[header_size];
+        if (std::fseek(s.fp_, static_cast<long>(r.offset), SEEK_SET) != 0 ||
+            std::fread(header, 1, header_size, s.fp_) != header_size) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill read failed " << s.name_;
+            return nullopt;
+        }
+        log_reader hr { header, header + header_size };
+        if (hr.get_u32() != r.size) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill invalid record " << s.name_ << " offset:" << r.offset;
+            return nullopt;
+        }
+        auto spa = make_shared_ptr_array(r.size);
+        if (std::fread(spa.get(), 1, r.size, s.fp_) != r.size) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill read failed " << s.name_;
+            return nullopt;
+        }
+        auto ptr = spa.get();
+        return buffer(string_view(ptr, r.size), force_move(spa));
+    }
+
+private:
+    // mtx_ must be locked by the caller
+    std::shared_ptr<spill_segment> open_segment() {
+        std::stringstream ss;
+        ss << config_.directory << "/offline_spill." << this << '.' << next_segment_++;
+        auto name = ss.str();
+        auto fp = std::fopen(name.c_str(), "w+b");
+        if (!fp) {
+            MQTT_LOG("mqtt_broker", error)
+                << "offline_spill cannot open " << name
+                << " " << std::strerror(errno);
+            return nullptr;
+        }
+#if !defined(_WIN32)
+        std::remove(name.c_str());
+#endif // !defined(_WIN32)
+        return std::make_shared<spill_segment>(force_move(name), fp, segments_);
+    }
+
+private:
+    offline_spill_config config_;
+    std::atomic<std::size_t> memory_bytes_{0};
+    std::atomic<std::size_t> spilled_bytes_{0};
+    std::atomic<std::size_t> segments_{0};
+    mutable mutex mtx_;
+    std::shared_ptr<spill_segment> current_;
+    std::uint64_t next_segment_ = 0;
+};
+
+inline std::size_t spill_record::bytes() const {
+    return offline_spill::header_size + size;
+}
+
+/**
+ * @brief FIFO queue of the records of one session on the shared spill files.
+ */
+class spill_queue {
+public:
+    explicit spill_queue(std::shared_ptr<offline_spill> spill)
+        :spill_(force_move(spill))
+    {
+    }
+
+    ~spill_queue() {
+        clear();
+    }
+
+    spill_queue(spill_queue const&) = delete;
+    spill_queue& operator=(spill_queue const&) = delete;
+
+    bool empty() const {
+        return records_.empty();
+    }
+
+    std::size_t size() const {
+        return records_.size();
+    }
+
+    /**
+     * @brief Get the bytes of the records that haven't been popped.
+     */
+    std::size_t bytes() const {
+        return bytes_;
+    }
+
+    /**
+     * @brief Push the payload to the back.
+     * @return false if the payload cannot be written. The queue is not changed.
+     */
+    bool push(string_view payload) {
+        auto r = spill_->append(payload);
+        if (!r) return false;
+        auto bytes = r.value().bytes();
+        records_.push_back(force_move(r.value()));
+        bytes_ += bytes;
+        spill_->add_spilled(bytes);
+        return true;
+    }
+
+    /**
+     * @brief Get the payload of the front record.
+     *        The payload is read once and kept until pop() is called.
+     *        If the record cannot be read, the payload is empty.
+     */
+    buffer const& front() {
+        BOOST_ASSERT(!empty());
+        if (!front_) {
+            auto payload = spill_->read(records_.front());
+            front_.emplace(payload ? force_move(payload.value()) : buffer());
+        }
+        return front_.value();
+    }
+
+    void pop() {
+        BOOST_ASSERT(!empty());
+        auto bytes = records_.front().bytes();
+        records_.pop_front();
+        bytes_ -= bytes;
+        spill_->sub_spilled(bytes);
+        front_ = nullopt;
+    }
+
+    void clear() {
+        spill_->sub_spilled(bytes_);
+        bytes_ = 0;
+        records_.clear();
+        front_ = nullopt;
+    }
+
+    /**
+     * @brief Call f(payload) for all records from the front. The front is not changed.
+     *        If a record cannot be read, the payload is empty.
+     */
+    template <typename Func>
+    void for_each(Func&& f) const {
+        for (auto const& r : records_) {
+            auto payload = spill_->read(r);
+            f(payload ? payload.value() : buffer());
+        }
+    }
+
+private:
+    std::shared_ptr<offline_spill> spill_;
+    std::deque<spill_record> records_;
+    std::size_t bytes_ = 0;
+    optional<buffer> front_;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_OFFLINE_SPILL_HPP
@@ -28,19 +28,35 @@ struct retain_t {
         buffer contents,
         v5::properties props,
         qos qos_value,
-        std::shared_ptr<as::steady_timer> tim_message_expiry = std::shared_ptr<as::steady_timer>())
+        std::shared_ptr<as::steady_timer> tim_message_expiry = std::shared_ptr<as::steady_timer>(),
+        std::shared_ptr<void const> payload_ref = std::shared_ptr<void const>())
         :topic(force_move(topic)),
          contents(force_move(contents)),
          props(force_move(props)),
          qos_value(qos_value),
-         tim_message_expiry(force_move(tim_message_expiry))
+         tim_message_expiry(force_move(tim_message_expiry)),
+         payload_ref(force_move(payload_ref))
     { }
 
+    /**
+     * @brief Get the approximate bytes that the message occupies in memory.
+     *        The deduplicated contents are not included. See retained_payload_store.
+     */
+    std::size_t memory_size() const {
+        std::size_t size = sizeof(retain_t) + topic.size();
+        if (!payload_ref) size += contents.size();
+        for (auto const& p : props) size += v5::size(p);
+        return size;
+    }
+
     buffer topic;
     buffer contents;
     v5::properties props;
     qos qos_value;
     std::shared_ptr<as::steady_timer> tim_message_expiry;
+
+    /// reference to the contents in the retained_payload_store. nullptr if not deduplicated.
+    std::shared_ptr<void const> payload_ref;
 };
 
 MQTT_BROKER_NS_END
@@ -0,0 +1,147 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_RETAINED_PAYLOAD_STORE_HPP)
+#define MQTT_BROKER_RETAINED_PAYLOAD_STORE_HPP
+
+#include <mqtt/config.hpp>
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/functional/hash.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/string_view.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/mutex.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+struct retained_payload_stats {
+    /// number of the distinct payloads in the store
+    std::size_t unique_payloads = 0;
+
+    /// bytes of the distinct payloads
+    std::size_t unique_bytes = 0;
+
+    /// number of the references to the payloads. It is the number of the retained messages
+    /// including the copies that are being delivered.
+    std::size_t references = 0;
+
+    /// bytes that the referenced payloads would occupy without the deduplication
+    std::size_t referenced_bytes = 0;
+
+    /// referenced_bytes / unique_bytes. 1.0 if there is no payload.
+    double dedupe_ratio() const {
+        if (unique_bytes == 0) return 1.0;
+        return static_cast<double>(referenced_bytes) / static_cast<double>(unique_bytes);
+    }
+};
+
+/**
+ * @brief Content-addressed store of the retained payloads.
+ *        The retained messages that have the identical payload share one buffer.
+ *        The payload is removed from the store when the last reference is released.
+ *        All member functions are thread safe.
+ */
+class retained_payload_store {
+public:
+    using ref_t = std::shared_ptr<void const>;
+
+    /**
+     * @brief Get the stored payload that is identical to the contents, or store the contents.
+     * @param contents payload
+     * @return the buffer that shares the stored payload, and the reference that keeps it in the store.
+     *         The caller holds the reference as long as it uses the buffer as the retained payload.
+     */
+    std::pair<buffer, ref_t> intern(buffer contents) {
+        std::lock_guard<mutex> g(impl_->mtx);
+        auto it = impl_->entries.find(contents);
+        if (it != impl_->entries.end()) {
+            if (auto e = it->second.lock()) {
+                return { e->contents, force_move(e) };
+            }
+            // The last reference is being released, and the deleter is waiting for the lock.
+            impl_->bytes -= it->first.size();
+            impl_->entries.erase(it);
+        }
+        // The contents of a small packet share the receive buffer with the other packets,
+        // so the stored payload is always copied not to keep the buffer.
+        contents = allocate_buffer(contents);
+        std::shared_ptr<entry> e(
+            new entry { force_move(contents) },
+            [wp = std::weak_ptr<impl>(impl_)](entry* p) {
+                if (auto sp = wp.lock()) {
+                    std::lock_guard<mutex> g(sp->mtx);
+                    auto it = sp->entries.find(p->contents);
+                    // The entry could be replaced by intern() after the expiry.
+                    if (it != sp->entries.end() && it->second.expired()) {
+                        sp->bytes -= p->contents.size();
+                        sp->entries.erase(it);
+                    }
+                }
+                delete p;
+            }
+        );
+        impl_->entries.emplace(e->contents, e);
+        impl_->bytes += e->contents.size();
+        return { e->contents, force_move(e) };
+    }
+
+    /**
+     * @brief Get the statistics. It scans all distinct payloads.
+     * @return statistics
+     */
+    retained_payload_stats stats() const {
+        retained_payload_stats ret;
+        std::lock_guard<mutex> g(impl_->mtx);
+        for (auto const& kv : impl_->entries) {
+            auto refs = kv.second.use_count();
+            if (refs == 0) continue;
+            ++ret.unique_payloads;
+            ret.unique_bytes += kv.first.size();
+            ret.references += static_cast<std::size_t>(refs);
+            ret.referenced_bytes += kv.first.size() * static_cast<std::size_t>(refs);
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Get the approximate bytes of the distinct payloads and the entries.
+     *        It doesn't scan the payloads.
+     * @return bytes
+     */
+    std::size_t memory_size() const {
+        std::lock_guard<mutex> g(impl_->mtx);
+        return impl_->bytes + impl_->entries.size() * entry_size;
+    }
+
+private:
+    struct entry {
+        buffer contents;
+    };
+
+    struct impl {
+        mutex mtx;
+        // The key refers to the contents of the entry.
+        std::unordered_map<string_view, std::weak_ptr<entry>, boost::hash<string_view>> entries;
+        std::size_t bytes = 0;
+    };
+
+    // entry, shared_ptr control block, and unordered_map node
+    static constexpr std::size_t entry_size =
+        sizeof(entry) + 2 * sizeof(void*) + sizeof(string_view) + sizeof(std::weak_ptr<entry>) + 2 * sizeof(void*);
+
+    std::shared_ptr<impl> impl_ = std::make_shared<impl>();
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_RETAINED_PAYLOAD_STORE_HPP
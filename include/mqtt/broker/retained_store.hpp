@@ -0,0 +1,285 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_RETAINED_STORE_HPP)
+#define MQTT_BROKER_RETAINED_STORE_HPP
+
+#include <mqtt/config.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+#include <boost/functional/hash.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/property_parse.hpp>
+#include <mqtt/subscribe_options.hpp>
+#include <mqtt/log.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/segment_log.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+struct retained_store_config {
+    /// Base path of the files. Segments are written to path.<number> and
+    /// the number of the first valid segment is written to path.head.
+    std::string path;
+
+    /// A new segment is started when the current segment exceeds this size.
+    std::size_t segment_size = 64 * 1024 * 1024;
+
+    /// Interval of checking the garbage ratio and writing the snapshot of all retained messages.
+    std::chrono::steady_clock::duration compaction_interval = std::chrono::minutes(10);
+
+    /// If true, the checksum of all records is verified on load.
+    /// If false, it is verified only for the last segment that could have a torn tail.
+    /// It touches all payload pages, so the startup gets slower.
+    bool verify_checksum = false;
+
+    /// If true, the file is synchronized to the storage device on each write.
+    bool sync = false;
+};
+
+enum class retained_record_type : std::uint8_t {
+    set            = 1,
+    erase          = 2,
+    clear          = 3,
+    snapshot_begin = 4,
+    snapshot_end   = 5,
+};
+
+/**
+ * @brief Loaded retained message.
+ *        topic, contents, and props refer to the mapped segment.
+ *        message_expiry is the absolute deadline in system_clock.
+ */
+struct stored_retain {
+    buffer topic;
+    buffer contents;
+    v5::properties props;
+    qos qos_value;
+    optional<std::chrono::system_clock::time_point> message_expiry;
+};
+
+/**
+ * @brief Persistent store of the retained messages.
+ *
+ * Set and erase of the retained messages are appended to the segment_log.
+ * On load, the segments are memory mapped and all records are replayed eagerly
+ * to rebuild the topic index in memory. The topic index is not persisted.
+ * The topic and the contents of the loaded messages refer to the mapping, and they
+ * are not copied. Unless verify_checksum is set, only the last segment is checksummed,
+ * so the payload pages of the other segments are read from the storage when the
+ * message is delivered at first.
+ */
+class retained_store {
+public:
+    explicit retained_store(retained_store_config config)
+        :config_(force_move(config)),
+         log_(config_.path, config_.segment_size, config_.sync)
+    {
+    }
+
+    retained_store(retained_store const&) = delete;
+    retained_store& operator=(retained_store const&) = delete;
+
+    retained_store_config const& config() const {
+        return config_;
+    }
+
+    /**
+     * @brief Read all segments and call the handler for each retained message.
+     *        The messages whose deadline has already passed are not loaded.
+     *        Call this function before any record is appended.
+     * @param h handler that is called as h(stored_retain&&)
+     * @return the number of loaded messages
+     */
+    template <typename Handler>
+    std::size_t load(Handler&& h) {
+        index_t index;
+        optional<index_t> snapshot;
+        auto records = log_.replay(
+            [&](std::uint8_t type, log_reader& r, const_shared_ptr_array const& life) {
+                return replay(static_cast<retained_record_type>(type), r, life, index, snapshot);
+            },
+            [&] {
+                // The incomplete snapshot is discarded.
+                snapshot = nullopt;
+            },
+            config_.verify_checksum
+        );
+        records_ = records;
+
+        auto now = std::chrono::system_clock::now();
+        std::size_t loaded = 0;
+        for (auto& e : index) {
+            auto& m = e.second;
+            if (m.message_expiry && m.message_expiry.value() <= now) continue;
+            h(
+                stored_retain {
+                    force_move(m.topic),
+                    force_move(m.contents),
+                    v5::property::parse(force_move(m.props)),
+                    m.qos_value,
+                    m.message_expiry
+                }
+            );
+            ++loaded;
+        }
+        MQTT_LOG("mqtt_broker", info)
+            << "retained_store loaded records:" << records
+            << " messages:" << loaded;
+        return loaded;
+    }
+
+    /**
+     * @brief Check the garbage ratio of the segments.
+     * @param live the number of the retained messages
+     * @return true if less than half of the records are live
+     */
+    bool needs_compaction(std::size_t live) const {
+        return records_ > live * 2;
+    }
+
+    /**
+     * @brief Write the snapshot of all retained messages to a new segment and remove the older segments.
+     *        The caller must prevent other threads from appending records until this function returns.
+     * @param writer function that calls set() for all retained messages. It is called with *this.
+     */
+    template <typename Writer>
+    void compact(Writer&& writer) {
+        log_.begin_compaction();
+        log_.append(static_cast<std::uint8_t>(retained_record_type::snapshot_begin), [](auto&) {});
+        records_ = 0;
+        std::forward<Writer>(writer)(*this);
+        log_.append(static_cast<std::uint8_t>(retained_record_type::snapshot_end), [](auto&) {});
+        log_.end_compaction();
+    }
+
+    void flush() {
+        log_.flush();
+    }
+
+    void set(
+        buffer const& topic,
+        buffer const& contents,
+        v5::properties const& props,
+        qos qos_value,
+        optional<std::chrono::steady_clock::time_point> message_expiry) {
+        append(
+            retained_record_type::set,
+            [&](auto& w) {
+                w.put_str(topic);
+                w.put_str(contents);
+                w.put_u8(static_cast<std::uint8_t>(qos_value));
+                w.put_expiry(message_expiry);
+                w.put_props(props);
+            }
+        );
+    }
+
+    void erase(string_view topic) {
+        append(
+            retained_record_type::erase,
+            [&](auto& w) {
+                w.put_str(topic);
+            }
+        );
+    }
+
+    void clear() {
+        append(retained_record_type::clear, [](auto&) {});
+    }
+
+private:
+    struct entry {
+        buffer topic;
+        buffer contents;
+        buffer props;
+        qos qos_value;
+        optional<std::chrono::system_clock::time_point> message_expiry;
+    };
+
+    // The key refers to entry::topic.
+    using index_t = std::unordered_map<string_view, entry, boost::hash<string_view>>;
+
+    template <typename Encoder>
+    void append(retained_record_type type, Encoder&& enc) {
+        log_.append(static_cast<std::uint8_t>(type), std::forward<Encoder>(enc));
+        ++records_;
+    }
+
+    /**
+     * @brief Replay one record.
+     * @return false if the payload is invalid.
+     */
+    static bool replay(
+        retained_record_type type,
+        log_reader& r,
+        const_shared_ptr_array const& life,
+        index_t& index,
+        optional<index_t>& snapshot) {
+        switch (type) {
+        case retained_record_type::snapshot_begin:
+            snapshot.emplace();
+            return true;
+        case retained_record_type::snapshot_end:
+            if (snapshot) {
+                index = force_move(snapshot.value());
+                snapshot = nullopt;
+            }
+            return true;
+        default:
+            break;
+        }
+
+        auto& target = snapshot ? snapshot.value() : index;
+        switch (type) {
+        case retained_record_type::set: {
+            auto topic = r.get_str();
+            auto contents = r.get_str();
+            auto qos_value = static_cast<qos>(r.get_u8());
+            auto message_expiry = r.get_expiry();
+            auto props = r.get_str();
+            if (!r.ok) return false;
+            // Erase first, because the key refers to the previous entry.
+            target.erase(topic);
+            entry e {
+                buffer(topic, life),
+                buffer(contents, life),
+                buffer(props, life),
+                qos_value,
+                message_expiry
+            };
+            string_view key = e.topic;
+            target.emplace(key, force_move(e));
+        } break;
+        case retained_record_type::erase:
+            target.erase(r.get_str());
+            break;
+        case retained_record_type::clear:
+            target.clear();
+            break;
+        default:
+            return false;
+        }
+        return r.ok;
+    }
+
+private:
+    retained_store_config config_;
+    segment_log log_;
+    std::atomic<std::size_t> records_{0};
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_RETAINED_STORE_HPP
@@ -7,7 +7,8 @@
 #if !defined(MQTT_BROKER_RETAINED_TOPIC_MAP_HPP)
 #define MQTT_BROKER_RETAINED_TOPIC_MAP_HPP
 
-#include <deque>
+#include <vector>
+#include <algorithm>
 
 #include <boost/functional/hash.hpp>
 #include <boost/multi_index_container.hpp>
@@ -67,12 +68,25 @@ class retained_topic_map {
 
         optional<Value> value;
 
+        // Children ordered by the id, that is the insertion order.
+        // The wildcards iterate them without the lookup of the index.
+        // The root node doesn't have the children starting with '$',
+        // because the wildcards on the first level don't match them.
+        // The erased child remains as nullptr until the half of the children are erased,
+        // to keep erasing from a wide level cheap.
+        struct child {
+            node_id_t id;
+            path_entry const* entry;
+        };
+        std::vector<child> children;
+        std::size_t erased_children = 0;
+
         path_entry(node_id_t parent_id, string_view name, node_id_t id)
             : parent_id(parent_id), name_buffer(allocate_buffer(name)), name(name_buffer), id(id)
         { }
     };
 
-    struct wildcard_index_tag { };
+    struct id_index_tag { };
     struct direct_index_tag { };
 
     // allow for two indices on retained topics
@@ -87,18 +101,44 @@ class retained_topic_map {
                 BOOST_MULTI_INDEX_MEMBER(path_entry, string_view, name) >
             >,
 
-        // index required for wildcard processing
-        mi::ordered_non_unique< mi::tag<wildcard_index_tag>, BOOST_MULTI_INDEX_MEMBER(path_entry, node_id_t, parent_id) >
+        // index required for resuming the cursor
+        mi::hashed_unique <
+            mi::tag<id_index_tag>,
+            BOOST_MULTI_INDEX_MEMBER(path_entry, node_id_t, id)
+            >
       >
     >;
 
     using direct_const_iterator = typename path_entry_set::template index<direct_index_tag>::type::const_iterator;
-    using wildcard_const_iterator = typename path_entry_set::template index<wildcard_index_tag>::type::const_iterator;
 
     path_entry_set map;
     size_t map_size;
     node_id_t next_node_id;
 
+    // Approximate bytes of the nodes and the stored values
+    std::size_t node_bytes;
+    std::size_t value_bytes;
+
+    static std::size_t node_size(string_view name) {
+        // including the element of the children of the parent
+        return sizeof(path_entry) + sizeof(typename path_entry::child) + name.size();
+    }
+
+    // Use Value::memory_size() if it is provided
+    template <typename V>
+    static auto value_size(V const& v, int) -> decltype(v.memory_size()) {
+        return v.memory_size();
+    }
+
+    template <typename V>
+    static std::size_t value_size(V const&, long) {
+        return sizeof(V);
+    }
+
+    static std::size_t value_size(Value const& v) {
+        return value_size(v, 0);
+    }
+
     direct_const_iterator root;
 
     direct_const_iterator create_topic(string_view topic) {
@@ -118,6 +158,10 @@ class retained_topic_map {
 
                 if (entry == direct_index.end()) {
                     entry = map.insert(path_entry(parent->id, t, next_node_id++)).first;
+                    if (parent != root || t.empty() || t[0] != '$') {
+                        direct_index.modify(parent, [&entry](path_entry& p){ p.children.push_back({ entry->id, &*entry }); });
+                    }
+                    node_bytes += node_size(t);
                     if (next_node_id == max_node_id) {
                         throw_max_stored_topics();
                     }
@@ -159,75 +203,61 @@ class retained_topic_map {
     }
 
     // Match all underlying topics when a hash entry is matched
-    // perform a breadth-first iteration over all items in the tree below
+    // perform a depth-first iteration over all items in the tree below
     template<typename Output>
-    void match_hash_entries(node_id_t parent, Output&& callback, bool ignore_system) const {
-        std::deque<node_id_t> entries;
-        entries.push_back(parent);
-        std::deque<node_id_t> new_entries;
-
-        auto const& wildcard_index = map.template get<wildcard_index_tag>();
+    void match_hash_entries(path_entry const& parent, Output&& callback) const {
+        std::vector<path_entry const*> entries;
+        auto push_children =
+            [&entries](path_entry const& e) {
+                for (auto i = e.children.rbegin(); i != e.children.rend(); ++i) {
+                    if (i->entry) entries.push_back(i->entry);
+                }
+            };
 
+        push_children(parent);
         while (!entries.empty()) {
-            new_entries.resize(0);
-
-            for (auto root : entries) {
-                // Find all entries below this node
-                for (auto i = wildcard_index.lower_bound(root); i != wildcard_index.end() && i->parent_id == root; ++i) {
-
-                    // Should we ignore system matches
-                    if (!ignore_system || i->name.empty() || i->name[0] != '$') {
-                        if (i->value) {
-                            callback(*i->value);
-                        }
-
-                        new_entries.push_back(i->id);
-                    }
-                }
+            auto entry = entries.back();
+            entries.pop_back();
+            if (entry->value) {
+                callback(*entry->value);
             }
-
-            // Ignore system only on first level
-            ignore_system = false;
-            std::swap(entries, new_entries);
+            push_children(*entry);
         }
-
     }
 
     // Find all topics that match the specified topic filter
     template<typename Output>
     void find_match(string_view topic_filter, Output&& callback) const {
-        std::deque<direct_const_iterator> entries;
-        entries.push_back(root);
+        std::vector<path_entry const*> entries { &*root };
+        std::vector<path_entry const*> new_entries;
 
-        std::deque<direct_const_iterator> new_entries;
         topic_filter_tokenizer(
             topic_filter,
             [this, &entries, &new_entries, &callback](string_view t) {
                 auto const& direct_index = map.template get<direct_index_tag>();
-                auto const& wildcard_index = map.template get<wildcard_index_tag>();
                 new_entries.resize(0);
 
-                for (auto const& entry : entries) {
-                    node_id_t parent = entry->id;
-
-                    if (t == string_view("+")) {
-                        for (auto i = wildcard_index.lower_bound(parent); i != wildcard_index.end() && i->parent_id == parent; ++i) {
-                            if (parent != root_node_id || i->name.empty() || i->name[0] != '$') {
-                                new_entries.push_back(map.template project<direct_index_tag, wildcard_const_iterator>(i));
-                            }
-                            else {
-                                break;
-                            }
+                if (t == string_view("+")) {
+                    for (auto entry : entries) {
+                        for (auto const& c : entry->children) {
+                            if (c.entry) new_entries.push_back(c.entry);
                         }
                     }
-                    else if (t == string_view("#")) {
-                        match_hash_entries(parent, callback, parent == root_node_id);
-                        return false;
+                }
+                else if (t == string_view("#")) {
+                    for (auto entry : entries) {
+                        // "a/#" also matches "a"
+                        if (entry != &*root && entry->value) {
+                            callback(*entry->value);
+                        }
+                        match_hash_entries(*entry, callback);
                     }
-                    else {
-                        direct_const_iterator i = direct_index.find(std::make_tuple(parent, t));
+                }
+                else {
+                    for (auto entry : entries) {
+                        auto i = direct_index.find(std::make_tuple(entry->id, t));
                         if (i != direct_index.end()) {
-                            new_entries.push_back(i);
+                            new_entries.push_back(&*i);
                         }
                     }
                 }
@@ -237,13 +267,42 @@ class retained_topic_map {
             }
         );
 
-        for (auto& entry : entries) {
+        for (auto entry : entries) {
             if (entry->value) {
                 callback(*entry->value);
             }
         }
     }
 
+    // Remove the child from the children of the parent
+    void remove_child(path_entry const& parent, path_entry const& child) {
+        auto& direct_index = map.template get<direct_index_tag>();
+        direct_index.modify(
+            direct_index.iterator_to(parent),
+            [&child](path_entry& p) {
+                auto it = std::lower_bound(
+                    p.children.begin(),
+                    p.children.end(),
+                    child.id,
+                    [](typename path_entry::child const& c, node_id_t id) { return c.id < id; }
+                );
+                if (it == p.children.end() || it->entry != &child) return;
+                it->entry = nullptr;
+                if (++p.erased_children * 2 > p.children.size()) {
+                    p.children.erase(
+                        std::remove_if(
+                            p.children.begin(),
+                            p.children.end(),
+                            [](typename path_entry::child const& c) { return !c.entry; }
+                        ),
+                        p.children.end()
+                    );
+                    p.erased_children = 0;
+                }
+            }
+        );
+    }
+
     // Remove a value at the specified topic
     size_t erase_topic(string_view topic) {
         auto path = find_topic(topic);
@@ -251,15 +310,24 @@ class retained_topic_map {
         // Reset the value if there is actually something stored
         if (!path.empty() && path.back()->value) {
             auto& direct_index = map.template get<direct_index_tag>();
+            value_bytes -= value_size(*path.back()->value);
             direct_index.modify(path.back(), [](path_entry &entry){ entry.value = nullopt; });
 
             // Do iterators stay valid when erasing ? I think they do ?
+            // The descendants of the erased node are also erased, so only the first one is removed from its parent.
+            path_entry const* parent = &*root;
             for (auto entry : path) {
                 direct_index.modify(entry, [](path_entry& entry){ entry.decrease_count(); });
 
                 if (entry->count == 0) {
+                    if (parent) remove_child(*parent, *entry);
+                    parent = nullptr;
+                    node_bytes -= node_size(entry->name);
                     map.erase(entry);
                 }
+                else {
+                    parent = &*entry;
+                }
             }
 
             return 1;
@@ -294,6 +362,8 @@ class retained_topic_map {
 
     void init_map() {
         map_size = 0;
+        node_bytes = node_size("");
+        value_bytes = 0;
         // Create the root node
         root = map.insert(path_entry(root_parent_id, "", root_node_id)).first;
         next_node_id = root_node_id + 1;
@@ -314,6 +384,7 @@ public:
         if (path.empty()) {
             auto new_topic = this->create_topic(topic);
             direct_index.modify(new_topic, [&value](path_entry &entry) mutable { entry.value.emplace(std::forward<V>(value)); });
+            value_bytes += value_size(*new_topic->value);
             increase_map_size();
             return 1;
         }
@@ -321,11 +392,14 @@ public:
         if (!path.back()->value) {
             this->increase_topics(path);
             direct_index.modify(path.back(), [&value](path_entry &entry) mutable { entry.value.emplace(std::forward<V>(value)); });
+            value_bytes += value_size(*path.back()->value);
             increase_map_size();
             return 1;
         }
 
+        value_bytes -= value_size(*path.back()->value);
         direct_index.modify(path.back(), [&value](path_entry &entry) mutable { entry.value.emplace(std::forward<V>(value)); });
+        value_bytes += value_size(*path.back()->value);
 
         return 0;
     }
@@ -336,6 +410,118 @@ public:
         find_match(topic_filter, std::forward<Output>(callback));
     }
 
+    /**
+     * @brief Position of the incremental find. See make_cursor() and find_next().
+     *        It refers to the nodes by their ids, so it remains valid while the map is modified.
+     *        The topics that are inserted or erased during the iteration may or may not be found.
+     */
+    class cursor {
+    public:
+        // Check whether all matched topics have been found
+        bool done() const { return stack_.empty(); }
+
+    private:
+        friend class retained_topic_map;
+
+        struct frame {
+            node_id_t node;
+            std::size_t level;     // index of the filter level that is matched with the children
+            node_id_t last = 0;    // id of the last visited child
+            bool all = false;      // all descendants are matched by '#'
+
+            // They are only valid during find_next(), because the map can be modified between the calls.
+            path_entry const* entry = nullptr;
+            std::size_t pos = 0;   // index of the next child
+        };
+
+        std::vector<std::string> levels_;
+        std::vector<frame> stack_;
+    };
+
+    // Create the cursor that finds the stored topics that match the specified topic_filter
+    cursor make_cursor(string_view topic_filter) const {
+        cursor c;
+        topic_filter_tokenizer(
+            topic_filter,
+            [&c](string_view t) {
+                c.levels_.emplace_back(t);
+                return true;
+            }
+        );
+        c.stack_.push_back(typename cursor::frame { root_node_id, 0 });
+        return c;
+    }
+
+    // Find up to max stored topics from the cursor position, and advance the cursor
+    // Returns the number of the found topics
+    template<typename Output>
+    std::size_t find_next(cursor& c, std::size_t max, Output&& callback) const {
+        auto const& direct_index = map.template get<direct_index_tag>();
+        auto const& id_index = map.template get<id_index_tag>();
+
+        // Resolve the nodes of the cursor. The erased nodes are skipped.
+        for (auto& f : c.stack_) {
+            auto i = id_index.find(f.node);
+            if (i == id_index.end()) {
+                f.entry = nullptr;
+                continue;
+            }
+            f.entry = &*i;
+            f.pos = static_cast<std::size_t>(
+                std::upper_bound(
+                    i->children.begin(),
+                    i->children.end(),
+                    f.last,
+                    [](node_id_t id, typename path_entry::child const& c) { return id < c.id; }
+                ) - i->children.begin()
+            );
+        }
+
+        std::size_t found = 0;
+        auto visit =
+            [&](path_entry const& e, std::size_t level, bool all) {
+                // "a/#" also matches "a"
+                if (all || level == c.levels_.size() || (level + 1 == c.levels_.size() && c.levels_[level] == "#")) {
+                    if (e.value) {
+                        callback(*e.value);
+                        ++found;
+                    }
+                }
+                if (all || level != c.levels_.size()) {
+                    c.stack_.push_back(typename cursor::frame { e.id, level, 0, all, &e, 0 });
+                }
+            };
+
+        while (!c.stack_.empty() && found < max) {
+            auto& f = c.stack_.back();
+            if (!f.entry) {
+                c.stack_.pop_back();
+                continue;
+            }
+            if (!f.all && c.levels_[f.level] == "#") {
+                f.all = true;
+                continue;
+            }
+            if (f.all || c.levels_[f.level] == "+") {
+                if (f.pos == f.entry->children.size()) {
+                    c.stack_.pop_back();
+                    continue;
+                }
+                auto const& child = f.entry->children[f.pos++];
+                f.last = child.id;
+                if (child.entry) visit(*child.entry, f.level + 1, f.all);
+            }
+            else {
+                auto node = f.node;
+                auto level = f.level;
+                c.stack_.pop_back();
+                auto i = direct_index.find(std::make_tuple(node, string_view(c.levels_[level])));
+                if (i != direct_index.end()) visit(*i, level + 1, false);
+            }
+        }
+        return found;
+    }
+
     // Remove a stored value at the specified topic
     std::size_t erase(string_view topic) {
         auto result = erase_topic(topic);
@@ -343,9 +529,21 @@ public:
         return result;
     }
 
+    // Call the callback for all stored values
+    template<typename Output>
+    void for_each(Output&& callback) const {
+        for (auto const& entry : map) {
+            if (entry.value) callback(entry.value.value());
+        }
+    }
+
     // Get the number of entries stored in the map
     std::size_t size() const { return map_size; }
 
+    // Get the approximate bytes of the nodes and the stored values
+    // The value size is Value::memory_size() if it is provided, otherwise sizeof(Value).
+    std::size_t memory_size() const { return node_bytes + value_bytes; }
+
     // Get the number of entries in the map (for debugging purpose only)
     std::size_t internal_size() const { return map.size(); }
 
@@ -700,22 +700,7 @@ struct security {
         get_auth_sub_by_user(
             username,
             [&](authorization const& i) {
-                if (i.sub_type == authorization::type::allow) {
-                    auto entry = is_subscribe_allowed(i.topic_tokens, topic_filter);
-                    if (entry) {
-                        auth_topics.push_back(entry.value());
-                    }
-                }
-                else {
-                    for (auto j = auth_topics.begin(); j != auth_topics.end();) {
-                        if (is_subscribe_denied(i.topic_tokens, topic_filter)) {
-                            j = auth_topics.erase(j);
-                        }
-                        else {
-                            ++j;
-                        }
-                    }
-                }
+                apply_sub_authorization(i, topic_filter, auth_topics);
             }
         );
         return auth_topics;
@@ -731,6 +716,35 @@ struct security {
         return !get_auth_sub_topics(username, topic_filter).empty();
     }
 
+    /**
+     * @brief Determine if user is allowed to subscribe to each of the specified topic filters
+     *        The authorizations of the user are looked up once for all topic filters.
+     * @param username The username to check
+     * @param topic_filters Topic filters the user would like to subscribe to
+     * @return true for each authorized topic filter in the same order as topic_filters
+     */
+    std::vector<bool> is_subscribe_authorized(string_view username, std::vector<string_view> const& topic_filters) const {
+        std::vector<authorization const*> auths;
+        get_auth_sub_by_user(
+            username,
+            [&](authorization const& i) {
+                auths.push_back(&i);
+            }
+        );
+
+        std::vector<bool> result;
+        result.reserve(topic_filters.size());
+        std::vector<std::string> auth_topics;
+        for (auto const& topic_filter : topic_filters) {
+            auth_topics.clear();
+            for (auto const* i : auths) {
+                apply_sub_authorization(*i, topic_filter, auth_topics);
+            }
+            result.push_back(!auth_topics.empty());
+        }
+        return result;
+    }
+
     // Get the individual path elements of the topic filter
     static std::vector<std::string> get_topic_filter_tokens(string_view topic_filter) {
         std::vector<std::string> result;
@@ -758,6 +772,29 @@ struct security {
     auth_map_type auth_sub_map;
 
 private:
+    static void apply_sub_authorization(
+        authorization const& i,
+        string_view topic_filter,
+        std::vector<std::string>& auth_topics
+    ) {
+        if (i.sub_type == authorization::type::allow) {
+            auto entry = is_subscribe_allowed(i.topic_tokens, topic_filter);
+            if (entry) {
+                auth_topics.push_back(entry.value());
+            }
+        }
+        else {
+            for (auto j = auth_topics.begin(); j != auth_topics.end();) {
+                if (is_subscribe_denied(i.topic_tokens, topic_filter)) {
+                    j = auth_topics.erase(j);
+                }
+                else {
+                    ++j;
+                }
+            }
+        }
+    }
+
     void validate_entry(std::string const& context, std::string const& name) const {
         if (is_valid_group_name(name) && groups_.find(name) == groups_.end()) {
             throw std::runtime_error("An invalid group name was specified for " + context + ": " + name);
@@ -0,0 +1,426 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_SEGMENT_LOG_HPP)
+#define MQTT_BROKER_SEGMENT_LOG_HPP
+
+#include <mqtt/config.hpp>
+
+#include <cstdio>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+#else  // defined(_WIN32)
+#include <unistd.h>
+#endif // defined(_WIN32)
+
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/log.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/mutex.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+/**
+ * @brief Little endian encoder of the record payload.
+ */
+struct log_writer {
+    void put_u8(std::uint8_t v) {
+        buf.push_back(static_cast<char>(v));
+    }
+    void put_u16(std::uint16_t v) {
+        put_u8(static_cast<std::uint8_t>(v));
+        put_u8(static_cast<std::uint8_t>(v >> 8));
+    }
+    void put_u32(std::uint32_t v) {
+        put_u16(static_cast<std::uint16_t>(v));
+        put_u16(static_cast<std::uint16_t>(v >> 16));
+    }
+    void put_u64(std::uint64_t v) {
+        put_u32(static_cast<std::uint32_t>(v));
+        put_u32(static_cast<std::uint32_t>(v >> 32));
+    }
+    void put_str(string_view v) {
+        put_u32(static_cast<std::uint32_t>(v.size()));
+        buf.append(v.data(), v.size());
+    }
+    /// The deadline is stored as system_clock milliseconds so that it survives the restart.
+    void put_expiry(optional<std::chrono::steady_clock::time_point> const& v) {
+        if (!v) {
+            put_u64(0);
+            return;
+        }
+        auto deadline =
+            std::chrono::system_clock::now() +
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                v.value() - std::chrono::steady_clock::now()
+            );
+        put_u64(
+            static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline.time_since_epoch()
+                ).count()
+            )
+        );
+    }
+    void put_props(v5::properties const& props) {
+        std::size_t size = 0;
+        for (auto const& p : props) size += v5::size(p);
+        put_u32(static_cast<std::uint32_t>(size));
+        auto pos = buf.size();
+        buf.resize(pos + size);
+        auto it = std::next(buf.begin(), static_cast<std::string::difference_type>(pos));
+        for (auto const& p : props) {
+            v5::fill(p, it, buf.end());
+            std::advance(it, static_cast<std::string::difference_type>(v5::size(p)));
+        }
+    }
+
+    std::string& buf;
+};
+
+/**
+ * @brief Decoder of the record payload. ok becomes false if the payload is shorter than expected.
+ */
+struct log_reader {
+    std::uint8_t get_u8() {
+        if (!ok || p == e) {
+            ok = false;
+            return 0;
+        }
+        return static_cast<std::uint8_t>(*p++);
+    }
+    std::uint16_t get_u16() {
+        std::uint16_t v = get_u8();
+        return static_cast<std::uint16_t>(v | (get_u8() << 8));
+    }
+    std::uint32_t get_u32() {
+        std::uint32_t v = get_u16();
+        return v | (static_cast<std::uint32_t>(get_u16()) << 16);
+    }
+    std::uint64_t get_u64() {
+        std::uint64_t v = get_u32();
+        return v | (static_cast<std::uint64_t>(get_u32()) << 32);
+    }
+    string_view get_str() {
+        auto size = get_u32();
+        if (!ok || static_cast<std::size_t>(e - p) < size) {
+            ok = false;
+            return string_view();
+        }
+        string_view v(p, size);
+        p += size;
+        return v;
+    }
+    optional<std::chrono::system_clock::time_point> get_expiry() {
+        auto v = get_u64();
+        if (v == 0) return nullopt;
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::milliseconds(v)
+            )
+        );
+    }
+
+    char const* p;
+    char const* e;
+    bool ok = true;
+};
+
+/**
+ * @brief Append-only log that consists of numbered segment files.
+ *
+ * Records are appended to the in-memory buffer, and flush() writes them
+ * by one sequential write. A new segment is started when the current segment
+ * exceeds segment_size.
+ * Segments are written to path.<number> and the number of the first valid
+ * segment is written to path.head. compaction moves the head to the segment
+ * that starts with the snapshot, and removes the older segments.
+ * Record format: [length:4][crc32:4][type:1][payload:length]
+ */
+class segment_log {
+public:
+    segment_log(std::string path, std::size_t segment_size, bool sync)
+        :path_(force_move(path)),
+         segment_size_(segment_size),
+         sync_(sync)
+    {
+        if (path_.empty()) {
+            throw std::runtime_error("segment_log path is empty");
+        }
+    }
+
+    ~segment_log() {
+        std::lock_guard<mutex> g(mtx_);
+        flush_no_lock();
+        close_no_lock();
+    }
+
+    segment_log(segment_log const&) = delete;
+    segment_log& operator=(segment_log const&) = delete;
+
+    std::string const& path() const {
+        return path_;
+    }
+
+    /**
+     * @brief Map all segments from the head, and call the handler for each record.
+     *        Call this function before any record is appended.
+     *        The tail of a segment is written when the process stops, so a torn or corrupted
+     *        record stops reading the segment, and the segment is truncated at the last valid record.
+     *        The truncation keeps the segment valid after the later records are appended to the
+     *        next segments, because the segment is no longer the last one and it could be
+     *        replayed without the verification.
+     * @param h handler that is called as h(type, reader, region).
+     *          reader refers to the payload in the mapped segment, and region owns the mapping.
+     *          A buffer that is created with region refers to the mapping without copy.
+     *          The handler returns false if the payload is invalid.
+     * @param torn handler that is called when a torn or corrupted record is found.
+     * @param verify_sealed if false, the checksum is verified only for the last non empty segment.
+     *        The other segments were completely written before the next one was started,
+     *        or truncated by the previous replay.
+     *        Skipping the verification avoids touching the payload pages on the startup.
+     * @return the number of records
+     */
+    template <typename Handler, typename Torn>
+    std::size_t replay(Handler&& h, Torn&& torn, bool verify_sealed = true) {
+        std::lock_guard<mutex> g(mtx_);
+        BOOST_ASSERT(!fp_);
+        first_segment_ = read_head();
+        next_segment_ = first_segment_;
+        std::size_t records = 0;
+        for (;; ++next_segment_) {
+            auto name = segment_name(next_segment_);
+            auto size = file_size(name);
+            if (!size) break;
+            if (size.value() == 0) continue;
+            // The next segment could be created but not written when the process stopped.
+            auto next_size = file_size(segment_name(next_segment_ + 1));
+            bool verify = verify_sealed || !next_size || next_size.value() == 0;
+
+            namespace ipc = boost::interprocess;
+            ipc::file_mapping fm(name.c_str(), ipc::read_only);
+            auto region = std::make_shared<ipc::mapped_region>(fm, ipc::read_only);
+            auto top = static_cast<char const*>(region->get_address());
+            auto b = top;
+            auto e = b + region->get_size();
+            // The mapping is kept while any buffer refers to it.
+            const_shared_ptr_array life(b, [region](char const*) {});
+            while (b != e) {
+                auto next = replay_record(b, e, verify, h, life);
+                if (!next) {
+                    MQTT_LOG("mqtt_broker", warning)
+                        << "segment_log torn record ignored. segment:" << name
+                        << " remaining bytes:" << (e - b);
+                    std::forward<Torn>(torn)();
+                    if (!truncate_file(name, static_cast<std::size_t>(b - top))) {
+                        MQTT_LOG("mqtt_broker", error)
+                            << "segment_log cannot truncate the torn record. segment:" << name;
+                    }
+                    break;
+                }
+                b = next;
+                ++records;
+            }
+        }
+        return records;
+    }
+
+    template <typename Encoder>
+    void append(std::uint8_t type, Encoder&& enc) {
+        std::lock_guard<mutex> g(mtx_);
+        append_no_lock(type, std::forward<Encoder>(enc));
+    }
+
+    void flush() {
+        std::lock_guard<mutex> g(mtx_);
+        flush_no_lock();
+    }
+
+    /**
+     * @brief Start a new segment that the snapshot is written to.
+     *        The records that are appended until end_compaction() returns are written
+     *        after the new segment starts, so they are replayed together with the snapshot.
+     */
+    void begin_compaction() {
+        std::lock_guard<mutex> g(mtx_);
+        flush_no_lock();
+        close_no_lock();
+        open_no_lock();
+        snapshot_segment_ = next_segment_ - 1;
+    }
+
+    /**
+     * @brief Write the snapshot, move the head to the segment that the snapshot starts,
+     *        and remove the older segments.
+     */
+    void end_compaction() {
+        std::lock_guard<mutex> g(mtx_);
+        flush_no_lock();
+        write_head(snapshot_segment_);
+        for (auto i = first_segment_; i != snapshot_segment_; ++i) {
+            std::remove(segment_name(i).c_str());
+        }
+        first_segment_ = snapshot_segment_;
+    }
+
+private:
+    static constexpr std::size_t header_size = 9;
+
+    template <typename Handler>
+    static char const* replay_record(
+        char const* b,
+        char const* e,
+        bool verify,
+        Handler& h,
+        const_shared_ptr_array const& life) {
+        log_reader hr { b, e };
+        auto length = hr.get_u32();
+        auto checksum = hr.get_u32();
+        if (!hr.ok || static_cast<std::size_t>(e - hr.p) < std::size_t(length) + 1) return nullptr;
+        if (verify) {
+            boost::crc_32_type crc;
+            crc.process_bytes(hr.p, length + 1);
+            if (crc.checksum() != checksum) return nullptr;
+        }
+        log_reader r { hr.p, hr.p + length + 1 };
+        auto type = r.get_u8();
+        if (!h(type, r, life)) return nullptr;
+        return hr.p + length + 1;
+    }
+
+    template <typename Encoder>
+    void append_no_lock(std::uint8_t type, Encoder&& enc) {
+        auto start = buffer_.size();
+        buffer_.append(header_size - 1, '\0');
+        log_writer w { buffer_ };
+        w.put_u8(type);
+        std::forward<Encoder>(enc)(w);
+
+        auto length = static_cast<std::uint32_t>(buffer_.size() - start - header_size);
+        boost::crc_32_type crc;
+        crc.process_bytes(buffer_.data() + start + header_size - 1, length + 1);
+        std::string header;
+        log_writer hw { header };
+        hw.put_u32(length);
+        hw.put_u32(crc.checksum());
+        buffer_.replace(start, header.size(), header);
+    }
+
+    void flush_no_lock() {
+        if (buffer_.empty()) return;
+        if (!fp_) open_no_lock();
+        if (std::fwrite(buffer_.data(), 1, buffer_.size(), fp_) != buffer_.size() ||
+            std::fflush(fp_) != 0) {
+            MQTT_LOG("mqtt_broker", error)
+                << "segment_log write failed. segment:" << segment_name(next_segment_ - 1);
+        }
+        if (sync_) {
+#if defined(_WIN32)
+            _commit(_fileno(fp_));
+#else  // defined(_WIN32)
+            ::fsync(fileno(fp_));
+#endif // defined(_WIN32)
+        }
+        segment_bytes_ += buffer_.size();
+        buffer_.clear();
+        if (segment_bytes_ >= segment_size_) close_no_lock();
+    }
+
+    void open_no_lock() {
+        BOOST_ASSERT(!fp_);
+        auto name = segment_name(next_segment_++);
+        fp_ = std::fopen(name.c_str(), "wb");
+        if (!fp_) {
+            throw std::runtime_error("segment_log cannot open " + name);
+        }
+        segment_bytes_ = 0;
+    }
+
+    void close_no_lock() {
+        if (!fp_) return;
+        std::fclose(fp_);
+        fp_ = nullptr;
+    }
+
+    std::string segment_name(std::uint64_t n) const {
+        std::stringstream ss;
+        ss << path_ << '.' << std::setw(10) << std::setfill('0') << n;
+        return ss.str();
+    }
+
+    std::uint64_t read_head() const {
+        std::ifstream ifs(path_ + ".head");
+        std::uint64_t n = 0;
+        if (ifs) ifs >> n;
+        return n;
+    }
+
+    void write_head(std::uint64_t n) const {
+        auto name = path_ + ".head";
+        auto tmp = name + ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            ofs << n << std::endl;
+        }
+#if defined(_WIN32)
+        std::remove(name.c_str());
+#endif // defined(_WIN32)
+        std::rename(tmp.c_str(), name.c_str());
+    }
+
+    static bool truncate_file(std::string const& name, std::size_t size) {
+#if defined(_WIN32)
+        int fd;
+        if (_sopen_s(&fd, name.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0) return false;
+        bool ret = _chsize_s(fd, static_cast<__int64>(size)) == 0;
+        _close(fd);
+        return ret;
+#else  // defined(_WIN32)
+        return ::truncate(name.c_str(), static_cast<off_t>(size)) == 0;
+#endif // defined(_WIN32)
+    }
+
+    static optional<std::size_t> file_size(std::string const& name) {
+        std::ifstream ifs(name, std::ios::binary | std::ios::ate);
+        if (!ifs) return nullopt;
+        return static_cast<std::size_t>(ifs.tellg());
+    }
+
+private:
+    std::string path_;
+    std::size_t segment_size_;
+    bool sync_;
+    mutex mtx_;
+    std::string buffer_;
+    std::FILE* fp_ = nullptr;
+    std::size_t segment_bytes_ = 0;
+    std::uint64_t first_segment_ = 0;
+    std::uint64_t next_segment_ = 0;
+    std::uint64_t snapshot_segment_ = 0;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_SEGMENT_LOG_HPP
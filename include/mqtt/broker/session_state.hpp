@@ -10,6 +10,11 @@
 #include <mqtt/config.hpp>
 
 #include <chrono>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <utility>
+#include <vector>
 
 #include <boost/asio/io_context.hpp>
 #include <boost/multi_index_container.hpp>
@@ -25,6 +30,13 @@
 #include <mqtt/broker/tags.hpp>
 #include <mqtt/broker/inflight_message.hpp>
 #include <mqtt/broker/offline_message.hpp>
+#include <mqtt/broker/retained_messages.hpp>
+#include <mqtt/broker/backpressure.hpp>
+#include <mqtt/broker/slow_consumer.hpp>
+#include <mqtt/broker/delivery_mailbox.hpp>
+#include <mqtt/broker/session_wal.hpp>
+#include <mqtt/broker/memory_usage.hpp>
+#include <mqtt/broker/latency_histogram.hpp>
 #include <mqtt/broker/mutex.hpp>
 
 MQTT_BROKER_NS_BEGIN
@@ -73,7 +85,9 @@ struct session_state {
         optional<will> will,
         will_sender_t will_sender,
         optional<std::chrono::steady_clock::duration> will_expiry_interval,
-        optional<std::chrono::steady_clock::duration> session_expiry_interval)
+        optional<std::chrono::steady_clock::duration> session_expiry_interval,
+        session_wal* wal = nullptr,
+        std::shared_ptr<offline_spill> spill = nullptr)
         :timer_ioc_(timer_ioc),
          mtx_subs_map_(mtx_subs_map),
          subs_map_(subs_map),
@@ -97,15 +111,82 @@ struct session_state {
                         session_expiry_interval_.value() != std::chrono::steady_clock::duration::zero();
                 }
             } ()
-         )
+         ),
+         wal_(wal)
     {
+        offline_messages_.set_spill(force_move(spill));
         update_will(timer_ioc, will, will_expiry_interval);
+        if (wal_ && durable()) {
+            wal_->session_open(username_, client_id_, version_, session_expiry_interval_);
+        }
+        update_serialize_handlers();
+    }
+
+    /**
+     * @brief Construct the offline session that is recovered from the session_wal.
+     *        Call restore() after the session is inserted.
+     */
+    session_state(
+        as::io_context& timer_ioc,
+        mutex& mtx_subs_map,
+        sub_con_map& subs_map,
+        shared_target& shared_targets,
+        protocol_version version,
+        buffer client_id,
+        std::string const& username,
+        will_sender_t will_sender,
+        optional<std::chrono::steady_clock::duration> session_expiry_interval)
+        :timer_ioc_(timer_ioc),
+         mtx_subs_map_(mtx_subs_map),
+         subs_map_(subs_map),
+         shared_targets_(shared_targets),
+         version_(version),
+         client_id_(force_move(client_id)),
+         username_(username),
+         session_expiry_interval_(force_move(session_expiry_interval)),
+         tim_will_delay_(timer_ioc_),
+         will_sender_(force_move(will_sender)),
+         remain_after_close_(true)
+    {
+    }
+
+    /**
+     * @brief Get the generation of the session.
+     *        The generation is changed when the session is cleaned.
+     * @return generation
+     */
+    std::uint64_t generation() const {
+        return generation_;
+    }
+
+    /**
+     * @brief Get the delivery mailbox of the io_context that the connection runs on.
+     * @return mailbox. nullptr if it has not been set for the current connection.
+     */
+    delivery_mailbox* mailbox() const {
+        return mailbox_;
+    }
+
+    void set_mailbox(delivery_mailbox* mailbox) {
+        mailbox_ = mailbox;
+    }
+
+    /**
+     * @brief Get the handle that the deliveries in the mailbox refer to the session by.
+     * @return handle
+     */
+    std::shared_ptr<delivery_target> const& mailbox_target() const {
+        return mailbox_target_;
     }
 
     ~session_state() {
         MQTT_LOG("mqtt_broker", trace)
             << MQTT_ADD_VALUE(address, this)
             << "session destroy";
+        mailbox_target_->ss = nullptr;
+        if (wal_ && durable()) wal_->session_erase(username_, client_id_);
+        wal_ = nullptr;
+        update_serialize_handlers();
         send_will_impl();
         clean();
     }
@@ -114,6 +195,26 @@ struct session_state {
         return bool(con_);
     }
 
+    /**
+     * @brief Get the number of the messages that are waiting for the responses and the Receive Maximum.
+     *        It is used to choose the target of the shared subscription.
+     *        The offline session is treated as saturated.
+     * @return pair of the number of the messages and the Receive Maximum
+     */
+    std::pair<std::size_t, std::size_t> inflight_load() const {
+        if (!con_) return { 1, 1 };
+        return { con_->store_size(), con_->publish_send_max() };
+    }
+
+    /**
+     * @brief Get the bytes in the send queue of the connection.
+     * @return bytes. 0 if the session is offline.
+     */
+    std::size_t send_queue_bytes() const {
+        if (!con_) return 0;
+        return con_->send_queue_bytes();
+    }
+
     template <typename SessionExpireHandler>
     void become_offline(SessionExpireHandler&& h) {
         BOOST_ASSERT(con_);
@@ -122,43 +223,220 @@ struct session_state {
                 MQTT_LOG("mqtt_broker", trace)
                     << MQTT_ADD_VALUE(address, this)
                     << "store inflight message";
+                // The serialize handlers have already recorded the message.
+                store_inflight_message(force_move(msg), force_move(life_keeper), false);
+            }
+        );
+        qos2_publish_handled_ = con_->get_qos2_publish_handled_pids();
+        con_->set_serialize_handlers();
+        con_.reset();
+        mailbox_ = nullptr;
+        clear_retained_deliveries();
+        resume_publishers();
+        set_slow_consumer(false, false);
+        {
+            std::lock_guard<mutex> g(mtx_slow_consumer_);
+            inflight_saturated_since_ = nullopt;
+        }
+        start_session_expiry_timer(std::forward<SessionExpireHandler>(h));
+    }
 
-                std::shared_ptr<as::steady_timer> tim_message_expiry;
-
-                MQTT_NS::visit(
-                    make_lambda_visitor(
-                        [&](v5::basic_publish_message<sizeof(packet_id_t)> const& m) {
-                            auto v = get_property<v5::property::message_expiry_interval>(m.props());
-                            if (v) {
-                                tim_message_expiry =
-                                    std::make_shared<as::steady_timer>(timer_ioc_, std::chrono::seconds(v.value().val()));
-                                tim_message_expiry->async_wait(
-                                    [this, wp = std::weak_ptr<as::steady_timer>(tim_message_expiry)]
-                                    (error_code ec) {
-                                        if (auto sp = wp.lock()) {
-                                            if (!ec) {
-                                                erase_inflight_message_by_expiry(sp);
-                                            }
-                                        }
-                                    }
-                                );
-                            }
-                        },
-                        [&](auto const&) {}
-                    ),
-                    msg
+    /**
+     * @brief Restore the state that is recovered from the session_wal.
+     *        Messages whose expiry has already passed are discarded.
+     * @param ws recovered state
+     * @param h session expire handler. See become_offline().
+     */
+    template <typename SessionExpireHandler>
+    void restore(wal_session const& ws, SessionExpireHandler&& h) {
+        BOOST_ASSERT(!con_);
+        auto now = std::chrono::system_clock::now();
+        auto remaining =
+            [&](optional<std::chrono::system_clock::time_point> const& message_expiry)
+            -> optional<std::uint32_t> {
+                if (!message_expiry) return nullopt;
+                auto d = std::chrono::duration_cast<std::chrono::seconds>(message_expiry.value() - now).count();
+                if (d <= 0) return std::uint32_t(0);
+                return static_cast<std::uint32_t>(d);
+            };
+
+        {
+            // The subscriptions that have the same subscription identifier are applied at once.
+            std::map<optional<std::size_t>, std::vector<subscribe_entry>> entries;
+            for (auto const& e : ws.subscriptions) {
+                auto const& sub = e.second;
+                entries[sub.sid].emplace_back(sub.share_name, sub.topic_filter, sub.subopts);
+            }
+            for (auto& e : entries) {
+                subscribe(force_move(e.second), [](subscribe_entry const&) {}, e.first);
+            }
+        }
+        {
+            std::lock_guard<mutex> g(mtx_offline_messages_);
+            for (auto const& m : ws.offline_messages) {
+                auto props = m.props;
+                if (auto d = remaining(m.message_expiry)) {
+                    if (d.value() == 0) continue;
+                    set_property<v5::property::message_expiry_interval>(
+                        props,
+                        v5::property::message_expiry_interval(d.value())
+                    );
+                }
+                offline_messages_.push_back(timer_ioc_, m.topic, m.contents, m.pubopts, force_move(props));
+                offline_messages_.enforce_memory_budget();
+            }
+        }
+        for (auto const& e : ws.inflight_messages) {
+            auto d = remaining(e.second.message_expiry);
+            if (d && d.value() == 0) continue;
+            if (auto msg = restore_inflight_message(e.second.serialized, d)) {
+                // The restored message refers to the serialized buffer.
+                store_inflight_message(force_move(msg.value()), e.second.serialized);
+            }
+        }
+        start_session_expiry_timer(std::forward<SessionExpireHandler>(h));
+    }
+
+    /**
+     * @brief Append the records that reproduce the current state to the session_wal.
+     *        Only durable sessions are written. Each part of the state is written under
+     *        the lock that is held while it is changed and recorded, so this function can
+     *        be called while the other threads deliver messages to the session.
+     */
+    void write_snapshot(session_wal& wal) const {
+        if (!durable()) return;
+        wal.session_open(username_, client_id_, version_, session_expiry_interval_);
+        {
+            std::lock_guard<mutex> g{mtx_subs_map_};
+            for (auto const& h : handles_) {
+                if (auto sub = subs_map_.get(h, client_id_)) {
+                    wal.subscribe(username_, client_id_, sub->share_name, sub->topic_filter, sub->subopts, sub->sid);
+                }
+            }
+        }
+        {
+            std::lock_guard<mutex> g(mtx_offline_messages_);
+            offline_messages_.for_each(
+                [&](offline_message const& m) {
+                    wal.offline_push(
+                        username_, client_id_, m.seq(), m.message_expiry(),
+                        m.topic(), m.contents(), m.pubopts(), m.props()
+                    );
+                }
+            );
+        }
+        {
+            std::lock_guard<mutex> g(mtx_inflight_messages_);
+            for (auto const& m : inflight_messages_.get<tag_seq>()) {
+                wal.inflight_insert(
+                    username_, client_id_, m.packet_id(), m.message_expiry(),
+                    continuous_buffer(m.message())
                 );
+            }
+        }
+        if (con_) {
+            // The messages that the connection stores until they are acknowledged.
+            con_->for_each_store(
+                [&](store_message_variant msg) {
+                    wal.inflight_insert(
+                        username_,
+                        client_id_,
+                        MQTT_NS::visit(
+                            make_lambda_visitor(
+                                [](auto const& m) {
+                                    return m.packet_id();
+                                }
+                            ),
+                            msg
+                        ),
+                        nullopt,
+                        continuous_buffer(msg)
+                    );
+                }
+            );
+        }
+    }
+
+    /**
+     * @brief Set the session_wal that records the mutations of this session.
+     * @param wal session_wal. nullptr stops recording.
+     */
+    void set_wal(session_wal* wal) {
+        wal_ = wal;
+        update_serialize_handlers();
+    }
+
+    /**
+     * @brief Set the memory budget of the offline messages.
+     * @param spill offline_spill. nullptr disables the budget.
+     */
+    void set_offline_spill(std::shared_ptr<offline_spill> spill) {
+        std::lock_guard<mutex> g(mtx_offline_messages_);
+        offline_messages_.set_spill(force_move(spill));
+        offline_messages_.enforce_memory_budget();
+    }
 
-                insert_inflight_message(
-                    force_move(msg),
-                    force_move(life_keeper),
-                    force_move(tim_message_expiry)
+    /**
+     * @brief Add the memory that this session holds to mu.
+     *        The counters of the offline messages and the send queue are maintained
+     *        on each change. The subscriptions and the inflight messages are counted
+     *        by visiting them.
+     */
+    void add_memory_usage(memory_usage& mu) const {
+        mu.sessions.add(1, sizeof(session_state) + client_id_.size() + username_.size());
+        {
+            std::lock_guard<mutex> g{mtx_subs_map_};
+            for (auto const& h : handles_) {
+                if (auto sub = subs_map_.get(h, client_id_)) {
+                    mu.subscriptions.add(
+                        1,
+                        sizeof(subscription) + sub->share_name.size() + sub->topic_filter.size()
+                    );
+                }
+            }
+        }
+        {
+            std::lock_guard<mutex> g(mtx_offline_messages_);
+            mu.offline_messages.add(
+                offline_messages_.size() - offline_messages_.spilled_size(),
+                offline_messages_.memory_bytes()
+            );
+            mu.spilled_offline_messages.add(
+                offline_messages_.spilled_size(),
+                offline_messages_.spilled_bytes()
+            );
+        }
+        {
+            std::lock_guard<mutex> g(mtx_inflight_messages_);
+            for (auto const& m : inflight_messages_.get<tag_seq>()) {
+                mu.inflight_messages.add(
+                    1,
+                    sizeof(inflight_message) +
+                    MQTT_NS::visit([](auto const& msg) { return msg.size(); }, m.message())
                 );
             }
-        );
-        qos2_publish_handled_ = con_->get_qos2_publish_handled_pids();
-        con_.reset();
+        }
+        if (con_) {
+            mu.send_queue.add(con_->send_queue_messages(), con_->send_queue_bytes());
+        }
+    }
+
+    /**
+     * @brief Check the session remains after the connection is closed.
+     *        Only the mutations of durable sessions are recorded to the session_wal.
+     */
+    bool durable() const {
+        if (version_ == protocol_version::v3_1_1) {
+            // Offline sessions are always durable.
+            return !con_ || !con_->clean_session();
+        }
+        return
+            session_expiry_interval_ &&
+            session_expiry_interval_.value() != std::chrono::steady_clock::duration::zero();
+    }
 
+    template <typename SessionExpireHandler>
+    void start_session_expiry_timer(SessionExpireHandler&& h) {
         if (session_expiry_interval_ &&
             session_expiry_interval_.value() != std::chrono::seconds(session_never_expire)) {
 
@@ -189,22 +467,63 @@ struct session_state {
             << MQTT_ADD_VALUE(address, this)
             << "renew_session expiry";
         session_expiry_interval_ = force_move(v);
-        std::lock_guard<mutex> g(mtx_tim_session_expiry_);
-        tim_session_expiry_.reset();
+        {
+            std::lock_guard<mutex> g(mtx_tim_session_expiry_);
+            tim_session_expiry_.reset();
+        }
+        if (wal_) {
+            if (durable()) {
+                wal_->session_open(username_, client_id_, version_, session_expiry_interval_);
+            }
+            else {
+                wal_->session_erase(username_, client_id_);
+            }
+        }
+        update_serialize_handlers();
     }
 
-    void publish(
+    /**
+     * @brief Publish the message to the online session.
+     * @param probe - if not empty, the write latency is recorded when the message is written
+     *                to the connection. The message that is queued offline is not recorded.
+     * @return false if the QoS0 message is dropped, otherwise true
+     */
+    bool publish(
         as::io_context& timer_ioc,
         buffer pub_topic,
         buffer contents,
         publish_options pubopts,
-        v5::properties props) {
+        v5::properties props,
+        backpressure_policy const& bp = backpressure_policy(),
+        latency_probe const& probe = latency_probe(),
+        std::function<void()> written = std::function<void()>()) {
 
         BOOST_ASSERT(online());
 
+        auto qos_value = pubopts.get_qos();
+        if (qos_value == qos::at_most_once && slow_consumer_drop_qos0_) {
+            MQTT_LOG("mqtt_broker", trace)
+                << MQTT_ADD_VALUE(address, this)
+                << "slow consumer. QoS0 message dropped";
+            return false;
+        }
+        bool queue_offline = false;
+        if (con_->send_queue_congested()) {
+            if (qos_value == qos::at_most_once) {
+                if (bp.drop_qos0) {
+                    MQTT_LOG("mqtt_broker", trace)
+                        << MQTT_ADD_VALUE(address, this)
+                        << "send queue congested. QoS0 message dropped";
+                    return false;
+                }
+            }
+            else {
+                queue_offline = bp.queue_offline;
+            }
+        }
+
         std::lock_guard<mutex> g(mtx_offline_messages_);
-        if (offline_messages_.empty()) {
-            auto qos_value = pubopts.get_qos();
+        if (offline_messages_.empty() && !queue_offline) {
             if (qos_value == qos::at_least_once ||
                 qos_value == qos::exactly_once) {
                 if (auto pid = con_->acquire_unique_packet_id_no_except()) {
@@ -215,16 +534,21 @@ struct session_state {
                         pubopts,
                         force_move(props),
                         any{},
-                        [con = con_]
+                        [con = con_, probe, written]
                         (error_code ec) {
                             if (ec) {
                                 MQTT_LOG("mqtt_broker", warning)
                                     << MQTT_ADD_VALUE(address, con.get())
                                     << ec.message();
+                                return;
+                            }
+                            if (probe) {
+                                probe.record_since_received(latency_stage::write);
                             }
+                            if (written) written();
                         }
                     );
-                    return;
+                    return true;
                 }
             }
             else {
@@ -234,48 +558,65 @@ struct session_state {
                     pubopts,
                     force_move(props),
                     any{},
-                    [con = con_]
+                    [con = con_, probe, written]
                     (error_code ec) {
                         if (ec) {
                             MQTT_LOG("mqtt_broker", warning)
                                 << MQTT_ADD_VALUE(address, con.get())
                                 << ec.message();
+                            return;
                         }
+                        if (probe) {
+                            probe.record_since_received(latency_stage::write);
+                        }
+                        if (written) written();
                     }
                 );
-                return;
+                return true;
             }
         }
 
-        // offline_messages_ is not empty or packet_id_exhausted
-        offline_messages_.push_back(
+        // offline_messages_ is not empty, packet_id_exhausted, or send queue congested
+        push_offline_message(
             timer_ioc,
             force_move(pub_topic),
             force_move(contents),
             pubopts,
             force_move(props)
         );
+        return true;
     }
 
-    void deliver(
+    /**
+     * @brief Deliver the message to the session regardless of whether it is online.
+     * @return false if the QoS0 message is dropped, otherwise true
+     */
+    bool deliver(
         as::io_context& timer_ioc,
         buffer pub_topic,
         buffer contents,
         publish_options pubopts,
-        v5::properties props) {
+        v5::properties props,
+        backpressure_policy const& bp = backpressure_policy(),
+        latency_probe const& probe = latency_probe()) {
+
+        // The session has ended. It is waiting for discard().
+        if (retired_) return true;
 
         if (online()) {
-            publish(
+            return publish(
                 timer_ioc,
                 force_move(pub_topic),
                 force_move(contents),
                 pubopts,
-                force_move(props)
+                force_move(props),
+                bp,
+                probe
             );
         }
         else {
             std::lock_guard<mutex> g(mtx_offline_messages_);
-            offline_messages_.push_back(
+            push_offline_message(
                 timer_ioc,
                 force_move(pub_topic),
                 force_move(contents),
@@ -283,16 +624,61 @@ struct session_state {
                 force_move(props)
             );
         }
+        return true;
     }
 
     void set_clean_handler(std::function<void()> handler) {
         clean_handler_ = force_move(handler);
     }
 
+    /**
+     * @brief Mark the session as retired. It is called when the session is detached from
+     *        the broker, so the new session that has the same client_id could be created
+     *        before discard() is called.
+     *        The shared subscriptions are removed here because they are chosen by the member
+     *        session, and the messages that are delivered to the retired session are discarded.
+     */
+    void retire() {
+        MQTT_LOG("mqtt_broker", trace)
+            << MQTT_ADD_VALUE(address, this)
+            << "retire";
+        retired_ = true;
+        generation_ = next_generation();
+        mailbox_target_->ss = nullptr;
+        if (wal_ && durable()) wal_->session_erase(username_, client_id_);
+        wal_ = nullptr;
+        update_serialize_handlers();
+        std::lock_guard<mutex> g{mtx_subs_map_};
+        shared_targets_.erase(*this);
+    }
+
+    /**
+     * @brief Remove the subscriptions and the stored messages of the retired session.
+     *        It doesn't require the lock of the sessions. The will is sent by the destructor.
+     */
+    void discard() {
+        BOOST_ASSERT(retired_);
+        MQTT_LOG("mqtt_broker", trace)
+            << MQTT_ADD_VALUE(address, this)
+            << "discard";
+        unsubscribe_all();
+        {
+            std::lock_guard<mutex> g(mtx_inflight_messages_);
+            inflight_messages_.clear();
+        }
+        {
+            std::lock_guard<mutex> g(mtx_offline_messages_);
+            offline_messages_.clear();
+        }
+        clear_retained_deliveries();
+    }
+
     void clean() {
         MQTT_LOG("mqtt_broker", trace)
             << MQTT_ADD_VALUE(address, this)
             << "clean";
+        generation_ = next_generation();
+        if (wal_ && durable()) wal_->session_clear(username_, client_id_);
         if (clean_handler_) clean_handler_();
         {
             std::lock_guard<mutex> g(mtx_inflight_messages_);
@@ -302,72 +688,106 @@ struct session_state {
             std::lock_guard<mutex> g(mtx_offline_messages_);
             offline_messages_.clear();
         }
-        shared_targets_.erase(*this);
+        clear_retained_deliveries();
+        {
+            std::lock_guard<mutex> g{mtx_subs_map_};
+            shared_targets_.erase(*this);
+        }
         unsubscribe_all();
     }
 
+    /**
+     * @brief Apply the subscribe entries of one SUBSCRIBE packet.
+     *        All entries are inserted with one lock of the subscription map.
+     * @param entries subscribe entries
+     * @param h handler that is called with the entry whose retained messages should be sent.
+     *          It is called after the subscription map is unlocked.
+     * @param sid subscription identifier
+     */
     template <typename PublishRetainHandler>
     void subscribe(
-        buffer share_name,
-        buffer topic_filter,
-        subscribe_options subopts,
+        std::vector<subscribe_entry> entries,
         PublishRetainHandler&& h,
         optional<std::size_t> sid = nullopt
     ) {
-        if (!share_name.empty()) {
-            shared_targets_.insert(share_name, topic_filter, *this);
+        for (auto const& e : entries) {
+            MQTT_LOG("mqtt_broker", trace)
+                << MQTT_ADD_VALUE(address, this)
+                << "subscribe"
+                << " share_name:" << e.share_name
+                << " topic_filter:" << e.topic_filter
+                << " qos:" << e.subopts.get_qos();
         }
-        MQTT_LOG("mqtt_broker", trace)
-            << MQTT_ADD_VALUE(address, this)
-            << "subscribe"
-            << " share_name:" << share_name
-            << " topic_filter:" << topic_filter
-            << " qos:" << subopts.get_qos();
 
-        subscription sub {*this, force_move(share_name), topic_filter, subopts, sid };
-        auto handle_ret =
-            [&] {
-                std::lock_guard<mutex> g{mtx_subs_map_};
-                return subs_map_.insert_or_assign(
-                    force_move(topic_filter),
+        std::vector<bool> inserted;
+        inserted.reserve(entries.size());
+        {
+            std::lock_guard<mutex> g{mtx_subs_map_};
+            // The records are appended under the lock that write_snapshot() takes,
+            // so the compaction doesn't lose the subscription.
+            if (wal_ && durable()) {
+                for (auto const& e : entries) {
+                    wal_->subscribe(username_, client_id_, e.share_name, e.topic_filter, e.subopts, sid);
+                }
+            }
+            shared_targets_.insert(entries, *this);
+            for (auto const& e : entries) {
+                auto handle_ret = subs_map_.insert_or_assign(
+                    e.topic_filter,
                     client_id_,
-                    force_move(sub)
+                    subscription { *this, e.share_name, e.topic_filter, e.subopts, sid }
                 );
-            } ();
+                // The subscription of the retired session that has the same client_id
+                // is overwritten. It is treated as the new subscription of this session.
+                inserted.push_back(handles_.insert(handle_ret.first).second);
+            }
+        }
 
-        auto rh = subopts.get_retain_handling();
+        for (std::size_t i = 0; i != entries.size(); ++i) {
+            auto const& e = entries[i];
+            auto rh = e.subopts.get_retain_handling();
 
-        if (handle_ret.second) { // insert
-            MQTT_LOG("mqtt_broker", trace)
-                << MQTT_ADD_VALUE(address, this)
-                << "subscription inserted";
+            if (inserted[i]) {
+                MQTT_LOG("mqtt_broker", trace)
+                    << MQTT_ADD_VALUE(address, this)
+                    << "subscription inserted";
 
-            handles_.insert(handle_ret.first);
-            if (rh == retain_handling::send ||
-                rh == retain_handling::send_only_new_subscription) {
-                std::forward<PublishRetainHandler>(h)();
+                if (rh == retain_handling::send ||
+                    rh == retain_handling::send_only_new_subscription) {
+                    h(e);
+                }
             }
-        }
-        else { // update
-            MQTT_LOG("mqtt_broker", trace)
-                << MQTT_ADD_VALUE(address, this)
-                << "subscription updated";
+            else {
+                MQTT_LOG("mqtt_broker", trace)
+                    << MQTT_ADD_VALUE(address, this)
+                    << "subscription updated";
 
-            if (rh == retain_handling::send) {
-                std::forward<PublishRetainHandler>(h)();
+                if (rh == retain_handling::send) {
+                    h(e);
+                }
             }
         }
     }
 
-    void unsubscribe(buffer const& share_name, buffer const& topic_filter) {
-        if (!share_name.empty()) {
-            shared_targets_.erase(share_name, topic_filter, *this);
-        }
+    /**
+     * @brief Apply the unsubscribe entries of one UNSUBSCRIBE packet.
+     *        All entries are erased with one lock of the subscription map.
+     * @param entries unsubscribe entries
+     */
+    void unsubscribe(std::vector<unsubscribe_entry> const& entries) {
         std::lock_guard<mutex> g{mtx_subs_map_};
-        auto handle = subs_map_.lookup(topic_filter);
-        if (handle) {
-            handles_.erase(handle.value());
-            subs_map_.erase(handle.value(), client_id_);
+        if (wal_ && durable()) {
+            for (auto const& e : entries) {
+                wal_->unsubscribe(username_, client_id_, e.share_name, e.topic_filter);
+            }
+        }
+        shared_targets_.erase(entries, *this);
+        for (auto const& e : entries) {
+            auto handle = subs_map_.lookup(e.topic_filter);
+            if (handle) {
+                handles_.erase(handle.value());
+                subs_map_.erase(handle.value(), client_id_);
+            }
         }
     }
 
@@ -375,7 +795,9 @@ struct session_state {
         {
             std::lock_guard<mutex> g{mtx_subs_map_};
             for (auto const& h : handles_) {
-                subs_map_.erase(h, client_id_);
+                // The subscription could belong to the new session that has the same client_id.
+                auto sub = subs_map_.get(h, client_id_);
+                if (sub && &sub->ss.get() == this) subs_map_.erase(h, client_id_);
             }
         }
         handles_.clear();
@@ -473,19 +895,141 @@ struct session_state {
     void erase_inflight_message_by_packet_id(packet_id_t packet_id) {
         std::lock_guard<mutex> g(mtx_inflight_messages_);
         auto& idx = inflight_messages_.get<tag_pid>();
-        idx.erase(packet_id);
+        if (idx.erase(packet_id) != 0 && wal_ && durable()) {
+            wal_->inflight_erase(username_, client_id_, packet_id);
+        }
     }
 
     void send_all_offline_messages() {
         BOOST_ASSERT(con_);
         std::lock_guard<mutex> g(mtx_offline_messages_);
-        offline_messages_.send_until_fail(*con_);
+        send_offline_messages_until_fail();
     }
 
     void send_offline_messages_by_packet_id_release() {
         BOOST_ASSERT(con_);
         std::lock_guard<mutex> g(mtx_offline_messages_);
-        offline_messages_.send_until_fail(*con_);
+        send_offline_messages_until_fail();
+    }
+
+    /**
+     * @brief Get the queue state of the online session.
+     *        The inflight saturated duration is measured from the first call that observes the saturation.
+     * @param now current time
+     * @return queue state
+     */
+    session_queue_stats queue_stats(std::chrono::steady_clock::time_point now) {
+        BOOST_ASSERT(con_);
+        session_queue_stats stats;
+        stats.client_id = client_id_;
+        stats.send_queue_bytes = con_->send_queue_bytes();
+        stats.send_queue_age = con_->send_queue_age();
+        {
+            std::lock_guard<mutex> g(mtx_offline_messages_);
+            stats.offline_messages = offline_messages_.size();
+            stats.spilled_offline_messages = offline_messages_.spilled_size();
+        }
+        // While online, offline messages remain only if the packet identifiers are exhausted
+        // or the send queue is congested.
+        bool saturated = con_->publish_send_saturated() || stats.offline_messages != 0;
+
+        std::lock_guard<mutex> g(mtx_slow_consumer_);
+        if (saturated) {
+            if (!inflight_saturated_since_) inflight_saturated_since_.emplace(now);
+            stats.inflight_saturated = now - inflight_saturated_since_.value();
+        }
+        else {
+            inflight_saturated_since_ = nullopt;
+        }
+        stats.slow = slow_consumer_;
+        return stats;
+    }
+
+    /**
+     * @brief Set slow consumer state.
+     * @param slow true if the session is treated as a slow consumer
+     * @param drop_qos0 if true, QoS0 messages to the session are dropped while the session is slow
+     * @return true if the state is changed
+     */
+    bool set_slow_consumer(bool slow, bool drop_qos0) {
+        std::lock_guard<mutex> g(mtx_slow_consumer_);
+        slow_consumer_drop_qos0_ = slow && drop_qos0;
+        if (slow_consumer_ == slow) return false;
+        slow_consumer_ = slow;
+        return true;
+    }
+
+    /**
+     * @brief Keep the publisher paused until the send queue of this session is drained.
+     * @param guard the guard that is returned by read_pause_control::pause()
+     */
+    void add_paused_publisher(std::shared_ptr<void> guard) {
+        {
+            std::lock_guard<mutex> g(mtx_paused_publishers_);
+            paused_publishers_.push_back(force_move(guard));
+        }
+        // The send queue could be drained before the guard is added.
+        if (!con_ || !con_->send_queue_congested()) resume_publishers();
+    }
+
+    /**
+     * @brief Retained messages that are delivered to a new subscription incrementally.
+     */
+    struct retained_delivery {
+        retained_messages::cursor cursor;
+        qos qos_value;
+        optional<std::size_t> sid;
+    };
+
+    void push_retained_delivery(retained_delivery rd) {
+        std::lock_guard<mutex> g(mtx_retained_deliveries_);
+        retained_deliveries_.push_back(force_move(rd));
+    }
+
+    /**
+     * @brief Take the front retained delivery to continue it.
+     *        Only one caller can take it at a time until it is given back by return_retained_delivery().
+     * @return the retained delivery. nullopt if there is no delivery or it is already taken.
+     */
+    optional<retained_delivery> take_retained_delivery() {
+        std::lock_guard<mutex> g(mtx_retained_deliveries_);
+        if (retained_delivery_taken_ || retained_deliveries_.empty()) return nullopt;
+        retained_delivery_taken_ = true;
+        optional<retained_delivery> rd(force_move(retained_deliveries_.front()));
+        retained_deliveries_.pop_front();
+        return rd;
+    }
+
+    /**
+     * @brief Give back the retained delivery that is taken by take_retained_delivery().
+     * @param rd the retained delivery. If its cursor is done, it is discarded.
+     */
+    void return_retained_delivery(retained_delivery rd) {
+        std::lock_guard<mutex> g(mtx_retained_deliveries_);
+        // The deliveries are cleared while the delivery is taken. e.g.) the session became offline.
+        if (!retained_delivery_taken_) return;
+        retained_delivery_taken_ = false;
+        if (!rd.cursor.done()) retained_deliveries_.push_front(force_move(rd));
+    }
+
+    void clear_retained_deliveries() {
+        std::lock_guard<mutex> g(mtx_retained_deliveries_);
+        retained_deliveries_.clear();
+        retained_delivery_taken_ = false;
+    }
+
+    bool has_offline_messages() const {
+        std::lock_guard<mutex> g(mtx_offline_messages_);
+        return !offline_messages_.empty();
+    }
+
+    void resume_publishers() {
+        std::vector<std::shared_ptr<void>> paused_publishers;
+        {
+            std::lock_guard<mutex> g(mtx_paused_publishers_);
+            paused_publishers.swap(paused_publishers_);
+        }
+        // guards are released here without the lock
     }
 
     protocol_version get_protocol_version() const {
@@ -516,6 +1060,9 @@ struct session_state {
             con->restore_qos2_publish_handled_pids(qos2_publish_handled_);
         }
         con_ = force_move(con);
+        mailbox_ = nullptr;
+        update_serialize_handlers();
+        resume_publishers();
     }
 
     con_sp_t const& con() const {
@@ -535,6 +1082,184 @@ struct session_state {
     }
 
 private:
+    // mtx_offline_messages_ must be locked by the caller
+    void push_offline_message(
+        as::io_context& timer_ioc,
+        buffer pub_topic,
+        buffer contents,
+        publish_options pubopts,
+        v5::properties props) {
+        auto const& m = offline_messages_.push_back(
+            timer_ioc,
+            force_move(pub_topic),
+            force_move(contents),
+            pubopts,
+            force_move(props)
+        );
+        if (wal_ && durable()) {
+            wal_->offline_push(
+                username_, client_id_, m.seq(), m.message_expiry(),
+                m.topic(), m.contents(), m.pubopts(), m.props()
+            );
+        }
+        offline_messages_.enforce_memory_budget();
+    }
+
+    // mtx_offline_messages_ must be locked by the caller
+    void send_offline_messages_until_fail() {
+        auto last_sent = offline_messages_.send_until_fail(*con_);
+        if (last_sent && wal_ && durable()) {
+            wal_->offline_erase_upto(username_, client_id_, last_sent.value());
+        }
+    }
+
+    void store_inflight_message(store_message_variant msg, any life_keeper, bool record = true) {
+        std::shared_ptr<as::steady_timer> tim_message_expiry;
+
+        MQTT_NS::visit(
+            make_lambda_visitor(
+                [&](v5::basic_publish_message<sizeof(packet_id_t)> const& m) {
+                    auto v = get_property<v5::property::message_expiry_interval>(m.props());
+                    if (v) {
+                        tim_message_expiry =
+                            std::make_shared<as::steady_timer>(timer_ioc_, std::chrono::seconds(v.value().val()));
+                        tim_message_expiry->async_wait(
+                            [this, wp = std::weak_ptr<as::steady_timer>(tim_message_expiry)]
+                            (error_code ec) {
+                                if (auto sp = wp.lock()) {
+                                    if (!ec) {
+                                        erase_inflight_message_by_expiry(sp);
+                                    }
+                                }
+                            }
+                        );
+                    }
+                },
+                [&](auto const&) {}
+            ),
+            msg
+        );
+
+        if (record && wal_ && durable()) {
+            optional<std::chrono::steady_clock::time_point> message_expiry;
+            if (tim_message_expiry) message_expiry.emplace(tim_message_expiry->expiry());
+            record_inflight_message(msg, message_expiry);
+        }
+
+        insert_inflight_message(
+            force_move(msg),
+            force_move(life_keeper),
+            force_move(tim_message_expiry)
+        );
+    }
+
+    void record_inflight_message(
+        store_message_variant const& msg,
+        optional<std::chrono::steady_clock::time_point> message_expiry) {
+        wal_->inflight_insert(
+            username_,
+            client_id_,
+            MQTT_NS::visit(
+                make_lambda_visitor(
+                    [](auto const& m) {
+                        return m.packet_id();
+                    }
+                ),
+                msg
+            ),
+            message_expiry,
+            continuous_buffer(msg)
+        );
+    }
+
+    /**
+     * @brief Record the messages that the connection stores until they are acknowledged.
+     *        The endpoint calls the serialize handlers when it stores a QoS1/2 PUBLISH or PUBREL
+     *        before sending it, and when the acknowledgement removes it. So the message that is
+     *        sent to the online session is recovered even if the broker stops before the
+     *        acknowledgement. The handlers are set only while the session is online and durable.
+     */
+    void update_serialize_handlers() {
+        if (!con_) return;
+        if (!wal_ || !durable()) {
+            con_->set_serialize_handlers();
+            return;
+        }
+        auto h_remove =
+            [this](packet_id_t packet_id) {
+                if (wal_) wal_->inflight_erase(username_, client_id_, packet_id);
+            };
+        con_->set_serialize_handlers(
+            endpoint_t::serialize_publish_message_handler(
+                [this](basic_publish_message<sizeof(packet_id_t)> msg) {
+                    if (wal_) record_inflight_message(force_move(msg), nullopt);
+                }
+            ),
+            endpoint_t::serialize_pubrel_message_handler(
+                [this](basic_pubrel_message<sizeof(packet_id_t)> msg) {
+                    if (wal_) record_inflight_message(force_move(msg), nullopt);
+                }
+            ),
+            h_remove
+        );
+        con_->set_v5_serialize_handlers(
+            endpoint_t::serialize_v5_publish_message_handler(
+                [this](v5::basic_publish_message<sizeof(packet_id_t)> msg) {
+                    if (!wal_) return;
+                    optional<std::chrono::steady_clock::time_point> message_expiry;
+                    if (auto v = get_property<v5::property::message_expiry_interval>(msg.props())) {
+                        message_expiry.emplace(
+                            std::chrono::steady_clock::now() + std::chrono::seconds(v.value().val())
+                        );
+                    }
+                    record_inflight_message(force_move(msg), message_expiry);
+                }
+            ),
+            endpoint_t::serialize_v5_pubrel_message_handler(
+                [this](v5::basic_pubrel_message<sizeof(packet_id_t)> msg) {
+                    if (wal_) record_inflight_message(force_move(msg), nullopt);
+                }
+            ),
+            h_remove
+        );
+    }
+
+    optional<store_message_variant> restore_inflight_message(
+        buffer const& serialized,
+        optional<std::uint32_t> message_expiry_interval) const {
+        if (serialized.empty()) return nullopt;
+        try {
+            auto cpt = get_control_packet_type(static_cast<std::uint8_t>(serialized.front()));
+            if (version_ == protocol_version::v3_1_1) {
+                if (cpt == control_packet_type::publish) {
+                    return store_message_variant(v3_1_1::basic_publish_message<sizeof(packet_id_t)>(serialized));
+                }
+                if (cpt == control_packet_type::pubrel) {
+                    return store_message_variant(v3_1_1::basic_pubrel_message<sizeof(packet_id_t)>(serialized));
+                }
+            }
+            else {
+                if (cpt == control_packet_type::publish) {
+                    v5::basic_publish_message<sizeof(packet_id_t)> m(serialized);
+                    if (message_expiry_interval) {
+                        m.update_prop(v5::property::message_expiry_interval(message_expiry_interval.value()));
+                    }
+                    return store_message_variant(force_move(m));
+                }
+                if (cpt == control_packet_type::pubrel) {
+                    return store_message_variant(v5::basic_pubrel_message<sizeof(packet_id_t)>(serialized));
+                }
+            }
+        }
+        catch (std::exception const& e) {
+            MQTT_LOG("mqtt_broker", warning)
+                << MQTT_ADD_VALUE(address, this)
+                << "invalid inflight message in session_wal ignored. cid:" << client_id_
+                << " " << e.what();
+        }
+        return nullopt;
+    }
+
     void send_will_impl() {
         if (!will_value_) return;
 
@@ -574,6 +1299,12 @@ private:
         }
     }
 
+private:
+    static std::uint64_t next_generation() {
+        static std::atomic<std::uint64_t> generation{0};
+        return ++generation;
+    }
+
 private:
     friend class session_states;
 
@@ -601,6 +1332,23 @@ private:
     mutable mutex mtx_offline_messages_;
     offline_messages offline_messages_;
 
+    mutex mtx_paused_publishers_;
+    std::vector<std::shared_ptr<void>> paused_publishers_;
+
+    mutex mtx_retained_deliveries_;
+    std::deque<retained_delivery> retained_deliveries_;
+    bool retained_delivery_taken_ = false;
+
+    std::atomic<std::uint64_t> generation_{next_generation()};
+    std::atomic<bool> retired_{false};
+    std::atomic<delivery_mailbox*> mailbox_{nullptr};
+    std::shared_ptr<delivery_target> mailbox_target_ = std::make_shared<delivery_target>(delivery_target{this});
+
+    mutex mtx_slow_consumer_;
+    optional<std::chrono::steady_clock::time_point> inflight_saturated_since_;
+    bool slow_consumer_ = false;
+    std::atomic<bool> slow_consumer_drop_qos0_{false};
+
     std::set<sub_con_map::handle> handles_; // to efficient remove
 
     as::steady_timer tim_will_delay_;
@@ -611,25 +1359,11 @@ private:
 
     optional<std::string> response_topic_;
     std::function<void()> clean_handler_;
+
+    session_wal* wal_ = nullptr;
 };
 
 class session_states {
-public:
-    template <typename Tag>
-    decltype(auto) get() {
-        return entries_.get<Tag>();
-    }
-
-    template <typename Tag>
-    decltype(auto) get() const {
-        return entries_.get<Tag>();
-    }
-
-    void clear() {
-        entries_.clear();
-    }
-
-private:
     // The mi_session_online container holds the relevant data about an active connection with the broker.
     // It can be queried either with the clientid, or with the shared pointer to the mqtt endpoint object
     using mi_session_state = mi::multi_index_container<
@@ -655,6 +1389,25 @@ private:
         >
     >;
 
+public:
+    /// The session that is extracted from the container. It keeps the address of the session.
+    using node_type = mi_session_state::node_type;
+
+    template <typename Tag>
+    decltype(auto) get() {
+        return entries_.get<Tag>();
+    }
+
+    template <typename Tag>
+    decltype(auto) get() const {
+        return entries_.get<Tag>();
+    }
+
+    void clear() {
+        entries_.clear();
+    }
+
+private:
     mi_session_state entries_;
 };
 
@@ -0,0 +1,465 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_SESSION_WAL_HPP)
+#define MQTT_BROKER_SESSION_WAL_HPP
+
+#include <mqtt/config.hpp>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/property_parse.hpp>
+#include <mqtt/protocol_version.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/subscribe_options.hpp>
+#include <mqtt/log.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+#include <mqtt/broker/common_type.hpp>
+#include <mqtt/broker/segment_log.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+struct session_wal_config {
+    /// Base path of the files. Segments are written to path.<number> and
+    /// the number of the first valid segment is written to path.head.
+    std::string path;
+
+    /// A new segment is started when the current segment exceeds this size.
+    std::size_t segment_size = 64 * 1024 * 1024;
+
+    /// Appended records are written to the file at least this interval.
+    std::chrono::steady_clock::duration flush_interval = std::chrono::milliseconds(100);
+
+    /// Interval of writing the snapshot of all sessions and removing the older segments.
+    std::chrono::steady_clock::duration compaction_interval = std::chrono::minutes(10);
+
+    /// If true, the file is synchronized to the storage device on each write.
+    bool sync = false;
+};
+
+enum class wal_record_type : std::uint8_t {
+    session_open       = 1,
+    session_erase      = 2,
+    session_clear      = 3,
+    subscribe          = 4,
+    unsubscribe        = 5,
+    offline_push       = 6,
+    offline_erase_upto = 7,
+    inflight_insert    = 8,
+    inflight_erase     = 9,
+    snapshot_begin     = 10,
+    snapshot_end       = 11,
+};
+
+/**
+ * @brief Recovered state of one session.
+ *        message_expiry is the absolute deadline in system_clock.
+ *        Messages whose deadline has already passed are not recovered.
+ */
+struct wal_session {
+    struct subscription {
+        buffer share_name;
+        buffer topic_filter;
+        subscribe_options subopts;
+        optional<std::size_t> sid;
+    };
+    struct offline_message {
+        std::uint64_t seq;
+        optional<std::chrono::system_clock::time_point> message_expiry;
+        buffer topic;
+        buffer contents;
+        publish_options pubopts;
+        v5::properties props;
+    };
+    struct inflight_message {
+        optional<std::chrono::system_clock::time_point> message_expiry;
+        buffer serialized;
+    };
+
+    protocol_version version = protocol_version::undetermined;
+    optional<std::chrono::steady_clock::duration> session_expiry_interval;
+    std::map<std::pair<std::string, std::string>, subscription> subscriptions;
+    std::deque<offline_message> offline_messages;
+    std::map<packet_id_t, inflight_message> inflight_messages;
+};
+
+//                         username     client_id
+using wal_session_key = std::pair<std::string, std::string>;
+using wal_sessions = std::map<wal_session_key, wal_session>;
+
+/**
+ * @brief Append-only write-ahead log of the durable session state.
+ *
+ * Each mutation is encoded as a record and appended to the segment_log.
+ * flush() writes all buffered records by one sequential write, so a message
+ * that is queued to many offline sessions costs one write.
+ * A torn record at the end of the last segment is ignored on recovery.
+ */
+class session_wal {
+public:
+    explicit session_wal(session_wal_config config)
+        :config_(force_move(config)),
+         log_(config_.path, config_.segment_size, config_.sync)
+    {
+    }
+
+    session_wal(session_wal const&) = delete;
+    session_wal& operator=(session_wal const&) = delete;
+
+    session_wal_config const& config() const {
+        return config_;
+    }
+
+    /**
+     * @brief Read all segments and replay the records.
+     *        Call this function before any record is appended.
+     * @return recovered sessions
+     */
+    wal_sessions recover() {
+        wal_sessions sessions;
+        optional<wal_sessions> snapshot;
+        auto records = log_.replay(
+            [&](std::uint8_t type, log_reader& r, const_shared_ptr_array const&) {
+                return replay(static_cast<wal_record_type>(type), r, sessions, snapshot);
+            },
+            [&] {
+                // The incomplete snapshot is discarded.
+                snapshot = nullopt;
+            }
+        );
+        MQTT_LOG("mqtt_broker", info)
+            << "session_wal recovered records:" << records
+            << " sessions:" << sessions.size();
+        return sessions;
+    }
+
+    /**
+     * @brief Write the snapshot of all sessions to a new segment and remove the older segments.
+     *        Other threads can append records while the writer runs. The records between
+     *        snapshot_begin and snapshot_end are applied to the snapshot on recovery, so a record
+     *        that is appended before the snapshot of its session is replaced by the snapshot,
+     *        and a record that is appended after it is applied on top of the snapshot.
+     *        The writer must write each session under the locks that the session holds
+     *        while it changes the state and appends the record.
+     * @param writer function that appends the records of all sessions. It is called with *this.
+     */
+    template <typename Writer>
+    void compact(Writer&& writer) {
+        log_.begin_compaction();
+        append(wal_record_type::snapshot_begin, [](auto&) {});
+        std::forward<Writer>(writer)(*this);
+        append(wal_record_type::snapshot_end, [](auto&) {});
+        log_.end_compaction();
+    }
+
+    void flush() {
+        log_.flush();
+    }
+
+    void session_open(
+        std::string const& username,
+        buffer const& client_id,
+        protocol_version version,
+        optional<std::chrono::steady_clock::duration> const& session_expiry_interval) {
+        append(
+            wal_record_type::session_open,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_u8(static_cast<std::uint8_t>(version));
+                w.put_u8(session_expiry_interval ? 1 : 0);
+                w.put_u64(
+                    session_expiry_interval
+                    ? static_cast<std::uint64_t>(
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            session_expiry_interval.value()
+                        ).count()
+                    )
+                    : 0
+                );
+            }
+        );
+    }
+
+    void session_erase(std::string const& username, buffer const& client_id) {
+        append(
+            wal_record_type::session_erase,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+            }
+        );
+    }
+
+    void session_clear(std::string const& username, buffer const& client_id) {
+        append(
+            wal_record_type::session_clear,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+            }
+        );
+    }
+
+    void subscribe(
+        std::string const& username,
+        buffer const& client_id,
+        buffer const& share_name,
+        buffer const& topic_filter,
+        subscribe_options subopts,
+        optional<std::size_t> sid) {
+        append(
+            wal_record_type::subscribe,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_str(share_name);
+                w.put_str(topic_filter);
+                w.put_u8(static_cast<std::uint8_t>(subopts));
+                w.put_u8(sid ? 1 : 0);
+                w.put_u32(sid ? static_cast<std::uint32_t>(sid.value()) : 0);
+            }
+        );
+    }
+
+    void unsubscribe(
+        std::string const& username,
+        buffer const& client_id,
+        buffer const& share_name,
+        buffer const& topic_filter) {
+        append(
+            wal_record_type::unsubscribe,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_str(share_name);
+                w.put_str(topic_filter);
+            }
+        );
+    }
+
+    void offline_push(
+        std::string const& username,
+        buffer const& client_id,
+        std::uint64_t seq,
+        optional<std::chrono::steady_clock::time_point> message_expiry,
+        buffer const& topic,
+        buffer const& contents,
+        publish_options pubopts,
+        v5::properties const& props) {
+        append(
+            wal_record_type::offline_push,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_u64(seq);
+                w.put_expiry(message_expiry);
+                w.put_str(topic);
+                w.put_str(contents);
+                w.put_u8(static_cast<std::uint8_t>(pubopts));
+                w.put_props(props);
+            }
+        );
+    }
+
+    /**
+     * @brief The offline messages whose seq is less than or equal to seq are removed.
+     */
+    void offline_erase_upto(std::string const& username, buffer const& client_id, std::uint64_t seq) {
+        append(
+            wal_record_type::offline_erase_upto,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_u64(seq);
+            }
+        );
+    }
+
+    void inflight_insert(
+        std::string const& username,
+        buffer const& client_id,
+        packet_id_t packet_id,
+        optional<std::chrono::steady_clock::time_point> message_expiry,
+        std::string const& serialized) {
+        append(
+            wal_record_type::inflight_insert,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_u16(packet_id);
+                w.put_expiry(message_expiry);
+                w.put_str(serialized);
+            }
+        );
+    }
+
+    void inflight_erase(std::string const& username, buffer const& client_id, packet_id_t packet_id) {
+        append(
+            wal_record_type::inflight_erase,
+            [&](auto& w) {
+                put_key(w, username, client_id);
+                w.put_u16(packet_id);
+            }
+        );
+    }
+
+private:
+    template <typename Encoder>
+    void append(wal_record_type type, Encoder&& enc) {
+        log_.append(static_cast<std::uint8_t>(type), std::forward<Encoder>(enc));
+    }
+
+    static void put_key(log_writer& w, std::string const& username, buffer const& client_id) {
+        w.put_str(username);
+        w.put_str(client_id);
+    }
+
+    static wal_session_key get_key(log_reader& r) {
+        auto username = r.get_str();
+        auto client_id = r.get_str();
+        return wal_session_key(std::string(username), std::string(client_id));
+    }
+
+    /**
+     * @brief Replay one record.
+     * @return false if the payload is invalid.
+     */
+    static bool replay(
+        wal_record_type type,
+        log_reader& r,
+        wal_sessions& sessions,
+        optional<wal_sessions>& snapshot) {
+        if (type == wal_record_type::snapshot_begin) {
+            snapshot.emplace();
+            return true;
+        }
+        if (type == wal_record_type::snapshot_end) {
+            if (snapshot) {
+                sessions = force_move(snapshot.value());
+                snapshot = nullopt;
+            }
+            return true;
+        }
+
+        auto& target = snapshot ? snapshot.value() : sessions;
+        auto key = get_key(r);
+        if (type == wal_record_type::session_open) {
+            auto& s = target[key];
+            s.version = static_cast<protocol_version>(r.get_u8());
+            auto has_sei = r.get_u8();
+            auto sei = r.get_u64();
+            if (has_sei) {
+                s.session_expiry_interval.emplace(std::chrono::milliseconds(sei));
+            }
+            else {
+                s.session_expiry_interval = nullopt;
+            }
+            return r.ok;
+        }
+
+        auto it = target.find(key);
+        if (it == target.end()) return r.ok;
+        auto& s = it->second;
+
+        // The records that keep the fields copy the rest of the record once,
+        // and the fields refer to the copy.
+        auto field =
+            [&](buffer const& payload, string_view sv) {
+                return payload.substr(static_cast<std::size_t>(sv.data() - r.p), sv.size());
+            };
+
+        switch (type) {
+        case wal_record_type::session_erase:
+            target.erase(it);
+            break;
+        case wal_record_type::session_clear:
+            s.subscriptions.clear();
+            s.offline_messages.clear();
+            s.inflight_messages.clear();
+            break;
+        case wal_record_type::subscribe: {
+            auto payload = allocate_buffer(r.p, r.e);
+            log_reader pr { r.p, r.e };
+            auto share_name = field(payload, pr.get_str());
+            auto topic_filter = field(payload, pr.get_str());
+            subscribe_options subopts(pr.get_u8());
+            auto has_sid = pr.get_u8();
+            auto sid = pr.get_u32();
+            if (!pr.ok) return false;
+            auto sub_key = std::make_pair(std::string(share_name), std::string(topic_filter));
+            s.subscriptions.erase(sub_key);
+            s.subscriptions.emplace(
+                force_move(sub_key),
+                wal_session::subscription {
+                    force_move(share_name),
+                    force_move(topic_filter),
+                    subopts,
+                    has_sid ? optional<std::size_t>(sid) : nullopt
+                }
+            );
+        } break;
+        case wal_record_type::unsubscribe: {
+            auto share_name = r.get_str();
+            auto topic_filter = r.get_str();
+            s.subscriptions.erase(std::make_pair(std::string(share_name), std::string(topic_filter)));
+        } break;
+        case wal_record_type::offline_push: {
+            auto payload = allocate_buffer(r.p, r.e);
+            log_reader pr { r.p, r.e };
+            auto seq = pr.get_u64();
+            auto message_expiry = pr.get_expiry();
+            auto topic = field(payload, pr.get_str());
+            auto contents = field(payload, pr.get_str());
+            publish_options pubopts(pr.get_u8());
+            auto props = field(payload, pr.get_str());
+            if (!pr.ok) return false;
+            s.offline_messages.push_back(
+                wal_session::offline_message {
+                    seq,
+                    message_expiry,
+                    force_move(topic),
+                    force_move(contents),
+                    pubopts,
+                    v5::property::parse(force_move(props))
+                }
+            );
+        } break;
+        case wal_record_type::offline_erase_upto: {
+            auto seq = r.get_u64();
+            while (!s.offline_messages.empty() && s.offline_messages.front().seq <= seq) {
+                s.offline_messages.pop_front();
+            }
+        } break;
+        case wal_record_type::inflight_insert: {
+            auto payload = allocate_buffer(r.p, r.e);
+            log_reader pr { r.p, r.e };
+            auto packet_id = pr.get_u16();
+            auto message_expiry = pr.get_expiry();
+            auto serialized = field(payload, pr.get_str());
+            if (!pr.ok) return false;
+            s.inflight_messages[packet_id] =
+                wal_session::inflight_message {
+                    message_expiry,
+                    force_move(serialized)
+                };
+        } break;
+        case wal_record_type::inflight_erase:
+            s.inflight_messages.erase(r.get_u16());
+            break;
+        default:
+            return false;
+        }
+        return r.ok;
+    }
+
+private:
+    session_wal_config config_;
+    segment_log log_;
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_SESSION_WAL_HPP
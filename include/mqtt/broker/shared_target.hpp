@@ -9,8 +9,13 @@
 
 #include <mqtt/config.hpp>
 
+#include <atomic>
+#include <memory>
 #include <set>
+#include <unordered_map>
+#include <vector>
 
+#include <boost/functional/hash.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/composite_key.hpp>
@@ -19,32 +24,85 @@
 
 #include <mqtt/buffer.hpp>
 #include <mqtt/optional.hpp>
-#include <mqtt/time_point_t.hpp>
+#include <mqtt/string_view.hpp>
+#include <mqtt/subscribe_entry.hpp>
 
 #include <mqtt/broker/broker_namespace.hpp>
 #include <mqtt/broker/session_state_fwd.hpp>
 #include <mqtt/broker/tags.hpp>
-#include <mqtt/broker/mutex.hpp>
 
 MQTT_BROKER_NS_BEGIN
 
 namespace mi = boost::multi_index;
 
+/**
+ * @brief How a shared subscription chooses the member that receives a message.
+ */
+enum class shared_target_strategy {
+    /// The members receive the messages in turn.
+    round_robin,
+
+    /// The member that has the fewest messages waiting for the responses,
+    /// relative to its Receive Maximum. Ties are broken in turn.
+    /// The offline member is treated as saturated.
+    least_inflight,
+
+    /// The member is chosen by the hash of the topic name.
+    /// The messages of a topic go to the same member while the members don't change.
+    sticky_topic,
+};
+
+/**
+ * @brief The distribution policy of the shared subscriptions.
+ *        See broker_t::set_shared_subscription_policy().
+ */
+struct shared_target_policy {
+    shared_target_strategy strategy = shared_target_strategy::round_robin;
+
+    /// The members whose send queue exceeds this bytes are skipped.
+    /// If all members exceed it, the strategy chooses from all members.
+    /// 0 means no threshold.
+    std::size_t send_queue_threshold = 0;
+};
+
+/**
+ * @brief Members of the shared subscriptions.
+ *        Each share_name/topic_filter pair has a ring of the member sessions.
+ *        The rings are rebuilt only when a member joins or leaves, and get_target()
+ *        picks the member by the policy.
+ *        It has no lock. It is guarded by the lock of the subscription map.
+ *        insert() and erase() require the exclusive lock, and get_target() requires
+ *        the shared lock that do_publish() already holds while matching the subscriptions.
+ */
 class shared_target {
 public:
-    void insert(buffer share_name, buffer topic_filter, session_state& ss);
-    void erase(buffer share_name, buffer topic_filter, session_state const& ss);
+    /**
+     * @brief Join the rings of the shared subscription entries.
+     *        The entries that have no share_name are ignored.
+     *        The rings are rebuilt once for all entries.
+     */
+    void insert(std::vector<subscribe_entry> const& entries, session_state& ss);
+
+    /**
+     * @brief Leave the rings of the shared subscription entries.
+     *        The entries that have no share_name are ignored.
+     *        The rings are rebuilt once for all entries.
+     */
+    void erase(std::vector<unsubscribe_entry> const& entries, session_state const& ss);
     void erase(session_state const& ss);
-    optional<session_state_ref> get_target(buffer const& share_name, buffer const& topic_filter);
+    optional<session_state_ref> get_target(
+        buffer const& share_name,
+        buffer const& topic_filter,
+        string_view topic) const;
+    void set_policy(shared_target_policy policy);
 
 private:
     struct entry {
-        entry(buffer share_name, session_state& ss, time_point_t tp);
+        entry(buffer share_name, session_state& ss);
 
         buffer const& client_id() const;
         buffer share_name;
         session_state_ref ssr;
-        time_point_t tp;
         std::set<buffer> topic_filters;
     };
 
@@ -58,20 +116,33 @@ private:
                     BOOST_MULTI_INDEX_CONST_MEM_FUN(entry, buffer const&, client_id),
                     BOOST_MULTI_INDEX_MEMBER(entry, buffer, share_name)
                 >
-            >,
-            mi::ordered_non_unique<
-                mi::tag<tag_sn_tp>,
-                mi::composite_key<
-                    entry,
-                    BOOST_MULTI_INDEX_MEMBER(entry, buffer, share_name),
-                    BOOST_MULTI_INDEX_MEMBER(entry, time_point_t, tp)
-                >
             >
         >
     >;
 
-    mutable mutex mtx_targets_;
+    // Immutable except the cursor. Replaced by a new ring when the members are changed.
+    struct ring {
+        ring(buffer share_name, buffer topic_filter, std::vector<session_state_ref> members, std::size_t cursor);
+
+        buffer share_name;
+        buffer topic_filter;
+        std::vector<session_state_ref> members;
+        mutable std::atomic<std::size_t> cursor;
+    };
+
+    //                         share_name   topic_filter
+    using ring_key = std::pair<string_view, string_view>;
+    // The key refers to the share_name and topic_filter of the ring.
+    using rings_t = std::unordered_map<ring_key, std::unique_ptr<ring const>, boost::hash<ring_key>>;
+
+    void join(buffer const& share_name, buffer const& topic_filter, session_state& ss);
+    void leave(buffer const& share_name, buffer const& topic_filter, session_state const& ss);
+
     mi_shared_target targets_;
+    rings_t rings_;
+
+    std::atomic<shared_target_strategy> strategy_{shared_target_strategy::round_robin};
+    std::atomic<std::size_t> send_queue_threshold_{0};
 };
 
 MQTT_BROKER_NS_END
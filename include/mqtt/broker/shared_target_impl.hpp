@@ -12,94 +12,187 @@
 
 MQTT_BROKER_NS_BEGIN
 
-inline void shared_target::insert(buffer share_name, buffer topic_filter, session_state& ss) {
-    std::lock_guard<mutex> g{mtx_targets_};
+inline void shared_target::insert(std::vector<subscribe_entry> const& entries, session_state& ss) {
     auto& idx = targets_.get<tag_cid_sn>();
-    auto it = idx.lower_bound(std::make_tuple(ss.client_id(), share_name));
-    if (it == idx.end() || (it->share_name != share_name || it->client_id() != ss.client_id())) {
-        it = idx.emplace_hint(it, force_move(share_name), ss, std::chrono::steady_clock::now());
+    for (auto const& e : entries) {
+        if (e.share_name.empty()) continue;
+        auto it = idx.lower_bound(std::make_tuple(ss.client_id(), e.share_name));
+        if (it == idx.end() || (it->share_name != e.share_name || it->client_id() != ss.client_id())) {
+            it = idx.emplace_hint(it, e.share_name, ss);
+        }
 
         // const_cast is appropriate here
         // See https://github.com/boostorg/multi_index/issues/50
         auto& st = const_cast<entry&>(*it);
         bool inserted;
-        std::tie(std::ignore, inserted) = st.topic_filters.insert(force_move(topic_filter));
-        BOOST_ASSERT(inserted);
+        std::tie(std::ignore, inserted) = st.topic_filters.insert(e.topic_filter);
+        if (!inserted) continue; // ignore overwrite
+
+        join( e.share_name, e.topic_filter, ss);
     }
-    else {
+}
+
+inline void shared_target::erase(std::vector<unsubscribe_entry> const& entries, session_state const& ss) {
+    auto& idx = targets_.get<tag_cid_sn>();
+    for (auto const& e : entries) {
+        if (e.share_name.empty()) continue;
+        auto it = idx.find(std::make_tuple(ss.client_id(), e.share_name));
+        if (it == idx.end()) {
+            MQTT_LOG("mqtt_broker", warning)
+                << "attempt to erase non exist entry"
+                << " share_name:" << e.share_name
+                << " topic_filtere:" << e.topic_filter
+                << " client_id:" << ss.client_id();
+            continue;
+        }
+
         // entry exists
 
         // const_cast is appropriate here
         // See https://github.com/boostorg/multi_index/issues/50
         auto& st = const_cast<entry&>(*it);
-        st.topic_filters.insert(force_move(topic_filter)); // ignore overwrite
+        if (st.topic_filters.erase(e.topic_filter) == 0) continue;
+        if (it->topic_filters.empty()) {
+            idx.erase(it);
+        }
+
+        leave( e.share_name, e.topic_filter, ss);
     }
 }
 
-inline void shared_target::erase(buffer share_name, buffer topic_filter, session_state const& ss) {
-    std::lock_guard<mutex> g{mtx_targets_};
+inline void shared_target::erase(session_state const& ss) {
     auto& idx = targets_.get<tag_cid_sn>();
-    auto it = idx.find(std::make_tuple(ss.client_id(), share_name));
-    if (it == idx.end()) {
-        MQTT_LOG("mqtt_broker", warning)
-            << "attempt to erase non exist entry"
-            << " share_name:" << share_name
-            << " topic_filtere:" << topic_filter
-            << " client_id:" << ss.client_id();
-        return;
+    auto r = idx.equal_range(ss.client_id());
+    for (auto it = r.first; it != r.second;) {
+        // The entry could belong to the new session that has the same client_id
+        // if ss is the retired session.
+        if (&it->ssr.get() != &ss) {
+            ++it;
+            continue;
+        }
+        for (auto const& topic_filter : it->topic_filters) {
+            leave(it->share_name, topic_filter, ss);
+        }
+        it = idx.erase(it);
     }
+}
 
-    // entry exists
+inline optional<session_state_ref> shared_target::get_target(
+    buffer const& share_name,
+    buffer const& topic_filter,
+    string_view topic) const {
+    auto it = rings_.find(ring_key(share_name, topic_filter));
+    if (it == rings_.end()) return nullopt;
+    auto const& members = it->second->members;
+    auto& cursor = it->second->cursor;
+    auto size = members.size();
+    BOOST_ASSERT(size != 0);
+
+    auto strategy = strategy_.load(std::memory_order_relaxed);
+    auto threshold = send_queue_threshold_.load(std::memory_order_relaxed);
+    auto over_threshold =
+        [&](session_state const& ss) {
+            return threshold != 0 && ss.send_queue_bytes() > threshold;
+        };
+
+    if (strategy == shared_target_strategy::least_inflight) {
+        auto start = cursor.fetch_add(1, std::memory_order_relaxed);
+        std::size_t best = start % size;
+        bool best_over = over_threshold(members[best].get());
+        auto best_load = members[best].get().inflight_load();
+        for (std::size_t i = 1; i != size; ++i) {
+            auto pos = (start + i) % size;
+            auto const& ss = members[pos].get();
+            bool over = over_threshold(ss);
+            if (over && !best_over) continue;
+            auto load = ss.inflight_load();
+            // compare load.first / load.second < best_load.first / best_load.second
+            if ((!over && best_over) ||
+                load.first * best_load.second < best_load.first * load.second) {
+                best = pos;
+                best_over = over;
+                best_load = load;
+            }
+        }
+        return members[best];
+    }
 
-    // const_cast is appropriate here
-    // See https://github.com/boostorg/multi_index/issues/50
-    auto& st = const_cast<entry&>(*it);
-    st.topic_filters.erase(topic_filter);
-    if (it->topic_filters.empty()) {
-        idx.erase(it);
+    auto start =
+        strategy == shared_target_strategy::sticky_topic ? boost::hash<string_view>()(topic)
+                                                         : cursor.fetch_add(1, std::memory_order_relaxed);
+    if (threshold != 0) {
+        for (std::size_t i = 0; i != size; ++i) {
+            auto const& m = members[(start + i) % size];
+            if (!over_threshold(m.get())) return m;
+        }
     }
+    return members[start % size];
 }
 
-inline void shared_target::erase(session_state const& ss) {
-    std::lock_guard<mutex> g{mtx_targets_};
-    auto& idx = targets_.get<tag_cid_sn>();
-    auto r = idx.equal_range(ss.client_id());
-    idx.erase(r.first, r.second);
+inline void shared_target::set_policy(shared_target_policy policy) {
+    strategy_.store(policy.strategy, std::memory_order_relaxed);
+    send_queue_threshold_.store(policy.send_queue_threshold, std::memory_order_relaxed);
+}
+
+inline void shared_target::join(buffer const& share_name, buffer const& topic_filter, session_state& ss) {
+    std::vector<session_state_ref> members;
+    std::size_t cursor = 0;
+    auto it = rings_.find(ring_key(share_name, topic_filter));
+    if (it != rings_.end()) {
+        auto const& old = it->second->members;
+        members.reserve(old.size() + 1);
+        members.insert(members.end(), old.begin(), old.end());
+        // keep the next member. the new member is the last one.
+        cursor = it->second->cursor.load(std::memory_order_relaxed) % old.size();
+        rings_.erase(it);
+    }
+    members.emplace_back(ss);
+    auto r = std::make_unique<ring const>(share_name, topic_filter, force_move(members), cursor);
+    rings_.emplace(ring_key(r->share_name, r->topic_filter), force_move(r));
 }
 
-inline optional<session_state_ref> shared_target::get_target(buffer const& share_name, buffer const& topic_filter) {
-    std::lock_guard<mutex> g{mtx_targets_};
-    // get share_name matched range ordered by timestamp (ascending)
-    auto& idx = targets_.get<tag_sn_tp>();
-    auto r = idx.equal_range(share_name);
-    for (; r.first != r.second; ++r.first) {
-        auto const& elem = *r.first;
-        auto it = elem.topic_filters.find(topic_filter);
-
-        // no share_name/topic_filter matched
-        if (it == elem.topic_filters.end()) continue;
-
-        // matched
-        // update timestamp (timestamp is key)
-        idx.modify(r.first, [](auto& e) { e.tp = std::chrono::steady_clock::now(); });
-        return elem.ssr;
+inline void shared_target::leave(buffer const& share_name, buffer const& topic_filter, session_state const& ss) {
+    auto it = rings_.find(ring_key(share_name, topic_filter));
+    if (it == rings_.end()) return;
+    auto const& old = *it->second;
+    // keep the next member. if the next member leaves, the member after it is the next.
+    auto next = old.cursor.load(std::memory_order_relaxed) % old.members.size();
+    std::size_t cursor = 0;
+    std::vector<session_state_ref> members;
+    members.reserve(old.members.size());
+    for (std::size_t i = 0; i != old.members.size(); ++i) {
+        if (i == next) cursor = members.size();
+        if (&old.members[i].get() != &ss) members.push_back(old.members[i]);
     }
-    return nullopt;
+    auto r =
+        members.empty() ? nullptr
+                        : std::make_unique<ring const>(old.share_name, old.topic_filter, force_move(members), cursor);
+    rings_.erase(it);
+    if (r) rings_.emplace(ring_key(r->share_name, r->topic_filter), force_move(r));
 }
 
 inline shared_target::entry::entry(
     buffer share_name,
-    session_state& ss,
-    time_point_t tp)
+    session_state& ss)
     : share_name { force_move(share_name) },
-      ssr { ss },
-      tp { force_move(tp) }
+      ssr { ss }
 {}
 
 inline buffer const& shared_target::entry::client_id() const {
     return ssr.get().client_id();
 }
 
+inline shared_target::ring::ring(
+    buffer share_name,
+    buffer topic_filter,
+    std::vector<session_state_ref> members,
+    std::size_t cursor)
+    : share_name { force_move(share_name) },
+      topic_filter { force_move(topic_filter) },
+      members { force_move(members) },
+      cursor { cursor }
+{}
+
 MQTT_BROKER_NS_END
 
 #endif // MQTT_BROKER_SHARED_TARGET_IMPL_HPP
@@ -0,0 +1,97 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_SLOW_CONSUMER_HPP)
+#define MQTT_BROKER_SLOW_CONSUMER_HPP
+
+#include <mqtt/config.hpp>
+
+#include <chrono>
+#include <ostream>
+
+#include <mqtt/buffer.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+/**
+ * @brief The queue state of the online session.
+ */
+struct session_queue_stats {
+    buffer client_id;
+
+    /// bytes of the messages that are queued to the connection and haven't been written yet
+    std::size_t send_queue_bytes = 0;
+
+    /// waiting time of the oldest message in the send queue of the connection
+    std::chrono::steady_clock::duration send_queue_age = std::chrono::steady_clock::duration::zero();
+
+    /// number of the messages in the offline queue of the session
+    std::size_t offline_messages = 0;
+
+    /// number of the offline messages that are spilled to the files (included in offline_messages)
+    std::size_t spilled_offline_messages = 0;
+
+    /// how long the inflight window (Receive Maximum or packet identifiers) has been saturated
+    std::chrono::steady_clock::duration inflight_saturated = std::chrono::steady_clock::duration::zero();
+
+    /// true if the session is treated as a slow consumer
+    bool slow = false;
+};
+
+enum class slow_consumer_action {
+    warn,      ///< output the warning log
+    drop_qos0, ///< output the warning log and drop QoS0 messages to the session
+    disconnect ///< output the warning log and disconnect with Quota exceeded (0x97) on v5
+};
+
+constexpr char const* slow_consumer_action_to_str(slow_consumer_action v) {
+    switch(v) {
+    case slow_consumer_action::warn:       return "warn";
+    case slow_consumer_action::drop_qos0:  return "drop_qos0";
+    case slow_consumer_action::disconnect: return "disconnect";
+    default:                               return "unknown_slow_consumer_action";
+    }
+}
+
+inline
+std::ostream& operator<<(std::ostream& os, slow_consumer_action val)
+{
+    os << slow_consumer_action_to_str(val);
+    return os;
+}
+
+/**
+ * @brief The thresholds to treat the session as a slow consumer.
+ *        If any threshold is exceeded, the action is applied.
+ *        A threshold that is zero is not checked.
+ */
+struct slow_consumer_policy {
+    /// interval of checking all online sessions
+    std::chrono::steady_clock::duration check_interval = std::chrono::seconds(1);
+
+    std::size_t max_send_queue_bytes = 0;
+    std::chrono::steady_clock::duration max_send_queue_age = std::chrono::steady_clock::duration::zero();
+    std::size_t max_offline_messages = 0;
+    std::chrono::steady_clock::duration max_inflight_saturated = std::chrono::steady_clock::duration::zero();
+
+    slow_consumer_action action = slow_consumer_action::warn;
+
+    bool exceeded(session_queue_stats const& stats) const {
+        return
+            (max_send_queue_bytes != 0 && stats.send_queue_bytes > max_send_queue_bytes) ||
+            (max_send_queue_age != std::chrono::steady_clock::duration::zero() &&
+             stats.send_queue_age > max_send_queue_age) ||
+            (max_offline_messages != 0 && stats.offline_messages > max_offline_messages) ||
+            (max_inflight_saturated != std::chrono::steady_clock::duration::zero() &&
+             stats.inflight_saturated > max_inflight_saturated);
+    }
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_SLOW_CONSUMER_HPP
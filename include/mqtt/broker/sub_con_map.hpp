@@ -12,6 +12,7 @@
 #include <mqtt/broker/broker_namespace.hpp>
 #include <mqtt/broker/subscription_map.hpp>
 #include <mqtt/broker/subscription.hpp>
+#include <mqtt/broker/subscription_prefilter.hpp>
 
 MQTT_BROKER_NS_BEGIN
 
@@ -23,7 +24,47 @@ struct buffer_hasher  {
     }
 };
 
-using sub_con_map = multiple_subscription_map<buffer, subscription, buffer_hasher>;
+/**
+ * @brief Subscriptions of the broker. The key is the client id.
+ *        The inserted and erased topic filters are reflected to the prefilter.
+ */
+class sub_con_map : public multiple_subscription_map<buffer, subscription, buffer_hasher> {
+    using base = multiple_subscription_map<buffer, subscription, buffer_hasher>;
+
+public:
+    std::pair<handle, bool> insert_or_assign(string_view topic_filter, buffer const& key, subscription value) {
+        auto ret = base::insert_or_assign(topic_filter, key, force_move(value));
+        if (ret.second) prefilter_.insert(topic_filter);
+        return ret;
+    }
+
+    std::size_t erase(handle const& h, buffer const& key) {
+        auto p = get(h, key);
+        if (!p) return base::erase(h, key);
+        auto topic_filter = p->topic_filter;
+        auto ret = base::erase(h, key);
+        if (ret) prefilter_.erase(topic_filter);
+        return ret;
+    }
+
+    std::size_t erase(string_view topic_filter, buffer const& key) {
+        auto ret = base::erase(topic_filter, key);
+        if (ret) prefilter_.erase(topic_filter);
+        return ret;
+    }
+
+    /**
+     * @brief Check some subscriptions could match the topic. It doesn't require the lock.
+     * @param topic topic name
+     * @return false if no subscription matches the topic
+     */
+    bool may_match(string_view topic) const {
+        return prefilter_.may_match(topic);
+    }
+
+private:
+    subscription_prefilter prefilter_;
+};
 
 MQTT_BROKER_NS_END
 
@@ -701,6 +701,16 @@ public:
         return result;
     }
 
+    // Get the value of the key at the specified handle
+    // returns nullptr if the handle or the key is not found
+    Value const* get(handle const &h, Key const& key) const {
+        auto h_iter = this->get_map().find(h);
+        if (h_iter == this->get_map().end()) return nullptr;
+        auto it = h_iter->second.value.find(key);
+        if (it == h_iter->second.value.end()) return nullptr;
+        return &it->second;
+    }
+
     // Find all topic filters that match the specified topic
     template<typename Output>
     void find(string_view topic, Output&& callback) const {
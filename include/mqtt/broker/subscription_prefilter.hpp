@@ -0,0 +1,108 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_BROKER_SUBSCRIPTION_PREFILTER_HPP)
+#define MQTT_BROKER_SUBSCRIPTION_PREFILTER_HPP
+
+#include <mqtt/config.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <boost/functional/hash.hpp>
+
+#include <mqtt/string_view.hpp>
+
+#include <mqtt/broker/broker_namespace.hpp>
+
+MQTT_BROKER_NS_BEGIN
+
+/**
+ * @brief Counting bloom filter of the first levels of the topic filters.
+ *        may_match() returns false only if no topic filter can match the topic,
+ *        so the caller can skip matching the subscriptions.
+ *        It could return true even if no topic filter matches the topic.
+ *        insert() and erase() should be serialized by the caller. may_match() can be called
+ *        concurrently with them without locking.
+ */
+class subscription_prefilter {
+public:
+    /**
+     * @brief Add a topic filter
+     * @param topic_filter topic filter. It doesn't contain $share/share_name/.
+     */
+    void insert(string_view topic_filter) {
+        update(topic_filter, true);
+    }
+
+    /**
+     * @brief Remove a topic filter that is added by insert()
+     * @param topic_filter topic filter
+     */
+    void erase(string_view topic_filter) {
+        update(topic_filter, false);
+    }
+
+    /**
+     * @brief Check some topic filters could match the topic
+     * @param topic topic name
+     * @return false if no topic filter matches the topic
+     */
+    bool may_match(string_view topic) const {
+        // '+' and '#' at the first level don't match the topic that starts with '$'.
+        // See http://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901246
+        if ((topic.empty() || topic.front() != '$') &&
+            wildcards_.load(std::memory_order_acquire) != 0) return true;
+        auto idx = indexes(first_level(topic));
+        return
+            counters_[idx.first].load(std::memory_order_acquire) != 0 &&
+            counters_[idx.second].load(std::memory_order_acquire) != 0;
+    }
+
+private:
+    static constexpr std::size_t counters_bits = 14;
+    static constexpr std::size_t counters_size = std::size_t(1) << counters_bits;
+
+    static string_view first_level(string_view topic) {
+        return topic.substr(0, topic.find('/'));
+    }
+
+    static std::pair<std::size_t, std::size_t> indexes(string_view level) {
+        auto h = static_cast<std::uint64_t>(boost::hash<string_view>()(level));
+        // fibonacci hashing makes the second index independent of the low bits
+        auto h2 = h * 0x9e3779b97f4a7c15ULL;
+        return {
+            static_cast<std::size_t>(h & (counters_size - 1)),
+            static_cast<std::size_t>(h2 >> (64 - counters_bits))
+        };
+    }
+
+    void update(string_view topic_filter, bool inc) {
+        auto level = first_level(topic_filter);
+        if (level == "+" || level == "#") {
+            if (inc) wildcards_.fetch_add(1, std::memory_order_release);
+            else wildcards_.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        auto idx = indexes(level);
+        if (inc) {
+            counters_[idx.first].fetch_add(1, std::memory_order_release);
+            counters_[idx.second].fetch_add(1, std::memory_order_release);
+        }
+        else {
+            counters_[idx.first].fetch_sub(1, std::memory_order_release);
+            counters_[idx.second].fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    std::array<std::atomic<std::uint32_t>, counters_size> counters_{};
+    std::atomic<std::size_t> wildcards_{0};
+};
+
+MQTT_BROKER_NS_END
+
+#endif // MQTT_BROKER_SUBSCRIPTION_PREFILTER_HPP
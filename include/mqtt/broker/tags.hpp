@@ -22,7 +22,6 @@ struct tag_cid {};
 struct tag_cid_topic_filter {};
 struct tag_tim {};
 struct tag_pid {};
-struct tag_sn_tp {};
 struct tag_cid_sn {};
 
 MQTT_BROKER_NS_END
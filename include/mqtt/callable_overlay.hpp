@@ -752,6 +752,15 @@ struct callable_overlay final : public Impl
         }
     }
 
+    /**
+     * @brief send queue drained handler
+     *        This handler is called when the bytes in the async send queue fall to
+     *        the low watermark after exceeding the high watermark.
+     */
+    MQTT_ALWAYS_INLINE void on_send_queue_drained() noexcept override final {
+        if (h_send_queue_drained_) h_send_queue_drained_();
+    }
+
     /**
      * @brief Pingreq handler
      *        See http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Toc398718086<BR>
@@ -1384,6 +1393,14 @@ struct callable_overlay final : public Impl
     using mqtt_message_processed_handler =
         std::function<void(any session_life_keeper)>;
 
+    /**
+     * @brief send queue drained handler
+     *        This handler is called when the bytes in the async send queue fall to
+     *        the low watermark after exceeding the high watermark.
+     *        See endpoint::set_send_queue_watermark().
+     */
+    using send_queue_drained_handler = std::function<void()>;
+
 
 
     // MQTT Common handlers
@@ -2046,6 +2063,22 @@ struct callable_overlay final : public Impl
         return h_mqtt_message_processed_;
     }
 
+    /**
+     * @brief Set send queue drained handler
+     * @param h handler
+     */
+    void set_send_queue_drained_handler(send_queue_drained_handler h = send_queue_drained_handler()) {
+        h_send_queue_drained_ = force_move(h);
+    }
+
+    /**
+     * @brief Get send queue drained handler
+     * @return handler
+     */
+    send_queue_drained_handler const& get_send_queue_drained_handler() const {
+        return h_send_queue_drained_;
+    }
+
     /**
      * @brief Set close handler
      * @param h handler
@@ -2124,6 +2157,7 @@ private:
     pre_send_handler h_pre_send_;
     is_valid_length_handler h_is_valid_length_;
     mqtt_message_processed_handler h_mqtt_message_processed_;
+    send_queue_drained_handler h_send_queue_drained_;
 }; // callable_overlay
 
 } // namespace MQTT_NS
@@ -70,6 +70,7 @@
 #include <mqtt/subscribe_entry.hpp>
 #include <mqtt/shared_subscriptions.hpp>
 #include <mqtt/packet_id_manager.hpp>
+#include <mqtt/packet_decoder.hpp>
 #include <mqtt/store.hpp>
 
 #if defined(MQTT_USE_WS)
@@ -819,6 +820,14 @@ protected:
         }
     }
 
+    /**
+     * @brief send queue drained handler
+     *        This handler is called when the bytes in the async send queue fall to
+     *        the low watermark after exceeding the high watermark.
+     *        See set_send_queue_watermark().
+     */
+    virtual void on_send_queue_drained() noexcept {}
+
 public:
     endpoint(this_type const&) = delete;
     endpoint(this_type&&) = delete;
@@ -885,6 +894,90 @@ public:
         return total_bytes_sent_;
     }
 
+    /**
+     * @brief Set the watermarks of the async send queue.
+     *        When the bytes of the messages that are queued by async_* functions and
+     *        haven't been written to the socket exceed the high watermark,
+     *        send_queue_congested() returns true. When the bytes fall to the low watermark,
+     *        send_queue_congested() returns false and on_send_queue_drained() is called.
+     *        The endpoint itself doesn't discard any messages. The user decides what to do
+     *        while the queue is congested.
+     * @param high high watermark in bytes. 0 means no watermark. The default value is 0.
+     * @param low  low watermark in bytes. It should be less than high.
+     */
+    void set_send_queue_watermark(std::size_t high, std::size_t low) {
+        BOOST_ASSERT(high == 0 || low < high);
+        send_queue_high_watermark_ = high;
+        send_queue_low_watermark_ = low;
+    }
+
+    /**
+     * @brief Get the bytes of the messages in the async send queue.
+     * @return bytes
+     */
+    std::size_t send_queue_bytes() const {
+        return send_queue_bytes_;
+    }
+
+    /**
+     * @brief Get the number of the messages in the async send queue.
+     * @return number of the messages
+     */
+    std::size_t send_queue_messages() const {
+        return send_queue_messages_;
+    }
+
+    /**
+     * @brief Check the async send queue is congested.
+     * See set_send_queue_watermark().
+     * @return true if the queue exceeded the high watermark and hasn't fallen to the low watermark yet.
+     */
+    bool send_queue_congested() const {
+        return send_queue_congested_;
+    }
+
+    /**
+     * @brief Get the time that the oldest message in the async send queue has been waiting.
+     * @return duration. zero if the queue is empty.
+     */
+    std::chrono::steady_clock::duration send_queue_age() const {
+        auto front = send_queue_front_time_.load();
+        if (front == std::chrono::steady_clock::duration::zero()) {
+            return std::chrono::steady_clock::duration::zero();
+        }
+        return std::chrono::steady_clock::now().time_since_epoch() - front;
+    }
+
+    /**
+     * @brief Check the number of QoS1 and QoS2 PUBLISH packets that are waiting for the responses
+     *        reaches the Receive Maximum of the counterpart.
+     *        See https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901049<BR>
+     *        3.1.2.11.3 Receive Maximum
+     * @return true if no more QoS1 and QoS2 PUBLISH packets can be sent until the responses are received.
+     */
+    bool publish_send_saturated() const {
+        return publish_send_count_.load() >= publish_send_max_;
+    }
+
+    /**
+     * @brief Get the Receive Maximum of the counterpart.
+     *        It is the maximum value of receive_maximum_t on MQTT v3.1.1.
+     * @return Receive Maximum
+     */
+    receive_maximum_t publish_send_max() const {
+        return publish_send_max_;
+    }
+
+    /**
+     * @brief Get the number of the stored messages that are waiting for the responses.
+     *        They are QoS1 and QoS2 PUBLISH and PUBREL packets.
+     * @return number of the messages
+     */
+    std::size_t store_size() const {
+        LockGuard<Mutex> lck (store_mtx_);
+        return store_.size();
+    }
+
     /**
      * @brief Set auto publish response mode.
      * @param b set value
@@ -5550,14 +5643,8 @@ private:
         );
     }
 
-    bool calc_variable_length(std::size_t& v, std::size_t& multiplier, char buf) {
-        v += (buf & 0b01111111) * multiplier;
-        multiplier *= 128;
-        return multiplier <= 128 * 128 * 128 * 128;
-    }
-
     void handle_remaining_length(any session_life_keeper, this_type_sp self) {
-        if (!calc_variable_length(remaining_length_, remaining_length_multiplier_, buf_.front())) {
+        if (!packet_decoder::add_remaining_length_byte(remaining_length_, remaining_length_multiplier_, buf_.front())) {
             call_bad_message_error_handlers();
             return;
         }
@@ -5586,61 +5673,15 @@ private:
                 return;
             }
             auto cpt = cpt_opt.value();
-            auto check =
-                [&]() -> bool {
-                    switch (version_) {
-                    case protocol_version::v3_1_1:
-                        switch (cpt) {
-                        case control_packet_type::connect:
-                        case control_packet_type::publish:
-                        case control_packet_type::subscribe:
-                        case control_packet_type::suback:
-                        case control_packet_type::unsubscribe:
-                            return check_is_valid_length(cpt, remaining_length_);
-                        case control_packet_type::connack:
-                            return remaining_length_ == 2;
-                        case control_packet_type::puback:
-                        case control_packet_type::pubrec:
-                        case control_packet_type::pubrel:
-                        case control_packet_type::pubcomp:
-                        case control_packet_type::unsuback:
-                            return remaining_length_ == sizeof(packet_id_t);
-                        case control_packet_type::pingreq:
-                        case control_packet_type::pingresp:
-                        case control_packet_type::disconnect:
-                            return remaining_length_ == 0;
-                        // Even though there is no auth packet type in v3.1.1
-                        // it's included in the switch case to provide a warning
-                        // about missing enum values if any are missing.
-                        case control_packet_type::auth:
-                            return false;
-                        }
-                        return false;
-                    case protocol_version::v5:
-                    default:
-                        switch (cpt) {
-                        case control_packet_type::connect:
-                        case control_packet_type::publish:
-                        case control_packet_type::subscribe:
-                        case control_packet_type::suback:
-                        case control_packet_type::unsubscribe:
-                        case control_packet_type::connack:
-                        case control_packet_type::puback:
-                        case control_packet_type::pubrec:
-                        case control_packet_type::pubrel:
-                        case control_packet_type::pubcomp:
-                        case control_packet_type::unsuback:
-                        case control_packet_type::disconnect:
-                        case control_packet_type::auth:
-                            return check_is_valid_length(cpt, remaining_length_);
-                        case control_packet_type::pingreq:
-                        case control_packet_type::pingresp:
-                            return remaining_length_ == 0;
-                        }
-                        return false;
+            if (!packet_decoder::check_remaining_length<PacketIdBytes>(
+                    version_,
+                    cpt,
+                    remaining_length_,
+                    [&](std::size_t remaining_length) {
+                        return check_is_valid_length(cpt, remaining_length);
                     }
-                };
-            if (!check()) {
+                )
+            ) {
                 call_protocol_error_handlers();
                 return;
             }
@@ -5941,7 +5982,7 @@ private:
                 std::size_t size,
                 std::size_t multiplier
             ) mutable {
-                if (!calc_variable_length(size, multiplier, buf.front())) {
+                if (!packet_decoder::add_remaining_length_byte(size, multiplier, buf.front())) {
                     call_protocol_error_handlers();
                     return;
                 }
@@ -11405,9 +11446,13 @@ private:
     public:
         async_packet(
             basic_message_variant<PacketIdBytes> mv,
-            async_handler_t h = {})
+            async_handler_t h = {},
+            std::size_t size = 0,
+            std::chrono::steady_clock::duration enqueued = std::chrono::steady_clock::duration::zero())
             : mv_(force_move(mv))
-            , handler_(force_move(h)) {}
+            , handler_(force_move(h))
+            , size_(size)
+            , enqueued_(enqueued) {}
         basic_message_variant<PacketIdBytes> const& message() const {
             return mv_;
         }
@@ -11416,9 +11461,13 @@ private:
         }
         async_handler_t const& handler() const { return handler_; }
         async_handler_t& handler() { return handler_; }
+        std::size_t size() const { return size_; }
+        std::chrono::steady_clock::duration enqueued() const { return enqueued_; }
     private:
         basic_message_variant<PacketIdBytes> mv_;
         async_handler_t handler_;
+        std::size_t size_;
+        std::chrono::steady_clock::duration enqueued_;
     };
 
     struct write_completion_handler {
@@ -11441,14 +11490,14 @@ private:
         void operator()(error_code ec) const {
             func_(ec);
             for (std::size_t i = 0; i != num_of_messages_; ++i) {
-                self_->queue_.pop_front();
+                self_->queue_pop_front();
             }
             if (ec || // Error is handled by async_read.
                 !self_->connected_) {
                 while (!self_->queue_.empty()) {
                     // Handlers for outgoing packets need not be valid.
                     if (auto&& h = self_->queue_.front().handler()) h(ec);
-                    self_->queue_.pop_front();
+                    self_->queue_pop_front();
                 }
                 return;
             }
@@ -11462,14 +11511,14 @@ private:
             func_(ec);
             self_->total_bytes_sent_ += bytes_transferred;
             for (std::size_t i = 0; i != num_of_messages_; ++i) {
-                self_->queue_.pop_front();
+                self_->queue_pop_front();
             }
             if (ec || // Error is handled by async_read.
                 !self_->connected_) {
                 while (!self_->queue_.empty()) {
                     // Handlers for outgoing packets need not be valid.
                     if(auto&& h = self_->queue_.front().handler()) h(ec);
-                    self_->queue_.pop_front();
+                    self_->queue_pop_front();
                 }
                 return;
             }
@@ -11477,7 +11526,7 @@ private:
                 while (!self_->queue_.empty()) {
                     // Handlers for outgoing packets need not be valid.
                     if(auto&& h = self_->queue_.front().handler()) h(ec);
-                    self_->queue_.pop_front();
+                    self_->queue_pop_front();
                 }
                 throw write_bytes_transferred_error(bytes_to_transfer_, bytes_transferred);
             }
@@ -11551,17 +11600,24 @@ private:
     }
 
     void do_async_write(basic_message_variant<PacketIdBytes> mv, async_handler_t func) {
+        // The bytes are counted before posting so that the caller can check
+        // send_queue_congested() just after calling async_* functions.
+        auto size = MQTT_NS::size<PacketIdBytes>(mv);
+        add_send_queue_bytes(size);
+        auto enqueued = std::chrono::steady_clock::now().time_since_epoch();
         // Move this job to the socket's strand so that it can be queued without mutexes.
         socket_->post(
-            [this, self = this->shared_from_this(), mv = force_move(mv), func = force_move(func)]
+            [this, self = this->shared_from_this(), mv = force_move(mv), func = force_move(func), size, enqueued]
             () mutable {
                 if (can_send()) {
-                    queue_.emplace_back(force_move(mv), force_move(func));
+                    queue_.emplace_back(force_move(mv), force_move(func), size, enqueued);
                     // Only need to start async writes if there was nothing in the queue before the above item.
                     if (queue_.size() > 1) return;
+                    send_queue_front_time_ = enqueued;
                     do_async_write();
                 }
                 else {
+                    sub_send_queue_bytes(size);
                     // offline async publish is successfully finished, because there's nothing to do.
                     if (func) func(boost::system::errc::make_error_code(boost::system::errc::success));
                     return;
@@ -11570,6 +11626,48 @@ private:
         );
     }
 
+    void queue_pop_front() {
+        sub_send_queue_bytes(queue_.front().size());
+        queue_.pop_front();
+        send_queue_front_time_ =
+            queue_.empty() ? std::chrono::steady_clock::duration::zero()
+                           : queue_.front().enqueued();
+    }
+
+    void add_send_queue_bytes(std::size_t size) {
+        ++send_queue_messages_;
+        auto bytes = send_queue_bytes_.fetch_add(size) + size;
+        if (send_queue_high_watermark_ != 0 &&
+            bytes > send_queue_high_watermark_) {
+            send_queue_congested_ = true;
+            // The strand could drain the queue between fetch_add() and setting the flag.
+            // Then nobody clears the flag, so check the bytes again on the strand.
+            if (send_queue_bytes_ <= send_queue_low_watermark_) {
+                socket_->post(
+                    [this, self = this->shared_from_this()] {
+                        clear_send_queue_congested();
+                    }
+                );
+            }
+        }
+    }
+
+    void sub_send_queue_bytes(std::size_t size) {
+        --send_queue_messages_;
+        send_queue_bytes_.fetch_sub(size);
+        clear_send_queue_congested();
+    }
+
+    // Called on the strand.
+    void clear_send_queue_congested() {
+        if (send_queue_bytes_ <= send_queue_low_watermark_) {
+            bool expected = true;
+            if (send_queue_congested_.compare_exchange_strong(expected, false)) {
+                on_send_queue_drained();
+            }
+        }
+    }
+
     static constexpr std::uint16_t make_uint16_t(char b1, char b2) {
         return
             static_cast<std::uint16_t>(
@@ -11736,13 +11834,20 @@ private:
     std::size_t remaining_length_;
     std::vector<char> payload_;
 
-    Mutex store_mtx_;
+    mutable Mutex store_mtx_;
     store<PacketIdBytes> store_;
 
     mutable Mutex qos2_publish_handled_mtx_;
     std::set<packet_id_t> qos2_publish_handled_;
 
     std::deque<async_packet> queue_;
+    std::atomic<std::size_t> send_queue_bytes_{0};
+    std::atomic<std::size_t> send_queue_messages_{0};
+    std::atomic<bool> send_queue_congested_{false};
+    // time_since_epoch of the oldest message in queue_. zero means empty.
+    std::atomic<std::chrono::steady_clock::duration> send_queue_front_time_{std::chrono::steady_clock::duration::zero()};
+    std::size_t send_queue_high_watermark_{0};
+    std::size_t send_queue_low_watermark_{0};
 
     packet_id_manager<packet_id_t> pid_man_;
 
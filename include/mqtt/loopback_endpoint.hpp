@@ -0,0 +1,450 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_LOOPBACK_ENDPOINT_HPP)
+#define MQTT_LOOPBACK_ENDPOINT_HPP
+
+#include <array>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/type_erased_socket.hpp>
+#include <mqtt/strand.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/attributes.hpp>
+#include <mqtt/log.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+namespace detail {
+
+/**
+ * @brief Circular byte buffer. The capacity is a power of two.
+ */
+class byte_ring {
+public:
+    explicit byte_ring(std::size_t capacity)
+        :buf_(round_up(capacity)) {}
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    std::size_t space() const {
+        return buf_.size() - size_;
+    }
+
+    /**
+     * @brief Copy up to len bytes into the ring.
+     * @return copied bytes
+     */
+    std::size_t put(char const* p, std::size_t len) {
+        auto n = std::min(len, space());
+        auto tail = (head_ + size_) & (buf_.size() - 1);
+        auto first = std::min(n, buf_.size() - tail);
+        std::memcpy(&buf_[tail], p, first);
+        std::memcpy(&buf_[0], p + first, n - first);
+        size_ += n;
+        return n;
+    }
+
+    /**
+     * @brief Move up to len bytes out of the ring.
+     * @return moved bytes
+     */
+    std::size_t get(char* p, std::size_t len) {
+        auto n = std::min(len, size_);
+        auto first = std::min(n, buf_.size() - head_);
+        std::memcpy(p, &buf_[head_], first);
+        std::memcpy(p + first, &buf_[0], n - first);
+        head_ = (head_ + n) & (buf_.size() - 1);
+        size_ -= n;
+        return n;
+    }
+
+    /**
+     * @brief Grow the ring so that len bytes can be put.
+     */
+    void reserve(std::size_t len) {
+        if (space() >= len) return;
+        std::vector<char> buf(round_up(size_ + len));
+        auto size = size_;
+        get(buf.data(), size);
+        buf_ = force_move(buf);
+        head_ = 0;
+        size_ = size;
+    }
+
+    void clear() {
+        head_ = 0;
+        size_ = 0;
+    }
+
+private:
+    static std::size_t round_up(std::size_t v) {
+        std::size_t ret = 1;
+        while (ret < v) ret <<= 1;
+        return ret;
+    }
+
+private:
+    std::vector<char> buf_;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+};
+
+} // namespace detail
+
+/**
+ * @brief Shared state of the paired loopback_endpoint.
+ *
+ * Each direction has its own ring buffer. A write is copied into the ring of
+ * the direction, and a read is copied out of it. When the ring is full, the
+ * async_write waits for the peer to read like a TCP socket with the full window.
+ * The completion handlers are posted to the executor of the endpoint that
+ * initiated the operation, so the endpoints can run on different io_contexts.
+ */
+class loopback_pipe {
+public:
+    using handler_t = std::function<void(error_code, std::size_t)>;
+
+    explicit loopback_pipe(std::size_t ring_bytes)
+        :channels_ { { channel(ring_bytes), channel(ring_bytes) } } {}
+
+    void async_read(std::size_t side, as::mutable_buffer buf, handler_t handler, as::any_io_executor ex) {
+        completions_t cs;
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            auto& c = channels_[1 - side];
+            BOOST_ASSERT(!c.read_handler);
+            c.read_buf = buf;
+            c.read_transferred = 0;
+            c.read_handler = force_move(handler);
+            c.read_ex = force_move(ex);
+            pump(c, cs);
+        }
+        post_all(cs);
+    }
+
+    void async_write(std::size_t side, std::vector<as::const_buffer> bufs, handler_t handler, as::any_io_executor ex) {
+        completions_t cs;
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            auto& c = channels_[side];
+            BOOST_ASSERT(!c.write_handler);
+            c.write_bufs = force_move(bufs);
+            c.write_index = 0;
+            c.write_offset = 0;
+            c.write_transferred = 0;
+            c.write_handler = force_move(handler);
+            c.write_ex = force_move(ex);
+            pump(c, cs);
+        }
+        post_all(cs);
+    }
+
+    /**
+     * @brief Write all bytes without waiting. The ring grows if it is full.
+     */
+    std::size_t write(std::size_t side, std::vector<as::const_buffer> const& bufs, error_code& ec) {
+        completions_t cs;
+        std::size_t total = 0;
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            auto& c = channels_[side];
+            if (c.sender_closed) {
+                ec = as::error::bad_descriptor;
+                return 0;
+            }
+            if (c.receiver_closed) {
+                ec = as::error::broken_pipe;
+                return 0;
+            }
+            for (auto const& b : bufs) total += b.size();
+            c.ring.reserve(total);
+            for (auto const& b : bufs) c.ring.put(static_cast<char const*>(b.data()), b.size());
+            pump(c, cs);
+        }
+        post_all(cs);
+        ec = error_code();
+        return total;
+    }
+
+    /**
+     * @brief Close both directions. The peer reads the remaining bytes, then gets eof.
+     */
+    void close(std::size_t side) {
+        completions_t cs;
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            auto& out = channels_[side];
+            auto& in = channels_[1 - side];
+            out.sender_closed = true;
+            in.receiver_closed = true;
+            in.ring.clear();
+            pump(out, cs);
+            pump(in, cs);
+        }
+        post_all(cs);
+    }
+
+    bool closed(std::size_t side) const {
+        std::lock_guard<std::mutex> g(mtx_);
+        return channels_[side].sender_closed;
+    }
+
+private:
+    using completions_t = std::vector<std::pair<as::any_io_executor, std::function<void()>>>;
+
+    // Bytes from the sender to the receiver.
+    struct channel {
+        explicit channel(std::size_t ring_bytes)
+            :ring(ring_bytes) {}
+
+        detail::byte_ring ring;
+
+        as::mutable_buffer read_buf;
+        std::size_t read_transferred = 0;
+        handler_t read_handler;
+        as::any_io_executor read_ex;
+
+        std::vector<as::const_buffer> write_bufs;
+        std::size_t write_index = 0;
+        std::size_t write_offset = 0;
+        std::size_t write_transferred = 0;
+        handler_t write_handler;
+        as::any_io_executor write_ex;
+
+        bool sender_closed = false;
+        bool receiver_closed = false;
+    };
+
+    static void complete(
+        completions_t& cs,
+        as::any_io_executor& ex,
+        handler_t& handler,
+        error_code ec,
+        std::size_t bytes) {
+        cs.emplace_back(
+            force_move(ex),
+            [handler = force_move(handler), ec, bytes] {
+                handler(ec, bytes);
+            }
+        );
+        handler = nullptr;
+    }
+
+    /**
+     * @brief Progress the pending operations of the channel as far as possible.
+     */
+    static void pump(channel& c, completions_t& cs) {
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            if (c.write_handler) {
+                if (c.sender_closed) {
+                    complete(cs, c.write_ex, c.write_handler, as::error::operation_aborted, c.write_transferred);
+                }
+                else if (c.receiver_closed) {
+                    complete(cs, c.write_ex, c.write_handler, as::error::broken_pipe, c.write_transferred);
+                }
+                else {
+                    while (c.write_index != c.write_bufs.size() && c.ring.space() != 0) {
+                        auto const& b = c.write_bufs[c.write_index];
+                        auto n = c.ring.put(static_cast<char const*>(b.data()) + c.write_offset, b.size() - c.write_offset);
+                        if (n != 0) progress = true;
+                        c.write_offset += n;
+                        c.write_transferred += n;
+                        if (c.write_offset == b.size()) {
+                            ++c.write_index;
+                            c.write_offset = 0;
+                        }
+                    }
+                    if (c.write_index == c.write_bufs.size()) {
+                        c.write_bufs.clear();
+                        complete(cs, c.write_ex, c.write_handler, error_code(), c.write_transferred);
+                    }
+                }
+            }
+            if (c.read_handler) {
+                if (c.receiver_closed) {
+                    complete(cs, c.read_ex, c.read_handler, as::error::operation_aborted, c.read_transferred);
+                    continue;
+                }
+                auto n = c.ring.get(
+                    static_cast<char*>(c.read_buf.data()) + c.read_transferred,
+                    c.read_buf.size() - c.read_transferred
+                );
+                if (n != 0) progress = true;
+                c.read_transferred += n;
+                if (c.read_transferred == c.read_buf.size()) {
+                    complete(cs, c.read_ex, c.read_handler, error_code(), c.read_transferred);
+                }
+                else if (c.sender_closed && c.ring.size() == 0) {
+                    complete(cs, c.read_ex, c.read_handler, as::error::eof, c.read_transferred);
+                }
+            }
+        }
+    }
+
+    static void post_all(completions_t& cs) {
+        for (auto& c : cs) {
+            as::post(c.first, force_move(c.second));
+        }
+    }
+
+private:
+    mutable std::mutex mtx_;
+    std::array<channel, 2> channels_;
+};
+
+/**
+ * @brief In-memory socket that is connected to the paired loopback_endpoint.
+ *        Create the pair by make_loopback_pair().
+ *        It doesn't touch the kernel networking, so it is useful to measure the
+ *        broker itself with many clients in one process.
+ */
+template <typename Strand = strand>
+class loopback_endpoint : public socket {
+public:
+    loopback_endpoint(as::io_context& ioc, std::shared_ptr<loopback_pipe> pipe, std::size_t side)
+        :pipe_(force_move(pipe)),
+         side_(side),
+         tcp_(ioc),
+         strand_(ioc.get_executor())
+    {}
+
+    MQTT_ALWAYS_INLINE void async_read(
+        as::mutable_buffer buffers,
+        std::function<void(error_code, std::size_t)> handler
+    ) override final {
+        pipe_->async_read(side_, buffers, force_move(handler), strand_);
+    }
+
+    MQTT_ALWAYS_INLINE void async_write(
+        std::vector<as::const_buffer> buffers,
+        std::function<void(error_code, std::size_t)> handler
+    ) override final {
+        pipe_->async_write(side_, force_move(buffers), force_move(handler), strand_);
+    }
+
+    MQTT_ALWAYS_INLINE std::size_t write(
+        std::vector<as::const_buffer> buffers,
+        boost::system::error_code& ec
+    ) override final {
+        return pipe_->write(side_, buffers, ec);
+    }
+
+    MQTT_ALWAYS_INLINE void post(std::function<void()> handler) override final {
+        as::post(
+            strand_,
+            force_move(handler)
+        );
+    }
+
+    MQTT_ALWAYS_INLINE void dispatch(std::function<void()> handler) override final {
+        as::dispatch(
+            strand_,
+            force_move(handler)
+        );
+    }
+
+    MQTT_ALWAYS_INLINE void defer(std::function<void()> handler) override final {
+        as::defer(
+            strand_,
+            force_move(handler)
+        );
+    }
+
+    MQTT_ALWAYS_INLINE bool running_in_this_thread() const override final {
+        return strand_.running_in_this_thread();
+    }
+
+    /**
+     * @brief The socket is never opened. It exists only to satisfy the interface,
+     *        so the options set to it fail with bad_descriptor.
+     */
+    MQTT_ALWAYS_INLINE as::ip::tcp::socket::lowest_layer_type& lowest_layer() override final {
+        return tcp_.lowest_layer();
+    }
+
+    MQTT_ALWAYS_INLINE any native_handle() override final {
+        return pipe_.get();
+    }
+
+    MQTT_ALWAYS_INLINE void clean_shutdown_and_close(boost::system::error_code& ec) override final {
+        close(ec);
+    }
+
+    MQTT_ALWAYS_INLINE void async_clean_shutdown_and_close(std::function<void(error_code)> handler) override final {
+        post(
+            [this, handler = force_move(handler)] () mutable {
+                error_code ec;
+                close(ec);
+                force_move(handler)(ec);
+            }
+        );
+    }
+
+    MQTT_ALWAYS_INLINE void force_shutdown_and_close(boost::system::error_code& ec) override final {
+        close(ec);
+    }
+
+    MQTT_ALWAYS_INLINE as::any_io_executor get_executor() override final {
+        return strand_;
+    }
+
+private:
+    void close(boost::system::error_code& ec) {
+        pipe_->close(side_);
+        MQTT_LOG("mqtt_impl", trace)
+            << MQTT_ADD_VALUE(address, this)
+            << "loopback close";
+        ec = boost::system::errc::make_error_code(boost::system::errc::success);
+    }
+
+private:
+    std::shared_ptr<loopback_pipe> pipe_;
+    std::size_t side_;
+    as::ip::tcp::socket tcp_;
+    Strand strand_;
+};
+
+/**
+ * @brief Create the connected pair of loopback_endpoint.
+ * @param ioc1 io_context of the first endpoint
+ * @param ioc2 io_context of the second endpoint
+ * @param ring_bytes capacity of the ring buffer of each direction
+ */
+template <typename Strand = strand>
+std::pair<std::shared_ptr<loopback_endpoint<Strand>>, std::shared_ptr<loopback_endpoint<Strand>>>
+make_loopback_pair(as::io_context& ioc1, as::io_context& ioc2, std::size_t ring_bytes = 64 * 1024) {
+    auto pipe = std::make_shared<loopback_pipe>(ring_bytes);
+    return std::make_pair(
+        std::make_shared<loopback_endpoint<Strand>>(ioc1, pipe, 0),
+        std::make_shared<loopback_endpoint<Strand>>(ioc2, pipe, 1)
+    );
+}
+
+template <typename Strand = strand>
+std::pair<std::shared_ptr<loopback_endpoint<Strand>>, std::shared_ptr<loopback_endpoint<Strand>>>
+make_loopback_pair(as::io_context& ioc, std::size_t ring_bytes = 64 * 1024) {
+    return make_loopback_pair<Strand>(ioc, ioc, ring_bytes);
+}
+
+} // namespace MQTT_NS
+
+#endif // MQTT_LOOPBACK_ENDPOINT_HPP
@@ -0,0 +1,703 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_PACKET_DECODER_HPP)
+#define MQTT_PACKET_DECODER_HPP
+
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/string_view.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/constant.hpp>
+#include <mqtt/control_packet_type.hpp>
+#include <mqtt/protocol_version.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/subscribe_options.hpp>
+#include <mqtt/utf8encoded_strings.hpp>
+
+namespace MQTT_NS {
+
+// The views refer to the bytes that are passed to packet_decoder::feed() or
+// the reassembly buffer of the decoder. They are valid only in the visitor.
+// The properties are the encoded bytes without the property length.
+// v5::property::parse() can parse them.
+
+struct will_view {
+    string_view properties;
+    string_view topic;
+    string_view message;
+    publish_options pubopts;
+};
+
+struct connect_view {
+    protocol_version version;
+    bool clean_start;
+    std::uint16_t keep_alive;
+    string_view properties;
+    string_view client_id;
+    optional<will_view> will;
+    optional<string_view> user_name;
+    optional<string_view> password;
+};
+
+struct connack_view {
+    bool session_present;
+    /// connect_return_code of v3.1.1 or v5::connect_reason_code
+    std::uint8_t reason_code;
+    string_view properties;
+};
+
+struct publish_view {
+    publish_options pubopts;
+    string_view topic;
+    optional<std::uint16_t> packet_id;
+    string_view properties;
+    string_view payload;
+};
+
+template <control_packet_type Type>
+struct pubres_view {
+    std::uint16_t packet_id;
+    /// 0 (success) if the reason code is omitted
+    std::uint8_t reason_code;
+    string_view properties;
+};
+
+using puback_view = pubres_view<control_packet_type::puback>;
+using pubrec_view = pubres_view<control_packet_type::pubrec>;
+using pubrel_view = pubres_view<control_packet_type::pubrel>;
+using pubcomp_view = pubres_view<control_packet_type::pubcomp>;
+
+struct subscribe_view {
+    std::uint16_t packet_id;
+    string_view properties;
+    /// The encoded topic filters and the options. They have been validated.
+    string_view entries;
+
+    /**
+     * @brief Call the function for each entry.
+     * @param f function that is called with (string_view topic_filter, subscribe_options options)
+     */
+    template <typename Func>
+    void for_each(Func&& f) const {
+        for (std::size_t i = 0; i != entries.size();) {
+            auto size = static_cast<std::size_t>(
+                (static_cast<std::uint8_t>(entries[i]) << 8) | static_cast<std::uint8_t>(entries[i + 1])
+            );
+            f(entries.substr(i + 2, size), subscribe_options(static_cast<std::uint8_t>(entries[i + 2 + size])));
+            i += 2 + size + 1;
+        }
+    }
+};
+
+struct suback_view {
+    std::uint16_t packet_id;
+    string_view properties;
+    /// suback_return_code of v3.1.1 or v5::suback_reason_code for each byte
+    string_view reason_codes;
+};
+
+struct unsubscribe_view {
+    std::uint16_t packet_id;
+    string_view properties;
+    /// The encoded topic filters. They have been validated.
+    string_view entries;
+
+    /**
+     * @brief Call the function for each entry.
+     * @param f function that is called with (string_view topic_filter)
+     */
+    template <typename Func>
+    void for_each(Func&& f) const {
+        for (std::size_t i = 0; i != entries.size();) {
+            auto size = static_cast<std::size_t>(
+                (static_cast<std::uint8_t>(entries[i]) << 8) | static_cast<std::uint8_t>(entries[i + 1])
+            );
+            f(entries.substr(i + 2, size));
+            i += 2 + size;
+        }
+    }
+};
+
+struct unsuback_view {
+    std::uint16_t packet_id;
+    string_view properties;
+    /// v5::unsuback_reason_code for each byte. Empty on v3.1.1.
+    string_view reason_codes;
+};
+
+struct pingreq_view {};
+struct pingresp_view {};
+
+struct disconnect_view {
+    /// 0 (normal_disconnection) if the reason code is omitted
+    std::uint8_t reason_code;
+    string_view properties;
+};
+
+struct auth_view {
+    /// 0 (success) if the reason code is omitted
+    std::uint8_t reason_code;
+    string_view properties;
+};
+
+/**
+ * @brief Incremental decoder of MQTT packets.
+ *        The bytes are fed in arbitrary pieces, and the visitor is called with the view of
+ *        each packet. It is independent of the I/O, so it can be used for the offline
+ *        processing, proxies, and fuzzing.
+ *        The packet that is contained in one feed() is decoded in place. Only the packet that
+ *        spans feed() calls is copied to the reassembly buffer, whose capacity is reused.
+ *        After an error, feed() returns the same error until reset() is called.
+ */
+class packet_decoder {
+public:
+    /**
+     * @brief constructor
+     * @param version protocol version. If undetermined, it is determined by the CONNECT packet.
+     * @param maximum_packet_size the packet that is larger than this bytes is a protocol error
+     */
+    explicit packet_decoder(
+        protocol_version version = protocol_version::undetermined,
+        std::size_t maximum_packet_size = packet_size_no_limit)
+        : version_(version),
+          maximum_packet_size_(maximum_packet_size)
+    {}
+
+    protocol_version get_protocol_version() const {
+        return version_;
+    }
+
+    /**
+     * @brief Discard the partially received packet and the error.
+     */
+    void reset() {
+        state_ = state::fixed_header;
+        body_.clear();
+        ec_ = error_code();
+    }
+
+    /**
+     * @brief Decode the bytes.
+     * @param bytes bytes that follow the previously fed bytes
+     * @param vis visitor that is called with each decoded view. e.g. make_lambda_visitor()
+     * @return bad_message if the packet is malformed, protocol_error if the packet violates
+     *         the protocol, otherwise success
+     */
+    template <typename Visitor>
+    error_code feed(string_view bytes, Visitor&& vis) {
+        if (state_ == state::failed) return ec_;
+        auto p = bytes.data();
+        auto e = p + bytes.size();
+        while (p != e) {
+            switch (state_) {
+            case state::fixed_header: {
+                fixed_header_ = static_cast<std::uint8_t>(*p++);
+                if (!get_control_packet_type_with_check(fixed_header_)) {
+                    return fail(boost::system::errc::bad_message);
+                }
+                remaining_length_ = 0;
+                multiplier_ = 1;
+                header_size_ = 1;
+                state_ = state::remaining_length;
+            } break;
+            case state::remaining_length: {
+                auto c = *p++;
+                ++header_size_;
+                if (!add_remaining_length_byte(remaining_length_, multiplier_, c)) {
+                    return fail(boost::system::errc::bad_message);
+                }
+                if (c & variable_length_continue_flag) break;
+                auto cpt = get_control_packet_type(fixed_header_);
+                if (!check_remaining_length(
+                        version_,
+                        cpt,
+                        remaining_length_,
+                        [&](std::size_t remaining_length) {
+                            return header_size_ + remaining_length <= maximum_packet_size_;
+                        }
+                    )
+                ) {
+                    return fail(boost::system::errc::protocol_error);
+                }
+                if (remaining_length_ == 0) {
+                    if (auto ec = decode(string_view(), vis)) return fail(ec);
+                    state_ = state::fixed_header;
+                }
+                else {
+                    body_.clear();
+                    state_ = state::body;
+                }
+            } break;
+            case state::body: {
+                auto avail = static_cast<std::size_t>(e - p);
+                if (body_.empty() && avail >= remaining_length_) {
+                    // The whole body is in the bytes.
+                    auto ec = decode(string_view(p, remaining_length_), vis);
+                    p += remaining_length_;
+                    if (ec) return fail(ec);
+                    state_ = state::fixed_header;
+                    break;
+                }
+                if (body_.empty()) body_.reserve(remaining_length_);
+                auto size = std::min(remaining_length_ - body_.size(), avail);
+                body_.append(p, size);
+                p += size;
+                if (body_.size() == remaining_length_) {
+                    if (auto ec = decode(string_view(body_), vis)) return fail(ec);
+                    body_.clear();
+                    state_ = state::fixed_header;
+                }
+            } break;
+            case state::failed:
+                return ec_;
+            }
+        }
+        return error_code();
+    }
+
+    /**
+     * @brief Accumulate a byte of the Variable Byte Integer of the remaining length.
+     * @param v remaining length
+     * @param multiplier multiplier of the byte. It starts from 1.
+     * @param byte byte
+     * @return false if the remaining length exceeds four bytes
+     */
+    static bool add_remaining_length_byte(std::size_t& v, std::size_t& multiplier, char byte) {
+        v += (byte & 0b01111111) * multiplier;
+        multiplier *= 128;
+        return multiplier <= 128 * 128 * 128 * 128;
+    }
+
+    /**
+     * @brief Check the remaining length by the packet type and the protocol version.
+     * @param version protocol version. undetermined allows only CONNECT.
+     * @param cpt control packet type
+     * @param remaining_length remaining length
+     * @param variable_length_check function that checks the remaining length of the packet
+     *        that has the variable length. It is called with the remaining length.
+     * @return true if the remaining length is valid
+     * @tparam PacketIdBytes size of the packet identifier. 4 is the extended packet identifier of v3.1.1.
+     */
+    template <std::size_t PacketIdBytes = 2, typename Func>
+    static bool check_remaining_length(
+        protocol_version version,
+        control_packet_type cpt,
+        std::size_t remaining_length,
+        Func&& variable_length_check) {
+        switch (version) {
+        case protocol_version::undetermined:
+            return cpt == control_packet_type::connect && variable_length_check(remaining_length);
+        case protocol_version::v3_1_1:
+            switch (cpt) {
+            case control_packet_type::connect:
+            case control_packet_type::publish:
+            case control_packet_type::subscribe:
+            case control_packet_type::suback:
+            case control_packet_type::unsubscribe:
+                return variable_length_check(remaining_length);
+            case control_packet_type::connack:
+                return remaining_length == 2;
+            case control_packet_type::puback:
+            case control_packet_type::pubrec:
+            case control_packet_type::pubrel:
+            case control_packet_type::pubcomp:
+            case control_packet_type::unsuback:
+                return remaining_length == PacketIdBytes;
+            case control_packet_type::pingreq:
+            case control_packet_type::pingresp:
+            case control_packet_type::disconnect:
+                return remaining_length == 0;
+            // Even though there is no auth packet type in v3.1.1
+            // it's included in the switch case to provide a warning
+            // about missing enum values if any are missing.
+            case control_packet_type::auth:
+                return false;
+            }
+            return false;
+        case protocol_version::v5:
+        default:
+            switch (cpt) {
+            case control_packet_type::connect:
+            case control_packet_type::publish:
+            case control_packet_type::subscribe:
+            case control_packet_type::suback:
+            case control_packet_type::unsubscribe:
+            case control_packet_type::connack:
+            case control_packet_type::puback:
+            case control_packet_type::pubrec:
+            case control_packet_type::pubrel:
+            case control_packet_type::pubcomp:
+            case control_packet_type::unsuback:
+            case control_packet_type::disconnect:
+            case control_packet_type::auth:
+                return variable_length_check(remaining_length);
+            case control_packet_type::pingreq:
+            case control_packet_type::pingresp:
+                return remaining_length == 0;
+            }
+            return false;
+        }
+    }
+
+private:
+    static constexpr std::uint8_t variable_length_continue_flag = 0b10000000;
+
+    enum class state : std::uint8_t {
+        fixed_header,
+        remaining_length,
+        body,
+        failed,
+    };
+
+    class reader {
+    public:
+        explicit reader(string_view bytes)
+            : bytes_(bytes)
+        {}
+
+        bool empty() const {
+            return bytes_.empty();
+        }
+
+        bool read(std::uint8_t& v) {
+            if (bytes_.empty()) return false;
+            v = static_cast<std::uint8_t>(bytes_.front());
+            bytes_.remove_prefix(1);
+            return true;
+        }
+
+        bool read(std::uint16_t& v) {
+            if (bytes_.size() < 2) return false;
+            v = static_cast<std::uint16_t>(
+                (static_cast<std::uint8_t>(bytes_[0]) << 8) | static_cast<std::uint8_t>(bytes_[1])
+            );
+            bytes_.remove_prefix(2);
+            return true;
+        }
+
+        bool read_bytes(std::size_t size, string_view& v) {
+            if (bytes_.size() < size) return false;
+            v = bytes_.substr(0, size);
+            bytes_.remove_prefix(size);
+            return true;
+        }
+
+        bool read_binary(string_view& v) {
+            std::uint16_t size;
+            return read(size) && read_bytes(size, v);
+        }
+
+        bool read_string(string_view& v) {
+            return read_binary(v) && utf8string::validate_contents(v) == utf8string::validation::well_formed;
+        }
+
+        bool read_properties(string_view& v) {
+            std::size_t size = 0;
+            std::size_t multiplier = 1;
+            std::uint8_t c;
+            do {
+                if (!read(c)) return false;
+                if (!add_remaining_length_byte(size, multiplier, static_cast<char>(c))) return false;
+            } while (c & variable_length_continue_flag);
+            return read_bytes(size, v);
+        }
+
+        string_view rest() {
+            auto v = bytes_;
+            bytes_ = string_view();
+            return v;
+        }
+
+    private:
+        string_view bytes_;
+    };
+
+    error_code fail(boost::system::errc::errc_t e) {
+        return fail(boost::system::errc::make_error_code(e));
+    }
+
+    error_code fail(error_code ec) {
+        state_ = state::failed;
+        body_.clear();
+        ec_ = ec;
+        return ec;
+    }
+
+    static error_code bad_message() {
+        return boost::system::errc::make_error_code(boost::system::errc::bad_message);
+    }
+
+    static error_code protocol_error() {
+        return boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+    }
+
+    bool is_v5() const {
+        return version_ == protocol_version::v5;
+    }
+
+    template <typename Visitor>
+    error_code decode(string_view body, Visitor&& vis) {
+        reader r(body);
+        switch (get_control_packet_type(fixed_header_)) {
+        case control_packet_type::connect:
+            return decode_connect(r, vis);
+        case control_packet_type::connack:
+            return decode_connack(r, vis);
+        case control_packet_type::publish:
+            return decode_publish(r, vis);
+        case control_packet_type::puback:
+            return decode_pubres<control_packet_type::puback>(r, vis);
+        case control_packet_type::pubrec:
+            return decode_pubres<control_packet_type::pubrec>(r, vis);
+        case control_packet_type::pubrel:
+            return decode_pubres<control_packet_type::pubrel>(r, vis);
+        case control_packet_type::pubcomp:
+            return decode_pubres<control_packet_type::pubcomp>(r, vis);
+        case control_packet_type::subscribe:
+            return decode_subscribe(r, vis);
+        case control_packet_type::suback:
+            return decode_suback(r, vis);
+        case control_packet_type::unsubscribe:
+            return decode_unsubscribe(r, vis);
+        case control_packet_type::unsuback:
+            return decode_unsuback(r, vis);
+        case control_packet_type::pingreq:
+            vis(pingreq_view{});
+            return error_code();
+        case control_packet_type::pingresp:
+            vis(pingresp_view{});
+            return error_code();
+        case control_packet_type::disconnect:
+            return decode_disconnect(r, vis);
+        case control_packet_type::auth:
+            return decode_auth(r, vis);
+        }
+        return bad_message();
+    }
+
+    template <typename Visitor>
+    error_code decode_connect(reader& r, Visitor&& vis) {
+        string_view protocol_name;
+        std::uint8_t level;
+        std::uint8_t flags;
+        std::uint16_t keep_alive;
+        if (!r.read_string(protocol_name) || !r.read(level) || !r.read(flags) || !r.read(keep_alive)) {
+            return bad_message();
+        }
+        if (protocol_name != "MQTT") return protocol_error();
+        auto version = static_cast<protocol_version>(level);
+        if (version != protocol_version::v3_1_1 && version != protocol_version::v5) return protocol_error();
+        if (version_ != protocol_version::undetermined && version_ != version) return protocol_error();
+        version_ = version;
+
+        // reserved
+        if (flags & 0b00000001) return bad_message();
+        bool will_flag = flags & 0b00000100;
+        auto will_qos = static_cast<qos>((flags & 0b00011000) >> 3);
+        bool will_retain = flags & 0b00100000;
+        bool password_flag = flags & 0b01000000;
+        bool user_name_flag = flags & 0b10000000;
+        if (will_qos > qos::exactly_once) return bad_message();
+        if (!will_flag && (will_qos != qos::at_most_once || will_retain)) return bad_message();
+        if (!is_v5() && password_flag && !user_name_flag) return bad_message();
+
+        connect_view v {
+            version,
+            bool(flags & 0b00000010),
+            keep_alive,
+            string_view(),
+            string_view(),
+            nullopt,
+            nullopt,
+            nullopt
+        };
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        if (!r.read_string(v.client_id)) return bad_message();
+        if (will_flag) {
+            will_view w {
+                string_view(),
+                string_view(),
+                string_view(),
+                publish_options(will_qos) | (will_retain ? retain::yes : retain::no)
+            };
+            if (is_v5() && !r.read_properties(w.properties)) return bad_message();
+            if (!r.read_string(w.topic) || !r.read_binary(w.message)) return bad_message();
+            v.will.emplace(w);
+        }
+        if (user_name_flag) {
+            string_view s;
+            if (!r.read_string(s)) return bad_message();
+            v.user_name.emplace(s);
+        }
+        if (password_flag) {
+            string_view s;
+            if (!r.read_binary(s)) return bad_message();
+            v.password.emplace(s);
+        }
+        if (!r.empty()) return bad_message();
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_connack(reader& r, Visitor&& vis) {
+        std::uint8_t flags;
+        connack_view v { false, 0, string_view() };
+        if (!r.read(flags) || !r.read(v.reason_code)) return bad_message();
+        // reserved
+        if (flags & 0b11111110) return bad_message();
+        v.session_present = flags & 0b00000001;
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        if (!r.empty()) return bad_message();
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_publish(reader& r, Visitor&& vis) {
+        publish_view v { publish_options(static_cast<std::uint8_t>(fixed_header_ & 0b00001111)), string_view(), nullopt, string_view(), string_view() };
+        auto qos_value = v.pubopts.get_qos();
+        if (qos_value > qos::exactly_once) return bad_message();
+        if (qos_value == qos::at_most_once && v.pubopts.get_dup() == dup::yes) return bad_message();
+        if (!r.read_string(v.topic)) return bad_message();
+        if (qos_value != qos::at_most_once) {
+            std::uint16_t packet_id;
+            if (!r.read(packet_id)) return bad_message();
+            if (packet_id == 0) return protocol_error();
+            v.packet_id.emplace(packet_id);
+        }
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        // The topic alias is required if the topic is empty.
+        if (!is_v5() && v.topic.empty()) return protocol_error();
+        v.payload = r.rest();
+        vis(v);
+        return error_code();
+    }
+
+    template <control_packet_type Type, typename Visitor>
+    error_code decode_pubres(reader& r, Visitor&& vis) {
+        pubres_view<Type> v { 0, 0, string_view() };
+        if (!r.read(v.packet_id)) return bad_message();
+        if (is_v5() && !r.empty()) {
+            if (!r.read(v.reason_code)) return bad_message();
+            if (!r.empty() && !r.read_properties(v.properties)) return bad_message();
+        }
+        if (!r.empty()) return bad_message();
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_subscribe(reader& r, Visitor&& vis) {
+        subscribe_view v { 0, string_view(), string_view() };
+        if (!r.read(v.packet_id)) return bad_message();
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        v.entries = r.rest();
+        reader entries(v.entries);
+        if (entries.empty()) return protocol_error();
+        while (!entries.empty()) {
+            string_view topic_filter;
+            std::uint8_t options;
+            if (!entries.read_string(topic_filter) || !entries.read(options)) return bad_message();
+            auto opts = subscribe_options(options);
+            if (opts.get_qos() > qos::exactly_once) return bad_message();
+            if (is_v5()) {
+                // reserved
+                if (options & 0b11000000) return bad_message();
+                if (static_cast<std::uint8_t>(opts.get_retain_handling()) > static_cast<std::uint8_t>(retain_handling::not_send)) {
+                    return bad_message();
+                }
+            }
+            else {
+                // reserved
+                if (options & 0b11111100) return bad_message();
+            }
+        }
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_suback(reader& r, Visitor&& vis) {
+        suback_view v { 0, string_view(), string_view() };
+        if (!r.read(v.packet_id)) return bad_message();
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        v.reason_codes = r.rest();
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_unsubscribe(reader& r, Visitor&& vis) {
+        unsubscribe_view v { 0, string_view(), string_view() };
+        if (!r.read(v.packet_id)) return bad_message();
+        if (is_v5() && !r.read_properties(v.properties)) return bad_message();
+        v.entries = r.rest();
+        reader entries(v.entries);
+        if (entries.empty()) return protocol_error();
+        while (!entries.empty()) {
+            string_view topic_filter;
+            if (!entries.read_string(topic_filter)) return bad_message();
+        }
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_unsuback(reader& r, Visitor&& vis) {
+        unsuback_view v { 0, string_view(), string_view() };
+        if (!r.read(v.packet_id)) return bad_message();
+        if (is_v5()) {
+            if (!r.read_properties(v.properties)) return bad_message();
+            v.reason_codes = r.rest();
+        }
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_disconnect(reader& r, Visitor&& vis) {
+        disconnect_view v { 0, string_view() };
+        if (!r.empty()) {
+            if (!r.read(v.reason_code)) return bad_message();
+            if (!r.empty() && !r.read_properties(v.properties)) return bad_message();
+        }
+        if (!r.empty()) return bad_message();
+        vis(v);
+        return error_code();
+    }
+
+    template <typename Visitor>
+    error_code decode_auth(reader& r, Visitor&& vis) {
+        auth_view v { 0, string_view() };
+        if (!r.empty()) {
+            if (!r.read(v.reason_code)) return bad_message();
+            if (!r.empty() && !r.read_properties(v.properties)) return bad_message();
+        }
+        if (!r.empty()) return bad_message();
+        vis(v);
+        return error_code();
+    }
+
+    protocol_version version_;
+    std::size_t maximum_packet_size_;
+    state state_ = state::fixed_header;
+    std::uint8_t fixed_header_ = 0;
+    std::size_t remaining_length_ = 0;
+    std::size_t multiplier_ = 1;
+    std::size_t header_size_ = 0;
+    std::string body_;
+    error_code ec_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_PACKET_DECODER_HPP
@@ -10,6 +10,7 @@
 #include <mqtt/variant.hpp> // should be top to configure variant limit
 
 #include <memory>
+#include <atomic>
 #include <boost/asio.hpp>
 
 #include <mqtt/namespace.hpp>
@@ -18,6 +19,7 @@
 #include <mqtt/endpoint.hpp>
 #include <mqtt/move.hpp>
 #include <mqtt/callable_overlay.hpp>
+#include <mqtt/shared_scope_guard.hpp>
 #include <mqtt/strand.hpp>
 #include <mqtt/null_strand.hpp>
 
@@ -429,6 +431,21 @@ public:
         underlying_connect_timeout_ = force_move(timeout);
     }
 
+    /**
+     * @brief Set io_context getter for the underlying layer handshake.
+     * If the getter is set, the TLS handshake is processed on the io_context that is
+     * returned by the getter instead of the connection io_context.
+     * When the handshake is finished, the stream is handed to the connection io_context
+     * and the accept handler is called on it.
+     * Handshakes of the different connections are processed concurrently in this mode.
+     * It isolates the handshake CPU load from the established connections.
+     * @param ioc_handshake_getter io_context getter for the handshake.
+     *                             If empty function is set, the connection io_context is used.
+     */
+    void set_handshake_ioc_getter(std::function<as::io_context&()> ioc_handshake_getter = std::function<as::io_context&()>()) {
+        ioc_handshake_getter_ = force_move(ioc_handshake_getter);
+    }
+
     /**
      * @brief Get boost asio ssl context.
      * @return ssl context
@@ -464,10 +481,13 @@ private:
                     : false;
         };
 
-        ctx_.set_verify_mode(MQTT_NS::tls::verify_peer);
-        ctx_.set_verify_callback(verify_cb_);
         auto socket = std::make_shared<socket_t>(ioc_con, ctx_);
 
+        // verify callback is set per stream because it refers the username of
+        // the connection, and handshakes could be processed concurrently.
+        socket->socket().set_verify_mode(MQTT_NS::tls::verify_peer);
+        socket->socket().set_verify_callback(verify_cb_);
+
         auto ps = socket.get();
         acceptor_.value().async_accept(
             ps->lowest_layer(),
@@ -478,13 +498,24 @@ private:
                     if (h_error_) h_error_(ec, ioc_con);
                     return;
                 }
+
+                // If handshake io_context is set, the handshake and its timeout timer
+                // are processed on the strand of the handshake io_context.
+                // Otherwise, they are processed on the strand of the socket.
+                bool offload = bool(ioc_handshake_getter_);
+                auto handshake_executor =
+                    [&] () -> as::any_io_executor {
+                        if (offload) return as::make_strand(ioc_handshake_getter_());
+                        return socket->get_executor();
+                    } ();
+
                 auto underlying_finished = std::make_shared<bool>(false);
                 auto connection_error_called = std::make_shared<bool>(false);
                 auto tim = std::make_shared<as::steady_timer>(ioc_con);
                 tim->expires_after(underlying_connect_timeout_);
                 tim->async_wait(
                     as::bind_executor(
-                        socket->get_executor(),
+                        handshake_executor,
                         [
                             this,
                             socket,
@@ -515,7 +546,7 @@ private:
                 ps->async_handshake(
                     tls::stream_base::server,
                     as::bind_executor(
-                        ps->get_executor(),
+                        handshake_executor,
                         [
                             this,
                             socket = force_move(socket),
@@ -523,7 +554,8 @@ private:
                             underlying_finished,
                             connection_error_called,
                             &ioc_con,
-                            username
+                            username,
+                            offload
                         ]
                         (error_code ec) mutable {
                             *underlying_finished = true;
@@ -533,16 +565,30 @@ private:
                                     h_connection_error_(ec, ioc_con);
                                     *connection_error_called = true;
                                 }
-                                do_accept();
+                                if (!offload) do_accept();
                                 return;
                             }
-                            auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
-                            sp->set_preauthed_user_name(*username);
-                            if (h_accept_) h_accept_(force_move(sp));
-                            do_accept();
+                            auto con_executor = socket->get_executor();
+                            auto accept =
+                                [this, socket = force_move(socket), &ioc_con, username] () mutable {
+                                    auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
+                                    sp->set_preauthed_user_name(*username);
+                                    if (h_accept_) h_accept_(force_move(sp));
+                                };
+                            if (offload) {
+                                // hand the established stream to the connection io_context
+                                as::post(con_executor, force_move(accept));
+                            }
+                            else {
+                                accept();
+                                do_accept();
+                            }
                         }
                     )
                 );
+
+                // the next accept doesn't need to wait for the handshake
+                if (offload) do_accept();
             }
         );
     }
@@ -554,6 +600,7 @@ private:
     as::io_context& ioc_accept_;
     as::io_context* ioc_con_ = nullptr;
     std::function<as::io_context&()> ioc_con_getter_;
+    std::function<as::io_context&()> ioc_handshake_getter_;
     optional<as::ip::tcp::acceptor> acceptor_;
     std::function<void(as::ip::tcp::acceptor&)> config_;
     bool close_request_{false};
@@ -569,6 +616,23 @@ private:
 
 #if defined(MQTT_USE_WS)
 
+namespace detail {
+
+/**
+ * @brief Estimate zlib memory usage of the server role permessage-deflate stream.
+ * deflate : (1 << (windowBits + 2)) + (1 << (memLevel + 9))
+ * inflate : (1 << windowBits) + about 7KB
+ * @param pmd permessage-deflate option
+ * @return estimated memory usage in bytes
+ */
+inline std::size_t deflate_memory_usage(boost::beast::websocket::permessage_deflate const& pmd) {
+    auto deflate = (std::size_t(1) << (pmd.server_max_window_bits + 2)) + (std::size_t(1) << (pmd.memLevel + 9));
+    auto inflate = (std::size_t(1) << pmd.client_max_window_bits) + 7 * 1024;
+    return deflate + inflate;
+}
+
+} // namespace detail
+
 template <
     typename Strand = strand,
     typename Mutex = std::mutex,
@@ -747,7 +811,63 @@ public:
         underlying_connect_timeout_ = force_move(timeout);
     }
 
+    /**
+     * @brief Set permessage-deflate extension option.
+     * The option is applied to the connections that are accepted after this function call.
+     * server_enable needs to be true to negotiate the extension.
+     * All messages are compressed on the connections that negotiate the extension.
+     * @param pmd permessage-deflate option (window bits, memory level, compression level, etc)
+     */
+    void set_permessage_deflate(boost::beast::websocket::permessage_deflate const& pmd) {
+        pmd_.emplace(pmd);
+    }
+
+    /**
+     * @brief Set the maximum total memory for permessage-deflate of all connections.
+     * The memory usage is estimated from window bits and memory level for each connection.
+     * The memory of a connection is counted only if the connection negotiates the extension.
+     * If the new connection would exceed the limit, permessage-deflate is not offered to it.
+     * @param size maximum memory in bytes. 0 means no limit. The default value is 0.
+     */
+    void set_max_deflate_memory(std::size_t size) {
+        max_deflate_memory_ = size;
+    }
+
+    /**
+     * @brief Get the estimated total memory for permessage-deflate of all connections.
+     * @return memory in bytes
+     */
+    std::size_t deflate_memory() const {
+        return deflate_memory_->load();
+    }
+
 private:
+    /**
+     * @brief Offer permessage-deflate to the connection if the memory limit allows.
+     * The estimated memory is reserved during the handshake. The caller moves the returned
+     * reservation to the endpoint only if the extension is negotiated. Otherwise, the memory
+     * is released when the reservation is destroyed.
+     * @param s socket
+     * @return reservation of the deflate memory. empty if the extension is not offered.
+     */
+    std::shared_ptr<void> offer_permessage_deflate(socket_t& s) {
+        if (!pmd_) return nullptr;
+        auto size = detail::deflate_memory_usage(*pmd_);
+        if (deflate_memory_->fetch_add(size) + size > max_deflate_memory_ &&
+            max_deflate_memory_ != 0) {
+            deflate_memory_->fetch_sub(size);
+            MQTT_LOG("mqtt_api", warning)
+                << "permessage-deflate is not offered. max_deflate_memory:" << max_deflate_memory_;
+            return nullptr;
+        }
+        s.set_option(*pmd_);
+        return shared_scope_guard(
+            [deflate_memory = deflate_memory_, size] {
+                deflate_memory->fetch_sub(size);
+            }
+        );
+    }
+
     void do_accept() {
         if (close_request_) return;
         auto& ioc_con = ioc_con_getter_();
@@ -839,21 +959,27 @@ private:
                                 return;
                             }
                             auto ps = socket.get();
+                            auto negotiated = std::make_shared<bool>(false);
+                            auto deflate_reservation = offer_permessage_deflate(*ps);
 
 #if BOOST_BEAST_VERSION >= 248
 
                             auto it = request->find("Sec-WebSocket-Protocol");
-                            if (it != request->end()) {
-                                ps->set_option(
-                                    boost::beast::websocket::stream_base::decorator(
-                                        [name = it->name(), value = it->value()] // name is enum, value is boost::string_view
-                                        (boost::beast::websocket::response_type& res) {
-                                            // This lambda is called before the scope out point *1
-                                            res.set(name, value);
+                            ps->set_option(
+                                boost::beast::websocket::stream_base::decorator(
+                                    [
+                                        protocol = it == request->end() ? std::string() : std::string(it->value()),
+                                        negotiated
+                                    ]
+                                    (boost::beast::websocket::response_type& res) {
+                                        if (!protocol.empty()) {
+                                            res.set(boost::beast::http::field::sec_websocket_protocol, protocol);
                                         }
-                                    )
-                                );
-                            }
+                                        // The negotiated extension is set to the response before the decorator is called.
+                                        *negotiated = res.find(boost::beast::http::field::sec_websocket_extensions) != res.end();
+                                    }
+                                )
+                            );
                             ps->async_accept(
                                 *request,
                                 as::bind_executor(
@@ -864,7 +990,9 @@ private:
                                         tim,
                                         underlying_finished,
                                         connection_error_called,
-                                        &ioc_con
+                                        &ioc_con,
+                                        negotiated,
+                                        deflate_reservation = force_move(deflate_reservation)
                                     ]
                                     (error_code ec) mutable {
                                         *underlying_finished = true;
@@ -876,6 +1004,7 @@ private:
                                             *connection_error_called = true;
                                             return;
                                         }
+                                        if (*negotiated) socket->set_life_keeper(force_move(deflate_reservation));
                                         auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
                                         if (h_accept_) h_accept_(force_move(sp));
                                     }
@@ -886,16 +1015,25 @@ private:
 
                             ps->async_accept_ex(
                                 *request,
-                                [request, connection_error_called]
+                                [request, connection_error_called, negotiated]
                                 (boost::beast::websocket::response_type& m) {
                                     auto it = request->find("Sec-WebSocket-Protocol");
                                     if (it != request->end()) {
                                         m.insert(it->name(), it->value());
                                     }
+                                    *negotiated = m.find(boost::beast::http::field::sec_websocket_extensions) != m.end();
                                 },
                                 as::bind_executor(
                                     socket->get_executor(),
-                                    [this, socket = force_move(socket), tim, underlying_finished, &ioc_con]
+                                    [
+                                        this,
+                                        socket = force_move(socket),
+                                        tim,
+                                        underlying_finished,
+                                        &ioc_con,
+                                        negotiated,
+                                        deflate_reservation = force_move(deflate_reservation)
+                                    ]
                                     (error_code ec) mutable {
                                         *underlying_finished = true;
                                         tim->cancel();
@@ -906,6 +1044,7 @@ private:
                                             }
                                             return;
                                         }
+                                        if (*negotiated) socket->set_life_keeper(force_move(deflate_reservation));
                                         auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
                                         if (h_accept_) h_accept_(force_move(sp));
                                     }
@@ -936,6 +1075,10 @@ private:
     error_handler_with_ioc h_error_;
     protocol_version version_ = protocol_version::undetermined;
     std::chrono::steady_clock::duration underlying_connect_timeout_ = std::chrono::seconds(10);
+    optional<boost::beast::websocket::permessage_deflate> pmd_;
+    std::size_t max_deflate_memory_ = 0;
+    // shared with the connections because they could outlive the server
+    std::shared_ptr<std::atomic<std::size_t>> deflate_memory_ = std::make_shared<std::atomic<std::size_t>>(0);
 };
 
 
@@ -1127,6 +1270,51 @@ public:
         underlying_connect_timeout_ = force_move(timeout);
     }
 
+    /**
+     * @brief Set permessage-deflate extension option.
+     * The option is applied to the connections that are accepted after this function call.
+     * server_enable needs to be true to negotiate the extension.
+     * All messages are compressed on the connections that negotiate the extension.
+     * @param pmd permessage-deflate option (window bits, memory level, compression level, etc)
+     */
+    void set_permessage_deflate(boost::beast::websocket::permessage_deflate const& pmd) {
+        pmd_.emplace(pmd);
+    }
+
+    /**
+     * @brief Set the maximum total memory for permessage-deflate of all connections.
+     * The memory usage is estimated from window bits and memory level for each connection.
+     * The memory of a connection is counted only if the connection negotiates the extension.
+     * If the new connection would exceed the limit, permessage-deflate is not offered to it.
+     * @param size maximum memory in bytes. 0 means no limit. The default value is 0.
+     */
+    void set_max_deflate_memory(std::size_t size) {
+        max_deflate_memory_ = size;
+    }
+
+    /**
+     * @brief Get the estimated total memory for permessage-deflate of all connections.
+     * @return memory in bytes
+     */
+    std::size_t deflate_memory() const {
+        return deflate_memory_->load();
+    }
+
+    /**
+     * @brief Set io_context getter for the underlying layer handshake.
+     * If the getter is set, the TLS handshake is processed on the io_context that is
+     * returned by the getter instead of the connection io_context.
+     * When the handshake is finished, the stream is handed to the connection io_context
+     * and the accept handler is called on it.
+     * Handshakes of the different connections are processed concurrently in this mode.
+     * It isolates the handshake CPU load from the established connections.
+     * @param ioc_handshake_getter io_context getter for the handshake.
+     *                             If empty function is set, the connection io_context is used.
+     */
+    void set_handshake_ioc_getter(std::function<as::io_context&()> ioc_handshake_getter = std::function<as::io_context&()>()) {
+        ioc_handshake_getter_ = force_move(ioc_handshake_getter);
+    }
+
     /**
      * @brief Get boost asio ssl context.
      * @return ssl context
@@ -1150,6 +1338,32 @@ public:
     }
 
 private:
+    /**
+     * @brief Offer permessage-deflate to the connection if the memory limit allows.
+     * The estimated memory is reserved during the handshake. The caller moves the returned
+     * reservation to the endpoint only if the extension is negotiated. Otherwise, the memory
+     * is released when the reservation is destroyed.
+     * @param s socket
+     * @return reservation of the deflate memory. empty if the extension is not offered.
+     */
+    std::shared_ptr<void> offer_permessage_deflate(socket_t& s) {
+        if (!pmd_) return nullptr;
+        auto size = detail::deflate_memory_usage(*pmd_);
+        if (deflate_memory_->fetch_add(size) + size > max_deflate_memory_ &&
+            max_deflate_memory_ != 0) {
+            deflate_memory_->fetch_sub(size);
+            MQTT_LOG("mqtt_api", warning)
+                << "permessage-deflate is not offered. max_deflate_memory:" << max_deflate_memory_;
+            return nullptr;
+        }
+        s.set_option(*pmd_);
+        return shared_scope_guard(
+            [deflate_memory = deflate_memory_, size] {
+                deflate_memory->fetch_sub(size);
+            }
+        );
+    }
+
     void do_accept() {
         if (close_request_) return;
         auto& ioc_con = ioc_con_getter_();
@@ -1162,10 +1376,13 @@ private:
                     : false;
         };
 
-        ctx_.set_verify_mode(MQTT_NS::tls::verify_peer);
-        ctx_.set_verify_callback(verify_cb_);
-
         auto socket = std::make_shared<socket_t>(ioc_con, ctx_);
+
+        // verify callback is set per stream because it refers the username of
+        // the connection, and handshakes could be processed concurrently.
+        socket->next_layer().set_verify_mode(MQTT_NS::tls::verify_peer);
+        socket->next_layer().set_verify_callback(verify_cb_);
+
         auto ps = socket.get();
         acceptor_.value().async_accept(
             ps->next_layer().next_layer(),
@@ -1176,13 +1393,24 @@ private:
                     if (h_error_) h_error_(ec, ioc_con);
                     return;
                 }
+
+                // If handshake io_context is set, the TLS handshake, the WebSocket upgrade,
+                // and their timeout timer are processed on the strand of the handshake io_context.
+                // Otherwise, they are processed on the strand of the socket.
+                bool offload = bool(ioc_handshake_getter_);
+                auto handshake_executor =
+                    [&] () -> as::any_io_executor {
+                        if (offload) return as::make_strand(ioc_handshake_getter_());
+                        return socket->get_executor();
+                    } ();
+
                 auto underlying_finished = std::make_shared<bool>(false);
                 auto connection_error_called = std::make_shared<bool>(false);
                 auto tim = std::make_shared<as::steady_timer>(ioc_con);
                 tim->expires_after(underlying_connect_timeout_);
                 tim->async_wait(
                     as::bind_executor(
-                        socket->get_executor(),
+                        handshake_executor,
                         [
                             this,
                             socket,
@@ -1211,170 +1439,217 @@ private:
 
                 auto ps = socket.get();
 
+                // The next accept is started when the connection establishment
+                // is finished (success or error).
+                // If the handshake is offloaded, it is started immediately.
+                auto accept_next =
+                    [this, offload] {
+                        if (!offload) do_accept();
+                    };
+
+                auto accept_finish =
+                    [this, &ioc_con, username, offload, accept_next]
+                    (std::shared_ptr<socket_t> socket) {
+                        auto con_executor = socket->get_executor();
+                        auto accept =
+                            [this, socket = force_move(socket), &ioc_con, username] () mutable {
+                                auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
+                                sp->set_preauthed_user_name(*username);
+                                if (h_accept_) h_accept_(force_move(sp));
+                            };
+                        if (offload) {
+                            // hand the established stream to the connection io_context
+                            as::post(con_executor, force_move(accept));
+                        }
+                        else {
+                            accept();
+                        }
+                        accept_next();
+                    };
+
                 ps->next_layer().async_handshake(
                     tls::stream_base::server,
-                    [
-                        this,
-                        socket = force_move(socket),
-                        tim,
-                        underlying_finished,
-                        connection_error_called,
-                        &ioc_con,
-                        username
-                    ]
-                    (error_code ec) mutable {
-                        if (ec) {
-                            *underlying_finished = true;
-                            tim->cancel();
-                            do_accept();
-                            return;
-                        }
-                        auto sb = std::make_shared<boost::asio::streambuf>();
-                        auto request = std::make_shared<boost::beast::http::request<boost::beast::http::string_body>>();
-                        auto ps = socket.get();
-                        boost::beast::http::async_read(
-                            ps->next_layer(),
-                            *sb,
-                            *request,
-                            as::bind_executor(
-                                ps->get_executor(),
-                                [
-                                    this,
-                                    socket = force_move(socket),
-                                    sb,
-                                    request,
-                                    tim,
-                                    underlying_finished,
-                                    connection_error_called,
-                                    &ioc_con,
-                                    username
-                                ]
-                                (error_code ec, std::size_t) mutable {
-                                    if (ec) {
-                                        *underlying_finished = true;
-                                        tim->cancel();
-                                        if (h_connection_error_ && !*connection_error_called) {
-                                            h_connection_error_(ec, ioc_con);
-                                            *connection_error_called = true;
+                    as::bind_executor(
+                        handshake_executor,
+                        [
+                            this,
+                            socket = force_move(socket),
+                            tim,
+                            underlying_finished,
+                            connection_error_called,
+                            &ioc_con,
+                            handshake_executor,
+                            accept_next,
+                            accept_finish
+                        ]
+                        (error_code ec) mutable {
+                            if (ec) {
+                                *underlying_finished = true;
+                                tim->cancel();
+                                accept_next();
+                                return;
+                            }
+                            auto sb = std::make_shared<boost::asio::streambuf>();
+                            auto request = std::make_shared<boost::beast::http::request<boost::beast::http::string_body>>();
+                            auto ps = socket.get();
+                            boost::beast::http::async_read(
+                                ps->next_layer(),
+                                *sb,
+                                *request,
+                                as::bind_executor(
+                                    handshake_executor,
+                                    [
+                                        this,
+                                        socket = force_move(socket),
+                                        sb,
+                                        request,
+                                        tim,
+                                        underlying_finished,
+                                        connection_error_called,
+                                        &ioc_con,
+                                        handshake_executor,
+                                        accept_next,
+                                        accept_finish
+                                    ]
+                                    (error_code ec, std::size_t) mutable {
+                                        if (ec) {
+                                            *underlying_finished = true;
+                                            tim->cancel();
+                                            if (h_connection_error_ && !*connection_error_called) {
+                                                h_connection_error_(ec, ioc_con);
+                                                *connection_error_called = true;
+                                            }
+                                            accept_next();
+                                            return;
                                         }
-                                        do_accept();
-                                        return;
-                                    }
-                                    if (!boost::beast::websocket::is_upgrade(*request)) {
-                                        *underlying_finished = true;
-                                        tim->cancel();
-                                        if (h_connection_error_ && !*connection_error_called) {
-                                            h_connection_error_(
-                                                boost::system::errc::make_error_code(
-                                                    boost::system::errc::protocol_error
-                                                ),
-                                                ioc_con
-                                            );
-                                            *connection_error_called = true;
+                                        if (!boost::beast::websocket::is_upgrade(*request)) {
+                                            *underlying_finished = true;
+                                            tim->cancel();
+                                            if (h_connection_error_ && !*connection_error_called) {
+                                                h_connection_error_(
+                                                    boost::system::errc::make_error_code(
+                                                        boost::system::errc::protocol_error
+                                                    ),
+                                                    ioc_con
+                                                );
+                                                *connection_error_called = true;
+                                            }
+                                            accept_next();
+                                            return;
                                         }
-                                        do_accept();
-                                        return;
-                                    }
-                                    auto ps = socket.get();
+                                        auto ps = socket.get();
+                                        auto negotiated = std::make_shared<bool>(false);
+                                        auto deflate_reservation = offer_permessage_deflate(*ps);
 
 #if BOOST_BEAST_VERSION >= 248
 
-                                    auto it = request->find("Sec-WebSocket-Protocol");
-                                    if (it != request->end()) {
+                                        auto it = request->find("Sec-WebSocket-Protocol");
                                         ps->set_option(
                                             boost::beast::websocket::stream_base::decorator(
-                                                [name = it->name(), value = it->value()] // name is enum, value is boost::string_view
+                                                [
+                                                    protocol = it == request->end() ? std::string() : std::string(it->value()),
+                                                    negotiated
+                                                ]
                                                 (boost::beast::websocket::response_type& res) {
-                                                    // This lambda is called before the scope out point *1
-                                                    res.set(name, value);
+                                                    if (!protocol.empty()) {
+                                                        res.set(boost::beast::http::field::sec_websocket_protocol, protocol);
+                                                    }
+                                                    // The negotiated extension is set to the response before the decorator is called.
+                                                    *negotiated = res.find(boost::beast::http::field::sec_websocket_extensions) != res.end();
                                                 }
                                             )
                                         );
-                                    }
-                                    ps->async_accept(
-                                        *request,
-                                        as::bind_executor(
-                                            ps->get_executor(),
-                                            [
-                                                this,
-                                                socket = force_move(socket),
-                                                tim,
-                                                underlying_finished,
-                                                connection_error_called,
-                                                &ioc_con,
-                                                username
-                                            ]
-                                            (error_code ec) mutable {
-                                                *underlying_finished = true;
-                                                tim->cancel();
-                                                if (ec) {
-                                                    if (h_connection_error_ && !*connection_error_called) {
-                                                        h_connection_error_(ec, ioc_con);
-                                                        *connection_error_called = true;
+                                        ps->async_accept(
+                                            *request,
+                                            as::bind_executor(
+                                                handshake_executor,
+                                                [
+                                                    this,
+                                                    socket = force_move(socket),
+                                                    tim,
+                                                    underlying_finished,
+                                                    connection_error_called,
+                                                    &ioc_con,
+                                                    accept_next,
+                                                    accept_finish,
+                                                    negotiated,
+                                                    deflate_reservation = force_move(deflate_reservation)
+                                                ]
+                                                (error_code ec) mutable {
+                                                    *underlying_finished = true;
+                                                    tim->cancel();
+                                                    if (ec) {
+                                                        if (h_connection_error_ && !*connection_error_called) {
+                                                            h_connection_error_(ec, ioc_con);
+                                                            *connection_error_called = true;
+                                                        }
+                                                        accept_next();
+                                                        return;
                                                     }
-                                                    do_accept();
-                                                    return;
+                                                    if (*negotiated) socket->set_life_keeper(force_move(deflate_reservation));
+                                                    accept_finish(force_move(socket));
                                                 }
-                                                auto sp = std::make_shared<endpoint_t>(ioc_con, force_move(socket), version_);
-                                                sp->set_preauthed_user_name(*username);
-                                                if (h_accept_) h_accept_(force_move(sp));
-                                                do_accept();
-                                            }
-                                        )
-                                    );
+                                            )
+                                        );
 
 #else  // BOOST_BEAST_VERSION >= 248
 
-                                    ps->async_accept_ex(
-                                        *request,
-                                        [request]
-                                        (boost::beast::websocket::response_type& m) {
-                                            auto it = request->find("Sec-WebSocket-Protocol");
-                                            if (it != request->end()) {
-                                                m.insert(it->name(), it->value());
-                                            }
-                                        },
-                                        as::bind_executor(
-                                            ps->get_executor(),
-                                            [
-                                                this,
-                                                socket = force_move(socket),
-                                                tim,
-                                                underlying_finished,
-                                                connection_error_called,
-                                                &ioc_con,
-                                                username
-                                            ]
-                                            (error_code ec) mutable {
-                                                *underlying_finished = true;
-                                                tim->cancel();
-                                                if (ec) {
-                                                    if (h_connection_error_ && *connection_error_called) {
-                                                        h_connection_error_(ec, ioc_con);
-                                                        *connection_error_called = true;
+                                        ps->async_accept_ex(
+                                            *request,
+                                            [request, negotiated]
+                                            (boost::beast::websocket::response_type& m) {
+                                                auto it = request->find("Sec-WebSocket-Protocol");
+                                                if (it != request->end()) {
+                                                    m.insert(it->name(), it->value());
+                                                }
+                                                *negotiated = m.find(boost::beast::http::field::sec_websocket_extensions) != m.end();
+                                            },
+                                            as::bind_executor(
+                                                handshake_executor,
+                                                [
+                                                    this,
+                                                    socket = force_move(socket),
+                                                    tim,
+                                                    underlying_finished,
+                                                    connection_error_called,
+                                                    &ioc_con,
+                                                    accept_next,
+                                                    accept_finish,
+                                                    negotiated,
+                                                    deflate_reservation = force_move(deflate_reservation)
+                                                ]
+                                                (error_code ec) mutable {
+                                                    *underlying_finished = true;
+                                                    tim->cancel();
+                                                    if (ec) {
+                                                        if (h_connection_error_ && *connection_error_called) {
+                                                            h_connection_error_(ec, ioc_con);
+                                                            *connection_error_called = true;
+                                                        }
+                                                        accept_next();
+                                                        return;
                                                     }
-                                                    do_accept();
-                                                    return;
+                                                    if (*negotiated) socket->set_life_keeper(deflate_reservation);
+                                                    // TODO: The use of force_move on this line of code causes
+                                                    // a static assertion that socket is a const object when
+                                                    // TLS is enabled, and WS is enabled, with Boost 1.70, and gcc 8.3.0
+                                                    accept_finish(socket);
                                                 }
-                                                // TODO: The use of force_move on this line of code causes
-                                                // a static assertion that socket is a const object when
-                                                // TLS is enabled, and WS is enabled, with Boost 1.70, and gcc 8.3.0
-                                                auto sp = std::make_shared<endpoint_t>(ioc_con, socket, version_);
-                                                sp->set_preauthed_user_name(*username);
-                                                if (h_accept_) h_accept_(force_move(sp));
-                                                do_accept();
-                                            }
-                                        )
-                                    );
+                                            )
+                                        );
 
 #endif // BOOST_BEAST_VERSION >= 248
 
-                                    // scope out point *1
-                                }
-                            )
-                        );
-                    }
+                                        // scope out point *1
+                                    }
+                                )
+                            );
+                        }
+                    )
                 );
+
+                // the next accept doesn't need to wait for the handshake
+                if (offload) do_accept();
             }
         );
     }
@@ -1386,6 +1661,7 @@ private:
     as::io_context& ioc_accept_;
     as::io_context* ioc_con_ = nullptr;
     std::function<as::io_context&()> ioc_con_getter_;
+    std::function<as::io_context&()> ioc_handshake_getter_;
     optional<as::ip::tcp::acceptor> acceptor_;
     std::function<void(as::ip::tcp::acceptor&)> config_;
     bool close_request_{false};
@@ -1395,6 +1671,10 @@ private:
     tls::context ctx_;
     protocol_version version_ = protocol_version::undetermined;
     std::chrono::steady_clock::duration underlying_connect_timeout_ = std::chrono::seconds(10);
+    optional<boost::beast::websocket::permessage_deflate> pmd_;
+    std::size_t max_deflate_memory_ = 0;
+    // shared with the connections because they could outlive the server
+    std::shared_ptr<std::atomic<std::size_t>> deflate_memory_ = std::make_shared<std::atomic<std::size_t>>(0);
 };
 
 #endif // defined(MQTT_USE_TLS)
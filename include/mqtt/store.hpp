@@ -123,6 +123,10 @@ public:
         return elems_.empty();
     }
 
+    std::size_t size() const {
+        return elems_.size();
+    }
+
 private:
 
     struct elem_t {
@@ -512,6 +512,8 @@ public:
         ret.push_back(static_cast<char>(connect_acknowledge_flags_));
         ret.push_back(static_cast<char>(reason_code_));
 
+        ret.append(property_length_buf_.data(), property_length_buf_.size());
+
         auto it = ret.end();
         ret.resize(ret.size() + property_length_);
         auto end = ret.end();
@@ -1172,6 +1174,7 @@ struct basic_puback_message {
 
         ret.push_back(static_cast<char>(fixed_header_));
         ret.append(remaining_length_buf_.data(), remaining_length_buf_.size());
+        ret.append(packet_id_.data(), packet_id_.size());
 
         // TODO: This is wrong. The reason code MUST be provided
         // if there are properties. Not the other way around.
@@ -1376,6 +1379,7 @@ struct basic_pubrec_message {
 
         ret.push_back(static_cast<char>(fixed_header_));
         ret.append(remaining_length_buf_.data(), remaining_length_buf_.size());
+        ret.append(packet_id_.data(), packet_id_.size());
 
         // TODO: This is wrong. The reason code MUST be provided
         // if there are properties. Not the other way around.
@@ -1906,6 +1910,7 @@ struct basic_pubcomp_message {
 
         ret.push_back(static_cast<char>(fixed_header_));
         ret.append(remaining_length_buf_.data(), remaining_length_buf_.size());
+        ret.append(packet_id_.data(), packet_id_.size());
 
         // TODO: This is wrong. The reason code MUST be provided
         // if there are properties. Not the other way around.
@@ -2246,6 +2251,8 @@ public:
 
         ret.append(packet_id_.data(), packet_id_.size());
 
+        ret.append(property_length_buf_.data(), property_length_buf_.size());
+
         auto it = ret.end();
         ret.resize(ret.size() + property_length_);
         auto end = ret.end();
@@ -2413,6 +2420,8 @@ public:
 
         ret.append(packet_id_.data(), packet_id_.size());
 
+        ret.append(property_length_buf_.data(), property_length_buf_.size());
+
         auto it = ret.end();
         ret.resize(ret.size() + property_length_);
         auto end = ret.end();
@@ -2555,6 +2564,8 @@ public:
 
         ret.append(packet_id_.data(), packet_id_.size());
 
+        ret.append(property_length_buf_.data(), property_length_buf_.size());
+
         auto it = ret.end();
         ret.resize(ret.size() + property_length_);
         auto end = ret.end();
@@ -2735,6 +2746,7 @@ struct disconnect_message {
         // Properties. In this case the DISCONNECT has a Remaining Length of 0.
         if (reason_code_ != v5::disconnect_reason_code::normal_disconnection || MQTT_ALWAYS_SEND_REASON_CODE) {
             ret.push_back(static_cast<char>(reason_code_));
+            ret.append(property_length_buf_.data(), property_length_buf_.size());
 
             auto it = ret.end();
             ret.resize(ret.size() + property_length_);
@@ -2905,6 +2917,7 @@ struct auth_message {
         // Properties. In this case the AUTH has a Remaining Length of 0.
         if (reason_code_ != v5::auth_reason_code::success || MQTT_ALWAYS_SEND_REASON_CODE) {
             ret.push_back(static_cast<char>(reason_code_));
+            ret.append(property_length_buf_.data(), property_length_buf_.size());
 
             auto it = ret.end();
             ret.resize(ret.size() + property_length_);
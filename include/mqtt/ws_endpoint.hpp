@@ -7,6 +7,8 @@
 #if !defined(MQTT_WS_ENDPOINT_HPP)
 #define MQTT_WS_ENDPOINT_HPP
 
+#include <memory>
+
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/asio/bind_executor.hpp>
@@ -33,6 +35,8 @@ public:
          strand_(ioc.get_executor())
     {
         ws_.binary(true);
+        // One async_write call (that could contain multiple MQTT packets) is sent as one frame.
+        ws_.auto_fragment(false);
         ws_.set_option(
             boost::beast::websocket::stream_base::decorator(
                 [](boost::beast::websocket::request_type& req) {
@@ -46,63 +50,14 @@ public:
         as::mutable_buffer buffers,
         std::function<void(error_code, std::size_t)> handler
     ) override final {
-        auto req_size = as::buffer_size(buffers);
-
-        using beast_read_handler_t =
-            std::function<void(error_code ec, std::shared_ptr<void>)>;
-
-        std::shared_ptr<beast_read_handler_t> beast_read_handler;
-        if (req_size <= buffer_.size()) {
-            as::buffer_copy(buffers, buffer_.data(), req_size);
-            buffer_.consume(req_size);
-            handler(boost::system::errc::make_error_code(boost::system::errc::success), req_size);
+        if (buffers.size() == 0) {
+            handler(boost::system::errc::make_error_code(boost::system::errc::success), 0);
             return;
         }
-
-        beast_read_handler.reset(
-            new beast_read_handler_t(
-                [this, req_size, buffers, handler = force_move(handler)]
-                (error_code ec, std::shared_ptr<void> const& v) mutable {
-                    if (ec) {
-                        force_move(handler)(ec, 0);
-                        return;
-                    }
-                    if (!ws_.got_binary()) {
-                        buffer_.consume(buffer_.size());
-                        force_move(handler)
-                            (boost::system::errc::make_error_code(boost::system::errc::bad_message), 0);
-                        return;
-                    }
-                    if (req_size > buffer_.size()) {
-                        auto beast_read_handler = std::static_pointer_cast<beast_read_handler_t>(v);
-                        ws_.async_read(
-                            buffer_,
-                            as::bind_executor(
-                                strand_,
-                                [beast_read_handler]
-                                (error_code ec, std::size_t) {
-                                    (*beast_read_handler)(ec, beast_read_handler);
-                                }
-                            )
-                        );
-                        return;
-                    }
-                    as::buffer_copy(buffers, buffer_.data(), req_size);
-                    buffer_.consume(req_size);
-                    force_move(handler)(boost::system::errc::make_error_code(boost::system::errc::success), req_size);
-                }
-            )
-        );
-        ws_.async_read(
-            buffer_,
-            as::bind_executor(
-                strand_,
-                [beast_read_handler]
-                (error_code ec, std::size_t) {
-                    (*beast_read_handler)(ec, beast_read_handler);
-                }
-            )
-        );
+        // WebSocket message boundaries are not related to MQTT packet boundaries.
+        // So the payload is read directly into the requested buffer without
+        // intermediate message buffering.
+        async_read_impl(buffers, 0, force_move(handler));
     }
 
     MQTT_ALWAYS_INLINE void async_write(
@@ -239,6 +194,16 @@ public:
         ws_.set_option(std::forward<T>(t));
     }
 
+    /**
+     * @brief Set the object that is kept until the endpoint is destroyed.
+     * It is used to release the resource (e.g. deflate memory accounting) that is
+     * related to the endpoint.
+     * @param guard guard object. Typically created by shared_scope_guard().
+     */
+    void set_life_keeper(std::shared_ptr<void> guard) {
+        life_keeper_ = force_move(guard);
+    }
+
     template <typename ConstBufferSequence, typename AcceptHandler>
     void async_accept(
         ConstBufferSequence const& buffers,
@@ -272,6 +237,37 @@ public:
     }
 
 private:
+    void async_read_impl(
+        as::mutable_buffer buffers,
+        std::size_t transferred,
+        std::function<void(error_code, std::size_t)> handler
+    ) {
+        ws_.async_read_some(
+            buffers + transferred,
+            as::bind_executor(
+                strand_,
+                [this, buffers, transferred, handler = force_move(handler)]
+                (error_code ec, std::size_t bytes_transferred) mutable {
+                    if (ec) {
+                        force_move(handler)(ec, 0);
+                        return;
+                    }
+                    if (!ws_.got_binary()) {
+                        force_move(handler)
+                            (boost::system::errc::make_error_code(boost::system::errc::bad_message), 0);
+                        return;
+                    }
+                    transferred += bytes_transferred;
+                    if (transferred < buffers.size()) {
+                        async_read_impl(buffers, transferred, force_move(handler));
+                        return;
+                    }
+                    force_move(handler)(boost::system::errc::make_error_code(boost::system::errc::success), transferred);
+                }
+            )
+        );
+    }
+
     void async_read_until_closed(std::function<void(error_code)> handler) {
         auto buffer = std::make_shared<boost::beast::flat_buffer>();
         ws_.async_read(
@@ -349,7 +345,7 @@ private:
 
 private:
     boost::beast::websocket::stream<Socket> ws_;
-    boost::beast::flat_buffer buffer_;
+    std::shared_ptr<void> life_keeper_;
     Strand strand_;
 };
 
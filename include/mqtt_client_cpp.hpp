@@ -15,6 +15,7 @@
 #include <mqtt/fixed_header.hpp>
 #include <mqtt/hexdump.hpp>
 #include <mqtt/log.hpp>
+#include <mqtt/packet_decoder.hpp>
 #include <mqtt/publish.hpp>
 #include <mqtt/setup_log.hpp>
 #include <mqtt/subscribe_options.hpp>
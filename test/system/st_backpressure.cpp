@@ -0,0 +1,219 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/loopback_endpoint.hpp>
+#include <mqtt/broker/broker.hpp>
+
+BOOST_AUTO_TEST_SUITE(st_backpressure)
+
+namespace as = boost::asio;
+
+namespace {
+
+using endpoint_t = MQTT_NS::broker::endpoint_t;
+
+// The connections are loopback_endpoints with the small ring buffers, and everything
+// runs on one io_context. While the subscriber doesn't read, the broker's writes to it
+// wait for the ring, so the send queue of the broker's connection grows.
+constexpr std::size_t ring_bytes = 128;
+constexpr std::size_t high_watermark = 200;
+constexpr std::size_t low_watermark = 50;
+constexpr std::size_t messages = 20;
+
+struct fixture {
+    explicit fixture(MQTT_NS::broker::backpressure_policy policy)
+        :b(ioc) {
+        b.set_send_queue_watermark(high_watermark, low_watermark, policy);
+        pub = connect("pub", pub_bep);
+        sub = connect("sub", sub_bep);
+
+        sub->set_publish_handler(
+            [this]
+            (MQTT_NS::optional<endpoint_t::packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer,
+             MQTT_NS::buffer contents) {
+                received.emplace_back(contents);
+                return true;
+            }
+        );
+        // The subscriber stops reading while stalled.
+        sub->set_mqtt_message_processed_handler(
+            [this]
+            (MQTT_NS::any session_life_keeper) {
+                if (stalled) {
+                    stalled_keeper.emplace(MQTT_NS::force_move(session_life_keeper));
+                    return;
+                }
+                sub->async_read_next_message(MQTT_NS::force_move(session_life_keeper));
+            }
+        );
+    }
+
+    ~fixture() {
+        resume_subscriber();
+        pub->async_disconnect();
+        sub->async_disconnect();
+        poll();
+    }
+
+    std::shared_ptr<endpoint_t> connect(std::string const& cid, std::shared_ptr<endpoint_t>& bep) {
+        auto p = MQTT_NS::make_loopback_pair(ioc, ring_bytes);
+        bep = std::make_shared<endpoint_t>(ioc, p.first, MQTT_NS::protocol_version::undetermined);
+        b.handle_accept(bep);
+        auto c = std::make_shared<endpoint_t>(ioc, p.second, MQTT_NS::protocol_version::v3_1_1, true);
+        bool connacked = false;
+        c->set_connack_handler(
+            [&]
+            (bool, MQTT_NS::connect_return_code rc) {
+                BOOST_TEST(rc == MQTT_NS::connect_return_code::accepted);
+                connacked = true;
+                return true;
+            }
+        );
+        c->start_session();
+        c->async_connect(MQTT_NS::allocate_buffer(cid), MQTT_NS::nullopt, MQTT_NS::nullopt, MQTT_NS::nullopt, 0);
+        poll();
+        BOOST_TEST(connacked);
+        return c;
+    }
+
+    void subscribe(MQTT_NS::qos qos_value) {
+        bool subacked = false;
+        sub->set_suback_handler(
+            [&]
+            (endpoint_t::packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                subacked = true;
+                return true;
+            }
+        );
+        sub->async_subscribe(sub->acquire_unique_packet_id(), "topic1", qos_value);
+        poll();
+        BOOST_TEST(subacked);
+    }
+
+    void publish(MQTT_NS::qos qos_value) {
+        for (std::size_t i = 0; i != messages; ++i) {
+            std::string contents = std::to_string(i);
+            contents.resize(40, 'x');
+            auto pid = qos_value == MQTT_NS::qos::at_most_once ? 0 : pub->acquire_unique_packet_id();
+            pub->async_publish(pid, "topic1", MQTT_NS::force_move(contents), qos_value);
+        }
+    }
+
+    void resume_subscriber() {
+        stalled = false;
+        if (stalled_keeper) {
+            auto keeper = MQTT_NS::force_move(stalled_keeper.value());
+            stalled_keeper = MQTT_NS::nullopt;
+            sub->async_read_next_message(MQTT_NS::force_move(keeper));
+        }
+        poll();
+    }
+
+    // Run the handlers until nothing is ready. The io_context is stopped when it runs out of work,
+    // so it is restarted first.
+    void poll() {
+        ioc.restart();
+        ioc.poll();
+    }
+
+    // the messages are received in order from "0"
+    bool received_in_order() const {
+        for (std::size_t i = 0; i != received.size(); ++i) {
+            if (received[i].substr(0, received[i].find('x')) != std::to_string(i)) return false;
+        }
+        return true;
+    }
+
+    as::io_context ioc;
+    MQTT_NS::broker::broker_t b;
+    std::shared_ptr<endpoint_t> pub;
+    std::shared_ptr<endpoint_t> sub;
+    // the broker's side of the connections
+    std::shared_ptr<endpoint_t> pub_bep;
+    std::shared_ptr<endpoint_t> sub_bep;
+    bool stalled = false;
+    MQTT_NS::optional<MQTT_NS::any> stalled_keeper;
+    std::vector<std::string> received;
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( drop_qos0 ) {
+    MQTT_NS::broker::backpressure_policy policy;
+    policy.drop_qos0 = true;
+    fixture f(policy);
+    f.subscribe(MQTT_NS::qos::at_most_once);
+
+    f.stalled = true;
+    f.publish(MQTT_NS::qos::at_most_once);
+    f.poll();
+    BOOST_TEST(f.sub_bep->send_queue_congested());
+    auto dropped = f.b.get_metrics()[MQTT_NS::broker::broker_metric::dropped_messages];
+    BOOST_TEST(dropped != 0U);
+
+    f.resume_subscriber();
+    BOOST_TEST(!f.sub_bep->send_queue_congested());
+    // The messages that are queued before the congestion are received, and the rest are dropped.
+    BOOST_TEST(!f.received.empty());
+    BOOST_TEST(f.received.size() + dropped == messages);
+    BOOST_TEST(f.received_in_order());
+}
+
+BOOST_AUTO_TEST_CASE( queue_offline ) {
+    MQTT_NS::broker::backpressure_policy policy;
+    policy.queue_offline = true;
+    fixture f(policy);
+    f.subscribe(MQTT_NS::qos::at_least_once);
+
+    f.stalled = true;
+    f.publish(MQTT_NS::qos::at_least_once);
+    f.poll();
+    BOOST_TEST(f.sub_bep->send_queue_congested());
+    // The messages are queued in the session instead of the send queue.
+    // The send queue holds the messages until the congestion only.
+    BOOST_TEST(f.sub_bep->send_queue_bytes() < messages * 40);
+
+    f.resume_subscriber();
+    BOOST_TEST(!f.sub_bep->send_queue_congested());
+    // The queued messages are sent after the send queue is drained.
+    BOOST_TEST(f.received.size() == messages);
+    BOOST_TEST(f.received_in_order());
+    BOOST_TEST(f.b.get_metrics()[MQTT_NS::broker::broker_metric::dropped_messages] == 0U);
+}
+
+BOOST_AUTO_TEST_CASE( pause_publishers ) {
+    MQTT_NS::broker::backpressure_policy policy;
+    policy.pause_publishers = true;
+    fixture f(policy);
+    f.subscribe(MQTT_NS::qos::at_most_once);
+
+    f.stalled = true;
+    f.publish(MQTT_NS::qos::at_most_once);
+    f.poll();
+    BOOST_TEST(f.sub_bep->send_queue_congested());
+    // The broker stops reading from the publisher, so the publisher's messages
+    // are left in its own send queue.
+    BOOST_TEST(f.pub->send_queue_bytes() != 0U);
+    auto received_by_broker =
+        f.b.get_metrics()[MQTT_NS::broker::broker_metric::messages_received_qos0];
+    BOOST_TEST(received_by_broker < messages);
+
+    // The reading is resumed when the subscriber's send queue falls to the low watermark.
+    f.resume_subscriber();
+    BOOST_TEST(!f.sub_bep->send_queue_congested());
+    BOOST_TEST(f.pub->send_queue_bytes() == 0U);
+    BOOST_TEST(f.b.get_metrics()[MQTT_NS::broker::broker_metric::messages_received_qos0] == messages);
+    // Nothing is dropped.
+    BOOST_TEST(f.received.size() == messages);
+    BOOST_TEST(f.received_in_order());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
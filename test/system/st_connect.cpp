@@ -2047,4 +2047,143 @@ BOOST_AUTO_TEST_CASE( session_taken_over ) {
     };
     do_combi_test_sync(test, 3);
 }
+
+BOOST_AUTO_TEST_CASE( session_taken_over_clean_start_resubscribe ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& /*b*/) {
+        auto& c1 = cs[0];
+        auto& c2 = cs[1];
+        clear_ordered();
+        if (c1->get_protocol_version() != MQTT_NS::protocol_version::v5) {
+            finish();
+            return;
+        }
+        using packet_id_t = typename std::remove_reference_t<decltype(*c1)>::packet_id_t;
+        c1->set_client_id("cid1");
+        c2->set_client_id("cid1");
+        c1->set_clean_start(true);
+        c2->set_clean_start(true);
+
+        checker chk = {
+            // connect and subscribe
+            cont("h_connack1"),
+            cont("h_suback1"),
+            // connect with clean start. the old session is discarded
+            cont("h_disconnect1"),
+            cont("h_error1"),
+            deps("h_connack2", "h_suback1"),
+            // subscribe the same topic filter
+            deps("h_suback2_1", "h_connack2"),
+            deps("h_publish2_1", "h_suback2_1"),
+            // unsubscribe removes the subscription of the new session
+            deps("h_unsuback2", "h_publish2_1"),
+            deps("h_suback2_2", "h_unsuback2"),
+            deps("h_publish2_2", "h_suback2_2"),
+            // disconnect
+            deps("h_close2", "h_publish2_2"),
+        };
+
+        c1->set_v5_connack_handler(
+            [&]
+            (bool sp, MQTT_NS::v5::connect_reason_code connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack1");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connect_reason_code == MQTT_NS::v5::connect_reason_code::success);
+                c1->subscribe("topic1", MQTT_NS::qos::at_most_once);
+                return true;
+            }
+        );
+        c1->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties) {
+                MQTT_CHK("h_suback1");
+                c2->connect();
+                return true;
+            }
+        );
+        c1->set_v5_disconnect_handler(
+            [&](MQTT_NS::v5::disconnect_reason_code disconnect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_disconnect1");
+                BOOST_TEST(disconnect_reason_code == MQTT_NS::v5::disconnect_reason_code::session_taken_over);
+            }
+        );
+        c1->set_error_handler(
+            [&]
+            (MQTT_NS::error_code) {
+                MQTT_CHK("h_error1");
+            }
+        );
+
+        c2->set_v5_connack_handler(
+            [&]
+            (bool sp, MQTT_NS::v5::connect_reason_code connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack2");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connect_reason_code == MQTT_NS::v5::connect_reason_code::success);
+                c2->subscribe("topic1", MQTT_NS::qos::at_most_once);
+                return true;
+            }
+        );
+        c2->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties) {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_suback2_1");
+                        c2->publish("topic1", "topic1_contents", MQTT_NS::qos::at_most_once);
+                    },
+                    [&] {
+                        MQTT_CHK("h_suback2_2");
+                        // topic1 has been unsubscribed
+                        c2->publish("topic1", "topic1_contents", MQTT_NS::qos::at_most_once);
+                        c2->publish("topic2", "topic2_contents", MQTT_NS::qos::at_most_once);
+                    }
+                );
+                BOOST_TEST(ret);
+                return true;
+            }
+        );
+        c2->set_v5_unsuback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::unsuback_reason_code>, MQTT_NS::v5::properties) {
+                MQTT_CHK("h_unsuback2");
+                c2->subscribe("topic2", MQTT_NS::qos::at_most_once);
+                return true;
+            }
+        );
+        c2->set_v5_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer,
+             MQTT_NS::v5::properties) {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_publish2_1");
+                        BOOST_TEST(topic == "topic1");
+                        c2->unsubscribe("topic1");
+                    },
+                    [&] {
+                        MQTT_CHK("h_publish2_2");
+                        BOOST_TEST(topic == "topic2");
+                        c2->disconnect();
+                    }
+                );
+                BOOST_TEST(ret);
+                return true;
+            }
+        );
+        c2->set_close_handler(
+            [&] {
+                MQTT_CHK("h_close2");
+                finish();
+            }
+        );
+        c1->connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_sync(test, 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,157 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+BOOST_AUTO_TEST_SUITE(st_delivery_mailbox)
+
+BOOST_AUTO_TEST_CASE( pubsub_in_order ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        clear_ordered();
+        b.set_delivery_mailbox(true);
+
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // subscribe topic1 QoS2
+            cont("h_suback"),
+            // publish topic1 QoS0, QoS1, QoS2
+            cont("h_publish1"),
+            cont("h_publish2"),
+            cont("h_publish3"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        std::size_t received = 0;
+        auto on_publish =
+            [&]
+            (MQTT_NS::publish_options pubopts, MQTT_NS::buffer contents) {
+                switch (++received) {
+                case 1:
+                    MQTT_CHK("h_publish1");
+                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_most_once);
+                    BOOST_TEST(contents == "message1");
+                    break;
+                case 2:
+                    MQTT_CHK("h_publish2");
+                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                    BOOST_TEST(contents == "message2");
+                    break;
+                case 3:
+                    MQTT_CHK("h_publish3");
+                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::exactly_once);
+                    BOOST_TEST(contents == "message3");
+                    c->async_disconnect();
+                    break;
+                default:
+                    BOOST_CHECK(false);
+                    break;
+                }
+            };
+
+        auto publish =
+            [&] {
+                c->async_publish("topic1", "message1", MQTT_NS::qos::at_most_once);
+                c->async_publish("topic1", "message2", MQTT_NS::qos::at_least_once);
+                c->async_publish("topic1", "message3", MQTT_NS::qos::exactly_once);
+            };
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        switch (c->get_protocol_version()) {
+        case MQTT_NS::protocol_version::v3_1_1:
+            c->set_connack_handler(
+                [&chk, &c]
+                (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(sp == false);
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    c->async_subscribe("topic1", MQTT_NS::qos::exactly_once);
+                    return true;
+                });
+            c->set_suback_handler(
+                [&chk, &publish]
+                (packet_id_t, std::vector<MQTT_NS::suback_return_code> results) {
+                    MQTT_CHK("h_suback");
+                    BOOST_TEST(results.size() == 1U);
+                    BOOST_TEST(results[0] == MQTT_NS::suback_return_code::success_maximum_qos_2);
+                    publish();
+                    return true;
+                });
+            c->set_publish_handler(
+                [&on_publish]
+                (MQTT_NS::optional<packet_id_t>,
+                 MQTT_NS::publish_options pubopts,
+                 MQTT_NS::buffer topic,
+                 MQTT_NS::buffer contents) {
+                    BOOST_TEST(topic == "topic1");
+                    on_publish(pubopts, contents);
+                    return true;
+                });
+            break;
+        case MQTT_NS::protocol_version::v5:
+            c->set_v5_connack_handler(
+                [&chk, &c]
+                (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(sp == false);
+                    BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                    c->async_subscribe("topic1", MQTT_NS::qos::exactly_once);
+                    return true;
+                });
+            c->set_v5_suback_handler(
+                [&chk, &publish]
+                (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+                    MQTT_CHK("h_suback");
+                    BOOST_TEST(reasons.size() == 1U);
+                    BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_2);
+                    publish();
+                    return true;
+                });
+            c->set_v5_publish_handler(
+                [&on_publish]
+                (MQTT_NS::optional<packet_id_t>,
+                 MQTT_NS::publish_options pubopts,
+                 MQTT_NS::buffer topic,
+                 MQTT_NS::buffer contents,
+                 MQTT_NS::v5::properties /*props*/) {
+                    BOOST_TEST(topic == "topic1");
+                    on_publish(pubopts, contents);
+                    return true;
+                });
+            break;
+        default:
+            BOOST_CHECK(false);
+            break;
+        }
+
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,117 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <sstream>
+
+BOOST_AUTO_TEST_SUITE(st_latency)
+
+BOOST_AUTO_TEST_CASE( record ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            cont("h_connack"),
+            cont("h_suback"),
+            cont("h_publish"),
+            cont("h_close"),
+        };
+
+        b.set_latency_tracking(MQTT_NS::broker::latency_tracking_config());
+        auto latency = b.get_latency();
+        BOOST_TEST(latency);
+
+        c->set_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_most_once);
+                return true;
+            });
+        c->set_v5_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_most_once);
+                return true;
+            });
+        auto suback =
+            [&] {
+                MQTT_CHK("h_suback");
+                c->async_publish("topic1", "topic1_contents", MQTT_NS::qos::at_most_once);
+            };
+        c->set_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                suback();
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties /*props*/) {
+                suback();
+                return true;
+            });
+        auto publish =
+            [&] {
+                MQTT_CHK("h_publish");
+                c->async_disconnect();
+            };
+        c->set_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer,
+             MQTT_NS::buffer) {
+                publish();
+                return true;
+            });
+        c->set_v5_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer,
+             MQTT_NS::buffer,
+             MQTT_NS::v5::properties /*props*/) {
+                publish();
+                return true;
+            });
+        c->set_close_handler(
+            [&]
+            () {
+                MQTT_CHK("h_close");
+                // The write to the subscriber has been completed before DISCONNECT is received.
+                using MQTT_NS::broker::latency_stage;
+                BOOST_TEST(latency->histogram(latency_stage::auth).count() == 1U);
+                BOOST_TEST(latency->histogram(latency_stage::match).count() == 1U);
+                BOOST_TEST(latency->histogram(latency_stage::enqueue).count() == 1U);
+                BOOST_TEST(latency->histogram(latency_stage::write).count() == 1U);
+                BOOST_TEST(
+                    latency->histogram(latency_stage::write).max().count() >=
+                    latency->histogram(latency_stage::enqueue).max().count()
+                );
+                std::stringstream ss;
+                ss << *latency;
+                BOOST_TEST(ss.str().find("write") != std::string::npos);
+                b.set_latency_tracking(MQTT_NS::nullopt);
+                BOOST_TEST(!b.get_latency());
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,192 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+BOOST_AUTO_TEST_SUITE(st_memory_usage)
+
+BOOST_AUTO_TEST_CASE( count ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        clear_ordered();
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            cont("h_connack"),
+            cont("h_suback"),
+            cont("h_puback"),
+            cont("h_close"),
+        };
+
+        {
+            auto mu = b.get_memory_usage();
+            BOOST_TEST(mu.sessions.count == 0U);
+            BOOST_TEST(mu.retained_messages.count == 0U);
+        }
+
+        c->set_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                c->async_subscribe("topic2", MQTT_NS::qos::at_most_once);
+                return true;
+            });
+        c->set_v5_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                c->async_subscribe("topic2", MQTT_NS::qos::at_most_once);
+                return true;
+            });
+        auto suback =
+            [&] {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_suback");
+                    },
+                    [&] {
+                        c->async_publish("retained", "contents", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                    }
+                );
+                BOOST_TEST(ret);
+            };
+        c->set_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                suback();
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties /*props*/) {
+                suback();
+                return true;
+            });
+        auto puback =
+            [&] {
+                MQTT_CHK("h_puback");
+                auto mu = b.get_memory_usage();
+                BOOST_TEST(mu.sessions.count == 1U);
+                BOOST_TEST(mu.subscriptions.count == 2U);
+                BOOST_TEST(mu.retained_messages.count == 1U);
+                BOOST_TEST(mu.retained_messages.bytes >= std::string("retainedcontents").size());
+                BOOST_TEST(mu.offline_messages.count == 0U);
+                BOOST_TEST(mu.total_bytes() > mu.retained_messages.bytes);
+                c->async_disconnect();
+            };
+        c->set_puback_handler(
+            [&]
+            (packet_id_t) {
+                puback();
+                return true;
+            });
+        c->set_v5_puback_handler(
+            [&]
+            (packet_id_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties /*props*/) {
+                puback();
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish, &b]
+            () {
+                MQTT_CHK("h_close");
+                b.clear_all_retained_topics();
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_CASE( retained_payload_dedupe ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        clear_ordered();
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        b.set_retained_payload_dedupe(true);
+        checker chk = {
+            cont("h_connack"),
+            cont("h_puback_all"),
+            cont("h_close"),
+        };
+
+        auto connack =
+            [&] {
+                MQTT_CHK("h_connack");
+                for (int i = 0; i != 3; ++i) {
+                    c->async_publish("device" + std::to_string(i), "online", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                }
+            };
+        c->set_connack_handler(
+            [&]
+            (bool, MQTT_NS::connect_return_code) {
+                connack();
+                return true;
+            });
+        c->set_v5_connack_handler(
+            [&]
+            (bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                connack();
+                return true;
+            });
+        std::size_t pubacked = 0;
+        auto puback =
+            [&] {
+                if (++pubacked != 3) return;
+                MQTT_CHK("h_puback_all");
+                auto stats = b.get_retained_payload_stats();
+                BOOST_CHECK(stats);
+                BOOST_TEST(stats.value().unique_payloads == 1U);
+                BOOST_TEST(stats.value().unique_bytes == 6U);
+                BOOST_TEST(stats.value().references == 3U);
+                BOOST_TEST(stats.value().dedupe_ratio() == 3.0);
+                auto mu = b.get_memory_usage();
+                BOOST_TEST(mu.retained_messages.count == 3U);
+                c->async_disconnect();
+            };
+        c->set_puback_handler(
+            [&]
+            (packet_id_t) {
+                puback();
+                return true;
+            });
+        c->set_v5_puback_handler(
+            [&]
+            (packet_id_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties /*props*/) {
+                puback();
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish, &b]
+            () {
+                MQTT_CHK("h_close");
+                b.clear_all_retained_topics();
+                BOOST_TEST(b.get_retained_payload_stats().value().unique_payloads == 0U);
+                b.set_retained_payload_dedupe(false);
+                BOOST_CHECK(!b.get_retained_payload_stats());
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,128 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+BOOST_AUTO_TEST_SUITE(st_offline_spill)
+
+BOOST_AUTO_TEST_CASE( spilled_in_order ) {
+    clear_ordered();
+    checker chk = {
+        cont("h_connack_sub1"),
+        cont("h_suback_sub"),
+        cont("h_close_sub1"),
+        cont("h_connack_pub"),
+        cont("h_puback_pub"),
+        cont("h_close_pub"),
+        cont("h_connack_sub2"),
+        cont("h_publish_sub"),
+        cont("h_close_sub2"),
+    };
+
+    constexpr std::size_t num = 20;
+
+    boost::asio::io_context ioc;
+    MQTT_NS::broker::broker_t b(ioc);
+    MQTT_NS::broker::offline_spill_config config;
+    config.directory = ".";
+    // The second message exceeds the budget.
+    config.session_memory_budget = 300;
+    config.segment_size = 256;
+    b.set_offline_spill(config);
+    MQTT_NS::optional<test_server_no_tls> s;
+    s.emplace(ioc, b);
+
+    auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+    bool first = true;
+    std::size_t received = 0;
+    std::size_t acked = 0;
+
+    sub->set_client_id("sub");
+    sub->set_clean_session(false);
+    sub->set_connack_handler(
+        [&chk, &sub, &first]
+        (bool, MQTT_NS::connect_return_code) {
+            if (first) {
+                MQTT_CHK("h_connack_sub1");
+                sub->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+            }
+            else {
+                MQTT_CHK("h_connack_sub2");
+            }
+            return true;
+        });
+    sub->set_suback_handler(
+        [&chk, &sub]
+        (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+            MQTT_CHK("h_suback_sub");
+            sub->async_disconnect();
+            return true;
+        });
+    sub->set_publish_handler(
+        [&chk, &sub, &received]
+        (MQTT_NS::optional<packet_id_t>,
+         MQTT_NS::publish_options pubopts,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer contents) {
+            if (received == 0) MQTT_CHK("h_publish_sub");
+            BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+            BOOST_TEST(topic == "topic1");
+            BOOST_TEST(contents == "message" + std::to_string(received));
+            if (++received == num) sub->async_disconnect();
+            return true;
+        });
+    sub->set_close_handler(
+        [&chk, &pub, &s, &first]
+        () {
+            if (first) {
+                MQTT_CHK("h_close_sub1");
+                first = false;
+                pub->async_connect();
+            }
+            else {
+                MQTT_CHK("h_close_sub2");
+                s->close();
+            }
+        });
+
+    pub->set_client_id("pub");
+    pub->set_clean_session(true);
+    pub->set_connack_handler(
+        [&chk, &pub]
+        (bool, MQTT_NS::connect_return_code) {
+            MQTT_CHK("h_connack_pub");
+            for (std::size_t i = 0; i != num; ++i) {
+                pub->async_publish("topic1", "message" + std::to_string(i), MQTT_NS::qos::at_least_once);
+            }
+            return true;
+        });
+    pub->set_puback_handler(
+        [&chk, &pub, &acked]
+        (packet_id_t) {
+            if (acked == 0) MQTT_CHK("h_puback_pub");
+            if (++acked == num) pub->async_disconnect();
+            return true;
+        });
+    pub->set_close_handler(
+        [&chk, &sub]
+        () {
+            MQTT_CHK("h_close_pub");
+            sub->async_connect();
+        });
+    sub->async_connect();
+    ioc.run();
+    BOOST_TEST(received == num);
+    BOOST_TEST(chk.all());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
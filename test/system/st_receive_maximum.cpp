@@ -13,6 +13,8 @@
 
 #include <mqtt/optional.hpp>
 
+#include <set>
+
 BOOST_AUTO_TEST_SUITE(st_receive_maximum)
 
 using namespace MQTT_NS::literals;
@@ -285,4 +287,107 @@ BOOST_AUTO_TEST_CASE( async_manual_pubrel ) {
     do_combi_test_async(test);
 }
 
+BOOST_AUTO_TEST_CASE( retained_delivery ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        clear_ordered();
+
+        if (c->get_protocol_version() != MQTT_NS::protocol_version::v5) {
+            finish();
+            return;
+        }
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        // The retained messages are delivered in chunks within the receive maximum of the client.
+        b.set_retained_delivery_chunk(4);
+        std::size_t const num = 50;
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // publish the retained messages
+            cont("h_puback_all"),
+            // subscribe rd/#
+            cont("h_suback"),
+            cont("h_publish_all"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        std::size_t pubacked = 0;
+        std::set<std::string> received;
+        c->set_v5_connack_handler(
+            [&]
+            (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                for (std::size_t i = 0; i != num; ++i) {
+                    c->async_publish(
+                        "rd/" + std::to_string(i),
+                        "message" + std::to_string(i),
+                        MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes
+                    );
+                }
+                return true;
+            });
+        c->set_v5_puback_handler(
+            [&]
+            (packet_id_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties /*props*/) {
+                if (++pubacked == num) {
+                    MQTT_CHK("h_puback_all");
+                    c->async_subscribe("rd/#", MQTT_NS::qos::at_least_once);
+                }
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_suback");
+                BOOST_TEST(reasons.size() == 1U);
+                BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_1);
+                return true;
+            });
+        c->set_v5_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents,
+             MQTT_NS::v5::properties /*props*/) {
+                BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::yes);
+                BOOST_TEST(contents == "message" + std::string(topic.substr(3)));
+                received.emplace(topic);
+                if (received.size() == num) {
+                    MQTT_CHK("h_publish_all");
+                    c->async_disconnect();
+                }
+                return true;
+            });
+        c->set_close_handler(
+            [&]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect(
+            MQTT_NS::v5::properties {
+                MQTT_NS::v5::property::receive_maximum(3)
+            },
+            [](MQTT_NS::error_code) {}
+        );
+
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,158 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <cstdio>
+
+BOOST_AUTO_TEST_SUITE(st_retained_store)
+
+namespace {
+
+MQTT_NS::broker::retained_store_config make_config() {
+    MQTT_NS::broker::retained_store_config config;
+    config.path = "st_retained_store";
+    return config;
+}
+
+void remove_files() {
+    auto config = make_config();
+    std::remove((config.path + ".head").c_str());
+    for (int i = 0; i != 10; ++i) {
+        char num[16];
+        std::snprintf(num, sizeof(num), ".%010d", i);
+        std::remove((config.path + num).c_str());
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( load_retained_message ) {
+    remove_files();
+    clear_ordered();
+    checker chk = {
+        // broker 1
+        cont("h_connack_pub"),
+        cont("h_puback_pub1"),
+        cont("h_puback_pub2"),
+        cont("h_puback_pub3"),
+        cont("h_close_pub"),
+        // broker 2 loads the retained messages
+        cont("h_connack_sub"),
+        cont("h_suback_sub"),
+        cont("h_publish_sub"),
+        cont("h_close_sub"),
+    };
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_retained_store(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*pub)>::packet_id_t;
+
+        pub->set_client_id("pub");
+        pub->set_clean_session(true);
+        pub->set_connack_handler(
+            [&chk, &pub]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack_pub");
+                pub->async_publish("topic1", "message1", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                pub->async_publish("topic1", "message2", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                // removed
+                pub->async_publish("topic2", "message3", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                return true;
+            });
+        pub->set_puback_handler(
+            [&chk, &pub]
+            (packet_id_t) {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_puback_pub1");
+                    },
+                    [&] {
+                        MQTT_CHK("h_puback_pub2");
+                    },
+                    [&] {
+                        MQTT_CHK("h_puback_pub3");
+                        pub->async_publish("topic2", "", MQTT_NS::qos::at_most_once | MQTT_NS::retain::yes);
+                        pub->async_disconnect();
+                    }
+                );
+                BOOST_TEST(ret);
+                return true;
+            });
+        pub->set_close_handler(
+            [&chk, &s, &b]
+            () {
+                MQTT_CHK("h_close_pub");
+                s->close();
+                b.set_retained_store(MQTT_NS::nullopt);
+            });
+        pub->async_connect();
+        ioc.run();
+    }
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_retained_store(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+        sub->set_client_id("sub");
+        sub->set_clean_session(true);
+        sub->set_connack_handler(
+            [&chk, &sub]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack_sub");
+                sub->async_subscribe("#", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        sub->set_suback_handler(
+            [&chk]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                MQTT_CHK("h_suback_sub");
+                return true;
+            });
+        sub->set_publish_handler(
+            [&chk, &sub]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents) {
+                MQTT_CHK("h_publish_sub");
+                BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::yes);
+                BOOST_TEST(topic == "topic1");
+                BOOST_TEST(contents == "message2");
+                sub->async_disconnect();
+                return true;
+            });
+        sub->set_close_handler(
+            [&chk, &s, &b]
+            () {
+                MQTT_CHK("h_close_sub");
+                s->close();
+                b.set_retained_store(MQTT_NS::nullopt);
+            });
+        sub->async_connect();
+        ioc.run();
+    }
+    BOOST_TEST(chk.all());
+    remove_files();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
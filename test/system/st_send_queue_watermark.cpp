@@ -0,0 +1,102 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <string>
+
+BOOST_AUTO_TEST_SUITE(st_send_queue_watermark)
+
+BOOST_AUTO_TEST_CASE( congested_and_drained ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& /*b*/) {
+        auto& c = cs[0];
+        clear_ordered();
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+        c->set_send_queue_watermark(100, 10);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // publish topic1 QoS0 x 3 (exceed high watermark)
+            cont("congested"),
+            // all messages are written
+            cont("h_drained"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        auto publish =
+            [&] {
+                BOOST_TEST(!c->send_queue_congested());
+                std::string contents(50, 'a');
+                c->async_publish("topic1", contents, MQTT_NS::qos::at_most_once);
+                c->async_publish("topic1", contents, MQTT_NS::qos::at_most_once);
+                c->async_publish("topic1", contents, MQTT_NS::qos::at_most_once);
+                MQTT_CHK("congested");
+                BOOST_TEST(c->send_queue_congested());
+                BOOST_TEST(c->send_queue_bytes() > 100U);
+            };
+
+        switch (c->get_protocol_version()) {
+        case MQTT_NS::protocol_version::v3_1_1:
+            c->set_connack_handler(
+                [&chk, &publish]
+                (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(sp == false);
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    publish();
+                    return true;
+                });
+            break;
+        case MQTT_NS::protocol_version::v5:
+            c->set_v5_connack_handler(
+                [&chk, &publish]
+                (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(sp == false);
+                    BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                    publish();
+                    return true;
+                });
+            break;
+        default:
+            BOOST_CHECK(false);
+            break;
+        }
+
+        c->set_send_queue_drained_handler(
+            [&chk, &c]
+            () {
+                MQTT_CHK("h_drained");
+                BOOST_TEST(!c->send_queue_congested());
+                BOOST_TEST(c->send_queue_bytes() <= 10U);
+                c->async_disconnect();
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,307 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <cstdio>
+
+BOOST_AUTO_TEST_SUITE(st_session_wal)
+
+namespace {
+
+MQTT_NS::broker::session_wal_config make_config() {
+    MQTT_NS::broker::session_wal_config config;
+    config.path = "st_session_wal";
+    return config;
+}
+
+void remove_files() {
+    auto config = make_config();
+    std::remove((config.path + ".head").c_str());
+    for (int i = 0; i != 10; ++i) {
+        char num[16];
+        std::snprintf(num, sizeof(num), ".%010d", i);
+        std::remove((config.path + num).c_str());
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( recover_offline_message ) {
+    remove_files();
+    clear_ordered();
+    checker chk = {
+        // broker 1
+        cont("h_connack_sub1"),
+        cont("h_suback_sub"),
+        cont("h_close_sub1"),
+        cont("h_connack_pub"),
+        cont("h_puback_pub"),
+        cont("h_close_pub"),
+        // broker 2 recovers the session of sub
+        cont("h_connack_sub2"),
+        cont("h_publish_sub"),
+        cont("h_close_sub2"),
+    };
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_session_wal(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+        sub->set_client_id("sub");
+        sub->set_clean_session(false);
+        sub->set_connack_handler(
+            [&chk, &sub]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                MQTT_CHK("h_connack_sub1");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                sub->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        sub->set_suback_handler(
+            [&chk, &sub]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                MQTT_CHK("h_suback_sub");
+                sub->async_disconnect();
+                return true;
+            });
+        sub->set_close_handler(
+            [&chk, &pub]
+            () {
+                MQTT_CHK("h_close_sub1");
+                pub->async_connect();
+            });
+
+        pub->set_client_id("pub");
+        pub->set_clean_session(true);
+        pub->set_connack_handler(
+            [&chk, &pub]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack_pub");
+                pub->async_publish("topic1", "message1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        pub->set_puback_handler(
+            [&chk, &pub]
+            (packet_id_t) {
+                MQTT_CHK("h_puback_pub");
+                pub->async_disconnect();
+                return true;
+            });
+        pub->set_close_handler(
+            [&chk, &s, &b]
+            () {
+                MQTT_CHK("h_close_pub");
+                s->close();
+                b.set_session_wal(MQTT_NS::nullopt);
+            });
+        sub->async_connect();
+        ioc.run();
+    }
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_session_wal(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+        sub->set_client_id("sub");
+        sub->set_clean_session(false);
+        sub->set_connack_handler(
+            [&chk]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                MQTT_CHK("h_connack_sub2");
+                BOOST_TEST(sp == true);
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                return true;
+            });
+        sub->set_publish_handler(
+            [&chk, &sub]
+            (MQTT_NS::optional<packet_id_t> packet_id,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents) {
+                MQTT_CHK("h_publish_sub");
+                BOOST_CHECK(packet_id);
+                BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                BOOST_TEST(topic == "topic1");
+                BOOST_TEST(contents == "message1");
+                sub->async_disconnect();
+                return true;
+            });
+        sub->set_close_handler(
+            [&chk, &s, &b]
+            () {
+                MQTT_CHK("h_close_sub2");
+                s->close();
+                b.set_session_wal(MQTT_NS::nullopt);
+            });
+        sub->async_connect();
+        ioc.run();
+    }
+    BOOST_TEST(chk.all());
+    remove_files();
+}
+
+BOOST_AUTO_TEST_CASE( recover_unacked_message ) {
+    remove_files();
+    clear_ordered();
+    checker chk = {
+        // broker 1
+        cont("h_connack_sub1"),
+        cont("h_suback_sub"),
+        cont("h_connack_pub"),
+        // sub receives the message and doesn't send PUBACK
+        cont("h_publish_sub1"),
+        deps("h_puback_pub", "h_connack_pub"),
+        // broker 2 recovers the unacknowledged message of sub
+        cont("h_connack_sub2"),
+        cont("h_publish_sub2"),
+        cont("h_close_sub2"),
+    };
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_session_wal(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+        std::size_t done = 0;
+        // The broker stops while the message to sub is unacknowledged.
+        auto stop =
+            [&] {
+                if (++done != 2) return;
+                s->close();
+                b.set_session_wal(MQTT_NS::nullopt);
+                sub->async_force_disconnect();
+                pub->async_disconnect();
+            };
+
+        sub->set_client_id("sub");
+        sub->set_clean_session(false);
+        sub->set_auto_pub_response(false);
+        sub->set_connack_handler(
+            [&chk, &sub]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                MQTT_CHK("h_connack_sub1");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                sub->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        sub->set_suback_handler(
+            [&chk, &pub]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                MQTT_CHK("h_suback_sub");
+                pub->async_connect();
+                return true;
+            });
+        sub->set_publish_handler(
+            [&chk, &stop]
+            (MQTT_NS::optional<packet_id_t> packet_id,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents) {
+                MQTT_CHK("h_publish_sub1");
+                BOOST_CHECK(packet_id);
+                BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                BOOST_TEST(topic == "topic1");
+                BOOST_TEST(contents == "message1");
+                stop();
+                return true;
+            });
+
+        pub->set_client_id("pub");
+        pub->set_clean_session(true);
+        pub->set_connack_handler(
+            [&chk, &pub]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack_pub");
+                pub->async_publish("topic1", "message1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        pub->set_puback_handler(
+            [&chk, &stop]
+            (packet_id_t) {
+                MQTT_CHK("h_puback_pub");
+                stop();
+                return true;
+            });
+        sub->async_connect();
+        ioc.run();
+    }
+
+    {
+        boost::asio::io_context ioc;
+        MQTT_NS::broker::broker_t b(ioc);
+        b.set_session_wal(make_config());
+        MQTT_NS::optional<test_server_no_tls> s;
+        s.emplace(ioc, b);
+
+        auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+        sub->set_client_id("sub");
+        sub->set_clean_session(false);
+        sub->set_connack_handler(
+            [&chk]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                MQTT_CHK("h_connack_sub2");
+                BOOST_TEST(sp == true);
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                return true;
+            });
+        sub->set_publish_handler(
+            [&chk, &sub]
+            (MQTT_NS::optional<packet_id_t> packet_id,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents) {
+                MQTT_CHK("h_publish_sub2");
+                BOOST_CHECK(packet_id);
+                BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                BOOST_TEST(pubopts.get_dup() == MQTT_NS::dup::yes);
+                BOOST_TEST(topic == "topic1");
+                BOOST_TEST(contents == "message1");
+                sub->async_disconnect();
+                return true;
+            });
+        sub->set_close_handler(
+            [&chk, &s, &b]
+            () {
+                MQTT_CHK("h_close_sub2");
+                s->close();
+                b.set_session_wal(MQTT_NS::nullopt);
+            });
+        sub->async_connect();
+        ioc.run();
+    }
+    BOOST_TEST(chk.all());
+    remove_files();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
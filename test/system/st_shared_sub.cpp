@@ -10,6 +10,9 @@
 #include "ordered_caller.hpp"
 #include "../common/global_fixture.hpp"
 
+#include <map>
+#include <set>
+
 using namespace MQTT_NS::literals;
 
 BOOST_AUTO_TEST_SUITE(st_shared_sub)
@@ -73,20 +76,23 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
         cont("h_suback_s3"),
 
         // publish t1,t2,t1,t2,t1,t2,t1,t2  8times
+        // each share_name/topic_filter pair delivers to its members in turn
+        // sn1/t1: s1, s3
+        // sn1/t2: s1, s2, s3
 
         deps("h_publish_s1_1", "h_suback_s1"),
         cont("h_publish_s1_2"),
         cont("h_publish_s1_3"),
+        cont("h_publish_s1_4"),
         deps("h_publish_s2_1", "h_suback_s2"),
-        cont("h_publish_s2_2"),
         deps("h_publish_s3_1", "h_suback_s3"),
         cont("h_publish_s3_2"),
         cont("h_publish_s3_3"),
 
         // close
         deps("h_close_p1", "h_suback_s3"),
-        deps("h_close_s1", "h_publish_s1_3"),
-        deps("h_close_s2", "h_publish_s2_2"),
+        deps("h_close_s1", "h_publish_s1_4"),
+        deps("h_close_s2", "h_publish_s2_1"),
         deps("h_close_s3", "h_publish_s3_3"),
     };
 
@@ -216,7 +222,7 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
                     BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
                     BOOST_TEST(!packet_id);
                     BOOST_TEST(topic == "t2");
-                    BOOST_TEST(contents == "contents4");
+                    BOOST_TEST(contents == "contents2");
                 },
                 [&]{
                     MQTT_CHK("h_publish_s1_3");
@@ -225,7 +231,16 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
                     BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
                     BOOST_TEST(!packet_id);
                     BOOST_TEST(topic == "t1");
-                    BOOST_TEST(contents == "contents7");
+                    BOOST_TEST(contents == "contents5");
+                },
+                [&]{
+                    MQTT_CHK("h_publish_s1_4");
+                    BOOST_TEST(pubopts.get_dup() == MQTT_NS::dup::no);
+                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_most_once);
+                    BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
+                    BOOST_TEST(!packet_id);
+                    BOOST_TEST(topic == "t2");
+                    BOOST_TEST(contents == "contents8");
                     s1->disconnect();
                 }
             );
@@ -249,16 +264,7 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
                     BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
                     BOOST_TEST(!packet_id);
                     BOOST_TEST(topic == "t2");
-                    BOOST_TEST(contents == "contents2");
-                },
-                [&]{
-                    MQTT_CHK("h_publish_s2_2");
-                    BOOST_TEST(pubopts.get_dup() == MQTT_NS::dup::no);
-                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_most_once);
-                    BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
-                    BOOST_TEST(!packet_id);
-                    BOOST_TEST(topic == "t2");
-                    BOOST_TEST(contents == "contents6");
+                    BOOST_TEST(contents == "contents4");
                     s2->disconnect();
                 }
             );
@@ -290,8 +296,8 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
                     BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_most_once);
                     BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
                     BOOST_TEST(!packet_id);
-                    BOOST_TEST(topic == "t1");
-                    BOOST_TEST(contents == "contents5");
+                    BOOST_TEST(topic == "t2");
+                    BOOST_TEST(contents == "contents6");
                 },
                 [&]{
                     MQTT_CHK("h_publish_s3_3");
@@ -299,8 +305,8 @@ BOOST_AUTO_TEST_CASE( qos0 ) {
                     BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_most_once);
                     BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::no);
                     BOOST_TEST(!packet_id);
-                    BOOST_TEST(topic == "t2");
-                    BOOST_TEST(contents == "contents8");
+                    BOOST_TEST(topic == "t1");
+                    BOOST_TEST(contents == "contents7");
                     s3->disconnect();
                 }
             );
@@ -609,4 +615,546 @@ BOOST_AUTO_TEST_CASE( unsub_target ) {
 }
 
 
+BOOST_AUTO_TEST_CASE( least_inflight ) {
+    boost::asio::io_context iocb;
+    MQTT_NS::broker::broker_t b(iocb);
+    MQTT_NS::broker::shared_target_policy policy;
+    policy.strategy = MQTT_NS::broker::shared_target_strategy::least_inflight;
+    b.set_shared_subscription_policy(policy);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    // s1 has Receive Maximum 1 and doesn't send PUBACK.
+    // After s1 receives the first message, s1 is saturated and s2 receives the rest.
+
+    auto p1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+
+    p1->set_clean_start(true);
+    s1->set_clean_start(true);
+    s2->set_clean_start(true);
+
+    p1->set_client_id("p1");
+    s1->set_client_id("s1");
+    s2->set_client_id("s2");
+
+    s1->set_auto_pub_response(false);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*p1)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack_p1"),
+        cont("h_connack_s1"),
+        cont("h_connack_s2"),
+
+        // shared subscribe
+        cont("h_suback_s1"),
+        cont("h_suback_s2"),
+
+        // publish t1 4times
+        deps("h_publish_s1_1", "h_suback_s2"),
+        deps("h_publish_s2_1", "h_suback_s2"),
+        cont("h_publish_s2_2"),
+        cont("h_publish_s2_3"),
+
+        // close
+        deps("h_close_p1", "h_publish_s2_3"),
+        deps("h_close_s1", "h_publish_s2_3"),
+        deps("h_close_s2", "h_publish_s2_3"),
+    };
+
+    p1->set_v5_connack_handler(
+        [&]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack_p1");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->connect(
+                MQTT_NS::v5::properties {
+                    MQTT_NS::v5::property::receive_maximum(1)
+                }
+            );
+            return true;
+        }
+    );
+
+    s1->set_v5_connack_handler(
+        [&]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack_s1");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s2->connect();
+            return true;
+        }
+    );
+
+    s2->set_v5_connack_handler(
+        [&]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack_s2");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->subscribe("$share/sn1/t1", MQTT_NS::qos::at_least_once);
+            return true;
+        }
+    );
+
+    s1->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback_s1");
+            BOOST_TEST(reasons.size() == 1U);
+            BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_1);
+            s2->subscribe("$share/sn1/t1", MQTT_NS::qos::at_least_once);
+            return true;
+        }
+    );
+
+    s2->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback_s2");
+            BOOST_TEST(reasons.size() == 1U);
+            BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_1);
+            p1->publish("t1", "contents1", MQTT_NS::qos::at_least_once);
+            p1->publish("t1", "contents2", MQTT_NS::qos::at_least_once);
+            p1->publish("t1", "contents3", MQTT_NS::qos::at_least_once);
+            p1->publish("t1", "contents4", MQTT_NS::qos::at_least_once);
+            return true;
+        }
+    );
+
+    s1->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> packet_id,
+         MQTT_NS::publish_options pubopts,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            MQTT_CHK("h_publish_s1_1");
+            BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+            BOOST_TEST(packet_id);
+            BOOST_TEST(topic == "t1");
+            BOOST_TEST(contents == "contents1");
+            return true;
+        }
+    );
+
+    s2->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> packet_id,
+         MQTT_NS::publish_options pubopts,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            auto ret = MQTT_ORDERED(
+                [&] {
+                    MQTT_CHK("h_publish_s2_1");
+                    BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                    BOOST_TEST(packet_id);
+                    BOOST_TEST(topic == "t1");
+                    BOOST_TEST(contents == "contents2");
+                },
+                [&]{
+                    MQTT_CHK("h_publish_s2_2");
+                    BOOST_TEST(contents == "contents3");
+                },
+                [&]{
+                    MQTT_CHK("h_publish_s2_3");
+                    BOOST_TEST(contents == "contents4");
+                    p1->disconnect();
+                    s1->disconnect();
+                    s2->disconnect();
+                }
+            );
+            BOOST_TEST(ret);
+            return true;
+        }
+    );
+
+    auto g = MQTT_NS::shared_scope_guard(
+        [&] {
+            finish();
+        }
+    );
+
+    p1->set_close_handler(
+        [&, g]
+        () mutable {
+            MQTT_CHK("h_close_p1");
+            g.reset();
+        }
+    );
+    s1->set_close_handler(
+        [&, g]
+        () mutable {
+            MQTT_CHK("h_close_s1");
+            g.reset();
+        }
+    );
+    s2->set_close_handler(
+        [&, g]
+        () mutable {
+            MQTT_CHK("h_close_s2");
+            g.reset();
+        }
+    );
+
+    g.reset();
+    p1->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( sticky_topic ) {
+    boost::asio::io_context iocb;
+    MQTT_NS::broker::broker_t b(iocb);
+    MQTT_NS::broker::shared_target_policy policy;
+    policy.strategy = MQTT_NS::broker::shared_target_strategy::sticky_topic;
+    b.set_shared_subscription_policy(policy);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    // The messages of the same topic go to the same member.
+
+    auto p1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+
+    p1->set_clean_start(true);
+    s1->set_clean_start(true);
+    s2->set_clean_start(true);
+
+    p1->set_client_id("p1");
+    s1->set_client_id("s1");
+    s2->set_client_id("s2");
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*p1)>::packet_id_t;
+
+    std::vector<std::string> const topics { "t/a", "t/b", "t/c", "t/d" };
+    std::size_t const rounds = 3;
+    //       topic        receivers
+    std::map<std::string, std::set<std::string>> received;
+    std::size_t count = 0;
+
+    auto on_publish =
+        [&](std::string const& receiver, MQTT_NS::buffer const& topic) {
+            received[std::string(topic)].insert(receiver);
+            if (++count == topics.size() * rounds) {
+                p1->disconnect();
+                s1->disconnect();
+                s2->disconnect();
+            }
+        };
+
+    p1->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->connect();
+            return true;
+        }
+    );
+    s1->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s2->connect();
+            return true;
+        }
+    );
+    s2->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->subscribe("$share/sn1/t/+", MQTT_NS::qos::at_most_once);
+            return true;
+        }
+    );
+    s1->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            s2->subscribe("$share/sn1/t/+", MQTT_NS::qos::at_most_once);
+            return true;
+        }
+    );
+    s2->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            for (std::size_t i = 0; i != rounds; ++i) {
+                for (auto const& t : topics) {
+                    p1->publish(t, "contents", MQTT_NS::qos::at_most_once);
+                }
+            }
+            return true;
+        }
+    );
+    s1->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer /*contents*/,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            on_publish("s1", topic);
+            return true;
+        }
+    );
+    s2->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer /*contents*/,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            on_publish("s2", topic);
+            return true;
+        }
+    );
+
+    auto g = MQTT_NS::shared_scope_guard(
+        [&] {
+            finish();
+        }
+    );
+    p1->set_close_handler([g]() mutable { g.reset(); });
+    s1->set_close_handler([g]() mutable { g.reset(); });
+    s2->set_close_handler([g]() mutable { g.reset(); });
+
+    g.reset();
+    p1->connect();
+
+    ioc.run();
+    BOOST_TEST(count == topics.size() * rounds);
+    BOOST_TEST(received.size() == topics.size());
+    for (auto const& r : received) {
+        BOOST_TEST(r.second.size() == 1U);
+    }
+    th.join();
+}
+
+
+BOOST_AUTO_TEST_CASE( multi_share_name ) {
+    boost::asio::io_context iocb;
+    MQTT_NS::broker::broker_t b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    // s1 and s3 subscribe sn1/t1, s2 subscribes sn2/t1.
+    // Each message is delivered once per share_name.
+
+    auto p1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto s3 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+
+    p1->set_clean_start(true);
+    s1->set_clean_start(true);
+    s2->set_clean_start(true);
+    s3->set_clean_start(true);
+
+    p1->set_client_id("p1");
+    s1->set_client_id("s1");
+    s2->set_client_id("s2");
+    s3->set_client_id("s3");
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*p1)>::packet_id_t;
+
+    std::size_t const messages = 4;
+    //       contents     receivers
+    std::map<std::string, std::set<std::string>> received;
+    std::size_t count = 0;
+
+    auto on_publish =
+        [&](std::string const& receiver, MQTT_NS::buffer const& contents) {
+            received[std::string(contents)].insert(receiver);
+            if (++count == messages * 2) {
+                p1->disconnect();
+                s1->disconnect();
+                s2->disconnect();
+                s3->disconnect();
+            }
+        };
+
+    p1->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->connect();
+            return true;
+        }
+    );
+    s1->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s2->connect();
+            return true;
+        }
+    );
+    s2->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s3->connect();
+            return true;
+        }
+    );
+    s3->set_v5_connack_handler(
+        [&]
+        (bool, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            s1->subscribe("$share/sn1/t1", MQTT_NS::qos::at_most_once);
+            return true;
+        }
+    );
+    s1->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(reasons.size() == 1U);
+            s2->subscribe("$share/sn2/t1", MQTT_NS::qos::at_most_once);
+            return true;
+        }
+    );
+    s2->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(reasons.size() == 1U);
+            s3->subscribe("$share/sn1/t1", MQTT_NS::qos::at_most_once);
+            return true;
+        }
+    );
+    s3->set_v5_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            for (std::size_t i = 0; i != messages; ++i) {
+                p1->publish("t1", "contents" + std::to_string(i), MQTT_NS::qos::at_most_once);
+            }
+            return true;
+        }
+    );
+    s1->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            on_publish("s1", contents);
+            return true;
+        }
+    );
+    s2->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            on_publish("s2", contents);
+            return true;
+        }
+    );
+    s3->set_v5_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) mutable {
+            on_publish("s3", contents);
+            return true;
+        }
+    );
+
+    auto g = MQTT_NS::shared_scope_guard(
+        [&] {
+            finish();
+        }
+    );
+    p1->set_close_handler([g]() mutable { g.reset(); });
+    s1->set_close_handler([g]() mutable { g.reset(); });
+    s2->set_close_handler([g]() mutable { g.reset(); });
+    s3->set_close_handler([g]() mutable { g.reset(); });
+
+    g.reset();
+    p1->connect();
+
+    ioc.run();
+    BOOST_TEST(count == messages * 2);
+    BOOST_TEST(received.size() == messages);
+    for (auto const& r : received) {
+        // one of s1 and s3, and s2
+        BOOST_TEST(r.second.size() == 2U);
+        BOOST_TEST(r.second.count("s2") == 1U);
+    }
+    th.join();
+}
+
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "ordered_caller.hpp"
+#include "../common/global_fixture.hpp"
+
+BOOST_AUTO_TEST_SUITE(st_slow_consumer)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( inflight_saturated_disconnect ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        clear_ordered();
+
+        if (c->get_protocol_version() != MQTT_NS::protocol_version::v5) {
+            finish();
+            return;
+        }
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+        // Don't send PUBACK. The inflight window of the broker is saturated.
+        c->set_auto_pub_response(false);
+
+        MQTT_NS::broker::slow_consumer_policy policy;
+        policy.check_interval = std::chrono::milliseconds(50);
+        policy.max_inflight_saturated = std::chrono::milliseconds(100);
+        policy.action = MQTT_NS::broker::slow_consumer_action::disconnect;
+        b.set_slow_consumer_policy(policy);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // subscribe topic1 QoS1
+            cont("h_suback"),
+            // publish topic1 QoS1 x 2
+            cont("h_publish"),
+            // disconnected by the broker
+            cont("h_disconnect"),
+            cont("h_error"),
+        };
+
+        c->set_v5_connack_handler(
+            [&chk, &c]
+            (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&chk, &c]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_suback");
+                BOOST_TEST(reasons.size() == 1U);
+                BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_1);
+                c->async_publish("topic1", "message1", MQTT_NS::qos::at_least_once);
+                c->async_publish("topic1", "message2", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_v5_puback_handler(
+            []
+            (packet_id_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties /*props*/) {
+                return true;
+            });
+        c->set_v5_publish_handler(
+            [&chk]
+            (MQTT_NS::optional<packet_id_t> packet_id,
+             MQTT_NS::publish_options pubopts,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents,
+             MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_publish");
+                BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+                BOOST_CHECK(packet_id);
+                BOOST_TEST(topic == "topic1");
+                BOOST_TEST(contents == "message1");
+                return true;
+            });
+        c->set_v5_disconnect_handler(
+            [&chk]
+            (MQTT_NS::v5::disconnect_reason_code reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_disconnect");
+                BOOST_TEST(reason_code == MQTT_NS::v5::disconnect_reason_code::quota_exceeded);
+            });
+        c->set_close_handler(
+            []
+            () {
+                BOOST_CHECK(false);
+            });
+        c->set_error_handler(
+            [&chk, &finish, &b]
+            (MQTT_NS::error_code) {
+                // The broker closes the connection after sending DISCONNECT
+                MQTT_CHK("h_error");
+                b.set_slow_consumer_policy(MQTT_NS::nullopt);
+                finish();
+            });
+        c->async_connect(
+            MQTT_NS::v5::properties{
+                MQTT_NS::v5::property::receive_maximum(1)
+            }
+        );
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
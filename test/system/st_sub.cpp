@@ -1044,6 +1044,123 @@ BOOST_AUTO_TEST_CASE( sub_unsub_prop ) {
     do_combi_test_sync(test);
 }
 
+BOOST_AUTO_TEST_CASE( sub_unsub_many_in_one_packet ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& /*b*/) {
+        auto& c = cs[0];
+        clear_ordered();
+        if (c->get_protocol_version() != MQTT_NS::protocol_version::v5) {
+            finish();
+            return;
+        }
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        std::size_t const num = 100;
+        std::vector<std::string> topics;
+        for (std::size_t i = 0; i != num; ++i) topics.push_back("t/" + std::to_string(i));
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // subscribe t/0 ... t/99 in one packet
+            cont("h_suback1"),
+            cont("h_publish1"),
+            // unsubscribe t/0 ... t/99 in one packet
+            cont("h_unsuback"),
+            // subscribe t/0
+            cont("h_suback2"),
+            cont("h_publish2"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        c->set_v5_connack_handler(
+            [&chk, &c, &topics]
+            (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                BOOST_TEST(sp == false);
+                BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                std::vector<std::tuple<std::string, MQTT_NS::subscribe_options>> v;
+                for (auto const& t : topics) v.emplace_back(t, MQTT_NS::qos::at_least_once);
+                c->async_subscribe(
+                    v,
+                    [](MQTT_NS::error_code) {}
+                );
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&chk, &c, num]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_suback1");
+                        BOOST_TEST(reasons.size() == num);
+                        for (auto r : reasons) {
+                            BOOST_TEST(r == MQTT_NS::v5::suback_reason_code::granted_qos_1);
+                        }
+                        c->async_publish("t/42", "topic1_contents", MQTT_NS::qos::at_most_once);
+                    },
+                    [&] {
+                        MQTT_CHK("h_suback2");
+                        BOOST_TEST(reasons.size() == 1);
+                        // t/42 is not delivered because it has been unsubscribed.
+                        c->async_publish("t/42", "topic1_contents", MQTT_NS::qos::at_most_once);
+                        c->async_publish("t/0", "topic1_contents", MQTT_NS::qos::at_most_once);
+                    }
+                );
+                BOOST_TEST(ret);
+                return true;
+            });
+        c->set_v5_unsuback_handler(
+            [&chk, &c, num]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::unsuback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_unsuback");
+                BOOST_TEST(reasons.size() == num);
+                c->async_subscribe("t/0", MQTT_NS::qos::at_most_once, [](MQTT_NS::error_code) {});
+                return true;
+            });
+        c->set_v5_publish_handler(
+            [&chk, &c, &topics]
+            (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+             MQTT_NS::publish_options /*pubopts*/,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer /*contents*/,
+             MQTT_NS::v5::properties /*props*/) {
+                auto ret = MQTT_ORDERED(
+                    [&] {
+                        MQTT_CHK("h_publish1");
+                        BOOST_TEST(topic == "t/42");
+                        c->async_unsubscribe(topics, [](MQTT_NS::error_code) {});
+                    },
+                    [&] {
+                        MQTT_CHK("h_publish2");
+                        BOOST_TEST(topic == "t/0");
+                        c->async_disconnect();
+                    }
+                );
+                BOOST_TEST(ret);
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
 BOOST_AUTO_TEST_CASE( suback_unsuback_prop ) {
     auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
         auto& c = cs[0];
@@ -0,0 +1,151 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+#include "../common/global_fixture.hpp"
+
+BOOST_AUTO_TEST_SUITE(st_sys_metrics)
+
+BOOST_AUTO_TEST_CASE( publish ) {
+    auto test = [](boost::asio::io_context& ioc, auto& cs, auto finish, auto& b) {
+        auto& c = cs[0];
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            cont("h_connack"),
+            cont("h_suback_topic1"),
+            cont("h_publish_topic1"),
+            cont("h_suback_sys"),
+            cont("h_publish_sys"),
+            cont("h_close"),
+        };
+
+        MQTT_NS::broker::sys_metrics_config config;
+        config.interval = std::chrono::milliseconds(10);
+        b.set_sys_metrics(config);
+
+        // "#" of the default config doesn't match $SYS topics.
+        MQTT_NS::broker::security security;
+        security.default_config();
+        security.add_auth(
+            "$SYS/#",
+            { }, MQTT_NS::broker::security::authorization::type::deny,
+            { "anonymous" }, MQTT_NS::broker::security::authorization::type::allow
+        );
+        b.set_security(MQTT_NS::force_move(security));
+
+        c->set_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::connect_return_code) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_v5_connack_handler(
+            [&chk, &c]
+            (bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_connack");
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+
+        std::size_t subacks = 0;
+        auto suback =
+            [&] {
+                if (subacks++ == 0) {
+                    MQTT_CHK("h_suback_topic1");
+                    c->async_publish("topic1", "topic1_contents", MQTT_NS::qos::at_least_once);
+                }
+                else {
+                    MQTT_CHK("h_suback_sys");
+                }
+            };
+        c->set_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::suback_return_code>) {
+                suback();
+                return true;
+            });
+        c->set_v5_suback_handler(
+            [&]
+            (packet_id_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties /*props*/) {
+                suback();
+                return true;
+            });
+        c->set_puback_handler(
+            [&]
+            (packet_id_t) {
+                return true;
+            });
+        c->set_v5_puback_handler(
+            [&]
+            (packet_id_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties /*props*/) {
+                return true;
+            });
+
+        bool done = false;
+        auto publish =
+            [&] (MQTT_NS::buffer topic, MQTT_NS::buffer contents) {
+                if (topic == "topic1") {
+                    MQTT_CHK("h_publish_topic1");
+                    c->async_subscribe("$SYS/broker/messages/received/qos1", MQTT_NS::qos::at_most_once);
+                    return;
+                }
+                BOOST_TEST(topic == "$SYS/broker/messages/received/qos1");
+                // The value that is published before the message is received can be delivered at first.
+                if (done || contents != "1") return;
+                MQTT_CHK("h_publish_sys");
+                done = true;
+                auto values = b.get_metrics();
+                using MQTT_NS::broker::broker_metric;
+                BOOST_TEST(values[broker_metric::connects] == 1U);
+                BOOST_TEST(values[broker_metric::messages_received_qos1] == 1U);
+                BOOST_TEST(values[broker_metric::messages_received_qos0] == 0U);
+                BOOST_TEST(values[broker_metric::messages_sent_qos1] == 1U);
+                BOOST_TEST(values[broker_metric::bytes_received] == std::string("topic1topic1_contents").size());
+                BOOST_TEST(values[broker_metric::subscriptions] == 2U);
+                BOOST_TEST(values[broker_metric::dropped_messages] == 0U);
+                c->async_disconnect();
+            };
+        c->set_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents) {
+                publish(MQTT_NS::force_move(topic), MQTT_NS::force_move(contents));
+                return true;
+            });
+        c->set_v5_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t>,
+             MQTT_NS::publish_options,
+             MQTT_NS::buffer topic,
+             MQTT_NS::buffer contents,
+             MQTT_NS::v5::properties /*props*/) {
+                publish(MQTT_NS::force_move(topic), MQTT_NS::force_move(contents));
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish, &b]
+            () {
+                MQTT_CHK("h_close");
+                b.set_sys_metrics(MQTT_NS::nullopt);
+                b.clear_all_retained_topics();
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_async(test);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,74 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <sstream>
+
+#include <mqtt/broker/latency_histogram.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_latency_histogram)
+
+using MQTT_NS::broker::latency_histogram;
+
+BOOST_AUTO_TEST_CASE( index ) {
+    std::size_t const bucket_count = latency_histogram::bucket_count;
+    // exact below sub_bucket_count
+    for (std::uint64_t v = 0; v != latency_histogram::sub_bucket_count; ++v) {
+        BOOST_TEST(latency_histogram::index(v) == v);
+        BOOST_TEST(latency_histogram::highest_equivalent(latency_histogram::index(v)) == v);
+    }
+    // the bucket covers the value, and the relative error is bounded
+    for (std::uint64_t v = latency_histogram::sub_bucket_count; v < latency_histogram::max_value; v = v * 3 / 2 + 1) {
+        auto i = latency_histogram::index(v);
+        BOOST_TEST(i < bucket_count);
+        auto high = latency_histogram::highest_equivalent(i);
+        BOOST_TEST(high >= v);
+        BOOST_TEST(high - v <= v / latency_histogram::sub_bucket_half);
+        BOOST_TEST(latency_histogram::index(high) == i);
+        BOOST_TEST(latency_histogram::index(high + 1) == i + 1);
+    }
+    BOOST_TEST(latency_histogram::index(latency_histogram::max_value) == bucket_count - 1);
+}
+
+BOOST_AUTO_TEST_CASE( percentile ) {
+    latency_histogram h;
+    BOOST_TEST(h.value_at_percentile(99.0).count() == 0);
+    for (std::int64_t i = 1; i <= 1000; ++i) {
+        h.record(std::chrono::microseconds(i));
+    }
+    BOOST_TEST(h.count() == 1000U);
+    BOOST_TEST(h.max().count() == 1000000);
+    BOOST_TEST(h.min().count() == 1000);
+    BOOST_TEST(h.mean().count() == 500500);
+
+    auto near =
+        [](std::chrono::nanoseconds actual, std::chrono::nanoseconds expected) {
+            return
+                actual >= expected &&
+                actual.count() <= expected.count() + expected.count() / static_cast<std::int64_t>(latency_histogram::sub_bucket_half);
+        };
+    BOOST_TEST(near(h.value_at_percentile(50.0), std::chrono::microseconds(500)));
+    BOOST_TEST(near(h.value_at_percentile(99.0), std::chrono::microseconds(990)));
+    BOOST_TEST(h.value_at_percentile(100.0).count() == 1000000);
+
+    h.reset();
+    BOOST_TEST(h.count() == 0U);
+    BOOST_TEST(h.max().count() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( dump ) {
+    MQTT_NS::broker::broker_latency l;
+    l.record(MQTT_NS::broker::latency_stage::write, std::chrono::microseconds(250));
+    std::stringstream ss;
+    ss << l;
+    auto s = ss.str();
+    BOOST_TEST(s.find("p999(us)") != std::string::npos);
+    BOOST_TEST(s.find("write") != std::string::npos);
+    BOOST_TEST(s.find("250.0") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/loopback_endpoint.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_loopback_endpoint)
+
+namespace as = boost::asio;
+
+BOOST_AUTO_TEST_CASE( read_write ) {
+    as::io_context ioc;
+    auto p = MQTT_NS::make_loopback_pair(ioc);
+
+    std::string const sent = "hello world";
+    std::vector<as::const_buffer> bufs { as::buffer(sent.data(), 5), as::buffer(sent.data() + 5, 6) };
+    bool written = false;
+    p.first->async_write(
+        bufs,
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 11);
+            written = true;
+        }
+    );
+
+    char received[11];
+    p.second->async_read(
+        as::buffer(received, 5),
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 5);
+            p.second->async_read(
+                as::buffer(received + 5, 6),
+                [&](MQTT_NS::error_code ec, std::size_t bytes) {
+                    BOOST_TEST(!ec);
+                    BOOST_TEST(bytes == 6);
+                }
+            );
+        }
+    );
+    ioc.run();
+    BOOST_TEST(written);
+    BOOST_TEST(std::string(received, 11) == sent);
+}
+
+BOOST_AUTO_TEST_CASE( ring_full ) {
+    as::io_context ioc;
+    auto p = MQTT_NS::make_loopback_pair(ioc, 16);
+
+    std::string sent;
+    for (std::size_t i = 0; i != 100; ++i) sent.push_back(static_cast<char>('a' + i % 26));
+
+    bool written = false;
+    p.first->async_write(
+        { as::buffer(sent) },
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 100);
+            written = true;
+        }
+    );
+    ioc.poll();
+    // The write waits for the peer to read.
+    BOOST_TEST(!written);
+    ioc.restart();
+
+    std::string received(100, '\0');
+    p.second->async_read(
+        as::buffer(&received[0], received.size()),
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 100);
+        }
+    );
+    ioc.run();
+    BOOST_TEST(written);
+    BOOST_TEST(received == sent);
+}
+
+BOOST_AUTO_TEST_CASE( sync_write ) {
+    as::io_context ioc;
+    auto p = MQTT_NS::make_loopback_pair(ioc, 16);
+
+    // The ring grows instead of blocking.
+    std::string sent(100, 'x');
+    MQTT_NS::error_code ec;
+    BOOST_TEST(p.first->write({ as::buffer(sent) }, ec) == 100);
+    BOOST_TEST(!ec);
+
+    std::string received(100, '\0');
+    p.second->async_read(
+        as::buffer(&received[0], received.size()),
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 100);
+        }
+    );
+    ioc.run();
+    BOOST_TEST(received == sent);
+}
+
+BOOST_AUTO_TEST_CASE( close ) {
+    as::io_context ioc;
+    auto p = MQTT_NS::make_loopback_pair(ioc);
+
+    std::string const sent = "abc";
+    MQTT_NS::error_code ec;
+    p.first->write({ as::buffer(sent) }, ec);
+    BOOST_TEST(!ec);
+
+    bool own_read_aborted = false;
+    char own[1];
+    p.first->async_read(
+        as::buffer(own, 1),
+        [&](MQTT_NS::error_code ec, std::size_t) {
+            BOOST_TEST(ec == as::error::operation_aborted);
+            own_read_aborted = true;
+        }
+    );
+    p.first->force_shutdown_and_close(ec);
+
+    // The remaining bytes are read before eof.
+    char received[4];
+    bool eof = false;
+    p.second->async_read(
+        as::buffer(received, 3),
+        [&](MQTT_NS::error_code ec, std::size_t bytes) {
+            BOOST_TEST(!ec);
+            BOOST_TEST(bytes == 3);
+            p.second->async_read(
+                as::buffer(received, 1),
+                [&](MQTT_NS::error_code ec, std::size_t bytes) {
+                    BOOST_TEST(ec == as::error::eof);
+                    BOOST_TEST(bytes == 0);
+                    eof = true;
+                }
+            );
+        }
+    );
+
+    bool write_failed = false;
+    p.second->async_write(
+        { as::buffer(sent) },
+        [&](MQTT_NS::error_code ec, std::size_t) {
+            BOOST_TEST(ec == as::error::broken_pipe);
+            write_failed = true;
+        }
+    );
+    ioc.run();
+    BOOST_TEST(own_read_aborted);
+    BOOST_TEST(eof);
+    BOOST_TEST(write_failed);
+}
+
+BOOST_AUTO_TEST_CASE( lowest_layer ) {
+    as::io_context ioc;
+    auto p = MQTT_NS::make_loopback_pair(ioc);
+    MQTT_NS::error_code ec;
+    p.first->lowest_layer().set_option(as::ip::tcp::no_delay(true), ec);
+    BOOST_TEST(ec);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
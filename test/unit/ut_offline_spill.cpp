@@ -0,0 +1,147 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/broker/offline_message.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_offline_spill)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+std::shared_ptr<MQTT_NS::broker::offline_spill> make_spill(std::size_t session_budget) {
+    MQTT_NS::broker::offline_spill_config config;
+    config.directory = ".";
+    config.session_memory_budget = session_budget;
+    config.segment_size = 64;
+    return std::make_shared<MQTT_NS::broker::offline_spill>(config);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( spill_queue ) {
+    auto spill = make_spill(0);
+    {
+        MQTT_NS::broker::spill_queue q(spill);
+        BOOST_TEST(q.empty());
+        for (int i = 0; i != 10; ++i) {
+            q.push("payload" + std::to_string(i));
+        }
+        BOOST_TEST(q.size() == 10U);
+        BOOST_TEST(spill->spilled_bytes() == 10U * (4U + 8U));
+
+        std::vector<std::string> all;
+        q.for_each([&](MQTT_NS::buffer const& p) { all.emplace_back(p); });
+        BOOST_TEST(all.size() == 10U);
+        BOOST_TEST(all.back() == "payload9");
+
+        for (int i = 0; i != 5; ++i) {
+            BOOST_TEST(q.front() == "payload" + std::to_string(i));
+            q.pop();
+        }
+        BOOST_TEST(q.size() == 5U);
+        BOOST_TEST(spill->spilled_bytes() == 5U * (4U + 8U));
+        q.push("payload10");
+        BOOST_TEST(q.front() == "payload5");
+    }
+    BOOST_TEST(spill->spilled_bytes() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE( memory_budget ) {
+    boost::asio::io_context ioc;
+    auto spill = make_spill(1);
+    {
+        MQTT_NS::broker::offline_messages oms;
+        oms.set_spill(spill);
+        for (int i = 0; i != 10; ++i) {
+            oms.push_back(
+                ioc,
+                "topic1"_mb,
+                MQTT_NS::allocate_buffer("message" + std::to_string(i)),
+                MQTT_NS::qos::at_least_once,
+                MQTT_NS::v5::properties {
+                    MQTT_NS::v5::property::message_expiry_interval(100)
+                }
+            );
+            oms.enforce_memory_budget();
+        }
+        BOOST_TEST(oms.size() == 10U);
+        BOOST_TEST(oms.spilled_size() == 10U);
+        BOOST_TEST(spill->memory_bytes() == 0U);
+
+        std::vector<std::uint64_t> seqs;
+        oms.for_each(
+            [&](MQTT_NS::broker::offline_message const& m) {
+                seqs.push_back(m.seq());
+                BOOST_TEST(m.topic() == "topic1");
+                BOOST_CHECK(m.message_expiry());
+            }
+        );
+        BOOST_TEST(seqs.size() == 10U);
+        for (std::size_t i = 0; i != seqs.size(); ++i) {
+            BOOST_TEST(seqs[i] == i);
+        }
+
+        // disable the budget. new messages are kept in memory.
+        oms.set_spill(nullptr);
+        oms.push_back(ioc, "topic1"_mb, "message10"_mb, MQTT_NS::qos::at_most_once, MQTT_NS::v5::properties{});
+        oms.enforce_memory_budget();
+        BOOST_TEST(oms.size() == 11U);
+        BOOST_TEST(oms.spilled_size() == 10U);
+        oms.clear();
+        BOOST_TEST(oms.empty());
+    }
+    BOOST_TEST(spill->memory_bytes() == 0U);
+    BOOST_TEST(spill->spilled_bytes() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE( shared_segments ) {
+    auto spill = make_spill(0);
+    {
+        // The records of all queues are appended to the shared spill files.
+        std::vector<std::unique_ptr<MQTT_NS::broker::spill_queue>> qs;
+        for (int i = 0; i != 100; ++i) {
+            qs.emplace_back(new MQTT_NS::broker::spill_queue(spill));
+            BOOST_TEST(qs.back()->push("payload" + std::to_string(i % 10)));
+        }
+        // A new file is started after 6 records of 12 bytes exceed 64 bytes.
+        BOOST_TEST(spill->segments() == 17U);
+        for (int i = 0; i != 100; ++i) {
+            BOOST_TEST(qs[std::size_t(i)]->front() == "payload" + std::to_string(i % 10));
+        }
+        // The file is closed when all records in it are popped.
+        for (std::size_t i = 0; i != 6; ++i) qs[i]->pop();
+        BOOST_TEST(spill->segments() == 16U);
+    }
+    // The current file is kept for the next record.
+    BOOST_TEST(spill->segments() == 1U);
+    BOOST_TEST(spill->spilled_bytes() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE( spill_failure ) {
+    boost::asio::io_context ioc;
+    MQTT_NS::broker::offline_spill_config config;
+    config.directory = "ut_offline_spill_does_not_exist";
+    config.session_memory_budget = 1;
+    auto spill = std::make_shared<MQTT_NS::broker::offline_spill>(config);
+    {
+        MQTT_NS::broker::offline_messages oms;
+        oms.set_spill(spill);
+        for (int i = 0; i != 3; ++i) {
+            oms.push_back(ioc, "topic1"_mb, "message"_mb, MQTT_NS::qos::at_least_once, MQTT_NS::v5::properties{});
+            // The messages are kept in memory if the spill file cannot be opened.
+            oms.enforce_memory_budget();
+        }
+        BOOST_TEST(oms.size() == 3U);
+        BOOST_TEST(oms.spilled_size() == 0U);
+        BOOST_TEST(spill->spilled_bytes() == 0U);
+    }
+    BOOST_TEST(spill->memory_bytes() == 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,305 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/packet_decoder.hpp>
+#include <mqtt/message_variant.hpp>
+#include <mqtt/property_parse.hpp>
+
+#include <cstring>
+
+BOOST_AUTO_TEST_SUITE(ut_packet_decoder)
+
+namespace as = boost::asio;
+using namespace MQTT_NS::literals;
+
+namespace {
+
+as::const_buffer cb(char const* s) {
+    return as::buffer(s, std::strlen(s));
+}
+
+// Record the decoded packets as strings.
+struct recorder {
+    void operator()(MQTT_NS::connect_view const& v) {
+        std::string s = "connect cid:" + std::string(v.client_id);
+        if (v.will) s += " will:" + std::string(v.will->topic) + "/" + std::string(v.will->message);
+        if (v.user_name) s += " user:" + std::string(*v.user_name);
+        if (v.password) s += " pw:" + std::string(*v.password);
+        events.push_back(s);
+    }
+    void operator()(MQTT_NS::connack_view const& v) {
+        events.push_back("connack sp:" + std::to_string(v.session_present) + " rc:" + std::to_string(v.reason_code));
+    }
+    void operator()(MQTT_NS::publish_view const& v) {
+        events.push_back(
+            "publish " + std::string(v.topic) + " " + std::string(v.payload) +
+            " pid:" + (v.packet_id ? std::to_string(*v.packet_id) : std::string("none"))
+        );
+    }
+    void operator()(MQTT_NS::puback_view const& v) {
+        events.push_back("puback pid:" + std::to_string(v.packet_id) + " rc:" + std::to_string(v.reason_code));
+    }
+    void operator()(MQTT_NS::pubrec_view const& v) {
+        events.push_back("pubrec pid:" + std::to_string(v.packet_id));
+    }
+    void operator()(MQTT_NS::pubrel_view const& v) {
+        events.push_back("pubrel pid:" + std::to_string(v.packet_id));
+    }
+    void operator()(MQTT_NS::pubcomp_view const& v) {
+        events.push_back("pubcomp pid:" + std::to_string(v.packet_id));
+    }
+    void operator()(MQTT_NS::subscribe_view const& v) {
+        std::string s = "subscribe pid:" + std::to_string(v.packet_id);
+        v.for_each(
+            [&](MQTT_NS::string_view topic_filter, MQTT_NS::subscribe_options opts) {
+                s += " " + std::string(topic_filter) + ":" + std::to_string(static_cast<int>(opts.get_qos()));
+            }
+        );
+        events.push_back(s);
+    }
+    void operator()(MQTT_NS::suback_view const& v) {
+        events.push_back("suback pid:" + std::to_string(v.packet_id) + " n:" + std::to_string(v.reason_codes.size()));
+    }
+    void operator()(MQTT_NS::unsubscribe_view const& v) {
+        std::string s = "unsubscribe pid:" + std::to_string(v.packet_id);
+        v.for_each(
+            [&](MQTT_NS::string_view topic_filter) {
+                s += " " + std::string(topic_filter);
+            }
+        );
+        events.push_back(s);
+    }
+    void operator()(MQTT_NS::unsuback_view const& v) {
+        events.push_back("unsuback pid:" + std::to_string(v.packet_id));
+    }
+    void operator()(MQTT_NS::pingreq_view const&) {
+        events.push_back("pingreq");
+    }
+    void operator()(MQTT_NS::pingresp_view const&) {
+        events.push_back("pingresp");
+    }
+    void operator()(MQTT_NS::disconnect_view const& v) {
+        events.push_back("disconnect rc:" + std::to_string(v.reason_code));
+    }
+    void operator()(MQTT_NS::auth_view const& v) {
+        events.push_back("auth rc:" + std::to_string(v.reason_code));
+    }
+
+    std::vector<std::string> events;
+};
+
+std::string v3_1_1_stream() {
+    std::string s;
+    s += MQTT_NS::connect_message(
+        10,
+        "cid1"_mb,
+        true,
+        MQTT_NS::will("wt"_mb, "wmsg"_mb, MQTT_NS::qos::at_least_once),
+        "user"_mb,
+        "pw"_mb
+    ).continuous_buffer();
+    s += MQTT_NS::publish_message(
+        1,
+        cb("topic1"),
+        cb("payload1"),
+        MQTT_NS::qos::at_least_once
+    ).continuous_buffer();
+    s += MQTT_NS::puback_message(1).continuous_buffer();
+    s += MQTT_NS::subscribe_message(
+        {
+            std::make_tuple(cb("t1"), MQTT_NS::subscribe_options(MQTT_NS::qos::at_least_once)),
+            std::make_tuple(cb("t2/#"), MQTT_NS::subscribe_options(MQTT_NS::qos::exactly_once))
+        },
+        2
+    ).continuous_buffer();
+    s += MQTT_NS::unsubscribe_message({ cb("t1") }, 3).continuous_buffer();
+    s += MQTT_NS::pingreq_message().continuous_buffer();
+    s += MQTT_NS::disconnect_message().continuous_buffer();
+    return s;
+}
+
+std::vector<std::string> const v3_1_1_events {
+    "connect cid:cid1 will:wt/wmsg user:user pw:pw",
+    "publish topic1 payload1 pid:1",
+    "puback pid:1 rc:0",
+    "subscribe pid:2 t1:1 t2/#:2",
+    "unsubscribe pid:3 t1",
+    "pingreq",
+    "disconnect rc:0",
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( v3_1_1_whole ) {
+    auto s = v3_1_1_stream();
+    MQTT_NS::packet_decoder d;
+    recorder r;
+    BOOST_TEST(!d.feed(s, r));
+    BOOST_TEST(d.get_protocol_version() == MQTT_NS::protocol_version::v3_1_1);
+    BOOST_TEST(r.events == v3_1_1_events);
+}
+
+BOOST_AUTO_TEST_CASE( v3_1_1_byte_by_byte ) {
+    auto s = v3_1_1_stream();
+    MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+    recorder r;
+    for (auto c : s) {
+        BOOST_TEST(!d.feed(MQTT_NS::string_view(&c, 1), r));
+    }
+    BOOST_TEST(r.events == v3_1_1_events);
+}
+
+BOOST_AUTO_TEST_CASE( in_place ) {
+    auto s = MQTT_NS::publish_message(
+        0,
+        cb("topic1"),
+        cb("payload1"),
+        MQTT_NS::qos::at_most_once | MQTT_NS::retain::yes
+    ).continuous_buffer();
+    MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+    bool called = false;
+    auto ec = d.feed(
+        s,
+        MQTT_NS::make_lambda_visitor(
+            [&](MQTT_NS::publish_view const& v) {
+                called = true;
+                // The view refers to the fed bytes.
+                BOOST_TEST(v.payload.data() == s.data() + s.size() - v.payload.size());
+                BOOST_TEST(v.pubopts.get_retain() == MQTT_NS::retain::yes);
+                BOOST_TEST(!v.packet_id);
+            },
+            [&](auto const&) {
+                BOOST_TEST(false);
+            }
+        )
+    );
+    BOOST_TEST(!ec);
+    BOOST_TEST(called);
+}
+
+BOOST_AUTO_TEST_CASE( v5_properties ) {
+    std::string s;
+    s += MQTT_NS::v5::connect_message(
+        0,
+        "cid1"_mb,
+        false,
+        MQTT_NS::nullopt,
+        MQTT_NS::nullopt,
+        MQTT_NS::nullopt,
+        { MQTT_NS::v5::property::session_expiry_interval(100) }
+    ).continuous_buffer();
+    s += MQTT_NS::v5::publish_message(
+        1,
+        cb("topic1"),
+        cb("payload1"),
+        MQTT_NS::qos::exactly_once,
+        { MQTT_NS::v5::property::content_type("json"_mb) }
+    ).continuous_buffer();
+    s += MQTT_NS::v5::puback_message(1, MQTT_NS::v5::puback_reason_code::not_authorized, {}).continuous_buffer();
+    s += MQTT_NS::v5::disconnect_message(MQTT_NS::v5::disconnect_reason_code::session_taken_over, {}).continuous_buffer();
+
+    MQTT_NS::packet_decoder d;
+    std::vector<std::string> events;
+    // feed in two pieces that split the publish packet
+    auto split = s.size() / 2;
+    for (auto piece : { MQTT_NS::string_view(s).substr(0, split), MQTT_NS::string_view(s).substr(split) }) {
+        auto ec = d.feed(
+            piece,
+            MQTT_NS::make_lambda_visitor(
+                [&](MQTT_NS::connect_view const& v) {
+                    BOOST_TEST(v.version == MQTT_NS::protocol_version::v5);
+                    auto props = MQTT_NS::v5::property::parse(MQTT_NS::buffer(v.properties));
+                    BOOST_TEST(props.size() == 1);
+                    events.push_back("connect");
+                },
+                [&](MQTT_NS::publish_view const& v) {
+                    BOOST_TEST(v.topic == "topic1");
+                    BOOST_TEST(v.payload == "payload1");
+                    BOOST_TEST(v.packet_id.value() == 1);
+                    auto props = MQTT_NS::v5::property::parse(MQTT_NS::buffer(v.properties));
+                    BOOST_TEST(props.size() == 1);
+                    events.push_back("publish");
+                },
+                [&](MQTT_NS::puback_view const& v) {
+                    BOOST_TEST(v.reason_code == static_cast<std::uint8_t>(MQTT_NS::v5::puback_reason_code::not_authorized));
+                    events.push_back("puback");
+                },
+                [&](MQTT_NS::disconnect_view const& v) {
+                    BOOST_TEST(v.reason_code == static_cast<std::uint8_t>(MQTT_NS::v5::disconnect_reason_code::session_taken_over));
+                    events.push_back("disconnect");
+                },
+                [&](auto const&) {
+                    BOOST_TEST(false);
+                }
+            )
+        );
+        BOOST_TEST(!ec);
+    }
+    BOOST_TEST((events == std::vector<std::string>{ "connect", "publish", "puback", "disconnect" }));
+}
+
+BOOST_AUTO_TEST_CASE( error ) {
+    recorder r;
+    {
+        // reserved bits of subscribe
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+        std::string s { static_cast<char>(0b1000'0000u), 0 };
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::bad_message);
+    }
+    {
+        // remaining length exceeds four bytes
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+        std::string s { 0b0011'0000, -1, -1, -1, -1, 1 };
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::bad_message);
+    }
+    {
+        // QoS3 publish
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+        std::string s { 0b0011'0110, 3, 0, 1, 't' };
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::bad_message);
+    }
+    {
+        // pingreq with the payload
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1);
+        std::string s { static_cast<char>(0b1100'0000u), 1, 0 };
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::protocol_error);
+    }
+    {
+        // the packet before connect
+        MQTT_NS::packet_decoder d;
+        std::string s { static_cast<char>(0b1100'0000u), 0 };
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::protocol_error);
+    }
+    BOOST_TEST(r.events.empty());
+}
+
+BOOST_AUTO_TEST_CASE( maximum_packet_size ) {
+    auto s = MQTT_NS::publish_message(
+        0,
+        cb("topic1"),
+        cb("payload1"),
+        MQTT_NS::qos::at_most_once
+    ).continuous_buffer();
+    recorder r;
+    {
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1, s.size());
+        BOOST_TEST(!d.feed(s, r));
+    }
+    {
+        MQTT_NS::packet_decoder d(MQTT_NS::protocol_version::v3_1_1, s.size() - 1);
+        BOOST_TEST(d.feed(s, r) == boost::system::errc::protocol_error);
+        // The error remains until reset.
+        BOOST_TEST(d.feed(MQTT_NS::pingreq_message().continuous_buffer(), r) == boost::system::errc::protocol_error);
+        d.reset();
+        BOOST_TEST(!d.feed(MQTT_NS::pingreq_message().continuous_buffer(), r));
+    }
+    BOOST_TEST((r.events == std::vector<std::string>{ "publish topic1 payload1 pid:none", "pingreq" }));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
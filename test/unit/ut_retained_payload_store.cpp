@@ -0,0 +1,151 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/broker/retained_payload_store.hpp>
+#include <mqtt/broker/retained_messages.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_retained_payload_store)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( intern ) {
+    MQTT_NS::broker::retained_payload_store store;
+    auto s0 = store.stats();
+    BOOST_TEST(s0.unique_payloads == 0U);
+    BOOST_TEST(s0.dedupe_ratio() == 1.0);
+
+    auto p1 = store.intern(MQTT_NS::allocate_buffer("online"));
+    auto p2 = store.intern(MQTT_NS::allocate_buffer("online"));
+    auto p3 = store.intern(MQTT_NS::allocate_buffer("offline"));
+    BOOST_TEST(p1.first == "online");
+    BOOST_TEST(p2.first == "online");
+    BOOST_TEST(p3.first == "offline");
+
+    // The identical payloads share the buffer.
+    BOOST_TEST(p1.first.data() == p2.first.data());
+    BOOST_TEST(p1.first.data() != p3.first.data());
+
+    auto s1 = store.stats();
+    BOOST_TEST(s1.unique_payloads == 2U);
+    BOOST_TEST(s1.unique_bytes == 13U);
+    BOOST_TEST(s1.references == 3U);
+    BOOST_TEST(s1.referenced_bytes == 19U);
+    BOOST_TEST(s1.dedupe_ratio() == 19.0 / 13.0);
+    auto size1 = store.memory_size();
+
+    // The payload remains while it is referred to.
+    p1.second.reset();
+    BOOST_TEST(store.stats().unique_payloads == 2U);
+    BOOST_TEST(store.memory_size() == size1);
+
+    // The buffer outlives the reference, but the store releases the payload.
+    p2.second.reset();
+    BOOST_TEST(p2.first == "online");
+    auto s2 = store.stats();
+    BOOST_TEST(s2.unique_payloads == 1U);
+    BOOST_TEST(s2.unique_bytes == 7U);
+    BOOST_TEST(store.memory_size() < size1);
+
+    // The payload without lifetime is copied.
+    auto p4 = store.intern(MQTT_NS::buffer("online"_mb));
+    BOOST_TEST(p4.first.has_life());
+    BOOST_TEST(store.stats().unique_payloads == 2U);
+
+    p3.second.reset();
+    p4.second.reset();
+    BOOST_TEST(store.stats().unique_payloads == 0U);
+    BOOST_TEST(store.memory_size() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE( release_packet_buffer ) {
+    MQTT_NS::broker::retained_payload_store store;
+
+    // The topic and the payload of a small packet share one receive buffer.
+    std::string packet = "topic1payload";
+    auto spa = MQTT_NS::make_shared_ptr_array(packet.size());
+    std::copy(packet.begin(), packet.end(), spa.get());
+    MQTT_NS::string_view view(spa.get(), packet.size());
+    auto contents = MQTT_NS::buffer(view.substr(6), spa);
+    BOOST_TEST(spa.use_count() == 2);
+
+    auto p = store.intern(MQTT_NS::force_move(contents));
+    BOOST_TEST(p.first == "payload");
+    // The stored payload doesn't keep the receive buffer.
+    BOOST_TEST(spa.use_count() == 1);
+
+    // The identical payload refers to the stored one.
+    auto p2 = store.intern(MQTT_NS::buffer(view.substr(6), spa));
+    BOOST_TEST(p2.first.data() == p.first.data());
+    BOOST_TEST(spa.use_count() == 1);
+}
+
+BOOST_AUTO_TEST_CASE( outlive_store ) {
+    MQTT_NS::broker::retained_payload_store::ref_t ref;
+    {
+        MQTT_NS::broker::retained_payload_store store;
+        ref = store.intern(MQTT_NS::allocate_buffer("payload")).second;
+    }
+    // Releasing the reference after the store is destroyed is safe.
+    ref.reset();
+}
+
+BOOST_AUTO_TEST_CASE( retained_messages ) {
+    MQTT_NS::broker::retained_payload_store store;
+    MQTT_NS::broker::retained_messages map;
+    auto insert =
+        [&](std::string const& topic, std::string const& contents) {
+            auto p = store.intern(MQTT_NS::allocate_buffer(contents));
+            map.insert_or_assign(
+                topic,
+                MQTT_NS::broker::retain_t(
+                    MQTT_NS::allocate_buffer(topic),
+                    MQTT_NS::force_move(p.first),
+                    MQTT_NS::v5::properties(),
+                    MQTT_NS::qos::at_most_once,
+                    nullptr,
+                    MQTT_NS::force_move(p.second)
+                )
+            );
+        };
+
+    for (std::size_t i = 0; i != 100; ++i) {
+        insert("device/" + std::to_string(i) + "/status", "online");
+    }
+    auto s1 = store.stats();
+    BOOST_TEST(s1.unique_payloads == 1U);
+    BOOST_TEST(s1.references == 100U);
+    BOOST_TEST(s1.dedupe_ratio() == 100.0);
+
+    // The deduplicated payloads are not included in the size of the map.
+    MQTT_NS::broker::retained_messages plain;
+    plain.insert_or_assign(
+        "device/0/status",
+        MQTT_NS::broker::retain_t(
+            MQTT_NS::allocate_buffer("device/0/status"),
+            MQTT_NS::allocate_buffer("online"),
+            MQTT_NS::v5::properties(),
+            MQTT_NS::qos::at_most_once
+        )
+    );
+    std::size_t size = 0;
+    map.find("device/0/status", [&](MQTT_NS::broker::retain_t const& r) { size = r.memory_size(); });
+    std::size_t plain_size = 0;
+    plain.find("device/0/status", [&](MQTT_NS::broker::retain_t const& r) { plain_size = r.memory_size(); });
+    BOOST_TEST(size + 6 == plain_size);
+
+    // Replaced and erased messages release the payload.
+    insert("device/0/status", "offline");
+    BOOST_TEST(store.stats().unique_payloads == 2U);
+    map.erase("device/0/status");
+    BOOST_TEST(store.stats().unique_payloads == 1U);
+    map.clear();
+    BOOST_TEST(store.stats().unique_payloads == 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
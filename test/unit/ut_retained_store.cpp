@@ -0,0 +1,182 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include <mqtt/broker/retained_store.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_retained_store)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+MQTT_NS::broker::retained_store_config make_config(std::string const& name) {
+    MQTT_NS::broker::retained_store_config config;
+    config.path = name;
+    return config;
+}
+
+void remove_files(std::string const& name) {
+    std::remove((name + ".head").c_str());
+    for (int i = 0; i != 10; ++i) {
+        char num[16];
+        std::snprintf(num, sizeof(num), ".%010d", i);
+        std::remove((name + num).c_str());
+    }
+}
+
+std::map<std::string, MQTT_NS::broker::stored_retain> load_all(MQTT_NS::broker::retained_store& rs) {
+    std::map<std::string, MQTT_NS::broker::stored_retain> ret;
+    rs.load(
+        [&](MQTT_NS::broker::stored_retain&& r) {
+            auto topic = std::string(r.topic);
+            ret.emplace(topic, MQTT_NS::force_move(r));
+        }
+    );
+    return ret;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( load_latest ) {
+    std::string name = "ut_retained_store_load";
+    remove_files(name);
+    {
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        BOOST_TEST(load_all(rs).empty());
+        rs.set("a/b"_mb, "message1"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.set(
+            "a/c"_mb, "message2"_mb,
+            MQTT_NS::v5::properties {
+                MQTT_NS::v5::property::content_type("text"_mb)
+            },
+            MQTT_NS::qos::at_least_once,
+            MQTT_NS::nullopt
+        );
+        // overwritten
+        rs.set("a/b"_mb, "message3"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::exactly_once, MQTT_NS::nullopt);
+        rs.set("a/d"_mb, "message4"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.erase("a/d");
+        // already expired on load
+        rs.set(
+            "a/e"_mb, "message5"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once,
+            std::chrono::steady_clock::now() - std::chrono::seconds(1)
+        );
+        rs.set(
+            "a/f"_mb, "message6"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once,
+            std::chrono::steady_clock::now() + std::chrono::hours(1)
+        );
+        rs.flush();
+    }
+    {
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        auto retains = load_all(rs);
+        BOOST_TEST(retains.size() == 3U);
+        BOOST_TEST(retains.at("a/b").contents == "message3");
+        BOOST_TEST(retains.at("a/b").qos_value == MQTT_NS::qos::exactly_once);
+        BOOST_TEST(retains.at("a/c").contents == "message2");
+        BOOST_TEST(retains.at("a/c").props.size() == 1U);
+        BOOST_CHECK(retains.at("a/f").message_expiry);
+        // 7 records, 3 live
+        BOOST_TEST(rs.needs_compaction(retains.size()) == true);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_CASE( compact_and_torn_tail ) {
+    std::string name = "ut_retained_store_compact";
+    remove_files(name);
+    {
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        load_all(rs);
+        for (int i = 0; i != 10; ++i) {
+            rs.set("a/b"_mb, "message1"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        }
+        rs.clear();
+        BOOST_TEST(rs.needs_compaction(1) == true);
+        rs.compact(
+            [](MQTT_NS::broker::retained_store& s) {
+                s.set("a/c"_mb, "message2"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+            }
+        );
+        BOOST_TEST(rs.needs_compaction(1) == false);
+        rs.set("a/d"_mb, "message3"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.flush();
+    }
+    {
+        // append a torn record
+        std::ofstream ofs(name + ".0000000001", std::ios::binary | std::ios::app);
+        ofs << "\x10\x00";
+    }
+    {
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        auto retains = load_all(rs);
+        BOOST_TEST(retains.size() == 2U);
+        BOOST_TEST(retains.at("a/c").contents == "message2");
+        BOOST_TEST(retains.at("a/d").contents == "message3");
+    }
+    {
+        std::ifstream ifs(name + ".0000000000");
+        // removed by the compaction
+        BOOST_TEST(!ifs);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_CASE( torn_tail_then_append ) {
+    std::string name = "ut_retained_store_torn";
+    remove_files(name);
+    {
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        load_all(rs);
+        rs.set("a/b"_mb, "message1"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.set("a/c"_mb, "message2"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.flush();
+    }
+    {
+        // The last record has the complete length but the contents are not written correctly.
+        std::string segment_name = name + ".0000000000";
+        std::string data;
+        {
+            std::ifstream ifs(segment_name, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+        auto pos = data.find("message2");
+        BOOST_TEST(pos != std::string::npos);
+        data[pos + 1] = 'a';
+        std::ofstream ofs(segment_name, std::ios::binary | std::ios::trunc);
+        ofs << data;
+    }
+    {
+        // The last segment is verified, and the torn record is truncated.
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        auto retains = load_all(rs);
+        BOOST_TEST(retains.size() == 1U);
+        BOOST_TEST(retains.at("a/b").contents == "message1");
+        // The record is appended to the next segment.
+        rs.set("a/d"_mb, "message3"_mb, MQTT_NS::v5::properties{}, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        rs.flush();
+    }
+    {
+        // The torn segment is not the last one, so it is not verified,
+        // but the torn record has been removed.
+        MQTT_NS::broker::retained_store rs(make_config(name));
+        auto retains = load_all(rs);
+        BOOST_TEST(retains.size() == 2U);
+        BOOST_TEST(retains.at("a/b").contents == "message1");
+        BOOST_TEST(retains.at("a/d").contents == "message3");
+        BOOST_TEST(retains.count("a/c") == 0U);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -254,4 +254,125 @@ BOOST_AUTO_TEST_CASE(large_number_of_topics) {
     BOOST_TEST(map.internal_size() == 1);
 }
 
+BOOST_AUTO_TEST_CASE(memory_size) {
+    struct sized_value {
+        std::size_t memory_size() const { return bytes; }
+        std::size_t bytes;
+    };
+    MQTT_NS::broker::retained_topic_map<sized_value> map;
+    auto empty_size = map.memory_size();
+
+    map.insert_or_assign("a/b/c", sized_value{ 100 });
+    auto one_size = map.memory_size();
+    BOOST_TEST(one_size > empty_size + 100);
+
+    // replace
+    map.insert_or_assign("a/b/c", sized_value{ 200 });
+    BOOST_TEST(map.memory_size() == one_size + 100);
+
+    // the nodes a and a/b are shared
+    map.insert_or_assign("a/b", sized_value{ 10 });
+    BOOST_TEST(map.memory_size() == one_size + 100 + 10);
+
+    map.erase("a/b/c");
+    map.erase("a/b");
+    BOOST_TEST(map.memory_size() == empty_size);
+
+    map.insert_or_assign("x", sized_value{ 10 });
+    map.clear();
+    BOOST_TEST(map.memory_size() == empty_size);
+}
+
+BOOST_AUTO_TEST_CASE(cursor) {
+    MQTT_NS::broker::retained_topic_map<std::string> map;
+    std::vector<std::string> topics = {
+        "a", "a/b", "a/b/c", "a/c", "a/b/d", "b/b/c", "$SYS", "$SYS/x", "$SYS/x/y", "/a", "a//b"
+    };
+    for (auto const& t : topics) map.insert_or_assign(t, t);
+
+    std::vector<std::pair<std::string, std::multiset<std::string>>> cases = {
+        { "#", { "a", "a/b", "a/b/c", "a/c", "a/b/d", "b/b/c", "/a", "a//b" } },
+        { "+", { "a" } },
+        { "+/#", { "a", "a/b", "a/b/c", "a/c", "a/b/d", "b/b/c", "/a", "a//b" } },
+        { "a/#", { "a", "a/b", "a/b/c", "a/c", "a/b/d", "a//b" } },
+        { "a/b/#", { "a/b", "a/b/c", "a/b/d" } },
+        { "a/+", { "a/b", "a/c" } },
+        { "a/+/+", { "a/b/c", "a/b/d", "a//b" } },
+        { "+/b/c", { "a/b/c", "b/b/c" } },
+        { "+/a", { "/a" } },
+        { "$SYS/#", { "$SYS", "$SYS/x", "$SYS/x/y" } },
+        { "$SYS/+", { "$SYS/x" } },
+        { "a/b", { "a/b" } },
+        { "x/#", { } },
+    };
+    for (auto const& c : cases) {
+        std::multiset<std::string> matched;
+        map.find(c.first, [&](std::string const& v) { matched.insert(v); });
+        BOOST_TEST(matched == c.second);
+
+        for (std::size_t max : { 1, 3, 100 }) {
+            std::multiset<std::string> found;
+            auto cur = map.make_cursor(c.first);
+            while (!cur.done()) {
+                auto n = map.find_next(cur, max, [&](std::string const& v) { found.insert(v); });
+                BOOST_TEST(n <= max);
+            }
+            BOOST_TEST(found == c.second);
+        }
+    }
+
+    // The cursor remains valid while the map is modified.
+    for (std::size_t i = 0; i != 30; ++i) map.insert_or_assign("many/" + std::to_string(i), "many");
+    std::size_t found = 0;
+    auto cur = map.make_cursor("many/+");
+    BOOST_TEST(map.find_next(cur, 10, [&](std::string const&) { ++found; }) == 10);
+    map.insert_or_assign("many/new", "new");
+    for (std::size_t i = 0; i != 30; ++i) map.erase("many/" + std::to_string(i));
+    std::vector<std::string> rest;
+    while (!cur.done()) {
+        map.find_next(cur, 1, [&](std::string const& v) { rest.push_back(v); });
+    }
+    BOOST_TEST(rest.size() == 1);
+    BOOST_TEST(rest[0] == "new");
+}
+
+BOOST_AUTO_TEST_CASE(wildcard_after_erase) {
+    MQTT_NS::broker::retained_topic_map<std::size_t> map;
+    for (std::size_t i = 0; i != 100; ++i) map.insert_or_assign("w/" + std::to_string(i), i);
+
+    // The cursor is in the middle of the wide level while the children are erased.
+    std::set<std::size_t> found;
+    auto c = map.make_cursor("w/+");
+    map.find_next(c, 10, [&](std::size_t v) { found.insert(v); });
+    BOOST_TEST(found.size() == 10);
+
+    // Erasing more than the half of the children compacts them.
+    for (std::size_t i = 0; i != 100; ++i) {
+        if (i % 4 != 0) map.erase("w/" + std::to_string(i));
+    }
+    while (!c.done()) {
+        map.find_next(c, 7, [&](std::size_t v) { found.insert(v); });
+    }
+    BOOST_TEST(found.size() == 10 + 90 / 4);
+    for (auto v : found) BOOST_TEST((v < 10 || v % 4 == 0));
+
+    for (auto const& f : { "w/+", "w/#", "#", "+/+" }) {
+        std::set<std::size_t> matched;
+        map.find(f, [&](std::size_t v) { matched.insert(v); });
+        BOOST_TEST(matched.size() == 25U);
+        for (auto v : matched) BOOST_TEST(v % 4 == 0);
+    }
+
+    // Re-inserted topics are found after the remaining ones.
+    map.insert_or_assign("w/1", 1);
+    std::vector<std::size_t> ordered;
+    map.find("w/+", [&](std::size_t v) { ordered.push_back(v); });
+    BOOST_TEST(ordered.size() == 26U);
+    BOOST_TEST(ordered.back() == 1U);
+
+    for (std::size_t i = 0; i != 100; ++i) map.erase("w/" + std::to_string(i));
+    BOOST_TEST(map.size() == 0U);
+    BOOST_TEST(map.internal_size() == 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
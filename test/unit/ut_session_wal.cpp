@@ -0,0 +1,159 @@
+// Copyright Takatoshi Kondo 2021
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+#include <mqtt/broker/session_wal.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_session_wal)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+MQTT_NS::broker::session_wal_config make_config(std::string const& name) {
+    MQTT_NS::broker::session_wal_config config;
+    config.path = name;
+    return config;
+}
+
+void remove_files(std::string const& name) {
+    std::remove((name + ".head").c_str());
+    for (int i = 0; i != 10; ++i) {
+        char num[16];
+        std::snprintf(num, sizeof(num), ".%010d", i);
+        std::remove((name + num).c_str());
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( recover ) {
+    std::string name = "ut_session_wal_recover";
+    remove_files(name);
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        BOOST_TEST(wal.recover().empty());
+        wal.session_open("user1", "cid1"_mb, MQTT_NS::protocol_version::v5,
+            MQTT_NS::optional<std::chrono::steady_clock::duration>(std::chrono::seconds(10))
+        );
+        wal.subscribe("user1", "cid1"_mb, ""_mb, "topic1"_mb, MQTT_NS::qos::at_least_once, 3);
+        wal.subscribe("user1", "cid1"_mb, ""_mb, "topic2"_mb, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+        wal.unsubscribe("user1", "cid1"_mb, ""_mb, "topic2"_mb);
+        for (std::uint64_t seq = 0; seq != 3; ++seq) {
+            wal.offline_push(
+                "user1", "cid1"_mb, seq, MQTT_NS::nullopt,
+                "topic1"_mb, "message"_mb, MQTT_NS::qos::at_least_once,
+                MQTT_NS::v5::properties {
+                    MQTT_NS::v5::property::content_type("text"_mb)
+                }
+            );
+        }
+        wal.offline_erase_upto("user1", "cid1"_mb, 0);
+        wal.session_open("user2", "cid2"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+        wal.session_erase("user2", "cid2"_mb);
+        wal.flush();
+    }
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        auto sessions = wal.recover();
+        BOOST_TEST(sessions.size() == 1U);
+        auto const& s = sessions[MQTT_NS::broker::wal_session_key("user1", "cid1")];
+        BOOST_TEST(s.version == MQTT_NS::protocol_version::v5);
+        BOOST_CHECK(s.session_expiry_interval.value() == std::chrono::seconds(10));
+        BOOST_TEST(s.subscriptions.size() == 1U);
+        auto const& sub = s.subscriptions.begin()->second;
+        BOOST_TEST(sub.topic_filter == "topic1");
+        BOOST_TEST(sub.subopts.get_qos() == MQTT_NS::qos::at_least_once);
+        BOOST_TEST(sub.sid.value() == 3U);
+        BOOST_TEST(s.offline_messages.size() == 2U);
+        BOOST_TEST(s.offline_messages.front().seq == 1U);
+        BOOST_TEST(s.offline_messages.front().contents == "message");
+        BOOST_TEST(s.offline_messages.front().props.size() == 1U);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_CASE( compact_and_torn_tail ) {
+    std::string name = "ut_session_wal_compact";
+    remove_files(name);
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        wal.recover();
+        wal.session_open("user1", "cid1"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+        wal.inflight_insert("user1", "cid1"_mb, 1, MQTT_NS::nullopt, "dummy");
+        wal.flush();
+        wal.compact(
+            [](MQTT_NS::broker::session_wal& w) {
+                w.session_open("user3", "cid3"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+            }
+        );
+        wal.session_open("user4", "cid4"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+        wal.flush();
+    }
+    {
+        // append a torn record
+        std::ofstream ofs(name + ".0000000001", std::ios::binary | std::ios::app);
+        ofs << "\x10\x00";
+    }
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        auto sessions = wal.recover();
+        // user1 is dropped by the snapshot
+        BOOST_TEST(sessions.size() == 2U);
+        BOOST_TEST(sessions.count(MQTT_NS::broker::wal_session_key("user3", "cid3")) == 1U);
+        BOOST_TEST(sessions.count(MQTT_NS::broker::wal_session_key("user4", "cid4")) == 1U);
+    }
+    {
+        std::ifstream ifs(name + ".0000000000");
+        // removed by the compaction
+        BOOST_TEST(!ifs);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_CASE( compact_with_appended_records ) {
+    std::string name = "ut_session_wal_compact_appended";
+    remove_files(name);
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        wal.recover();
+        wal.session_open("user1", "cid1"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+        wal.compact(
+            [](MQTT_NS::broker::session_wal& w) {
+                // appended by the other thread before the snapshot of user1
+                w.subscribe("user1", "cid1"_mb, ""_mb, "topic2"_mb, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+                // snapshot of user1 that contains topic2
+                w.session_open("user1", "cid1"_mb, MQTT_NS::protocol_version::v3_1_1, MQTT_NS::nullopt);
+                w.subscribe("user1", "cid1"_mb, ""_mb, "topic1"_mb, MQTT_NS::qos::at_least_once, MQTT_NS::nullopt);
+                w.subscribe("user1", "cid1"_mb, ""_mb, "topic2"_mb, MQTT_NS::qos::at_most_once, MQTT_NS::nullopt);
+                // appended by the other thread after the snapshot of user1
+                w.unsubscribe("user1", "cid1"_mb, ""_mb, "topic1"_mb);
+                w.offline_push(
+                    "user1", "cid1"_mb, 0, MQTT_NS::nullopt,
+                    "topic2"_mb, "message"_mb, MQTT_NS::qos::at_most_once,
+                    MQTT_NS::v5::properties {}
+                );
+            }
+        );
+        wal.flush();
+    }
+    {
+        MQTT_NS::broker::session_wal wal(make_config(name));
+        auto sessions = wal.recover();
+        BOOST_TEST(sessions.size() == 1U);
+        auto const& s = sessions[MQTT_NS::broker::wal_session_key("user1", "cid1")];
+        BOOST_TEST(s.subscriptions.size() == 1U);
+        BOOST_TEST(s.subscriptions.begin()->second.topic_filter == "topic2");
+        BOOST_TEST(s.offline_messages.size() == 1U);
+    }
+    remove_files(name);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "../common/test_main.hpp"
+#include "../common/global_fixture.hpp"
+
+#include <mqtt/broker/subscription_prefilter.hpp>
+
+BOOST_AUTO_TEST_SUITE(ut_subscription_prefilter)
+
+BOOST_AUTO_TEST_CASE( first_level ) {
+    MQTT_NS::broker::subscription_prefilter pf;
+    BOOST_TEST(!pf.may_match("a"));
+    BOOST_TEST(!pf.may_match("a/b"));
+
+    pf.insert("a/b/+");
+    BOOST_TEST(pf.may_match("a"));
+    BOOST_TEST(pf.may_match("a/b/c"));
+    BOOST_TEST(pf.may_match("a/x"));
+    BOOST_TEST(!pf.may_match("b/b/c"));
+    BOOST_TEST(!pf.may_match("ab"));
+
+    pf.insert("a/#");
+    pf.erase("a/b/+");
+    BOOST_TEST(pf.may_match("a/b/c"));
+    pf.erase("a/#");
+    BOOST_TEST(!pf.may_match("a/b/c"));
+
+    // empty first level
+    pf.insert("/a");
+    BOOST_TEST(pf.may_match("/a"));
+    BOOST_TEST(pf.may_match("/"));
+    BOOST_TEST(!pf.may_match("a"));
+}
+
+BOOST_AUTO_TEST_CASE( wildcard ) {
+    MQTT_NS::broker::subscription_prefilter pf;
+    pf.insert("+/b");
+    BOOST_TEST(pf.may_match("a/b"));
+    BOOST_TEST(pf.may_match("x"));
+    // '+' at the first level doesn't match '$' topics
+    BOOST_TEST(!pf.may_match("$SYS/b"));
+
+    pf.insert("#");
+    pf.erase("+/b");
+    BOOST_TEST(pf.may_match("x/y/z"));
+    BOOST_TEST(!pf.may_match("$SYS/broker/uptime"));
+
+    pf.insert("$SYS/#");
+    BOOST_TEST(pf.may_match("$SYS/broker/uptime"));
+    pf.erase("#");
+    BOOST_TEST(!pf.may_match("x/y/z"));
+    BOOST_TEST(pf.may_match("$SYS/broker/uptime"));
+}
+
+BOOST_AUTO_TEST_CASE( many ) {
+    MQTT_NS::broker::subscription_prefilter pf;
+    std::size_t const num = 1000;
+    for (std::size_t i = 0; i != num; ++i) {
+        pf.insert("sub" + std::to_string(i) + "/#");
+    }
+    for (std::size_t i = 0; i != num; ++i) {
+        BOOST_TEST(pf.may_match("sub" + std::to_string(i) + "/x"));
+    }
+    // Most of the other topics are rejected.
+    std::size_t false_positives = 0;
+    for (std::size_t i = 0; i != num; ++i) {
+        if (pf.may_match("pub" + std::to_string(i) + "/x")) ++false_positives;
+    }
+    BOOST_TEST(false_positives < num / 10);
+
+    for (std::size_t i = 0; i != num; ++i) {
+        pf.erase("sub" + std::to_string(i) + "/#");
+    }
+    for (std::size_t i = 0; i != num; ++i) {
+        BOOST_TEST(!pf.may_match("sub" + std::to_string(i) + "/x"));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()